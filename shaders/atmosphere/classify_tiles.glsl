@@ -0,0 +1,64 @@
+#version 450
+#include "common.glsl"
+
+// Classifies screen tiles by the previous frame's atmosphere, for the ray march to adapt its steps to:
+// the step scale and the transmittance at which rays stop, per tile. One work group per tile.
+
+layout(local_size_x = TileRes, local_size_y = TileRes, local_size_z = 1) in;
+#include "compute.glsl"
+
+uniform layout(binding=4) sampler2D oldLightTexture;
+uniform layout(binding=5) sampler2D oldTransmittanceTexture;
+
+uniform layout(binding=0, rg16f) writeonly image2D tileImage;
+
+uniform uvec2 fragOffset, fragFactor;
+
+layout(std430, binding = SSBO_TILE_RAYS) buffer tileRaysBuffer
+{
+    uint tileRays[4]; // rays traced this frame, per class
+};
+
+const uint TileSky = 0u, TileHaze = 1u, TileDense = 2u, TileOccluded = 3u;
+
+// Sky and haze can take longer steps, and rays through occluded tiles can stop well before extinction.
+float TileStepScale(uint tileClass) { return TileSky == tileClass ? 2.0 : TileHaze == tileClass ? 1.5 : 1.0; }
+float TileStopTransmittance(uint tileClass) { return TileOccluded == tileClass ? 1e-2 : 1e-4; }
+
+shared uint minTransmittanceBits, maxTransmittanceBits, maxLightBits, numRays;
+
+void main()
+{
+    if (gl_LocalInvocationIndex == 0u)
+    {
+        minTransmittanceBits = floatBitsToUint(1.0);
+        maxTransmittanceBits = maxLightBits = numRays = 0u;
+    }
+    barrier();
+
+    const ivec2 size = textureSize(oldTransmittanceTexture, 0);
+    const ivec2 ifragCoords = ivec2(gl_GlobalInvocationID.xy);
+    if (all(lessThan(ifragCoords, size)))
+    {
+        // (non-negative, so their bits order as they do)
+        const vec3 T = texelFetch(oldTransmittanceTexture, ifragCoords, 0).rgb;
+        const vec3 L = texelFetch(oldLightTexture, ifragCoords, 0).rgb;
+        const float transmittance = clamp(dot(T, vec3(1.0 / 3.0)), 0.0, 1.0);
+        atomicMin(minTransmittanceBits, floatBitsToUint(transmittance));
+        atomicMax(maxTransmittanceBits, floatBitsToUint(transmittance));
+        atomicMax(maxLightBits, floatBitsToUint(max(0.0, dot(L, vec3(1.0 / 3.0)))));
+        if (ifragCoords % ivec2(fragFactor) == ivec2(fragOffset)) atomicAdd(numRays, 1u);
+    }
+    barrier();
+    if (gl_LocalInvocationIndex != 0u) return;
+
+    // - to do: tune these
+    const float minT = uintBitsToFloat(minTransmittanceBits), maxT = uintBitsToFloat(maxTransmittanceBits);
+    uint tileClass = TileDense;
+    if (maxT < 1e-2) tileClass = TileOccluded;
+    else if (minT > 0.99 && uintBitsToFloat(maxLightBits) < 1e-3) tileClass = TileSky;
+    else if (minT > 0.5) tileClass = TileHaze;
+
+    imageStore(tileImage, ivec2(gl_WorkGroupID.xy), vec4(TileStepScale(tileClass), TileStopTransmittance(tileClass), 0.0, 0.0));
+    atomicAdd(tileRays[tileClass], numRays);
+}
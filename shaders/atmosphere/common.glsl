@@ -5,15 +5,28 @@
 #ifndef ANIMATE_INTERPOLATION
 #define ANIMATE_INTERPOLATION false
 #endif
+// Brick format (defined by the atmosphere when loading shaders):
+#ifndef BRICK_IMAGE_FORMAT
+#define BRICK_IMAGE_FORMAT rg8 // of brick images written during updates
+#endif
+#ifndef BRICK_SPLIT
+#define BRICK_SPLIT 0 // density and light in separate textures?
+#endif
 
 const float PI = 3.14159265358979323846;
 
+#define TileRes 8 // screen tiles for the ray march's step control (see classify_tiles.glsl)
+
 
 #define UBO_GLOBAL               0
 #define SSBO_VOXEL_NODES         0
 #define SSBO_VOXEL_UPLOAD        1
 #define SSBO_VOXEL_UPLOAD_BRICKS 2
 #define SSBO_VOXEL_GEN_DATA      3
+#define SSBO_BRICK_PAGES         4
+#define SSBO_BRICK_SLOTS         5
+#define SSBO_PREV_BRICK_SLOTS    6
+#define SSBO_TILE_RAYS           7
 #define NodeArity 8
 #define BrickRes 8
 const uint IndexMask     = 0x00ffffffu;
@@ -30,6 +43,7 @@ uniform GlobalUniforms
     vec4  sun; // distance, radius, intensity (already attenuated)
     vec4 betaR;
     vec4 absorptionExtinction;
+    vec4 prevCameraOffset; // previous frame's camera position relative to the current one (for reprojection)
     
     uint  rootGroupIndex;
     float time, animationTime, animationAlpha;
@@ -61,7 +75,9 @@ uniform layout(binding=2) usampler3D octreeMapTexture;
 uniform layout(binding=3) sampler2D  depthTexture;
 uniform layout(binding=5) sampler2D  transmittanceTexture;
 uniform layout(binding=6) sampler3D  scatterTexture;
-uniform layout(binding=7) usampler3D frustumOctreeMap;
+uniform layout(binding=7) usampler3D viewOctreeMap; // finer map of a cube around the camera (mapPosition, mapScale)
+uniform layout(binding=8) sampler3D  splitLightTexture; // light of brickTexture, with split brick formats
+uniform layout(binding=9) sampler3D  nextSplitLightTexture;
 
 uniform vec3 mapPosition, mapScale;
 
@@ -69,6 +85,7 @@ uniform vec3 mapPosition, mapScale;
 struct Node
 {
     uint children, neighbours[3];
+    uint meta; // see below
 };
 struct NodeGroup
 {
@@ -94,6 +111,24 @@ layout(std430, binding = SSBO_VOXEL_NODES) buffer nodeBuffer
 {
     NodeGroup nodeGroups[];
 };
+
+// Per-node metadata for empty-space skipping (as NodeMeta in Octree.hpp):
+// quantised density range of the node's brick, whether it's opaque, and how far around it is empty.
+const uint MetaMinShift = 0u, MetaMaxShift = 8u;
+const uint MetaOpaqueBit = 1u << 16u; // light is extinguished within a voxel length anywhere in it
+const uint MetaDistanceShift = 17u, MetaDistanceMask = 3u;
+const uint MaxEmptyDistance = 2u;
+const float OpaqueOpticalDepth = 10.0;
+uint EncodeNodeMeta(float minDensity, float maxDensity, bool opaque)
+{
+    const uint minQ = uint(floor(clamp(minDensity, 0.0, 1.0) * 255.0)), maxQ = uint(ceil(clamp(maxDensity, 0.0, 1.0) * 255.0));
+    return minQ << MetaMinShift | maxQ << MetaMaxShift | (opaque ? MetaOpaqueBit : 0u);
+}
+uint GetNodeMeta(uint ni) { return nodeGroups[ni / NodeArity].nodes[ni % NodeArity].meta; }
+bool MetaIsOpaque(uint meta) { return (meta & MetaOpaqueBit) != 0u; }
+bool MetaIsUniform(uint meta) { return ((meta >> MetaMinShift) & 0xffu) == ((meta >> MetaMaxShift) & 0xffu); }
+float MetaMinDensity(uint meta) { return float((meta >> MetaMinShift) & 0xffu) / 255.0; }
+uint MetaEmptyDistance(uint meta) { return (meta >> MetaDistanceShift) & MetaDistanceMask; }
 layout(std430, binding = SSBO_VOXEL_UPLOAD) buffer uploadBuffer
 {
     UploadNodeGroup uploadNodes[];
@@ -113,8 +148,16 @@ layout(std430, binding = SSBO_VOXEL_GEN_DATA) buffer splitNodesBuffer
     uint splitNodes[];
 };
 
-uniform uvec3 uBricksRes;
+// Brick page table: pages of consecutive brick indices map to (physical) boxes of bricks in the brick textures.
+layout(std430, binding = SSBO_BRICK_PAGES) readonly buffer brickPageBuffer
+{
+    uint brickPages[];
+};
+
+uniform uvec3 uBricksRes; // brick texture size, in bricks
 uniform vec3 bricksRes;
+uniform uvec3 uPageBricks; // page size, in bricks
+uniform uvec3 uPagesRes; // brick texture size, in pages
 uvec3 IndexTo3D(uint index, uvec3 bres)
 {
     uvec3 p;
@@ -125,31 +168,60 @@ uvec3 IndexTo3D(uint index, uvec3 bres)
 }
 uvec3 BrickIndexTo3D(uint brickIndex)
 {
-    return IndexTo3D(brickIndex, uBricksRes);
+    const uint bricksPerPage = uPageBricks.x * uPageBricks.y * uPageBricks.z;
+    const uint page = brickPages[brickIndex / bricksPerPage];
+    return IndexTo3D(page, uPagesRes) * uPageBricks + IndexTo3D(brickIndex % bricksPerPage, uPageBricks);
 }
+
+// Brick slots: with copy-on-write brick storage, GPU states share one brick texture, each mapping its bricks to slots.
+// (otherwise each state has its own texture, and a brick's slot is its index)
+layout(std430, binding = SSBO_BRICK_SLOTS) readonly buffer brickSlotBuffer
+{
+    uint brickSlots[]; // of the state being read or written
+};
+layout(std430, binding = SSBO_PREV_BRICK_SLOTS) readonly buffer prevBrickSlotBuffer
+{
+    uint prevBrickSlots[]; // of the previous state, when rendering
+};
+uniform bool uBrickSlots;
+uint BrickSlot(uint brickIndex) { return uBrickSlots ? brickSlots[brickIndex] : brickIndex; }
+uint PrevBrickSlot(uint brickIndex) { return uBrickSlots ? prevBrickSlots[brickIndex] : brickIndex; }
+uvec3 BrickSlotTo3D(uint brickIndex) { return BrickIndexTo3D(BrickSlot(brickIndex)); }
+uvec3 PrevBrickSlotTo3D(uint brickIndex) { return BrickIndexTo3D(PrevBrickSlot(brickIndex)); }
+
 vec3 BrickSampleCoordinates(vec3 brick3D, vec3 localCoords)
 {
     return (brick3D + (vec3(0.5) + localCoords * vec3(float(BrickRes - 1u))) / float(BrickRes)) / vec3(bricksRes);
 }
 
-vec4 RetrieveVoxelData(vec3 brickOffs, vec3 lc, sampler3D brickTexture)
+// Density in x and filtered light in y, whether kept in one texture or split into two.
+vec4 SampleBrick(sampler3D bricks, sampler3D lights, vec3 tc)
+{
+#if BRICK_SPLIT
+    return vec4(texture(bricks, tc).x, texture(lights, tc).x, 0.0, 0.0);
+#else
+    return texture(bricks, tc);
+#endif
+}
+
+vec4 RetrieveVoxelData(vec3 brickOffs, vec3 lc, sampler3D brickTexture, sampler3D lightTexture)
 {
     vec3 tc = lc * 0.5 + 0.5;
     tc = clamp(tc, vec3(0.0), vec3(1.0)); // - should this really be needed? Currently there can be artefacts without this
     tc = BrickSampleCoordinates(brickOffs, tc);
-    vec4 voxelData = texture(brickTexture, tc);
+    vec4 voxelData = SampleBrick(brickTexture, lightTexture, tc);
     return voxelData;
 }
 
-vec4 RetrieveAnimatedVoxelData(vec3 brickOffs, vec3 lc)
+// Samples the brick of node ni in the current state (nextBrickTexture), interpolated from the previous one (brickTexture).
+vec4 RetrieveAnimatedVoxelData(uint ni, vec3 lc)
 {
     vec3 tc = lc * 0.5 + 0.5;
     tc = clamp(tc, vec3(0.0), vec3(1.0)); // - should this really be needed? Currently there can be artefacts without this
-    tc = BrickSampleCoordinates(brickOffs, tc);
                 
-    vec4 voxelData = texture(nextBrickTexture, tc);
+    vec4 voxelData = SampleBrick(nextBrickTexture, nextSplitLightTexture, BrickSampleCoordinates(vec3(BrickSlotTo3D(ni)), tc));
                 
-    if (ANIMATE_INTERPOLATION) voxelData = mix(texture(brickTexture, tc), voxelData, animationAlpha);
+    if (ANIMATE_INTERPOLATION) voxelData = mix(SampleBrick(brickTexture, splitLightTexture, BrickSampleCoordinates(vec3(PrevBrickSlotTo3D(ni)), tc)), voxelData, animationAlpha);
     
     return voxelData;
 }
@@ -270,13 +342,22 @@ void OctreeDescendMap(inout OctreeTraversalData o)
 }
 void OctreeDescendMapMaxDepth(inout OctreeTraversalData o, uint maxDepth)
 {
-    //OctreeDescendMap(o); return;
-    // - to do: find out why this doesn't quite work
-    
     vec3 sampleLoc = o.p * 0.5 + 0.5;
     OctreeDescendMapInit(octreeMapTexture, sampleLoc, o);
+    // The first iteration goes one past the map's depth, so a map deeper than maxDepth would overshoot it:
+    if (o.depth >= maxDepth) OctreeDescendInit(o);
     OctreeDescendLoopMaxDepth(o, maxDepth);
 }
+// Descends from the finer map around the camera where it covers o.p, else from the whole-octree map.
+void OctreeDescendViewMap(inout OctreeTraversalData o)
+{
+    vec3 sampleLoc = (o.p - mapPosition) / mapScale;
+    if (all(greaterThanEqual(sampleLoc, vec3(0.0))) && all(lessThan(sampleLoc, vec3(1.0))))
+    {
+        OctreeDescendMap(viewOctreeMap, sampleLoc, o);
+    }
+    else OctreeDescendMap(o);
+}
 
 
 float RayleighDensityFromSample(float v)
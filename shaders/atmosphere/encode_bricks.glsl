@@ -0,0 +1,71 @@
+#version 450
+
+#include "common.glsl"
+layout(local_size_x = BrickRes / 4, local_size_y = BrickRes / 4, local_size_z = BrickRes) in;
+#include "compute.glsl"
+
+// Encodes bricks of the (uncompressed) work texture, bound as brickTexture, into BC5 (RGTC2) blocks.
+// Each invocation encodes one 4*4 block into one texel of the block image, from where it's copied into place.
+// Bricks are encoded in units of whole pages or single bricks, with units stacked in depth in the block image.
+
+uniform layout(binding=0, rgba32ui) writeonly uimage3D blockImage;
+uniform uint uEncodeUnitBricks; // bricks per unit
+uniform uvec3 uEncodeUnitRes;   // unit size, in bricks
+
+layout(std430, binding = SSBO_VOXEL_GEN_DATA) buffer encodeUnitsBuffer
+{
+    uint encodeUnits[]; // physical pages, or physical bricks (page * bricks per page + brick within the page)
+};
+
+// BC4 block: the endpoints are the extremes, with the values mapped to the nearest of the 8 palette entries.
+uvec2 EncodeBC4(float values[16])
+{
+    float lo = 1.0, hi = 0.0;
+    for (uint i = 0u; i < 16u; ++i)
+    {
+        lo = min(lo, values[i]);
+        hi = max(hi, values[i]);
+    }
+    const uint e0 = uint(round(clamp(hi, 0.0, 1.0) * 255.0));
+    const uint e1 = uint(round(clamp(lo, 0.0, 1.0) * 255.0));
+    uvec2 block = uvec2(e0 | (e1 << 8u), 0u);
+    if (e0 == e1) return block; // constant (all indices select e0)
+
+    // Palette position from e1 (0) to e0 (7): index 0 is e0, 1 is e1, and 2-7 are interpolated from e0 towards e1.
+    const uint paletteToIndex[8] = uint[8](1u, 7u, 6u, 5u, 4u, 3u, 2u, 0u);
+    const float scale = 7.0 / (float(e0) - float(e1));
+    for (uint i = 0u; i < 16u; ++i)
+    {
+        const uint p = uint(clamp(round((values[i] * 255.0 - float(e1)) * scale), 0.0, 7.0));
+        const uint index = paletteToIndex[p];
+        const uint bit = 16u + i * 3u; // (3-bit indices follow the endpoints, in 48 bits)
+        if (bit < 32u) block.x |= index << bit;
+        if (bit >= 32u) block.y |= index << (bit - 32u);
+        else if (bit + 3u > 32u) block.y |= index >> (32u - bit);
+    }
+    return block;
+}
+
+void main()
+{
+    const uint wgid = GetWorkGroupIndex();
+    const uint unit = wgid / uEncodeUnitBricks;
+    const uint brickInUnit = wgid % uEncodeUnitBricks;
+    const uint physicalBrick = encodeUnits[unit] * uEncodeUnitBricks + brickInUnit;
+    const uint bricksPerPage = uPageBricks.x * uPageBricks.y * uPageBricks.z;
+    const uvec3 brick = IndexTo3D(physicalBrick / bricksPerPage, uPagesRes) * uPageBricks + IndexTo3D(physicalBrick % bricksPerPage, uPageBricks);
+    const uvec3 texel = brick * BrickRes + gl_LocalInvocationID * uvec3(4u, 4u, 1u);
+
+    float r[16], g[16];
+    for (uint y = 0u; y < 4u; ++y)
+    for (uint x = 0u; x < 4u; ++x)
+    {
+        const vec2 v = texelFetch(brickTexture, ivec3(texel + uvec3(x, y, 0u)), 0).xy;
+        r[x + y * 4u] = v.x;
+        g[x + y * 4u] = v.y;
+    }
+
+    const uvec3 unitOffs = uvec3(0u, 0u, unit * uEncodeUnitRes.z * BrickRes);
+    const uvec3 brickOffs = IndexTo3D(brickInUnit, uEncodeUnitRes) * uvec3(BrickRes / 4u, BrickRes / 4u, BrickRes);
+    imageStore(blockImage, ivec3(unitOffs + brickOffs + gl_LocalInvocationID), uvec4(EncodeBC4(r), EncodeBC4(g)));
+}
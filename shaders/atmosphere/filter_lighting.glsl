@@ -10,7 +10,11 @@ layout(local_size_x = BrickRes + P2, local_size_y = BrickRes + P2, local_size_z
 shared float lightSamples[(BrickRes + P2) * (BrickRes + P2) * (BrickRes + P2)];
 
 //uniform layout(binding=0, r16f) writeonly image3D lightImage;
-uniform layout(binding=0, rg8) image3D lightImage;
+#if BRICK_SPLIT
+uniform layout(binding=0, r8) writeonly image3D lightImage; // (the state's light texture)
+#else
+uniform layout(binding=0, BRICK_IMAGE_FORMAT) image3D lightImage; // (the state's brick texture)
+#endif
 uniform uint brickUploadOffset;
 
 uniform layout(binding=1) sampler3D  brickLightTexture;
@@ -33,7 +37,8 @@ void main()
 {
     const uint loadId = GetWorkGroupIndex() + brickUploadOffset;
     const UploadBrick upload = uploadBricks[loadId];
-    uvec3 writeOffs = BrickIndexTo3D(upload.brickIndex) * BrickRes + (gl_LocalInvocationID - uvec3(Padding));
+    // (the temporary lighting is indexed by brick, while the state's bricks may be stored in other slots)
+    uvec3 writeOffs = BrickSlotTo3D(upload.brickIndex) * BrickRes + (gl_LocalInvocationID - uvec3(Padding));
     const vec3 brickOffs = vec3(BrickIndexTo3D(upload.brickIndex));
     
     const float localVoxelSize = 2.0 / float(BrickRes - 1u);
@@ -124,6 +129,10 @@ void main()
     //imageStore(lightImage, ivec3(writeOffs), vec4(light, vec3(0.0)));
     //light = max(0.025, light); // - just a test (a not so good way of getting "indirect" lighting)
     
+#if BRICK_SPLIT
+    imageStore(lightImage, ivec3(writeOffs), vec4(light, 0.0, 0.0, 0.0));
+#else
     float density = imageLoad(lightImage, ivec3(writeOffs)).r;
     imageStore(lightImage, ivec3(writeOffs), vec4(density, light, 0.0, 0.0));
+#endif
 }
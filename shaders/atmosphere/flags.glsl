@@ -1,13 +1,17 @@
 
 //
-// Flags which should really be uniforms (... or rather macros, to help the driver optimise):
+// Flags which should really be uniforms (... or rather macros, to help the driver optimise; those which are can be
+// set per program variant):
 //
 
 // Optimise per voxel lighting with intermediate mini shadow maps computed per node group.
 // Speeds up lighting pass roughly 4-8 times with seemingly no or few artefacts.
 // (even hides some aliasing "grooves" which were present without the optimisation)
 // (but might cause "spotty" artefacts instead. Really an... artefact redistribution)
-const bool usePerGroupLighting = true;
+#ifndef PER_GROUP_LIGHTING
+#define PER_GROUP_LIGHTING true
+#endif
+const bool usePerGroupLighting = PER_GROUP_LIGHTING;
 
 // Interpolate between two voxel states when animating.
 // - Big performance impact: roughly halves render speed in many common/heavier cases.
@@ -18,6 +22,10 @@ const bool usePerGroupLighting = true;
 // Moderate performance win. Roughly 1/6 of render time, depending on the view.
 const bool doubleStepsInEmptyBricks = false;//true;
 
+// Use per-node metadata to go faster through empty space (with steps growing with the empty distance around a node),
+// through nodes of uniform density (in one step, for shadow rays), and to stop early in opaque nodes.
+const bool useNodeMeta = true;
+
 
 // "Powder" effect as described in Nubis presentations.
 // - to do: expand
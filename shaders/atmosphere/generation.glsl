@@ -5,7 +5,7 @@
 layout(local_size_x = BrickRes, local_size_y = BrickRes, local_size_z = BrickRes) in;
 #include "compute.glsl"
 
-uniform layout(binding=0, rg8) writeonly image3D brickImage;
+uniform layout(binding=0, BRICK_IMAGE_FORMAT) writeonly image3D brickImage;
 uniform uint brickUploadOffset;
 
 float fBm(uint octaves, vec3 p, float persistence, float lacunarity)
@@ -45,7 +45,7 @@ void main()
 {
     const uint loadId = GetWorkGroupIndex() + brickUploadOffset;
     const UploadBrick upload = uploadBricks[loadId];
-    const uvec3 voxelOffs = BrickIndexTo3D(upload.brickIndex) * BrickRes + gl_LocalInvocationID;
+    const uvec3 voxelOffs = BrickSlotTo3D(upload.brickIndex) * BrickRes + gl_LocalInvocationID;
     
     vec3 lp = vec3(gl_LocalInvocationID) / float(BrickRes - 1u) * 2 - 1;
     vec3 p = (upload.nodeLocation.xyz + upload.nodeLocation.w * lp) * atmosphereScale;
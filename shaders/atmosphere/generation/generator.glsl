@@ -1,13 +1,19 @@
 #version 450
 #include "../generation.glsl"
 
-const bool optimiseGeneration = true;
+#ifndef OPTIMISE_GENERATION
+#define OPTIMISE_GENERATION true // (skip the detail noise where the mask is zero)
+#endif
+const bool optimiseGeneration = OPTIMISE_GENERATION;
+#ifndef CUMULUS_WIND_CELLS
+#define CUMULUS_WIND_CELLS 0 // experimental wind-aware cumulus mask
+#endif
 
 float ComputeCumulusMask(vec3 p)
 {
     float mask = 0.0;
     mask = fBm(9u, p * 64.0, 0.5, 2.0); // simplistic
-    if (false) // - testing
+#if CUMULUS_WIND_CELLS // - testing
     {
         const float numCells = 3.0; // number on southern/northern hemisphere
         
@@ -58,6 +64,7 @@ float ComputeCumulusMask(vec3 p)
         
         // - to do: construct wind-aware mask
     }
+#endif
     return smoothstep(0.0, 0.5, mask);
 }
 
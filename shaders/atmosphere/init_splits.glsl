@@ -4,7 +4,10 @@
 layout(local_size_x = BrickRes, local_size_y = BrickRes, local_size_z = BrickRes) in;
 #include "compute.glsl"
 
-uniform layout(binding=0, rg8) image3D oldBrickImage;
+uniform layout(binding=0, BRICK_IMAGE_FORMAT) image3D oldBrickImage;
+#if BRICK_SPLIT
+uniform layout(binding=1, r8) writeonly image3D oldLightImage;
+#endif
 //uniform uint brickUploadOffset;
 uniform layout(binding=0) sampler3D oldBrickTexture;
 
@@ -14,16 +17,19 @@ void main()
     const uint groupIndex = splitNodes[wgid / NodeArity];
     const uint octant = wgid % NodeArity;
     const uint brickIndex = groupIndex * NodeArity + octant;
-    uvec3 writeOffs = BrickIndexTo3D(brickIndex) * BrickRes + gl_LocalInvocationID;
-    const vec3 brickOffs = vec3(BrickIndexTo3D(brickIndex));
+    uvec3 writeOffs = BrickSlotTo3D(brickIndex) * BrickRes + gl_LocalInvocationID;
+    const vec3 brickOffs = vec3(BrickSlotTo3D(brickIndex));
     
     vec3 lp = vec3(ivec3(gl_LocalInvocationID)) / float(BrickRes - 1u) * 2 - 1;
     vec3 pp = 0.5 * (lp + vec3(uvec3(octant & 1u, (octant >> 1u) & 1u, (octant >> 2u) & 1u)) * 2 - 1);
     const uint parentIndex = nodeGroups[groupIndex].parent;
-    const vec3 parentBrickOffs = vec3(BrickIndexTo3D(parentIndex));
+    const vec3 parentBrickOffs = vec3(BrickSlotTo3D(parentIndex));
     
     // - to do: correct this. Not yet right
-    vec4 parentValue = RetrieveVoxelData(parentBrickOffs, pp, oldBrickTexture);
+    vec4 parentValue = RetrieveVoxelData(parentBrickOffs, pp, oldBrickTexture, splitLightTexture);
     
     imageStore(oldBrickImage, ivec3(writeOffs), parentValue);
+#if BRICK_SPLIT
+    imageStore(oldLightImage, ivec3(writeOffs), parentValue.yyyy);
+#endif
 }
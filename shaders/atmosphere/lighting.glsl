@@ -19,6 +19,19 @@ uvec3 GroupIndexTo3D(uint groupIndex)
 
 uniform mat4 groupLightMat, invGroupLightMat;
 
+// Per-group shadow maps lie in a plane this far (in group half-sizes) from their group's centre towards the light,
+// as groupLightMat places them. (as BrickLighting::SweepPlaneDistance)
+const float SweepPlaneDistance = 3.0 - sqrt(3.0);
+
+// Coordinates in the per-group shadow map texture of a point in the group (relative to its centre, in half-sizes).
+vec2 GroupLightMapCoordinates(uint groupIndex, vec3 groupPos, vec2 texSize)
+{
+    vec3 samplePos = vec3(invGroupLightMat * vec4(groupPos, 1.0));
+    vec2 sampleCoords = samplePos.xy * 0.5 + 0.5;
+    uvec2 uTexBase = GroupIndexTo3D(groupIndex).xy * GroupRes;
+    return (vec2(uTexBase) + vec2(0.5) + float(GroupRes - 1u) * sampleCoords) / texSize;
+}
+
 
 float PlanetShadow(vec3 ori, vec3 dir, vec3 planetCenter, float voxelSize)
 {
@@ -89,6 +102,7 @@ float TraceTransmittance(vec3 ori, vec3 dir, float dist, const float stepFactor,
             
             AabbIntersection(tmin, tmax, vec3(-o.size) + o.center, vec3(o.size) + o.center, ori, dir);
             tmax = min(tmax, maxDist);
+            const uint meta = useNodeMeta ? GetNodeMeta(o.ni) : 0u;
             
             //if (false)
             if ((o.flags & EmptyBrickBit) != 0u)
@@ -104,12 +118,28 @@ float TraceTransmittance(vec3 ori, vec3 dir, float dist, const float stepFactor,
                 
                 // - to do: skip the brick correctly
                 dist = tmax + atmStep * 1.0; // - testing // - does seem like a gain (maybe 1/3?). Investigate more
+                dist += float(MetaEmptyDistance(meta)) * 2.0 * o.size; // (the nodes that far around are empty too)
                 //if (it == 1u) return 0.0; // - testing (to see where bricks are marked as empty)
                 continue;
             }
+            if (MetaIsOpaque(meta) && tmax - dist >= 2.0 * o.size / float(BrickRes - 1u))
+            {
+                opticalDepthM = 1e30; // extinguished within (at least) a voxel length
+                break;
+            }
+            if (useNodeMeta && MetaIsUniform(meta))
+            {
+                // Constant density, so the steps through the node add up to this:
+                const float densityM = MetaMinDensity(meta) * mieMul;
+                const float stepsInNode = max(1.0, ceil((tmax - dist) / atmStep));
+                opticalDepthM += (prevDensityM + densityM) * 0.5 * atmStep + densityM * atmStep * (stepsInNode - 1.0);
+                prevDensityM = densityM;
+                dist += atmStep * stepsInNode;
+                continue;
+            }
             //if (it == 1u) return 1.0; // - testing
             
-            const vec3 brickOffs = vec3(BrickIndexTo3D(o.ni));
+            const vec3 brickOffs = vec3(BrickSlotTo3D(o.ni));
             vec3 localStart = (ori - o.center) / o.size;
             
             do // do while to not erroneously miss the first voxel if it's on the border
@@ -151,6 +181,67 @@ float TraceTransmittance(vec3 ori, vec3 dir, float dist, const float stepFactor,
     return TraceTransmittance(ori, dir, dist, stepFactor, maxDepth, 1e30);
 }
 
+// Lighting modes (as LightingMode in Common.hpp):
+const uint LightingShadowRays = 0u, LightingCones = 1u, LightingSweep = 2u;
+// (programs are compiled in variants per lighting mode)
+#ifndef LIGHTING_MODE
+#define LIGHTING_MODE LightingShadowRays
+#endif
+const uint lightingMode = LIGHTING_MODE;
+
+// Transmittance along a cone which starts a voxel wide and widens by the aperture per distance travelled.
+// Each step samples the deepest level whose voxels are at least as wide as the cone there (parent bricks being
+// prefiltered averages of their children), and steps are in proportion to that width, so they grow with distance.
+float ConeMarchTransmittance(vec3 ori, vec3 dir, float dist, const float voxelSize, const float aperture, const uint maxDepth)
+{
+    const float atmScale = atmosphereRadius;
+    const float rootVoxelSize = atmScale / float(BrickRes - 1u); // of the root's children; halved per depth
+    const float stepFactor = 0.5 * stepSize; // step length per voxel width
+    const float thresholdFraction = 1e-2;
+    const float threshold = -log(thresholdFraction) / betaMEx;
+    const uint maxSteps = 128u;
+    float opticalDepthM = 0.0;
+    float prevDensityM = 0.0;
+
+    float tmin, tmax;
+    if (IntersectSphere(ori, dir, vec3(0.0), planetRadius + atmosphereHeight, tmin, tmax))
+    {
+        for (uint i = 0u; i < maxSteps && dist < tmax && opticalDepthM <= threshold; ++i)
+        {
+            const float width = voxelSize + aperture * dist;
+            const uint depth = uint(clamp(floor(log2(rootVoxelSize / width)), 0.0, float(maxDepth)));
+
+            OctreeTraversalData o;
+            o.p = (ori + dist * dir) / atmScale;
+            OctreeDescendMapMaxDepth(o, depth);
+            if (InvalidIndex == o.ni) break;
+            // (the descent may end in a shallower leaf, with wider voxels)
+            const float atmStep = max(width, rootVoxelSize * exp2(-float(o.depth))) * stepFactor;
+
+            if ((o.flags & EmptyBrickBit) != 0u)
+            {
+                // Skip to where the node (and any empty surroundings of a leaf) ends.
+                float t0, t1;
+                AabbIntersection(t0, t1, (o.center - o.size) * atmScale, (o.center + o.size) * atmScale, ori, dir);
+                const uint meta = useNodeMeta ? GetNodeMeta(o.ni) : 0u;
+                dist = max(dist + atmStep, t1 + float(MetaEmptyDistance(meta)) * 2.0 * o.size * atmScale);
+                prevDensityM = 0.0;
+                continue;
+            }
+
+            const vec3 lc = (o.p - o.center) / o.size;
+            const vec3 tc = clamp(lc * 0.5 + 0.5, vec3(0.0), vec3(1.0));
+            const float densityM = texture(brickTexture, BrickSampleCoordinates(vec3(BrickSlotTo3D(o.ni)), tc)).x * mieMul;
+            opticalDepthM += (prevDensityM + densityM) * 0.5 * atmStep;
+            prevDensityM = densityM;
+            dist += atmStep;
+        }
+    }
+
+    if (opticalDepthM > threshold) return 0.0;
+    return exp(-opticalDepthM * betaMEx);
+}
+
 vec3 perpendicular(vec3 v)
 {
     vec3 a = cross(vec3(1, 0, 0), v), b = cross(vec3(0, 1, 0), v);
@@ -222,7 +313,7 @@ float ConeTraceTransmittance(vec3 ori, vec3 dir, float dist, const float stepFac
             const float step = o.size / atmScale * stepFactor;
             const float atmStep = step * atmScale;
             
-            const vec3 brickOffs = vec3(BrickIndexTo3D(o.ni));
+            const vec3 brickOffs = vec3(BrickSlotTo3D(o.ni));
             vec3 localStart = (ori - o.center) / o.size;
             vec3 lc = localStart + dist / o.size * dir;
             lc = (p * atmScale - o.center) / o.size;
@@ -0,0 +1,77 @@
+#version 450
+
+#include "common.glsl"
+layout(local_size_x = BrickRes, local_size_y = BrickRes, local_size_z = BrickRes) in;
+#include "compute.glsl"
+
+// Parent bricks as averages of their children's, for cone lighting (one depth per dispatch, deepest first).
+// The children of a node sample its volume at twice the resolution, so each parent voxel is a tent-filtered
+// average of the children's voxels around it.
+
+uniform layout(binding=0, BRICK_IMAGE_FORMAT) image3D brickImage;
+
+layout(std430, binding = SSBO_VOXEL_GEN_DATA) readonly buffer prefilterNodesBuffer
+{
+    uint prefilterNodes[];
+};
+
+shared uint minDensityBits, maxDensityBits; // (densities are non-negative, so their bits order as they do)
+
+// j: voxel of the children's combined grid, in [0, 2 * (BrickRes - 1)] (the children share their border voxels)
+float ChildDensity(uint childGroup, ivec3 j)
+{
+    const int last = int(BrickRes - 1u);
+    const ivec3 c = min(j / last, ivec3(1));
+    const uint ni = childGroup * NodeArity + uint(c.x + c.y * 2 + c.z * 4);
+    return imageLoad(brickImage, ivec3(BrickSlotTo3D(ni) * BrickRes) + j - c * last).x;
+}
+
+void main()
+{
+    const uint ni = prefilterNodes[GetWorkGroupIndex()];
+    const uint gi = ni / NodeArity, ci = ni % NodeArity;
+    const uint childGroup = nodeGroups[gi].nodes[ci].children & IndexMask;
+    if (0u == gl_LocalInvocationIndex)
+    {
+        minDensityBits = floatBitsToUint(1e30);
+        maxDensityBits = 0u;
+    }
+    barrier();
+
+    const ivec3 v = ivec3(gl_LocalInvocationID);
+    const int maxJ = 2 * int(BrickRes - 1u);
+    float sum = 0.0, weights = 0.0;
+    for (int z = -1; z <= 1; ++z)
+    for (int y = -1; y <= 1; ++y)
+    for (int x = -1; x <= 1; ++x)
+    {
+        const ivec3 j = 2 * v + ivec3(x, y, z);
+        if (any(lessThan(j, ivec3(0))) || any(greaterThan(j, ivec3(maxJ)))) continue; // (renormalised at the borders)
+        const float w = float((2 - abs(x)) * (2 - abs(y)) * (2 - abs(z)));
+        sum += w * ChildDensity(childGroup, j);
+        weights += w;
+    }
+    const float density = sum / weights;
+
+    const ivec3 writeOffs = ivec3(BrickSlotTo3D(ni) * BrickRes) + v;
+    vec4 voxel = imageLoad(brickImage, writeOffs);
+    voxel.x = density;
+    imageStore(brickImage, writeOffs, voxel);
+
+    // The parent's flags and metadata follow its new contents (as update_flags.glsl computes them).
+    atomicMin(minDensityBits, floatBitsToUint(density));
+    atomicMax(maxDensityBits, floatBitsToUint(density));
+    memoryBarrierShared();
+    barrier();
+    if (0u != gl_LocalInvocationIndex) return;
+
+    const float minDensity = uintBitsToFloat(minDensityBits), maxDensity = uintBitsToFloat(maxDensityBits);
+    const bool isEmpty = maxDensity == 0.0;
+    const uint children = nodeGroups[gi].nodes[ci].children & ~EmptyBrickBit;
+    nodeGroups[gi].nodes[ci].children = children | (isEmpty ? EmptyBrickBit : 0u);
+
+    const float halfSize = exp2(-float(DepthFromInfo(nodeGroups[gi].info) + 1u));
+    const float voxelSize = 2.0 / float(BrickRes - 1u) * halfSize * atmosphereScale * planetRadius;
+    const bool isOpaque = minDensity * mieMul * betaMEx * voxelSize >= OpaqueOpticalDepth;
+    nodeGroups[gi].nodes[ci].meta = EncodeNodeMeta(minDensity, maxDensity, isOpaque);
+}
@@ -1,3 +1,4 @@
+#version 450
 #include "common.glsl"
 #include "../noise.glsl"
 
@@ -10,6 +11,10 @@ layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
 
 uniform layout(binding=0, rgba16f) image2D lightImage;
 uniform layout(binding=1, rgba16f) image2D transmittanceImage;
+uniform layout(binding=3, r32f) writeonly image2D depthImage;
+uniform layout(binding=4, rg16f) readonly image2D tileImage; // step scale and stop transmittance per tile
+
+uniform bool adaptiveSteps;
 
 
 float GetDepth(vec4 clipCoords)
@@ -54,6 +59,7 @@ void main()
     const vec4 clipCoords = vec4(coords * 2.0 - 1.0, 1.0, 1.0);
     
     vec3 backLight = texelFetch(lightTexture, ifragCoords, 0).xyz;
+    const vec2 tileControl = adaptiveSteps ? imageLoad(tileImage, ifragCoords / TileRes).xy : vec2(1.0, 1e-4);
     //vec3 backLight = imageLoad(lightImage, ivec2(fragCoords), 0).xyz;
     const float atmScale = atmosphereRadius;
     
@@ -65,6 +71,8 @@ void main()
     float opticalDepthR = 0.0, opticalDepthM = 0.0, opticalDepthA = 0.0;
     vec3 transmittance = vec3(1.0);
     vec3 color = vec3(0.0);
+    // Depth of the pixel for reprojection: the distance of the marched samples weighted by the light they add.
+    float weightedDepth = 0.0, depthWeight = 0.0;
     
     AtmosphereIntersection ai = IntersectAtmosphere(ori, dir);
     
@@ -147,7 +155,7 @@ void main()
             OctreeDescendMap(o);
             o.center *= atmScale;
             o.size *= atmScale;
-            const vec3 brickOffs = vec3(BrickIndexTo3D(o.ni));
+            const vec3 brickOffs = vec3(PrevBrickSlotTo3D(o.ni));
             vec3 lc = (hit - o.center) / o.size;
             
             vec3 tc = lc * 0.5 + 0.5;
@@ -211,17 +219,14 @@ void main()
             //0.4 // - maybe can work? Or might cause problems. Let's see.
             0.2 // - used for a long time
             //0.1 // - arbitrary factor (to-be-tuned)
+            * tileControl.x
             ;
             stepSize;
         
         const vec3 globalStart = hit;
         OctreeTraversalData o;
         o.p = globalStart / atmScale;
-        OctreeDescendMap(o);
-        /*
-        o.p = (o.p - mapPosition) / mapScale;
-        OctreeDescendMap(frustumOctreeMap, o);
-        */
+        OctreeDescendViewMap(o);
         
         float dist = 0.0; // - to do: make it so this can be set to tmin?
         dist += 1e-5;// don't start at a face/edge/corner
@@ -248,16 +253,20 @@ void main()
         while (InvalidIndex != o.ni)
         {
             const bool isEmpty = (o.flags & EmptyBrickBit) != 0u;
+            const uint meta = useNodeMeta ? GetNodeMeta(o.ni) : 0u;
             
             o.center *= atmScale;
             o.size *= atmScale;
             const float step = o.size / atmScale * stepFactor;
             const float atmStep = step * atmScale
                 * (doubleStepsInEmptyBricks ? (float(isEmpty) + 1.0) : 1.0)
+                * (isEmpty ? float(1u + MetaEmptyDistance(meta)) : 1.0) // (only the smooth base atmosphere is there)
                 ;
             
             AabbIntersection(tmin, tmax, vec3(-o.size) + o.center, vec3(o.size) + o.center, hit, dir);
             tmax = min(tmax, solidDepth - outerMin);
+            // Nothing gets through an opaque node beyond a voxel length or so, so neither need the march:
+            if (MetaIsOpaque(meta)) tmax = min(tmax, dist + 4.0 * o.size / float(BrickRes - 1u));
             //if (isinf(tmin)) continue; // - testing
             
             //if (dist >= tmax) color += vec3(0.1); // - debugging
@@ -268,7 +277,6 @@ void main()
             //dist = ceil((tmin - randStep) / atmStep) * atmStep + randStep; // - try to avoid banding even in multi-LOD
             //dist += randOffs * o.size; // - to do: do this, but only when changing depth (or initially)?
             
-            const vec3 brickOffs = vec3(BrickIndexTo3D(o.ni));
             vec3 localStart = (globalStart - o.center) / o.size;
             
             // Precomputed transmittance for start and end in node, to interpolate per-voxel:
@@ -290,7 +298,7 @@ void main()
                 vec3 lc = localStart + dist / o.size * dir;
                 
                 
-                vec4 voxelData = RetrieveAnimatedVoxelData(brickOffs, lc);
+                vec4 voxelData = RetrieveAnimatedVoxelData(o.ni, lc);
                 
                 vec3 storedLight = voxelData.yyy;
                 
@@ -341,6 +349,9 @@ void main()
                     newLight += cloudFactor * phaseM * betaMSca * mieDensity * transm;
                 
                 color += newLight * T * atmStep;
+                const float lightWeight = dot(newLight * T, vec3(1.0));
+                weightedDepth += lightWeight * (outerMin + dist);
+                depthWeight += lightWeight;
                     
                 // - A *very* crude "approximation" of indirect light:
                 //color += T * atmStep * (1e-8 + 1e-8 * vec3(mieDensity)); // - testing
@@ -378,7 +389,8 @@ void main()
             
             // - used to have 1e-3, but that was high enough to visible show the node grid lines. 1e-4 works.
             // (maybe try to keep a higher threshold in directions not pointing towards the sun? To do)
-            if (length(T) < 1e-4) break; // stop early if transmittance is low
+            // (tiles that were occluded in the previous frame stop sooner)
+            if (length(T) < tileControl.y) break; // stop early if transmittance is low
             
             //dist = tmax + 1e-4; // - testing (but this is dangerous. To do: better epsilon)
             
@@ -387,12 +399,7 @@ void main()
             vec3 p = (hit + dist * dir) / atmScale;
             
             o.p = p;
-            OctreeDescendMap(o);
-            
-            // - using a map fit for the frustum:
-            // (this turned out to only give a very small improvement - perhaps roughly 1/30 of render time in the better cases)
-            //o.p = (o.p - mapPosition) / mapScale;
-            //OctreeDescendMap(frustumOctreeMap, o);
+            OctreeDescendViewMap(o);
             
             // - not necessary now that the loop above is a do-while
             /*if (old == o.ni)
@@ -453,4 +460,8 @@ void main()
     //color = vec3(1.0); // - testing
     imageStore(lightImage, ifragCoords, vec4(color, 0.0));
     imageStore(transmittanceImage, ifragCoords, vec4(transmittance, 0.0));
+    // (without marched light, the far side of the atmosphere or the solid surface before it)
+    const float depth = depthWeight > 0.0 ? weightedDepth / depthWeight
+        : ai.intersectsOuter ? min(ai.outerMax, actualSolidDepth) : 0.0;
+    imageStore(depthImage, ifragCoords, vec4(depth));
 }
@@ -1,3 +0,0 @@
-#version 450
-#define ANIMATE_INTERPOLATION false
-#include "render.glsl"
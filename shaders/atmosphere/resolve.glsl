@@ -2,9 +2,9 @@
 #include "common.glsl"
 #include "../noise.glsl"
 
-// - to do: also depth (both old and new)
 uniform layout(binding=4) sampler2D oldLightTexture;
 uniform layout(binding=5) sampler2D oldTransmittanceTexture;
+uniform layout(binding=10) sampler2D oldDepthTexture;
 
 layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
 #include "compute.glsl"
@@ -12,10 +12,30 @@ layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
 uniform layout(binding=0, rgba16f) image2D lightImage;
 uniform layout(binding=1, rgba16f) image2D transmittanceImage;
 uniform layout(binding=2, rgba16f) image2D outLightImage;
+uniform layout(binding=3, r32f) image2D depthImage;
 
 
 uniform uvec2 fragOffset, fragFactor;
 
+// History is only reused where the depth it was traced at agrees (relatively) with the reprojected one.
+const float DepthTolerance = 0.05;
+
+// Nearest pixel traced this frame to the given one (in the block at the given offset in blocks).
+// (which may be outside the image, for blocks beyond its edges; there's no traced pixel to use there)
+ivec2 TracedPixel(ivec2 ifragCoords, ivec2 blockOffset)
+{
+    ivec2 icoords = (ifragCoords / ivec2(fragFactor) + blockOffset) * ivec2(fragFactor) + ivec2(fragOffset);
+    // - these conditionals would be unnecessary if the image was always guaranteed to be evenly divisible by the downscale factor
+    const ivec2 size = imageSize(lightImage);
+    if (icoords.x >= size.x) icoords.x -= int(fragFactor.x);
+    if (icoords.y >= size.y) icoords.y -= int(fragFactor.y);
+    return icoords;
+}
+bool IsInImage(ivec2 icoords)
+{
+    return all(greaterThanEqual(icoords, ivec2(0))) && all(lessThan(icoords, imageSize(lightImage)));
+}
+
 void main()
 {
     const ivec2 ifragCoords = ivec2(gl_GlobalInvocationID);
@@ -43,39 +63,46 @@ void main()
         const vec3 ori = vec3(invViewMat * vec4(0, 0, 0, 1));
         const vec3 dir = normalize(vec3(invViewProjMat * clipCoords));
         AtmosphereIntersection ai = IntersectAtmosphere(ori, dir);
+        float depth = 0.0;
         
         if (ai.intersectsOuter) // only show atmosphere where there is atmosphere
         {
-            vec3 p = ori + dir * ai.outerMax; // - to do: more intelligent choice (nearer when intersecting planet and/or inner (cloud) shell)
-            vec4 pp = prevViewProjMat * vec4(p, 1.0);
-            vec2 oldCoords = pp.xy / pp.w * 0.5 + 0.5;
-            vec2 halfTexel = 0.5 / vec2(imageSize(lightImage));
-            //halfTexel = vec2(0.0);
-            
-            if (ifragCoords.y >= imageSize(lightImage).x) color += vec3(1.0);
+            // This pixel wasn't traced, so try the depths of the traced ones around it (the nearest first), and take
+            // the previous frame's value at the first whose reprojection agrees with the depth that value was traced at.
+            const ivec2 nearest = TracedPixel(ifragCoords, ivec2(0));
+            const ivec2 blockDir = ivec2(greaterThanEqual(ifragCoords, nearest)) * 2 - 1;
+            const ivec2 candidates[4] = { nearest, TracedPixel(ifragCoords, ivec2(blockDir.x, 0)),
+                TracedPixel(ifragCoords, ivec2(0, blockDir.y)), TracedPixel(ifragCoords, blockDir) };
             
-            if (any(lessThan(oldCoords, vec2(0.0))) || any(greaterThan(oldCoords, vec2(1.0))))
+            bool reprojected = false;
+            for (int i = 0; i < 4 && !reprojected; ++i)
             {
-                // - to do: use closest current frame point when oldCoords out of bounds?
-                // - to do: maybe look into making this more sophisticated
-                ivec2 icoords = ifragCoords / ivec2(fragFactor);
-                icoords = icoords * ivec2(fragFactor) + ivec2(fragOffset);
+                // (not clamped into the image, which would land on a pixel that isn't traced, and is being resolved)
+                if (!IsInImage(candidates[i])) continue;
+                depth = imageLoad(depthImage, candidates[i]).x;
+                if (depth <= 0.0) continue;
+                const vec3 p = ori + dir * depth - prevCameraOffset.xyz; // (relative to the previous camera)
+                const vec4 pp = prevViewProjMat * vec4(p, 1.0);
+                const vec2 oldCoords = pp.xy / pp.w * 0.5 + 0.5;
+                if (pp.w <= 0.0 || any(lessThan(oldCoords, vec2(0.0))) || any(greaterThan(oldCoords, vec2(1.0)))) continue;
                 
-                // - these conditionals would be unnecessary if the image was always guaranteed to be evenly divisible by the downscale factor
-                if (icoords.x >= imageSize(lightImage).x) icoords.x -= int(fragFactor.x);
-                if (icoords.y >= imageSize(lightImage).y) icoords.y -= int(fragFactor.y);
+                // (depths aren't filtered, so as not to blend across edges)
+                const float oldDepth = texelFetch(oldDepthTexture, ivec2(oldCoords * vec2(textureSize(oldDepthTexture, 0))), 0).x;
+                if (abs(oldDepth - length(p)) > DepthTolerance * length(p)) continue;
                 
-                color = imageLoad(lightImage, icoords).rgb;
-                transmittance = imageLoad(transmittanceImage, icoords).rgb;
-            }
-            else
-            {
                 color = texture(oldLightTexture, oldCoords).rgb;
                 transmittance = texture(oldTransmittanceTexture, oldCoords).rgb;
+                reprojected = true;
+            }
+            if (!reprojected) // disoccluded or out of view: the nearest traced pixel
+            {
+                // - to do: maybe look into making this more sophisticated
+                color = imageLoad(lightImage, nearest).rgb;
+                transmittance = imageLoad(transmittanceImage, nearest).rgb;
+                depth = imageLoad(depthImage, nearest).x;
             }
-            
-            // - to do: retrieve depth and search for closest depth in small pixel neighbourhood (among both old and new values)
         }
+        imageStore(depthImage, ifragCoords, vec4(depth));
     }
     
     imageStore(lightImage, ifragCoords, vec4(color, 0.0));
@@ -0,0 +1,52 @@
+#version 450
+
+#include "common.glsl"
+layout(local_size_x = 64, local_size_y = 1, local_size_z = 1) in;
+#include "compute.glsl"
+
+uniform uint brickUploadOffset, numBricks;
+
+// Is the node-sized cube around p (at the given depth) wholly covered by empty leaves?
+// (if the cube is subdivided further it's conservatively taken as not empty)
+bool IsEmptyAt(vec3 p, uint depth)
+{
+    if (any(greaterThanEqual(abs(p), vec3(1.0)))) return true; // outside the octree, and so the atmosphere
+    OctreeTraversalData o;
+    o.p = p;
+    OctreeDescendMapMaxDepth(o, depth);
+    return InvalidIndex == o.gi && (o.flags & EmptyBrickBit) != 0u;
+}
+
+void main()
+{
+    if (GetGlobalIndex() >= numBricks) return;
+    const UploadBrick upload = uploadBricks[GetGlobalIndex() + brickUploadOffset];
+    const uint gi = upload.nodeIndex / NodeArity;
+    const uint ci = upload.nodeIndex % NodeArity;
+    const uint children = nodeGroups[gi].nodes[ci].children;
+    if ((children & EmptyBrickBit) == 0u || (children & IndexMask) != InvalidIndex) return; // only empty leaves are skipped
+
+    const vec3 center = upload.nodeLocation.xyz;
+    const float extent = 2.0 * upload.nodeLocation.w;
+    const uint depth = uint(round(-log2(upload.nodeLocation.w))) - 1u;
+
+    // Grow a cube of empty nodes around this one, a shell (of Chebyshev distance k) at a time.
+    uint distance = 0u;
+    bool empty = true;
+    for (int k = 1; k <= int(MaxEmptyDistance) && empty; ++k)
+    {
+        for (int z = -k; z <= k && empty; ++z)
+        for (int y = -k; y <= k && empty; ++y)
+        {
+            const int xStep = abs(y) == k || abs(z) == k ? 1 : 2 * k; // (inside the shell only its two x faces)
+            for (int x = -k; x <= k && empty; x += xStep)
+            {
+                empty = IsEmptyAt(center + vec3(x, y, z) * extent, depth);
+            }
+        }
+        if (empty) distance = uint(k);
+    }
+
+    const uint meta = nodeGroups[gi].nodes[ci].meta;
+    nodeGroups[gi].nodes[ci].meta = (meta & ~(MetaDistanceMask << MetaDistanceShift)) | distance << MetaDistanceShift;
+}
@@ -5,7 +5,7 @@
 layout(local_size_x = 1, local_size_y = 1, local_size_z = BrickRes) in;
 #include "compute.glsl"
 
-uniform layout(binding=0, rg8) readonly image3D brickImage;
+uniform layout(binding=0, BRICK_IMAGE_FORMAT) readonly image3D brickImage;
 uniform uint brickUploadOffset;
 
 shared vec2 layers[BrickRes]; // min and max density
@@ -14,7 +14,7 @@ void main()
 {
     const uint loadId = GetWorkGroupIndex() + brickUploadOffset;
     const UploadBrick upload = uploadBricks[loadId];
-    const uvec3 voxelOffs = BrickIndexTo3D(upload.brickIndex) * BrickRes + gl_LocalInvocationID;
+    const uvec3 voxelOffs = BrickSlotTo3D(upload.brickIndex) * BrickRes + gl_LocalInvocationID;
     const uint layer = gl_LocalInvocationID.z;
     
     float minDensity = 1e30;
@@ -44,5 +44,8 @@ void main()
     const bool isEmpty = minDensity == 0.0 && maxDensity == 0.0;
     if (isEmpty) nodeGroups[gi].nodes[ni].children |= EmptyBrickBit;
     
-    // - maybe to do: other flags
+    // Metadata (the empty distance is found later, once all flags of the state are in place):
+    const float voxelSize = 2.0 / float(BrickRes - 1u) * upload.nodeLocation.w * atmosphereScale * planetRadius;
+    const bool isOpaque = minDensity * mieMul * betaMEx * voxelSize >= OpaqueOpticalDepth;
+    nodeGroups[gi].nodes[ni].meta = EncodeNodeMeta(minDensity, maxDensity, isOpaque);
 }
@@ -7,11 +7,23 @@ layout(local_size_x = GroupRes, local_size_y = GroupRes, local_size_z = 1) in;
 uniform layout(binding=0, r16) writeonly image2D lightImage;
 uniform uint brickUploadOffset;
 
+// Sweep lighting: one slab of groups per dispatch, front to back along the light. Texels continue from the map of
+// the group upstream of them if that's been swept already (its map plane lies above this slab's top), reading the
+// maps of earlier slabs while writing this one's.
+uniform float slabTopKey;
+uniform layout(binding=3) sampler2D groupLightMap;
+layout(std430, binding = SSBO_VOXEL_GEN_DATA) readonly buffer sweepGroupsBuffer
+{
+    uint sweepGroups[]; // (upload brick indices of the slab's groups)
+};
+
 void main()
 {
     if (!usePerGroupLighting) return;
     
-    const uint loadId = GetWorkGroupIndex() * NodeArity + brickUploadOffset;
+    const uint loadId = LightingSweep == lightingMode
+        ? sweepGroups[GetWorkGroupIndex()] * NodeArity
+        : GetWorkGroupIndex() * NodeArity + brickUploadOffset;
     const UploadBrick upload = uploadBricks[loadId];
     uvec3 writeOffs = GroupIndexTo3D(upload.brickIndex / NodeArity) * GroupRes + gl_LocalInvocationID;
     
@@ -62,7 +74,31 @@ void main()
             )
         {
             dist += sqrt(2.0) * voxelSize; // avoid self-shadowing
-            light *= TraceTransmittance(ori, dir, dist, stepFactor, depth);
+            
+            bool traced = false;
+            if (LightingSweep == lightingMode && all(lessThan(abs(gp), vec3(1.0))))
+            {
+                OctreeTraversalData o;
+                o.p = gp;
+                OctreeDescendMap(o);
+                const uint u = o.ni / NodeArity;
+                if (InvalidIndex != o.ni && u != upload.brickIndex / NodeArity)
+                {
+                    const vec3 childOffs = vec3(uvec3(o.ni, o.ni >> 1u, o.ni >> 2u) & 1u) * 2.0 - 1.0;
+                    const float uHalfSize = 2.0 * o.size;
+                    const vec3 uCenter = o.center - childOffs * o.size;
+                    const float uKey = dot(uCenter, dir) + SweepPlaneDistance * uHalfSize;
+                    if (uKey > slabTopKey)
+                    {
+                        const float maxDist = (uKey - dot(gp, dir)) * atmosphereScale * planetRadius;
+                        light *= TraceTransmittance(ori, dir, dist, stepFactor, depth, maxDist);
+                        vec2 sampleCoords = GroupLightMapCoordinates(u, (gp - uCenter) / uHalfSize, textureSize(groupLightMap, 0));
+                        light *= texture(groupLightMap, sampleCoords).r;
+                        traced = true;
+                    }
+                }
+            }
+            if (!traced) light *= TraceTransmittance(ori, dir, dist, stepFactor, depth);
         }
     }
     
@@ -7,6 +7,7 @@ layout(local_size_x = BrickRes, local_size_y = BrickRes, local_size_z = BrickRes
 uniform layout(binding=0, r8) writeonly image3D lightImage;
 uniform uint brickUploadOffset;
 uniform layout(binding=3) sampler2D groupLightMap;
+uniform float coneAperture;
 
 
 void main()
@@ -42,14 +43,10 @@ void main()
     vec3 light = vec3(1.0);
     float maxDist = 1e30;
     
-    if (usePerGroupLighting)
+    if (usePerGroupLighting && LightingCones != lightingMode) // (cones don't use the per-group shadow maps)
     {
         // Begin with sampling from the per-group shadowing
-        vec3 samplePos = vec3(invGroupLightMat * vec4(groupPos, 1.0));
-        // - to do: check correctness
-        vec2 sampleCoords = samplePos.xy * 0.5 + 0.5; // - is this correct? To test...
-        uvec2 uTexBase = GroupIndexTo3D(upload.brickIndex / NodeArity).xy * GroupRes;
-        sampleCoords = (vec2(uTexBase) + vec2(0.5) + float(GroupRes - 1u) * sampleCoords) / textureSize(groupLightMap, 0);
+        vec2 sampleCoords = GroupLightMapCoordinates(upload.brickIndex / NodeArity, groupPos, textureSize(groupLightMap, 0));
         float groupShadow = texture(groupLightMap, sampleCoords).r;
         light *= groupShadow;
         // - to do: determine max distance to trace to (into per-group shadow map)
@@ -77,7 +74,8 @@ void main()
         {
             dist += sqrt(2.0) * voxelSize; // avoid self-shadowing
             
-            light *= TraceTransmittance(ori, dir, dist, stepFactor, depth, maxDist);
+            if (LightingCones == lightingMode) light *= ConeMarchTransmittance(ori, dir, dist, voxelSize, coneAperture, depth);
+            else light *= TraceTransmittance(ori, dir, dist, stepFactor, depth, maxDist);
             //light *= ConeTraceTransmittance(ori, dir, dist, stepFactor, voxelSize);
             
             
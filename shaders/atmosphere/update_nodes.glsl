@@ -4,14 +4,16 @@
 layout(local_size_x = 1, local_size_y = 1, local_size_z = 1) in;
 #include "compute.glsl"
 
+uniform uint nodeUploadOffset;
 
 void main()
 {
-    const uint loadId = GetGlobalIndex();
+    const uint loadId = GetGlobalIndex() + nodeUploadOffset;
     UploadNodeGroup upload = uploadNodes[loadId];
     for (uint ci = 0u; ci < NodeArity; ++ci)
     {
         upload.nodeGroup.nodes[ci].children &= IndexMask;
+        upload.nodeGroup.nodes[ci].meta = 0u; // (recomputed along with the flags)
     }
     nodeGroups[upload.groupIndex] = upload.nodeGroup;
 }
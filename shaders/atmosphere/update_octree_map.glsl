@@ -8,17 +8,17 @@ layout(local_size_x = 8, local_size_y = 8, local_size_z = 8) in;
 uniform layout(binding=0, r32ui) writeonly uimage3D octreeMapImage;
 uniform vec3 resolution;
 uniform uint maxDepth;
+uniform uint useStateMap; // start descents from the whole-octree map (when making finer maps of parts of it)
 
 void main()
 {
     const uvec3 writeOffs = gl_GlobalInvocationID;
     //const vec3 unitPos = (vec3(writeOffs) + vec3(0.5)) / resolution;
     const vec3 p = (vec3(writeOffs) + vec3(0.5)) * mapScale + mapPosition;
-    //const uint maxDepth = 5u; // - to do: make this the 2-logarithm of the resolution
-    // - to do: enable acceleration using the octree-spanning map when making smaller (i.e. per-frustum) maps
     OctreeTraversalData o;
     o.p = p;
-    OctreeDescendMaxDepth(o, maxDepth);
+    if (0u != useStateMap) OctreeDescendMapMaxDepth(o, maxDepth);
+    else OctreeDescendMaxDepth(o, maxDepth);
     const uint ni = o.ni;
     uint gi = nodeGroups[ni / NodeArity].nodes[ni % NodeArity].children;
     gi &= IndexMask;
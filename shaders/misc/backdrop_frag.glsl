@@ -49,11 +49,10 @@ bool RenderPlanet(vec3 ori, vec3 dir)
         OctreeDescendMap(o);
         if (o.ni != InvalidIndex)
         {
-            const vec3 brickOffs = vec3(BrickIndexTo3D(o.ni));
             vec3 lc = (p - o.center) / o.size;
             
             // - to do: animation (time-based interpolation)
-            vec4 voxelData = RetrieveAnimatedVoxelData(brickOffs, lc);
+            vec4 voxelData = RetrieveAnimatedVoxelData(o.ni, lc);
             vec3 storedLight = voxelData.yyy;
             storedLight = storedLight.xxx;
             
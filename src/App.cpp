@@ -25,6 +25,7 @@ namespace Mulen {
         atmUpdateParams.update = true;
         atmUpdateParams.frustumCull = false;
 
+        Util::Shader::SetBinaryCacheDirectory(shaderCachePath);
         Reload();
         window.SetVSync(true);
 
@@ -46,9 +47,81 @@ namespace Mulen {
         return true;
     }
 
-    bool App::Reload()
+    bool App::ApplyMemoryBudget()
     {
-        return atmosphere.ReloadShaders(shaderPath);
+        const auto budget = static_cast<size_t>(gpuMemBudgetMiB) * (1u << 20u);
+        if (!atmosphere.SetMemoryBudget(budget)) return InitializeAtmosphere();
+        atmInitParams.memBudget = atmInitParams.gpuMemBudget = budget;
+        return true;
+    }
+
+    bool App::Reload(bool wait)
+    {
+        return atmosphere.ReloadShaders(shaderPath, wait);
+    }
+
+    bool App::StartMetricsServer(uint16_t port)
+    {
+        metrics.Describe("mulen_frame_seconds", "Time between frames.");
+        metrics.Describe("mulen_scope_cpu_seconds", "CPU time of timer scopes.");
+        metrics.Describe("mulen_scope_gpu_seconds", "GPU time of timer scopes (partial for update stages spread over frames).");
+        metrics.Describe("mulen_gpu_latency_frames", "Frames until GPU times are read back (average).");
+        metrics.Describe("mulen_gpu_latency_seconds", "Time the GPU is behind the CPU (average).");
+        metrics.Describe("mulen_octree_node_groups", "Octree node groups in use.");
+        metrics.Describe("mulen_octree_node_group_capacity", "Octree node groups available.");
+        metrics.Describe("mulen_update_iterations_total", "Octree update iterations handed over to rendering.");
+        metrics.Describe("mulen_update_iteration_splits", "Node splits per update iteration.");
+        metrics.Describe("mulen_update_iteration_merges", "Node merges per update iteration.");
+        metrics.Describe("mulen_upload_bytes_total", "Bytes uploaded to the GPU by the updater.");
+        metrics.Describe("mulen_queue_depth", "Work queued: node groups staged and dirty in the iteration, relights and shader builds pending.");
+        metrics.Describe("mulen_brick_pages", "Brick pages, resident and virtual.");
+        return metricsServer.Start(port);
+    }
+
+    void App::UpdateMetrics()
+    {
+        if (!metricsServer.IsRunning()) return;
+        metrics.Observe("mulen_frame_seconds", dt, 1e-6);
+
+        // The times stored since the last frame (GPU times arriving some frames late).
+        const auto numNames = timer.GetNumNames();
+        metricsTimesRead.resize(numNames * 2u, 0u);
+        while (metricsLabels.size() < numNames) metricsLabels.push_back(Util::Metrics::Label("scope", timer.RefToName(metricsLabels.size())));
+        for (Util::Timer::NameRef ref = 0u; ref < numNames; ++ref)
+        {
+            auto& t = timer.GetTimings(ref);
+            auto observe = [&](const auto& times, size_t& read, const char* name)
+            {
+                const auto num = static_cast<int>(glm::min(times.GetNumInserted() - read, times.Size()));
+                read = times.GetNumInserted();
+                for (auto i = 1 - num; i <= 0; ++i) metrics.Observe(name, times[i].duration, 1e-9, metricsLabels[ref]);
+            };
+            observe(t.cpuTimes, metricsTimesRead[ref * 2u], "mulen_scope_cpu_seconds");
+            observe(t.gpuTimes, metricsTimesRead[ref * 2u + 1u], "mulen_scope_gpu_seconds");
+        }
+        const auto latency = timer.GetGpuLatency();
+        metrics.SetGauge("mulen_gpu_latency_frames", latency.frames);
+        metrics.SetGauge("mulen_gpu_latency_seconds", latency.microseconds * 1e-6);
+
+        const auto s = atmosphere.GetStatistics();
+        metrics.SetGauge("mulen_octree_node_groups", double(s.nodeGroups));
+        metrics.SetGauge("mulen_octree_node_group_capacity", double(s.nodeGroupCapacity));
+        if (s.iterations != metricsIterations)
+        {
+            metrics.AddCounter("mulen_update_iterations_total", double(s.iterations - metricsIterations));
+            metrics.Observe("mulen_update_iteration_splits", double(s.splits));
+            metrics.Observe("mulen_update_iteration_merges", double(s.merges));
+            metrics.Observe("mulen_update_iteration_uninterpolated_groups", double(s.uninterpolatedNodeGroups));
+            metricsIterations = s.iterations;
+        }
+        metrics.AddCounter("mulen_upload_bytes_total", double(s.uploadBytes));
+        metrics.SetGauge("mulen_queue_depth", double(s.stagedNodeGroups), Util::Metrics::Label("queue", "staged_node_groups"));
+        metrics.SetGauge("mulen_queue_depth", double(s.dirtyNodeGroups), Util::Metrics::Label("queue", "dirty_node_groups"));
+        metrics.SetGauge("mulen_queue_depth", double(s.pendingRelights), Util::Metrics::Label("queue", "pending_relights"));
+        metrics.SetGauge("mulen_queue_depth", double(s.deferredNodeGroups), Util::Metrics::Label("queue", "deferred_node_groups"));
+        metrics.SetGauge("mulen_queue_depth", double(s.pendingShaders), Util::Metrics::Label("queue", "pending_shaders"));
+        metrics.SetGauge("mulen_brick_pages", double(s.residentBrickPages), Util::Metrics::Label("state", "resident"));
+        metrics.SetGauge("mulen_brick_pages", double(s.brickPages), Util::Metrics::Label("state", "virtual"));
     }
 
     void App::HandleUserInterface()
@@ -163,15 +236,115 @@ namespace Mulen {
                 ImGui::Checkbox("Animate", &atmUpdateParams.animate);
                 ImGui::Checkbox("Use feature generator", &atmUpdateParams.useFeatureGenerator);
                 ImGui::SliderInt("Depth", &atmUpdateParams.depthLimit, 1u, maxDepthLimit);
-                ImGui::SliderInt("Downscale", &downscaleFactor, 1u, 4u);
+                if (ImGui::BeginCombo("Lighting", GetLightingModeName(atmUpdateParams.lightingMode)))
+                {
+                    for (size_t i = 0u; i < size_t(LightingMode::Count); ++i)
+                    {
+                        const auto mode = LightingMode(i);
+                        if (ImGui::Selectable(GetLightingModeName(mode), mode == atmUpdateParams.lightingMode))
+                        {
+                            atmUpdateParams.lightingMode = mode;
+                        }
+                    }
+                    ImGui::EndCombo();
+                }
+                if (LightingMode::Cones == atmUpdateParams.lightingMode)
+                {
+                    ImGui::SliderFloat("Cone aperture", &atmUpdateParams.coneAperture, 0.0f, 0.5f);
+                }
+                if (LightingMode::ShadowRays == atmUpdateParams.lightingMode)
+                {
+                    ImGui::Checkbox("Per-group lighting", &atmUpdateParams.perGroupLighting);
+                }
+                ImGui::Checkbox("Optimise generation", &atmUpdateParams.optimiseGeneration);
+                ImGui::Checkbox("Cumulus wind cells", &atmUpdateParams.cumulusWindCells);
+                ImGui::SliderFloat("Trace budget (ms)", &traceBudgetMs, 0.0f, 33.0f);
+                if (traceBudgetMs > 0.0f)
+                {
+                    const auto f = atmosphere.GetFragFactor();
+                    ImGui::Text("Downscale: %u*%u", f.x, f.y);
+                }
+                else ImGui::SliderInt("Downscale", &downscaleFactor, 1u, 4u);
+                ImGui::Checkbox("Adaptive steps", &adaptiveSteps);
                 ImGui::Spacing();
                 ImGui::InputInt("GPU memory budget (MiB)", &gpuMemBudgetMiB, 256, 1024);
                 gpuMemBudgetMiB = glm::max(512, gpuMemBudgetMiB);
+                ImGui::Checkbox("Zero-copy uploads", &atmInitParams.zeroCopyUploads);
+                ImGui::Checkbox("Sparse bricks", &atmInitParams.sparseBricks);
+                ImGui::Checkbox("Copy-on-write bricks", &atmInitParams.copyOnWriteBricks);
+                if (ImGui::BeginCombo("Brick format", GetBrickFormatInfo(atmInitParams.brickFormat).name))
+                {
+                    for (size_t i = 0u; i < size_t(BrickFormat::Count); ++i)
+                    {
+                        const auto format = BrickFormat(i);
+                        if (ImGui::Selectable(GetBrickFormatInfo(format).name, format == atmInitParams.brickFormat))
+                        {
+                            atmInitParams.brickFormat = format; // (applied on re-init)
+                        }
+                    }
+                    ImGui::EndCombo();
+                }
+                if (atmosphere.GetBrickFormat() != atmInitParams.brickFormat)
+                {
+                    ImGui::SameLine();
+                    ImGui::Text("(active: %s)", GetBrickFormatInfo(atmosphere.GetBrickFormat()).name);
+                }
+                auto mapResSlider = [](const char* label, unsigned& res)
+                {
+                    int log2Res = 0;
+                    while ((2u << log2Res) <= res) ++log2Res;
+                    if (ImGui::SliderInt(label, &log2Res, 3, 9, std::to_string(1u << log2Res).c_str())) res = 1u << log2Res;
+                };
+                mapResSlider("Octree map resolution", atmInitParams.octreeMapRes); // (applied on re-init)
+                mapResSlider("View map resolution", atmInitParams.viewMapRes);
+                int viewMapLevels = int(atmInitParams.viewMapLevels);
+                if (ImGui::SliderInt("View map levels", &viewMapLevels, 0, 6)) atmInitParams.viewMapLevels = unsigned(viewMapLevels);
+                ImGui::Checkbox("Reload changed shaders", &reloadChangedShaders);
                 if (ImGui::Button("Re-init"))
                 {
                     atmosphere.ReloadShaders(shaderPath);
                     InitializeAtmosphere();
                 }
+                ImGui::SameLine();
+                if (ImGui::Button("Apply budget"))
+                {
+                    ApplyMemoryBudget();
+                }
+                ImGui::SameLine();
+                if (ImGui::Button("Capture reference"))
+                {
+                    Atmosphere::BrickStore store;
+                    if (atmosphere.CaptureBrickStore(store, camera, light, renderResolution) && store.Save(referenceCapturePath))
+                    {
+                        std::cout << "Saved reference capture to " << referenceCapturePath
+                            << " (render it with: --reference " << referenceCapturePath << " <output.hdr>)\n";
+                    }
+                }
+                ImGui::SameLine();
+                if (ImGui::Button("Validate octree maps"))
+                {
+                    atmosphere.ValidateOctreeMaps();
+                }
+                ImGui::SameLine();
+                if (ImGui::Button("Validate brick storage"))
+                {
+                    atmosphere.ValidateBrickStorage();
+                }
+                ImGui::SameLine();
+                if (ImGui::Button("Validate scattering tables"))
+                {
+                    atmosphere.ValidateScatteringTables();
+                }
+                ImGui::Text("Resident brick pages: %zu of %zu", atmosphere.GetResidentBrickPages(), atmosphere.GetBrickPages());
+                {
+                    std::vector<double> orderSeconds;
+                    const auto orders = atmosphere.GetScatteringProgress(orderSeconds);
+                    ImGui::Text("Scattering orders: %u of %u", orders, atmosphere.GetScatteringOrders());
+                    for (size_t i = 0u; i < orderSeconds.size(); ++i)
+                    {
+                        if (orderSeconds[i] > 0.0) ImGui::Text("  Order %zu computed in %.2f s", i + 1u, orderSeconds[i]);
+                    }
+                }
                 ImGui::PopItemWidth();
 
                 { // distance to planet or atmosphere cloud shell
@@ -348,6 +521,8 @@ namespace Mulen {
 
         if (vsync != window.GetVSync()) window.SetVSync(vsync);
         atmosphere.SetDownscaleFactor(downscaleFactor);
+        atmosphere.SetTraceBudget(traceBudgetMs * 1e-3);
+        atmosphere.SetAdaptiveSteps(adaptiveSteps);
         renderResolution = selectedResolution;
         if (renderResolution == glm::ivec2(0, 0)) renderResolution = windowSize;
 
@@ -414,18 +589,8 @@ namespace Mulen {
             {
                 auto getGpuTime = [&](const std::string& name)
                 {
-                    auto& t = timer.GetTimings(timer.NameToRef(name)).gpuTimes;
-                    const auto averageWindow = 100ull; // number of samples to average over
-                    //return t.Average(averageWindow);
-
-                    const size_t window = 100ull; // - to do: adjust
-                    const auto num = static_cast<int>(glm::min(window, t.Size()));
-                    auto sum = 0.0;
-                    for (auto i = 0; i < num; ++i)
-                    {
-                        sum += t[-i].duration / t[-i].meta.factor;
-                    }
-                    return sum / double(num);
+                    const size_t window = 100ull; // number of samples to average over (- to do: adjust)
+                    return timer.GetTimings(timer.NameToRef(name)).gpuTimes.AverageScaled(window);
                 };
                 auto displayGpuTime = [&](const char* nameLiteral)
                 {
@@ -433,12 +598,27 @@ namespace Mulen {
                     //ImGui::Text("%s: %.3f ms", nameLiteral, 1e3 * getGpuTime(name));
                     ImGui::Text("%9.3f ms    %s", 1e3 * getGpuTime(name), nameLiteral);
                 };
+                auto displayCpuTime = [&](const char* nameLiteral)
+                {
+                    auto& t = timer.GetTimings(timer.NameToRef(nameLiteral)).cpuTimes;
+                    ImGui::Text("%9.3f ms    %s (CPU)", 1e3 * t.Average(100u), nameLiteral);
+                };
 
                 ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
+                const auto latency = timer.GetGpuLatency();
+                ImGui::Text("GPU times arrive %.1f frames late (GPU %.0f us behind the CPU)", latency.frames, latency.microseconds);
 
                 displayGpuTime("App::OnFrame");
                 displayGpuTime("Atmosphere::Render");
                 displayGpuTime("Atmosphere::Update");
+                ImGui::Spacing();
+                ImGui::Text("Render pass:");
+                displayGpuTime("Render::Classify");
+                displayGpuTime("Render::Trace");
+                for (const auto& name : Profiler_RenderRays)
+                {
+                    ImGui::Text("%9.0f       %s (rays)", timer.GetTimings(name).counts.Average(100u), name.c_str());
+                }
                 // - to do: some sort of special handling for these, no? Possibly
                 ImGui::Spacing();
                 ImGui::Text("Update pass:");
@@ -449,6 +629,41 @@ namespace Mulen {
                 displayGpuTime("Update::LightPerGroup");
                 displayGpuTime("Update::LightPerVoxel");
                 displayGpuTime("Update::Filter");
+                displayGpuTime("Update::Upload");
+                displayCpuTime("Update::UploadCopy");
+                ImGui::Text("%9.3f MiB   uploaded this frame", atmosphere.GetUploadBytes() / double(1u << 20u));
+                ImGui::Spacing();
+                ImGui::Text("Shader variants:");
+                for (auto variants : atmosphere.GetShaderVariants())
+                {
+                    const auto& name = variants->GetName();
+                    ImGui::Text("%9.3f ms   %zu  %s", variants->GetLazyCompileSeconds() * 1e3, variants->GetNumVariants(),
+                        name.substr(name.find_last_of('/') + 1u).c_str());
+                }
+                ImGui::Spacing();
+                if (ImGui::TreeNode("Scopes (inclusive, self, GPU)"))
+                {
+                    // Nested as they were first begun (the worker thread's scopes are CPU-only).
+                    const auto numNames = timer.GetNumNames();
+                    std::vector<std::vector<Util::Timer::NameRef>> children(numNames + 1u); // (the last for roots)
+                    for (Util::Timer::NameRef ref = 0u; ref < numNames; ++ref)
+                    {
+                        auto& t = timer.GetTimings(ref);
+                        if (!t.cpuTimes.Size()) continue; // (counts)
+                        children[Util::Timer::NoRef == t.parent ? numNames : t.parent].push_back(ref);
+                    }
+                    std::function<void(Util::Timer::NameRef)> displayScope = [&](Util::Timer::NameRef ref)
+                    {
+                        auto& t = timer.GetTimings(ref);
+                        const auto flags = children[ref].empty() ? ImGuiTreeNodeFlags_Leaf : ImGuiTreeNodeFlags_DefaultOpen;
+                        if (!ImGui::TreeNodeEx((void*)(uintptr_t)ref, flags, "%9.3f %9.3f %9.3f ms  %s", 1e3 * t.cpuTimes.Average(100u),
+                            1e3 * t.selfTimes.Average(100u), 1e3 * t.gpuTimes.Average(100u), timer.RefToName(ref).c_str())) return;
+                        for (auto child : children[ref]) displayScope(child);
+                        ImGui::TreePop();
+                    };
+                    for (auto ref : children[numNames]) displayScope(ref);
+                    ImGui::TreePop();
+                }
                 ImGui::Spacing();
                 if (benchmarker.IsInactive() && ImGui::Button("Record path"))
                 {
@@ -462,14 +677,21 @@ namespace Mulen {
                 {
                     benchmarker.StartBenchmark();
                 }
+                if (benchmarker.IsInactive())
+                {
+                    ImGui::SameLine();
+                    if (ImGui::Button("Save stage costs")) benchmarker.SaveStageCosts(); // (for deterministic benchmarks)
+                }
             }
             ImGui::End();
         }
 
 
 
+        if (reloadChangedShaders) atmosphere.ReloadChangedShaders();
         atmosphere.Update(dt, atmUpdateParams, camera, light);
         atmosphere.Render(windowSize, renderResolution, camera, light);
+        UpdateMetrics();
         if (takeScreenshot) // - maybe to do: enable including profiling data
         {
             screenshotter.TakeScreenshot(window, renderResolution, camera, atmosphere);
@@ -498,7 +720,7 @@ namespace Mulen {
             fpsMode ? window.DisableCursor(fpsMode = false) : window.Close();
             break;
         case GLFW_KEY_F5:
-            if (Reload()) std::cout << "Reloaded\n";
+            if (Reload(false)) std::cout << "Reloading shaders\n"; // (swapped in once built)
             break;
         case GLFW_KEY_F4:
             vsync = !vsync;
@@ -9,6 +9,7 @@
 #include "atmosphere/Atmosphere.hpp"
 #include "Camera.hpp"
 #include "util/Timer.hpp"
+#include "util/Metrics.hpp"
 #include "Screenshotter.hpp"
 #include "Benchmarker.hpp"
 #include "LightSource.hpp"
@@ -19,6 +20,8 @@ namespace Mulen {
         App(Window&);
 
         const std::string shaderPath = "shaders/";
+        const std::string shaderCachePath = "cache/shaders/";
+        const std::string referenceCapturePath = "reference.brickstore";
         Benchmarker benchmarker;
 
         bool showGui = true;
@@ -36,6 +39,9 @@ namespace Mulen {
         bool collision = true, keepLevel = false, inertial = false;
         Atmosphere::Atmosphere::UpdateParams atmUpdateParams;
         int downscaleFactor = 4u;
+        bool adaptiveSteps = true; // per screen tile, by the previous frame
+        bool reloadChangedShaders = true; // as their source files change
+        float traceBudgetMs = 0.0f; // GPU time for atmosphere rays per frame, choosing the downscale (zero to not)
         const int maxDepthLimit = 16u;
         double lastTime;
         glm::ivec2 selectedResolution{ 0, 0 }, renderResolution{ 1, 1 };
@@ -43,7 +49,8 @@ namespace Mulen {
         int gpuMemBudgetMiB = 2048; // - kind of arbitrary, but we've got to start with something
         Atmosphere::Atmosphere::Params atmInitParams;
         bool InitializeAtmosphere();
-        bool Reload();
+        bool ApplyMemoryBudget(); // without reinitialising the atmosphere, if possible
+        bool Reload(bool wait = true);
         void OnFrame() override;
         void OnKey(int key, int scancode, int action, int mods) override;
         void OnScroll(double xoffset, double yoffset) override;
@@ -53,6 +60,14 @@ namespace Mulen {
 
         Screenshotter screenshotter;
 
+        // Monitoring: metrics gathered every frame while they're served (e.g. for Prometheus to scrape).
+        Util::Metrics metrics;
+        Util::MetricsServer metricsServer{ metrics };
+        bool StartMetricsServer(uint16_t port);
+        void UpdateMetrics();
+        std::vector<size_t> metricsTimesRead; // of each timer name's CPU and GPU times
+        std::vector<std::string> metricsLabels; // of each timer name
+        size_t metricsIterations = 0u;
 
         double dt, aspect;
         glm::ivec2 windowSize;
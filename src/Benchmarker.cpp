@@ -1,6 +1,8 @@
 ﻿#include "Benchmarker.hpp"
 #include "App.hpp"
+#include <algorithm>
 #include <filesystem>
+#include <sstream>
 #include <util/json.hpp>
 using nlohmann::json;
 
@@ -10,7 +12,18 @@ namespace Mulen {
     static const std::string
         configPath  = basePath + "config/",
         recordPath  = basePath + "record/",
-        resultsPath = basePath + "results/";
+        resultsPath = basePath + "results/",
+        convertedPath = basePath + "converted/", // (binary copies of JSON sequences)
+        stageCostsPath = basePath + "stage_costs.json"; // (for deterministic configurations)
+
+    static void WriteDeviceInfo(json& j)
+    {
+        j["device"] =
+        {
+            {"vendor", (const char*)glGetString(GL_VENDOR)},
+            {"renderer", (const char*)glGetString(GL_RENDERER)},
+        };
+    }
 
 
     static void WriteConfigurationParameters(const Benchmarker::Configuration& config, json& j)
@@ -22,19 +35,26 @@ namespace Mulen {
             {"rotateLight", config.atmUpdateParams.rotateLight},
             {"frustumCull", config.atmUpdateParams.frustumCull},
             {"depthLimit", config.atmUpdateParams.depthLimit},
-            {"useFeatureGenerator", config.atmUpdateParams.useFeatureGenerator}
+            {"useFeatureGenerator", config.atmUpdateParams.useFeatureGenerator},
+            {"lightingMode", GetLightingModeName(config.atmUpdateParams.lightingMode)},
+            {"coneAperture", config.atmUpdateParams.coneAperture},
+            {"perGroupLighting", config.atmUpdateParams.perGroupLighting},
+            {"optimiseGeneration", config.atmUpdateParams.optimiseGeneration},
+            {"cumulusWindCells", config.atmUpdateParams.cumulusWindCells}
         };
         j["config"] =
         {
             {"resolution", { config.resolution.x, config.resolution.y }},
             {"warmUpFrames", config.warmUpFrames},
-            {"gpuMemBudgetMiB", config.gpuMemBudgetMiB}
-        };
-        j["device"] =
-        {
-            {"vendor", (const char*)glGetString(GL_VENDOR)},
-            {"renderer", (const char*)glGetString(GL_RENDERER)},
+            {"gpuMemBudgetMiB", config.gpuMemBudgetMiB},
+            {"copyOnWriteBricks", config.copyOnWriteBricks},
+            {"brickFormat", GetBrickFormatInfo(config.brickFormat).name},
+            {"octreeMapRes", config.octreeMapRes},
+            {"viewMapRes", config.viewMapRes},
+            {"viewMapLevels", config.viewMapLevels},
+            {"deterministic", config.deterministic}
         };
+        WriteDeviceInfo(j);
     }
 
     Benchmarker::Benchmarker(App& app)
@@ -46,6 +66,8 @@ namespace Mulen {
         if (Mode::Inactive != mode) return;
         Load(configPath);
         if (configs.empty()) return; // no benchmark configuration to run
+        stageCosts.clear();
+        if (std::any_of(configs.begin(), configs.end(), [](const Configuration& c) { return c.deterministic; })) LoadStageCosts();
         mode = Mode::Benchmarking;
 
         currentConfig = currentFrame = warmUpFrame = 0u;
@@ -75,16 +97,36 @@ namespace Mulen {
         if (currentFrame == 0 && warmUpFrame == 0u) // starting on a new config?
         {
             results.clear();
-            //std::cout << " init frame of " << config.sequence.size() << std::endl;
+            octreeFrames.clear();
+            //std::cout << " init frame of " << config.numFrames << std::endl;
+            if (!replay.Open(config.sequencePath) || !replay.Next(replayFrame)) config.numFrames = 0u; // (skipped)
             const auto needsReInit = app.gpuMemBudgetMiB != config.gpuMemBudgetMiB;
             app.gpuMemBudgetMiB = config.gpuMemBudgetMiB;
-            if (needsReInit)
+            if (config.deterministic || // (starting from the initial octree, whatever ran before)
+                app.atmInitParams.copyOnWriteBricks != config.copyOnWriteBricks ||
+                app.atmInitParams.brickFormat != config.brickFormat ||
+                app.atmInitParams.octreeMapRes != config.octreeMapRes ||
+                app.atmInitParams.viewMapRes != config.viewMapRes ||
+                app.atmInitParams.viewMapLevels != config.viewMapLevels) // (the brick storage mode, format, and maps need a full Init)
             {
-                app.InitializeAtmosphere(); // - maybe to do: only do this if the GPU memory budget changed?
+                app.atmInitParams.copyOnWriteBricks = config.copyOnWriteBricks;
+                app.atmInitParams.brickFormat = config.brickFormat;
+                app.atmInitParams.octreeMapRes = config.octreeMapRes;
+                app.atmInitParams.viewMapRes = config.viewMapRes;
+                app.atmInitParams.viewMapLevels = config.viewMapLevels;
+                app.InitializeAtmosphere();
+            }
+            else if (needsReInit)
+            {
+                app.ApplyMemoryBudget(); // (only reinitialises if the budget exceeds the atmosphere's capacity)
             }
             // - to do: await updater thread iteration completion, if it's not idle already
+            // (the reinitialisation of deterministic configurations does)
             app.renderResolution = config.resolution;
             app.atmUpdateParams = config.atmUpdateParams;
+            app.atmosphere.SetDeterministicUpdates(config.deterministic, stageCosts);
+            if (config.deterministic) app.atmosphere.SetTraceBudget(0.0); // (as it follows measured GPU times)
+            startIterations = app.atmosphere.GetStatistics().iterations;
         }
 
         const auto inWarmUp = warmUpFrame < config.warmUpFrames;
@@ -92,7 +134,7 @@ namespace Mulen {
         {
             ++warmUpFrame;
         }
-        if (currentFrame >= config.sequence.size()) // done with this configuration?
+        if (currentFrame >= config.numFrames) // done with this configuration?
         {
             // - to do: await remaining profiler values for this pass before continuing?
             // (it would really be better to just receive them later, though)
@@ -120,7 +162,7 @@ namespace Mulen {
             for (size_t i = 0u; i < configs.size(); ++i)
             {
                 auto& config = configs[i];
-                auto progress = unsigned(100.0 * currentFrame / config.sequence.size());
+                auto progress = unsigned(100.0 * currentFrame / config.numFrames);
                 if (currentConfig < i) progress = 0;
                 if (currentConfig > i) progress = 100;
                 auto isWarmUp = currentConfig == i && inWarmUp;
@@ -129,7 +171,7 @@ namespace Mulen {
         }
         ImGui::End();
 
-        auto& frame = config.sequence[currentFrame];
+        const auto& frame = replayFrame;
 
         app.camera.SetPosition(frame.cameraPosition);
         app.camera.SetOrientation(frame.cameraOrientation);
@@ -146,30 +188,32 @@ namespace Mulen {
             if (results.size() < num) results.resize(num);
             for (size_t i = 0u; i < num; ++i)
             {
-                auto& name = profiler.RefToName(i);
-                auto& t = profiler.GetTimings(name).gpuTimes;
+                auto& t = profiler.GetTimings(i).gpuTimes;
                 if (!t.Size()) continue;
                 // - to do
                 auto& result = results[i];
                 
-                auto num = 0;
-                for (int ti = 0; ti < t.Size(); ++ti, ++num)
-                {
-                    if (t[-ti].frame <= result.lastFrame) break;
-                    //sum += t[-i].duration / t[-i].meta.factor;
-                }
-                if (!num) continue;
+                // (frames' times may arrive out of order, so new ones are told by the number inserted)
+                auto num = static_cast<int>(glm::min(t.GetNumInserted() - result.numRead, t.Size()));
+                result.numRead = t.GetNumInserted();
                 for (; num > 0;)
                 {
                     --num;
                     result.durations.push_back(static_cast<decltype(result.durations)::value_type>(t[-num].duration * 1e6));
-                    // - to do: also store the meta factor
-                    result.lastFrame = t[-num].frame;
+                    result.factors.push_back(static_cast<float>(t[-num].meta.factor));
                 }
             }
 
+            // (as of the previous frame's update)
+            const auto stats = app.atmosphere.GetStatistics();
+            octreeFrames.push_back({ stats.iterations - startIterations, stats.nodeGroups, stats.stagedNodeGroups });
+
             // Advance to next frame.
-            ++currentFrame;
+            if (++currentFrame < config.numFrames && !replay.Next(replayFrame))
+            {
+                std::cerr << config.sequencePath << " ended at frame " << currentFrame << " of " << config.numFrames << ".\n";
+                currentFrame = config.numFrames; // (the file changed since it was loaded)
+            }
         }
     }
 
@@ -204,13 +248,54 @@ namespace Mulen {
             auto& result = results[ref];
             const auto& name = app.timer.RefToName(ref);
             j["results"][name] = json::array();
-            json da;
+            json da, fa;
             for (auto& d : result.durations) da.push_back(d);
+            for (auto& f : result.factors) fa.push_back(f);
+            // The mean duration of a whole pass (as the updater estimates stage costs), so stages compare across configurations.
+            double passSum = 0.0;
+            size_t passNum = 0u;
+            for (size_t i = 0u; i < result.durations.size(); ++i)
+            {
+                if (result.factors[i] <= 0.0f) continue;
+                passSum += result.durations[i] / double(result.factors[i]);
+                ++passNum;
+            }
+            const auto passDuration = passNum ? passSum / double(passNum) : 0.0;
             j["results"][name] =
             {
-                {"duration", da}
+                {"duration", da},
+                {"factor", fa},
+                {"meanPassDuration", passDuration}
             };
-            // - to do: more values, possibly
+            if (Profiler_UpdateLight == name)
+            {
+                std::cout << fileName << ": " << name << " " << passDuration << " us per pass ("
+                    << GetLightingModeName(configs[currentConfig].atmUpdateParams.lightingMode) << " lighting)" << std::endl;
+            }
+        }
+
+        // The octree's state per frame, and a hash of it to compare runs by at a glance.
+        json iterations, nodeGroups, stagedNodeGroups;
+        uint64_t hash = 14695981039346656037ull; // (FNV-1a)
+        for (const auto& f : octreeFrames)
+        {
+            iterations.push_back(f.iterations);
+            nodeGroups.push_back(f.nodeGroups);
+            stagedNodeGroups.push_back(f.stagedNodeGroups);
+            for (auto v : { f.iterations, f.nodeGroups, f.stagedNodeGroups }) hash = (hash ^ uint64_t(v)) * 1099511628211ull;
+        }
+        std::ostringstream hashText;
+        hashText << std::hex << std::setw(16) << std::setfill('0') << hash;
+        j["octree"] =
+        {
+            {"iterations", iterations},
+            {"nodeGroups", nodeGroups},
+            {"stagedNodeGroups", stagedNodeGroups},
+            {"hash", hashText.str()}
+        };
+        if (configs[currentConfig].deterministic)
+        {
+            std::cout << fileName << ": octree hash " << hashText.str() << " over " << octreeFrames.size() << " frames" << std::endl;
         }
         file << std::setw(4) << j;
     }
@@ -224,13 +309,15 @@ namespace Mulen {
         frame.cameraFovy = app.camera.GetFovy();
         frame.animationTime = app.atmosphere.GetAnimationTime();
         frame.lightTime = app.atmosphere.GetLightTime();
-        recording.sequence.push_back(frame);
+        recordingWriter.Append(frame);
     }
 
     void Benchmarker::StopBenchmark()
     {
         if (Mode::Benchmarking != mode) return;
         mode = Mode::Inactive;
+        replay.Close();
+        app.atmosphere.SetDeterministicUpdates(false);
         // - to do: restore state modified by benchmarking
 
         // - to do: save results
@@ -246,6 +333,18 @@ namespace Mulen {
         recording.atmUpdateParams = app.atmUpdateParams;
         recording.resolution = app.renderResolution;
         recording.gpuMemBudgetMiB = app.gpuMemBudgetMiB;
+        recording.copyOnWriteBricks = app.atmInitParams.copyOnWriteBricks;
+        recording.brickFormat = app.atmInitParams.brickFormat;
+        recording.octreeMapRes = app.atmInitParams.octreeMapRes;
+        recording.viewMapRes = app.atmInitParams.viewMapRes;
+        recording.viewMapLevels = app.atmInitParams.viewMapLevels;
+
+        // (frames are appended as they're recorded, so a long recording neither builds up in memory nor takes long to save)
+        std::filesystem::create_directories(recordPath);
+        const auto fileName = recordPath + "recording" + CameraSequence::Extension; // - to do: destination file name as parameter?
+        json j;
+        WriteConfigurationParameters(recording, j);
+        if (!recordingWriter.Open(fileName, j)) mode = Mode::Inactive;
     }
 
     void Benchmarker::StopRecording()
@@ -253,64 +352,50 @@ namespace Mulen {
         if (Mode::Recording != mode) return;
         mode = Mode::Inactive;
 
-        std::filesystem::create_directories(recordPath);
-        const auto fileName = recordPath + "recording.json"; // - to do: destination file name as parameter?
-        std::ofstream file(fileName);
-        if (!file.is_open())
-        {
-            std::cerr << "Could not open recording file " << fileName << " to save recording\n";
-            return;
-        }
+        recordingWriter.Close();
+        std::cout << "Recorded " << recordingWriter.GetNumFrames() << " frames" << std::endl;
+    }
 
-        json j;
-        WriteConfigurationParameters(recording, j);
+    template<typename T>
+    static void jsonCond(json& j, T& value, const char* key)
+    {
+        if (j.contains(key)) value = j[key].get<T>();
+    }
 
-        j["sequence"] = json::array();
-        for (auto& frame : recording.sequence)
+    static void ReadConfigurationParameters(json& j, Benchmarker::Configuration& config)
+    {
+        auto jc = j["config"];
+        jsonCond(jc, config.warmUpFrames, "warmUpFrames");
+        jsonCond(jc, config.gpuMemBudgetMiB, "gpuMemBudgetMiB");
+        jsonCond(jc, config.copyOnWriteBricks, "copyOnWriteBricks");
+        jsonCond(jc, config.octreeMapRes, "octreeMapRes");
+        jsonCond(jc, config.viewMapRes, "viewMapRes");
+        jsonCond(jc, config.viewMapLevels, "viewMapLevels");
+        jsonCond(jc, config.deterministic, "deterministic");
+        if (jc.contains("brickFormat") && !ParseBrickFormat(jc["brickFormat"].get<std::string>(), config.brickFormat))
         {
-            auto& p = frame.cameraPosition;
-            auto& o = frame.cameraOrientation;
-
-            j["sequence"].push_back({
-                {"cameraPosition", {p.x, p.y, p.z}},
-                {"cameraOrientation", {o.x, o.y, o.z, o.w}},
-                {"cameraFovy", frame.cameraFovy},
-                {"animationTime", frame.animationTime},
-                {"lightTime", frame.lightTime}
-            });
+            std::cerr << "Unknown brick format " << jc["brickFormat"] << " in " << config.fileName << ".\n";
         }
-
-        // Compress by not storing repeat values:
-        json p = json::object();
-        std::vector<std::string> keysToDelete;
-        for (size_t i = 0u; i < j["sequence"].size(); ++i)
+        config.resolution = glm::ivec2(jc["resolution"][0].get<int>(), jc["resolution"][1].get<int>());
+        std::cout << "Read config of resolution " << config.resolution.x << "*" << config.resolution.y << "\n";
+        if (j.contains("atmosphereUpdateParams"))
         {
-            keysToDelete.clear();
-            auto& c = j["sequence"][i];
-            for (auto& [key, value] : c.items())
-            {
-                if (p.contains(key) && p[key] == value)
-                {
-                    // No need to store a repeat value.
-                    keysToDelete.push_back(key);
-                    continue;
-                }
-                p[key] = value;
-            }
-            for (auto& key : keysToDelete)
+            auto aj = j["atmosphereUpdateParams"];
+            jsonCond(aj, config.atmUpdateParams.update, "update");
+            jsonCond(aj, config.atmUpdateParams.animate, "animate");
+            jsonCond(aj, config.atmUpdateParams.rotateLight, "rotateLight");
+            jsonCond(aj, config.atmUpdateParams.frustumCull, "frustumCull");
+            jsonCond(aj, config.atmUpdateParams.depthLimit, "depthLimit");
+            jsonCond(aj, config.atmUpdateParams.useFeatureGenerator, "useFeatureGenerator");
+            jsonCond(aj, config.atmUpdateParams.coneAperture, "coneAperture");
+            jsonCond(aj, config.atmUpdateParams.perGroupLighting, "perGroupLighting");
+            jsonCond(aj, config.atmUpdateParams.optimiseGeneration, "optimiseGeneration");
+            jsonCond(aj, config.atmUpdateParams.cumulusWindCells, "cumulusWindCells");
+            if (aj.contains("lightingMode") && !ParseLightingMode(aj["lightingMode"].get<std::string>(), config.atmUpdateParams.lightingMode))
             {
-                c.erase(key);
+                std::cerr << "Unknown lighting mode " << aj["lightingMode"] << " in " << config.fileName << ".\n";
             }
         }
-        file << std::setw(4) << j;
-
-        std::cout << "Recorded " << recording.sequence.size() << " frames" << std::endl;
-    }
-
-    template<typename T>
-    static void jsonCond(json& j, T& value, const char* key)
-    {
-        if (j.contains(key)) value = j[key].get<T>();
     }
 
     void Benchmarker::Load(const std::string& dirPath)
@@ -319,59 +404,79 @@ namespace Mulen {
         size_t totalFrames = 0;
         for (auto& path : std::filesystem::directory_iterator(dirPath))
         {
-            std::ifstream file{ path.path() };
-            if (!file.is_open())
-            {
-                std::cerr << "Could not open benchmark configuration file " << path << ".\n";
-                return;
-            }
-
-            json j;
-            file >> j;
-            configs.push_back({});
-            auto& config = configs.back();
+            const auto extension = path.path().extension();
+            if (!path.is_regular_file() || (extension != CameraSequence::Extension && extension != ".json")) continue;
+            Configuration config;
             config.fileName = path.path().filename().string();
 
-            // Load general parameters.
-            int warmUpFrames = 0u;
-            auto jc = j["config"];
-            jsonCond(jc, config.warmUpFrames, "warmUpFrames");
-            jsonCond(jc, config.gpuMemBudgetMiB, "gpuMemBudgetMiB");
-            config.resolution = glm::ivec2(jc["resolution"][0].get<int>(), jc["resolution"][1].get<int>());
-            std::cout << "Read config of resolution " << config.resolution.x << "*" << config.resolution.y << "\n";
-            if (j.contains("atmosphereUpdateParams"))
+            // Frames are replayed from binary sequences as each configuration runs, rather than held in memory.
+            // JSON sequences (the earlier format) are converted to binary ones first, unless they have been already.
+            config.sequencePath = path.path().string();
+            if (extension != CameraSequence::Extension)
             {
-                auto aj = j["atmosphereUpdateParams"];
-                jsonCond(aj, config.atmUpdateParams.update, "update");
-                jsonCond(aj, config.atmUpdateParams.animate, "animate");
-                jsonCond(aj, config.atmUpdateParams.rotateLight, "rotateLight");
-                jsonCond(aj, config.atmUpdateParams.frustumCull, "frustumCull");
-                jsonCond(aj, config.atmUpdateParams.depthLimit, "depthLimit");
-                jsonCond(aj, config.atmUpdateParams.useFeatureGenerator, "useFeatureGenerator");
-            }
-
-            // Load frame sequence.
-            Frame frame{};
-            config.sequence.reserve(j["sequence"].size());
-            for (auto f : j["sequence"])
-            {
-                if (f.contains("cameraPosition"))
+                std::filesystem::create_directories(convertedPath);
+                config.sequencePath = convertedPath + path.path().stem().string() + CameraSequence::Extension;
+                std::error_code error;
+                const auto convertedTime = std::filesystem::last_write_time(config.sequencePath, error);
+                if ((error || convertedTime < path.last_write_time()) && !CameraSequence::ConvertJson(path.path().string(), config.sequencePath))
                 {
-                    auto p = f["cameraPosition"];
-                    frame.cameraPosition = Object::Position(p[0].get<double>(), p[1].get<double>(), p[2].get<double>());
-                }
-                if (f.contains("cameraOrientation"))
-                {
-                    auto o = f["cameraOrientation"];
-                    frame.cameraOrientation = Object::Orientation(o[3].get<double>(), o[0].get<double>(), o[1].get<double>(), o[2].get<double>());
+                    std::filesystem::remove(config.sequencePath, error); // (lest a partial conversion be taken as up to date)
+                    std::cerr << "Could not load benchmark configuration file " << path << ".\n";
+                    continue;
                 }
-                jsonCond(f, frame.cameraFovy, "cameraFovy");
-                jsonCond(f, frame.animationTime, "animationTime");
-                jsonCond(f, frame.lightTime, "lightTime");
-                config.sequence.push_back(frame);
             }
-            totalFrames += config.sequence.size();
+            SequenceReader reader;
+            if (!reader.Open(config.sequencePath)) continue;
+            json j = reader.GetParameters();
+            config.numFrames = reader.GetNumFrames();
+            if (!config.numFrames) // (a recording cut short, without the count)
+            {
+                for (Frame frame; reader.Next(frame);) ++config.numFrames;
+            }
+            ReadConfigurationParameters(j, config);
+            totalFrames += config.numFrames;
+            configs.push_back(std::move(config));
         }
         std::cout << "Loaded " << configs.size() << " benchmark configurations (" << totalFrames << " frames in total)." << std::endl;
     }
+
+    void Benchmarker::LoadStageCosts()
+    {
+        std::ifstream file{ stageCostsPath };
+        if (!file.is_open())
+        {
+            std::cout << "No stage costs in " << stageCostsPath << "; deterministic configurations use the built-in estimates.\n";
+            return;
+        }
+        const auto j = json::parse(file, nullptr, false);
+        if (j.is_discarded() || !j.contains("stageCosts"))
+        {
+            std::cerr << "Could not read stage costs from " << stageCostsPath << ".\n";
+            return;
+        }
+        for (auto& [name, cost] : j["stageCosts"].items()) stageCosts[name] = cost.get<double>();
+        std::cout << "Loaded " << stageCosts.size() << " stage costs for deterministic configurations." << std::endl;
+    }
+
+    void Benchmarker::SaveStageCosts()
+    {
+        const auto costs = app.atmosphere.GetUpdateStageCosts();
+        if (costs.empty())
+        {
+            std::cerr << "No stage costs to save (the atmosphere hasn't been updated yet).\n";
+            return;
+        }
+        std::filesystem::create_directories(basePath);
+        std::ofstream file(stageCostsPath);
+        if (!file.is_open())
+        {
+            std::cerr << "Could not open " << stageCostsPath << " to save stage costs\n";
+            return;
+        }
+        json j;
+        j["stageCosts"] = costs;
+        WriteDeviceInfo(j); // (of the profile)
+        file << std::setw(4) << j;
+        std::cout << "Saved " << costs.size() << " stage costs to " << stageCostsPath << std::endl;
+    }
 }
@@ -2,6 +2,7 @@
 #include <vector>
 #include <glad/glad.h>
 #include "Object.hpp"
+#include "CameraSequence.hpp"
 #include "atmosphere/Atmosphere.hpp"
 
 namespace Mulen {
@@ -18,22 +19,22 @@ namespace Mulen {
     class Benchmarker
     {
     public:
-        struct Frame
-        {
-            Object::Position cameraPosition;
-            Object::Orientation cameraOrientation;
-            double cameraFovy;
-            double animationTime, lightTime;
-            // - to do: more, if relevant. Generator sync points?
-        };
+        using Frame = SequenceFrame;
         struct Configuration
         {
             std::string fileName;
-            std::vector<Frame> sequence;
+            std::string sequencePath; // binary sequence, replayed a frame at a time as the configuration runs
+            size_t numFrames = 0u;
             int warmUpFrames = 0;
             glm::ivec2 resolution;
             int gpuMemBudgetMiB;
+            bool copyOnWriteBricks = false;
+            BrickFormat brickFormat = BrickFormat::RG8;
+            unsigned octreeMapRes = 64u, viewMapRes = 64u, viewMapLevels = 2u;
             Atmosphere::Atmosphere::UpdateParams atmUpdateParams;
+            // Deterministic: start from a newly initialised atmosphere, and update it by fixed stage costs,
+            // waiting for the update thread as needed, so that the octree is the same on every run and machine.
+            bool deterministic = false;
             // - possible to do: more data
 
         };
@@ -54,21 +55,36 @@ namespace Mulen {
         struct ResultsItem
         {
             std::vector<unsigned> durations; // in microseconds (because full float precision is unnecessary to output)
-            int lastFrame = -1;
+            std::vector<float> factors; // of a whole pass each duration covers (update stages are spread over frames)
+            size_t numRead = 0u; // of the timer's inserted times
         };
         typedef std::vector<ResultsItem> Results;
         Results results; // indexed by NameRefs from the timer
 
+        // The octree per frame, to tell that deterministic runs did the same work.
+        struct OctreeFrame
+        {
+            size_t iterations, nodeGroups, stagedNodeGroups;
+        };
+        std::vector<OctreeFrame> octreeFrames;
+        size_t startIterations = 0u;
+        Atmosphere::Updater::StageCosts stageCosts; // fixed, for deterministic configurations
+
 
         // - to do: ongoing profiler values when benchmarking
 
-        Configuration recording; // for recording a new path
+        SequenceReader replay; // the current configuration's sequence
+        Frame replayFrame{};   // (its current frame)
+
+        Configuration recording; // for recording a new path (only its parameters; frames go straight to the file)
+        SequenceWriter recordingWriter;
 
         void OnBenchmarkingFrame(double& dt);
         void OnRecordingFrame(double& dt);
 
         void SaveResults(const std::string&, Results&);
         void Load(const std::string& dirPath); // load configuration(s) from file(s)
+        void LoadStageCosts();
 
     public:
         Benchmarker(App&);
@@ -77,6 +93,7 @@ namespace Mulen {
         void StartBenchmark();
         void OnFrame(double& dt);
         void StopBenchmark();
+        void SaveStageCosts(); // the updater's current estimates, for deterministic benchmarks
 
         bool IsInactive() const { return mode == Mode::Inactive; }
         bool IsRecording() const { return mode == Mode::Recording; }
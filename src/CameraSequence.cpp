@@ -0,0 +1,240 @@
+#include "CameraSequence.hpp"
+#include <cstring>
+#include <iostream>
+using nlohmann::json;
+
+namespace Mulen {
+
+    namespace {
+        const char Magic[4] = { 'M', 'S', 'E', 'Q' };
+        const uint32_t FileVersion = 2u; // (version 1 lacks the frame count)
+        const std::streamoff NumFramesOffset = 8; // (after the magic and version)
+        const unsigned NumValues = 10u;
+
+        void GetValues(const SequenceFrame& frame, uint64_t (&bits)[NumValues])
+        {
+            const auto& p = frame.cameraPosition;
+            const auto& o = frame.cameraOrientation;
+            const double values[NumValues] = { p.x, p.y, p.z, o.x, o.y, o.z, o.w, frame.cameraFovy, frame.animationTime, frame.lightTime };
+            std::memcpy(bits, values, sizeof(values));
+        }
+        void SetValues(SequenceFrame& frame, const uint64_t (&bits)[NumValues])
+        {
+            double values[NumValues];
+            std::memcpy(values, bits, sizeof(values));
+            frame.cameraPosition = Object::Position(values[0], values[1], values[2]);
+            frame.cameraOrientation = Object::Orientation(values[6], values[3], values[4], values[5]);
+            frame.cameraFovy = values[7];
+            frame.animationTime = values[8];
+            frame.lightTime = values[9];
+        }
+
+        void WriteVarint(std::ostream& out, uint64_t v)
+        {
+            for (; v >= 0x80u; v >>= 7u) out.put(char((v & 0x7fu) | 0x80u));
+            out.put(char(v));
+        }
+        bool ReadVarint(std::istream& in, uint64_t& v)
+        {
+            v = 0u;
+            for (unsigned shift = 0u; shift < 64u; shift += 7u)
+            {
+                const auto c = in.get();
+                if (std::char_traits<char>::eof() == c) return false;
+                v |= uint64_t(c & 0x7f) << shift;
+                if (!(c & 0x80)) return true;
+            }
+            return false;
+        }
+        void WriteU32(std::ostream& out, uint32_t v)
+        {
+            for (unsigned i = 0u; i < 4u; ++i) out.put(char(v >> (i * 8u)));
+        }
+        bool ReadU32(std::istream& in, uint32_t& v)
+        {
+            unsigned char bytes[4];
+            if (!in.read(reinterpret_cast<char*>(bytes), sizeof(bytes))) return false;
+            v = bytes[0] | uint32_t(bytes[1]) << 8u | uint32_t(bytes[2]) << 16u | uint32_t(bytes[3]) << 24u;
+            return true;
+        }
+
+        // (linear extrapolation of the bits, which for values of the same sign and exponent is that of the values)
+        uint64_t Predict(const uint64_t (&previous)[2][NumValues], unsigned i)
+        {
+            return 2u * previous[0][i] - previous[1][i];
+        }
+        uint64_t ZigZag(uint64_t residual) { return residual << 1u ^ uint64_t(-int64_t(residual >> 63u)); }
+        uint64_t UnZigZag(uint64_t v) { return v >> 1u ^ uint64_t(-int64_t(v & 1u)); }
+    }
+
+    bool SequenceWriter::Open(const std::string& path, const json& parameters)
+    {
+        Close();
+        file.open(path, std::ios::binary);
+        if (!file.is_open())
+        {
+            std::cerr << "Could not open sequence file " << path << " for writing\n";
+            return false;
+        }
+        const auto text = parameters.dump();
+        file.write(Magic, sizeof(Magic));
+        WriteU32(file, FileVersion);
+        WriteU32(file, 0u); // (the frame count, written on closing)
+        WriteU32(file, uint32_t(text.size()));
+        file.write(text.data(), text.size());
+        std::memset(previous, 0, sizeof(previous));
+        numFrames = 0u;
+        return true;
+    }
+
+    void SequenceWriter::Append(const SequenceFrame& frame)
+    {
+        uint64_t bits[NumValues];
+        GetValues(frame, bits);
+        uint64_t mask = 0u;
+        for (unsigned i = 0u; i < NumValues; ++i) if (bits[i] != previous[0][i]) mask |= 1u << i;
+        WriteVarint(file, mask);
+        for (unsigned i = 0u; i < NumValues; ++i)
+        {
+            if (mask & 1u << i) WriteVarint(file, ZigZag(bits[i] - Predict(previous, i)));
+            previous[1][i] = previous[0][i];
+            previous[0][i] = bits[i];
+        }
+        // (flushed now and then, so that little is lost if the program doesn't get to close the file)
+        if (!(++numFrames % 256u)) file.flush();
+    }
+
+    void SequenceWriter::Close()
+    {
+        if (!file.is_open()) return;
+        file.seekp(NumFramesOffset);
+        WriteU32(file, uint32_t(numFrames));
+        file.close();
+    }
+
+    bool SequenceReader::Open(const std::string& path)
+    {
+        Close();
+        file.clear();
+        file.open(path, std::ios::binary);
+        if (!file.is_open())
+        {
+            std::cerr << "Could not open sequence file " << path << "\n";
+            return false;
+        }
+        char magic[sizeof(Magic)];
+        uint32_t version = 0u, length = 0u;
+        if (!file.read(magic, sizeof(magic)) || std::memcmp(magic, Magic, sizeof(Magic)) || !ReadU32(file, version))
+        {
+            std::cerr << path << " is not a sequence file\n";
+            return false;
+        }
+        if (version < 1u || version > FileVersion)
+        {
+            std::cerr << "Sequence file " << path << " is of version " << version << " (rather than at most " << FileVersion << ")\n";
+            return false;
+        }
+        uint32_t count = 0u;
+        if ((version > 1u && !ReadU32(file, count)) || !ReadU32(file, length))
+        {
+            std::cerr << path << " is not a sequence file\n";
+            return false;
+        }
+        numFrames = count;
+        std::string text(length, '\0');
+        if (!file.read(&text[0], length)) return false;
+        parameters = json::parse(text, nullptr, false);
+        if (parameters.is_discarded())
+        {
+            std::cerr << "Could not parse the parameters of sequence file " << path << "\n";
+            return false;
+        }
+        std::memset(previous, 0, sizeof(previous));
+        return true;
+    }
+
+    bool SequenceReader::Next(SequenceFrame& frame)
+    {
+        uint64_t mask = 0u, bits[NumValues];
+        if (!ReadVarint(file, mask)) return false;
+        for (unsigned i = 0u; i < NumValues; ++i)
+        {
+            bits[i] = previous[0][i];
+            uint64_t residual = 0u;
+            if (mask & 1u << i)
+            {
+                if (!ReadVarint(file, residual)) return false;
+                bits[i] = Predict(previous, i) + UnZigZag(residual);
+            }
+        }
+        for (unsigned i = 0u; i < NumValues; ++i)
+        {
+            previous[1][i] = previous[0][i];
+            previous[0][i] = bits[i];
+        }
+        SetValues(frame, bits);
+        return true;
+    }
+
+    void SequenceReader::Close()
+    {
+        if (file.is_open()) file.close();
+    }
+
+    bool CameraSequence::LoadJson(const std::string& path, json& parameters, const std::function<void(const SequenceFrame&)>& onFrame)
+    {
+        std::ifstream file{ path };
+        if (!file.is_open())
+        {
+            std::cerr << "Could not open sequence file " << path << "\n";
+            return false;
+        }
+
+        // Frames are objects at depth 2, in the "sequence" array; each is converted (carrying on the previous frame's
+        // values for those left out) and then discarded, rather than kept in the DOM.
+        SequenceFrame frame{};
+        bool inSequence = false;
+        auto callback = [&](int depth, json::parse_event_t event, json& parsed)
+        {
+            if (json::parse_event_t::key == event && 1 == depth) inSequence = parsed == "sequence";
+            if (!inSequence || 2 != depth || json::parse_event_t::object_end != event) return true;
+            if (parsed.contains("cameraPosition"))
+            {
+                const auto& p = parsed["cameraPosition"];
+                frame.cameraPosition = Object::Position(p[0].get<double>(), p[1].get<double>(), p[2].get<double>());
+            }
+            if (parsed.contains("cameraOrientation"))
+            {
+                const auto& o = parsed["cameraOrientation"];
+                frame.cameraOrientation = Object::Orientation(o[3].get<double>(), o[0].get<double>(), o[1].get<double>(), o[2].get<double>());
+            }
+            if (parsed.contains("cameraFovy")) frame.cameraFovy = parsed["cameraFovy"].get<double>();
+            if (parsed.contains("animationTime")) frame.animationTime = parsed["animationTime"].get<double>();
+            if (parsed.contains("lightTime")) frame.lightTime = parsed["lightTime"].get<double>();
+            onFrame(frame);
+            return false;
+        };
+        parameters = json::parse(file, callback, false);
+        if (parameters.is_discarded())
+        {
+            std::cerr << "Could not parse sequence file " << path << "\n";
+            return false;
+        }
+        parameters.erase("sequence"); // (left empty)
+        return true;
+    }
+
+    bool CameraSequence::ConvertJson(const std::string& jsonPath, const std::string& path)
+    {
+        // Two passes, so that the parameters (which come first in the binary file) are known before any frame is written,
+        // and no more than a frame is held at a time.
+        json parameters;
+        if (!LoadJson(jsonPath, parameters, [](const SequenceFrame&) {})) return false;
+        SequenceWriter writer;
+        if (!writer.Open(path, parameters)) return false;
+        if (!LoadJson(jsonPath, parameters, [&](const SequenceFrame& frame) { writer.Append(frame); })) return false;
+        writer.Close();
+        std::cout << "Converted " << writer.GetNumFrames() << " frames of " << jsonPath << " to " << path << "\n";
+        return true;
+    }
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include "Object.hpp"
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <util/json.hpp>
+
+namespace Mulen {
+
+    // A frame of a recorded camera path (as benchmarks replay them).
+    struct SequenceFrame
+    {
+        Object::Position cameraPosition;
+        Object::Orientation cameraOrientation;
+        double cameraFovy;
+        double animationTime, lightTime;
+        // - to do: more, if relevant. Generator sync points?
+    };
+
+    //
+    // Camera sequences in a compact binary format, written and read a frame at a time: a header with the sequence's
+    // parameters (as JSON text), then per frame a mask of the values that changed, and for each of those the difference
+    // of its bits from a linear prediction by the two previous frames' (zigzag varint coded). The coding is lossless,
+    // and smooth paths take a few bytes per value. The frame count in the header is written on closing, so it's zero
+    // for a recording cut short, which still loads (and whose frames can be counted by reading them).
+    //
+
+    class SequenceWriter
+    {
+    public:
+        ~SequenceWriter() { Close(); }
+        bool Open(const std::string& path, const nlohmann::json& parameters);
+        void Append(const SequenceFrame&);
+        void Close();
+        bool IsOpen() const { return file.is_open(); }
+        size_t GetNumFrames() const { return numFrames; }
+
+    private:
+        std::ofstream file;
+        uint64_t previous[2][10] = {}; // bits of the last two frames' values
+        size_t numFrames = 0u;
+    };
+
+    class SequenceReader
+    {
+    public:
+        bool Open(const std::string& path);
+        const nlohmann::json& GetParameters() const { return parameters; }
+        size_t GetNumFrames() const { return numFrames; } // as in the header (zero if unknown)
+        bool Next(SequenceFrame&); // false at the end (or at a truncated frame)
+        void Close();
+
+    private:
+        std::ifstream file;
+        nlohmann::json parameters;
+        size_t numFrames = 0u;
+        uint64_t previous[2][10] = {};
+    };
+
+    namespace CameraSequence {
+        static const std::string Extension = ".mseq";
+
+        // Reads a sequence saved as JSON (the earlier format, which leaves out values repeated from the previous frame)
+        // without building a DOM of its frames, which are passed on as they're parsed. Everything else is returned.
+        bool LoadJson(const std::string& path, nlohmann::json& parameters, const std::function<void(const SequenceFrame&)>& onFrame);
+
+        // Converts a JSON sequence (as in benchmark/config/) to the binary format.
+        bool ConvertJson(const std::string& jsonPath, const std::string& path);
+    }
+}
@@ -5,7 +5,34 @@
 #include "util/Timer.hpp"
 #include "LightSource.hpp"
 #include "Model.hpp"
-
+#include "OctreeMap.hpp"
+#include "ScatteringTables.hpp"
+#include <algorithm>
+#include <filesystem>
+#include <map>
+#include <numeric>
+
+
+namespace Mulen {
+    ProfilerRefs::ProfilerRefs(Util::Timer& timer)
+        : atmosphereUpdate{ timer.NameToRef("Atmosphere::Update") }
+        , atmosphereRender{ timer.NameToRef("Atmosphere::Render") }
+        , updateInitSplits{ timer.NameToRef(Profiler_UpdateInitSplits) }
+        , updateLightPerGroup{ timer.NameToRef(Profiler_UpdateLightPerGroup) }
+        , updateLightPerVoxel{ timer.NameToRef(Profiler_UpdateLightPerVoxel) }
+        , updateUpload{ timer.NameToRef(Profiler_UpdateUpload) }
+        , updateUploadCopy{ timer.NameToRef(Profiler_UpdateUploadCopy) }
+        , updateCompute{ timer.NameToRef(Profiler_UpdateCompute) }
+        , updateComputeGenerate{ timer.NameToRef(Profiler_UpdateComputeGenerate) }
+        , updateComputePriorities{ timer.NameToRef(Profiler_UpdateComputePriorities) }
+        , updateComputeSplits{ timer.NameToRef(Profiler_UpdateComputeSplits) }
+        , updateComputeStaging{ timer.NameToRef(Profiler_UpdateComputeStaging) }
+        , renderTrace{ timer.NameToRef(Profiler_RenderTrace) }
+        , renderClassify{ timer.NameToRef(Profiler_RenderClassify) }
+    {
+        for (size_t i = 0u; i < std::extent<decltype(renderRays)>::value; ++i) renderRays[i] = timer.NameToRef(Profiler_RenderRays[i]);
+    }
+}
 
 namespace Mulen::Atmosphere {
 
@@ -17,6 +44,7 @@ namespace Mulen::Atmosphere {
 
         glm::vec4 planetLocation, lightDir, sun;
         glm::vec4 betaR, absorptionExtinction;
+        glm::vec4 prevCameraOffset;
 
         unsigned rootGroupIndex;
         float time, animationTime, animationAlpha,
@@ -32,10 +60,15 @@ namespace Mulen::Atmosphere {
 
     Atmosphere::Atmosphere(Util::Timer& timer) 
         : timer{ timer }
+        , profilerRefs{ timer }
         , updater{ *this }
     {
-        // - to do: make use of model
-        Model model{};
+    }
+
+    Atmosphere::~Atmosphere()
+    {
+        StopMultipleScattering();
+        for (auto fence : tileRaysFences) if (fence) glDeleteSync(fence);
     }
 
     bool Atmosphere::Init(const Atmosphere::Params& p)
@@ -46,7 +79,11 @@ namespace Mulen::Atmosphere {
         initUpdate = true;
         vao.Create();
 
+        StopMultipleScattering();
+        scatteringOrderSeconds.clear();
         hasTransmittance = false;
+        scatteringCacheDirectory = p.scatteringCacheDirectory;
+        scatteringOrders = glm::max(1u, p.scatteringOrders);
 
         auto setTextureFilter = [](Util::Texture& tex, GLenum filter)
         {
@@ -56,46 +93,130 @@ namespace Mulen::Atmosphere {
 
         // - to do: maybe consider CPU budget too, or just remove it altogether since this is now mostly GPU-bound
         const size_t numStates = 3u;
-        const size_t voxelSize = 2u; // - to do: depend on format, if format becomes configurable (which it ought to)
         const size_t lightVoxelSize = 4u; // temporary lighting texture // - to do: also make this format-aware
 
+        // With copy-on-write bricks there's one full store, plus room for the changed bricks of the other states.
+        copyOnWriteBricks = p.copyOnWriteBricks;
+
+        brickFormat = p.brickFormat;
+        if (IsCompressed(brickFormat) && copyOnWriteBricks)
+        {
+            std::cout << "Compressed bricks aren't supported with copy-on-write brick storage; using RG8\n";
+            brickFormat = BrickFormat::RG8;
+        }
+        if (IsCompressed(brickFormat) && !Util::Texture::FormatSupported(GL_TEXTURE_3D, GetBrickFormatInfo(brickFormat).format))
+        {
+            std::cout << GetBrickFormatInfo(brickFormat).name << " 3D textures aren't supported; using RG8\n";
+            brickFormat = BrickFormat::RG8;
+        }
+        const auto& format = GetBrickFormatInfo(brickFormat);
+        std::cout << "Brick format: " << format.name << "\n";
+        if (!shaderPath.empty() && shaderBrickFormat != brickFormat)
+        {
+            ReloadShaders(shaderPath); // (the shaders are specialised for the format)
+        }
+        const double voxelSize = format.voxelSize;
+        const double changeFraction = glm::clamp(double(p.brickChangeFraction), 0.0, 1.0);
+        // (a changed brick holds an overflow slot for up to one pass per state, plus about one more until moved back home)
+        const double overflowFactor = 4.0;
+        const double brickCopies = copyOnWriteBricks ? 1.0 + overflowFactor * changeFraction : double(numStates);
+
         const size_t voxelsPerGroup = BrickRes3 * NodeArity;
         size_t gpuMemPerGroup = 0u; 
-        gpuMemPerGroup += voxelSize* numStates* voxelsPerGroup; // render voxel stores
+        gpuMemPerGroup += static_cast<size_t>(voxelSize * brickCopies * voxelsPerGroup); // render voxel stores
+        gpuMemPerGroup += static_cast<size_t>(format.workVoxelSize * voxelsPerGroup); // work texture (if compressed)
+        if (copyOnWriteBricks) gpuMemPerGroup += sizeof(BrickSlots::Slot) * NodeArity * numStates; // slot maps
         gpuMemPerGroup += voxelsPerGroup * lightVoxelSize;      // temporary lighting
         gpuMemPerGroup += LightPerGroupRes * LightPerGroupRes * lightVoxelSize; // per-group shadow maps
         gpuMemPerGroup += sizeof(NodeGroup);                    // node store
         // - to do: add more terms
 
+        this->gpuMemPerGroup = gpuMemPerGroup;
+        // The octree (and brick index space) is sized with some headroom, so that the budget can later be raised without
+        // starting over. Brick texture memory is only committed for pages in use, so the headroom costs little of that.
         const size_t numNodeGroups = p.gpuMemBudget / gpuMemPerGroup;//16384u * 3u; // - to do: make this controllable
-        const size_t numBricks = numNodeGroups * NodeArity;
-        octree.Init(numNodeGroups, numBricks);
-
-        Util::Texture::Dim maxWidth, brickRes, width, height, depth;
-        maxWidth = 4096u; // - to do: retrieve actual system-dependent limit programmatically
-        brickRes = BrickRes;
-        const auto cellsPerBrick = (BrickRes - 1u) * (BrickRes - 1u) * (BrickRes - 1u);
-        width = maxWidth - (maxWidth % brickRes);
-        texMap.x = width / brickRes;
-        texMap.y = glm::min(maxWidth / brickRes, unsigned(numBricks + texMap.x - 1u) / texMap.x);
-        texMap.z = (unsigned(numBricks) + texMap.x * texMap.y - 1u) / (texMap.x * texMap.y);
+        const size_t nodeGroupCapacity = static_cast<size_t>(double(numNodeGroups) * glm::max(1.0, double(p.budgetHeadroom)));
+        const size_t numBricks = nodeGroupCapacity * NodeArity;
+        octree.Init(nodeGroupCapacity, numBricks);
+        octree.nodes.SetLimit(static_cast<NodeIndex>(numNodeGroups));
+
+        // Brick storage slots: bricks first, then (with copy-on-write) overflow slots for changed ones.
+        const size_t maxDirtyGroups = copyOnWriteBricks ? glm::max(size_t(1u), static_cast<size_t>(double(numNodeGroups) * changeFraction)) : 0u;
+        const size_t numOverflowSlots = static_cast<size_t>(overflowFactor * double(maxDirtyGroups * NodeArity));
+        const size_t numSlots = numBricks + numOverflowSlots;
+        updater.maxDirtyGroups = maxDirtyGroups;
+        if (copyOnWriteBricks)
+        {
+            brickSlots.Init(numBricks, numOverflowSlots, static_cast<unsigned>(numStates));
+            std::cout << "Copy-on-write bricks: " << maxDirtyGroups << " changed node groups per iteration at most\n";
+        }
 
         auto computeRoot = [](size_t value, size_t n)
         {
             return static_cast<size_t>(std::ceil(std::pow(double(value), 1.0 / double(n))));
         };
-        texMap.x = texMap.y = texMap.z = static_cast<decltype(texMap.x)>(computeRoot(numBricks, 3));
-        width = texMap.x * brickRes;
-        height = texMap.y * brickRes;
-        depth = texMap.z * brickRes;
-        std::cout << numNodeGroups << " node groups (" << numBricks << " bricks, " << (cellsPerBrick * numBricks) / 1000000u << " M voxel cells)\n";
+
+        // Brick pages. With sparse textures the brick textures cover all pages, committing memory only for those in use,
+        // and otherwise they hold a pool of physical pages which grows (in depth) as needed.
+        auto sparse = p.sparseBricks && Util::Texture::SparseSupported();
+        pageBricks = glm::uvec3{ 4u }; // - to do: measure whether other page sizes are better for pooling
+        if (sparse)
+        {
+            // (page sizes are powers of two, as is the brick resolution, so the largest is a multiple of the others)
+            std::vector<GLenum> pagedFormats = { format.format, BrickLightFormat };
+            if (format.lightFormat) pagedFormats.push_back(format.lightFormat);
+            if (IsCompressed(brickFormat)) pagedFormats.push_back(format.imageFormat);
+            glm::uvec3 texels{ BrickRes };
+            for (auto f : pagedFormats)
+            {
+                GLint page[3];
+                sparse = sparse && Util::Texture::GetSparsePageSize(GL_TEXTURE_3D, f, page);
+                if (sparse) texels = glm::max(texels, glm::uvec3(page[0], page[1], page[2]));
+            }
+            if (sparse) pageBricks = texels / BrickRes;
+        }
+        auto bricksPerPage = pageBricks.x * pageBricks.y * pageBricks.z;
+        auto numPages = (numSlots + bricksPerPage - 1u) / bricksPerPage;
+        pagesRes = glm::uvec3{ static_cast<unsigned>(computeRoot(numPages, 3)) };
+        if (sparse)
+        {
+#ifdef GL_ARB_sparse_texture
+            GLint maxSize = 0;
+            glGetIntegerv(GL_MAX_SPARSE_3D_TEXTURE_SIZE_ARB, &maxSize);
+            if (pagesRes.x * pageBricks.x * BrickRes > static_cast<unsigned>(maxSize)
+                || pagesRes.y * pageBricks.y * BrickRes > static_cast<unsigned>(maxSize)
+                || pagesRes.z * pageBricks.z * BrickRes > static_cast<unsigned>(maxSize))
+            {
+                std::cout << "Brick index space exceeds the maximum sparse texture size; pooling brick pages instead\n";
+                sparse = false;
+                pageBricks = glm::uvec3{ 4u };
+                bricksPerPage = pageBricks.x * pageBricks.y * pageBricks.z;
+                numPages = (numSlots + bricksPerPage - 1u) / bricksPerPage;
+                pagesRes = glm::uvec3{ static_cast<unsigned>(computeRoot(numPages, 3)) };
+            }
+#endif
+        }
+        maxPagesDepth = (numPages + pagesRes.x * pagesRes.y - 1u) / (pagesRes.x * pagesRes.y);
+        if (!sparse) pagesRes.z = 1u; // grown on demand
+        // Pages stay resident until no GPU state can refer to them.
+        brickPages.Init(numSlots, bricksPerPage, sparse, static_cast<unsigned>(numStates));
+        brickPageBuffer.Create(sizeof(BrickPageTable::PageIndex) * brickPages.GetNumVirtualPages(), GL_DYNAMIC_STORAGE_BIT);
+        brickPageBuffer.BindBase(GL_SHADER_STORAGE_BUFFER, 4u);
+
+        texMap = pagesRes * pageBricks;
+        const auto cellsPerBrick = (BrickRes - 1u) * (BrickRes - 1u) * (BrickRes - 1u);
+        const auto brickTexels = texMap * BrickRes;
+        std::cout << numNodeGroups << " node groups (" << numNodeGroups * NodeArity << " bricks, " << (cellsPerBrick * numNodeGroups * NodeArity) / 1000000u << " M voxel cells), "
+            << nodeGroupCapacity << " at most\n";
+        std::cout << "Brick pages: " << numPages << " of " << pageBricks.x << "*" << pageBricks.y << "*" << pageBricks.z << " bricks, "
+            << (sparse ? "sparse" : "pooled") << "\n";
         std::cout << "Atmosphere texture size: " << texMap.x << "*" << texMap.y << "*" << texMap.z << " bricks, "
-            << width << "*" << height << "*" << depth << " texels (multiple of "
-            << width * height * depth / (1024 * 1024) << " MB)\n";
+            << brickTexels.x << "*" << brickTexels.y << "*" << brickTexels.z << " texels\n";
 
         auto setUpBrickTexture = [&](Util::Texture& tex, GLenum internalFormat, GLenum filter)
         {
-            tex.Create(GL_TEXTURE_3D, 1u, internalFormat, width, height, depth);
+            if (sparse) tex.CreateSparse(GL_TEXTURE_3D, 1u, internalFormat, brickTexels.x, brickTexels.y, brickTexels.z);
+            else tex.Create(GL_TEXTURE_3D, 1u, internalFormat, brickTexels.x, brickTexels.y, brickTexels.z);
             setTextureFilter(tex, filter);
         };
         auto setUpBrickLightTexture = [&](Util::Texture& tex)
@@ -104,26 +225,63 @@ namespace Mulen::Atmosphere {
         };
         auto setUpBrickLightPerGroupTexture = [&](Util::Texture& tex)
         {
-            auto res = static_cast<unsigned>(LightPerGroupRes * computeRoot(numNodeGroups, 2));
+            // - this is indexed by group, and not paged
+            auto res = static_cast<unsigned>(LightPerGroupRes * computeRoot(nodeGroupCapacity, 2));
             tex.Create(GL_TEXTURE_2D, 1u, GL_R16, res, res);
             setTextureFilter(tex, GL_LINEAR);
             std::cout << "Brick light per group texture size: " << tex.GetWidth() << "*" << tex.GetHeight() << " = " << tex.GetWidth() * tex.GetHeight() << std::endl;
         };
-        auto setUpMapTexture = [&](Util::Texture& tex)
+        auto validMapRes = [](unsigned res, const char* name)
+        {
+            if (res >= 8u && res <= 512u && !(res & (res - 1u))) return res;
+            std::cout << name << " " << res << " isn't a power of two in [8, 512]; using 64\n";
+            return 64u;
+        };
+        octreeMapRes = validMapRes(p.octreeMapRes, "Octree map resolution");
+        viewMapRes = validMapRes(p.viewMapRes, "View octree map resolution");
+        viewMapLevels = glm::min(p.viewMapLevels, 8u);
+        auto setUpMapTexture = [&](Util::Texture& tex, unsigned mapRes)
         {
-            // - the map *could* be mipmapped. Hmm. Maybe try it, if there's a need
-            const auto mapRes = 64u; // - to do: try different values and measure performance
             tex.Create(GL_TEXTURE_3D, 1u, GL_R32UI, mapRes, mapRes, mapRes);
             setTextureFilter(tex, GL_NEAREST);
         };
-        setUpMapTexture(octreeMap);
+        setUpMapTexture(octreeMap, viewMapRes);
 
         for (auto i = 0u; i < std::extent<decltype(gpuStates)>::value; ++i)
         {
             auto& state = gpuStates[i];
-            state.gpuNodes.Create(sizeof(NodeGroup) * numNodeGroups, 0u);
-            setUpBrickTexture(state.brickTexture, BrickFormat, GL_LINEAR);
-            setUpMapTexture(state.octreeMap);
+            state.gpuNodes.Create(sizeof(NodeGroup) * nodeGroupCapacity, 0u);
+            state.brickTexture.Destroy();
+            state.brickLightTexture.Destroy();
+            if (copyOnWriteBricks)
+            {
+                state.brickSlots.Create(sizeof(BrickSlots::Slot) * numBricks, GL_DYNAMIC_STORAGE_BIT);
+            }
+            else
+            {
+                setUpBrickTexture(state.brickTexture, format.format, GL_LINEAR);
+                if (format.lightFormat) setUpBrickTexture(state.brickLightTexture, format.lightFormat, GL_LINEAR);
+                state.brickSlots.Destroy();
+            }
+            setUpMapTexture(state.octreeMap, octreeMapRes);
+        }
+        sharedBrickTexture.Destroy();
+        sharedBrickLightTexture.Destroy();
+        if (copyOnWriteBricks)
+        {
+            setUpBrickTexture(sharedBrickTexture, format.format, GL_LINEAR);
+            if (format.lightFormat) setUpBrickTexture(sharedBrickLightTexture, format.lightFormat, GL_LINEAR);
+        }
+        brickWorkTexture.Destroy();
+        brickBlockTexture.Destroy();
+        if (IsCompressed(brickFormat))
+        {
+            setUpBrickTexture(brickWorkTexture, format.imageFormat, GL_LINEAR);
+            // One texel per 4*4 block; pages are encoded in batches stacked in depth.
+            const auto pageTexels = pageBricks * BrickRes;
+            encodeBatchPages = 64u;
+            brickBlockTexture.Create(GL_TEXTURE_3D, 1u, GL_RGBA32UI, pageTexels.x / 4u, pageTexels.y / 4u, pageTexels.z * static_cast<unsigned>(encodeBatchPages));
+            setTextureFilter(brickBlockTexture, GL_NEAREST);
         }
         setUpBrickLightTexture(brickLightTextureTemp);
         setUpBrickLightPerGroupTexture(brickLightPerGroupTexture);
@@ -140,10 +298,66 @@ namespace Mulen::Atmosphere {
         glTextureParameteri(scatterTexture.GetId(), GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
         glTextureParameteri(scatterTexture.GetId(), GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
 
-        maxToUpload = numNodeGroups;// / 8; // - arbitrary (to do: take care to make it high enough for timely updates)
+        maxToUpload = nodeGroupCapacity;// / 8; // - arbitrary (to do: take care to make it high enough for timely updates)
         gpuUploadNodes.Create(sizeof(UploadNodeGroup) * maxToUpload * NodeArity, GL_DYNAMIC_STORAGE_BIT);
         gpuUploadBricks.Create(sizeof(UploadBrick) * maxToUpload * NodeArity, GL_DYNAMIC_STORAGE_BIT);
         gpuGenData.Create(sizeof(uint32_t) * maxToUpload * NodeArity * 16u, GL_DYNAMIC_STORAGE_BIT); // - fairly arbitrary. Maybe look into trying to determine a good size?
+        // Room for roughly a full iteration's worth of node and brick records (plus some generation data) in flight at once.
+        // - to do: measure how much is actually in flight, and size accordingly
+        uploadRing.Create((sizeof(UploadNodeGroup) + sizeof(UploadBrick) * NodeArity + sizeof(uint32_t) * NodeArity * 4u) * maxToUpload);
+
+        // Upload staging: either records are written by the updater thread straight into persistently mapped buffers
+        // (one per update iteration), or they're kept in CPU memory and copied via the upload ring.
+        zeroCopyUploads = p.zeroCopyUploads;
+        stagingFile.Close();
+        const auto nodesStagingSize = sizeof(UploadNodeGroup) * nodeGroupCapacity, bricksStagingSize = sizeof(UploadBrick) * numBricks;
+        for (auto i = 0u; i < std::extent<decltype(iterationStaging)>::value; ++i)
+        {
+            auto& staging = iterationStaging[i];
+            auto& it = updater.iterations[i];
+            staging.buffer.Destroy();
+            it.SetStorage(nullptr, 0u, nullptr, 0u);
+
+            if (zeroCopyUploads)
+            {
+                GLint alignment = 1;
+                glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+                staging.nodesOffset = 0;
+                staging.nodesSize = nodesStagingSize;
+                staging.bricksOffset = (nodesStagingSize + alignment - 1u) / alignment * alignment;
+                staging.bricksSize = bricksStagingSize;
+                const GLsizeiptr size = staging.bricksOffset + staging.bricksSize;
+                const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+                staging.buffer.Create(size, flags);
+                auto data = static_cast<uint8_t*>(staging.buffer.Map(0, size, flags));
+                if (!data)
+                {
+                    std::cerr << "Failed to map upload staging buffer; falling back to copied uploads\n";
+                    zeroCopyUploads = false;
+                    break;
+                }
+                it.SetStorage(data + staging.nodesOffset, nodeGroupCapacity, data + staging.bricksOffset, numBricks);
+            }
+        }
+        if (!zeroCopyUploads)
+        {
+            for (auto& staging : iterationStaging) staging.buffer.Destroy();
+            for (auto& it : updater.iterations) it.SetStorage(nullptr, 0u, nullptr, 0u);
+            if (!p.stagingFilePath.empty())
+            {
+                const auto iterationSize = nodesStagingSize + bricksStagingSize;
+                if (stagingFile.Create(p.stagingFilePath, iterationSize * std::extent<decltype(updater.iterations)>::value))
+                {
+                    auto data = static_cast<uint8_t*>(stagingFile.GetData());
+                    for (auto& it : updater.iterations)
+                    {
+                        it.SetStorage(data, nodeGroupCapacity, data + nodesStagingSize, numBricks);
+                        data += iterationSize;
+                    }
+                }
+            }
+        }
+        std::cout << "Upload staging: " << (zeroCopyUploads ? "zero-copy" : stagingFile.IsOpen() ? "mapped file" : "copied") << std::endl;
 
         auto t = timer.Begin("Initial atmosphere splits");
 
@@ -155,48 +369,321 @@ namespace Mulen::Atmosphere {
         return true;
     }
 
+    bool Atmosphere::SetMemoryBudget(size_t gpuMemBudget)
+    {
+        if (!gpuMemPerGroup) return false;
+        const auto numNodeGroups = gpuMemBudget / gpuMemPerGroup;
+        if (!numNodeGroups || numNodeGroups > octree.GetNodeGroupCapacity()) return false;
+
+        // The worker thread may be using the octree.
+        updater.WaitForUpdateReady();
+        octree.nodes.SetLimit(static_cast<NodeIndex>(numNodeGroups));
+        std::cout << "Atmosphere memory budget set to " << numNodeGroups << " node groups (of at most " << octree.GetNodeGroupCapacity() << ")\n";
+        // (if lowered, the updater merges nodes until within the limit, and their pages are then released)
+        return true;
+    }
+
+    void Atmosphere::UpdateBrickSlots(UpdateIteration& it, unsigned stateIndex)
+    {
+        const auto numStates = std::extent<decltype(gpuStates)>::value;
+        brickSlots.BeginState(stateIndex, (stateIndex + numStates - 1u) % numStates);
+
+        // (groups are staged with their NodeArity bricks in step)
+        const auto numGroups = glm::min(it.nodesToUpload.size(), it.bricksToUpload.size() / NodeArity);
+        const auto numDirtyGroups = glm::min(it.numDirtyGroups, numGroups);
+        auto use = [&](size_t g)
+        {
+            size_t bricks[NodeArity];
+            for (NodeIndex ci = 0u; ci < NodeArity; ++ci) bricks[ci] = it.bricksToUpload[g * NodeArity + ci].brickIndex;
+            return brickSlots.Use(bricks, NodeArity, g < numDirtyGroups);
+        };
+        // New split groups get slots first: they have nothing to share, and their own slots may hold another state's
+        // bricks, so they mustn't be deferred. (the worker thread splits no more than the free slots allow for)
+        std::vector<bool> isSplit(numDirtyGroups, false), failed(numDirtyGroups, false);
+        {
+            std::vector<NodeIndex> splits = it.splitGroups;
+            std::sort(splits.begin(), splits.end());
+            for (size_t g = 0u; g < numDirtyGroups; ++g) isSplit[g] = std::binary_search(splits.begin(), splits.end(), it.nodesToUpload[g].groupIndex);
+        }
+        for (size_t g = 0u; g < numDirtyGroups; ++g) if (isSplit[g]) failed[g] = !use(g);
+        for (size_t g = 0u; g < numDirtyGroups; ++g) if (!isSplit[g]) failed[g] = !use(g);
+        for (size_t g = numDirtyGroups; g < numGroups; ++g) use(g);
+
+        std::vector<UploadNodeGroup> deferredNodes;
+        std::vector<UploadBrick> deferredBricks;
+        size_t numDirty = 0u;
+        it.deferredGroups.clear();
+        for (size_t g = 0u; g < numDirtyGroups; ++g)
+        {
+            if (!failed[g])
+            {
+                // Kept in the dirty range, which closes up behind the deferred groups.
+                if (numDirty != g)
+                {
+                    it.nodesToUpload[numDirty] = it.nodesToUpload[g];
+                    for (NodeIndex ci = 0u; ci < NodeArity; ++ci) it.bricksToUpload[numDirty * NodeArity + ci] = it.bricksToUpload[g * NodeArity + ci];
+                }
+                ++numDirty;
+            }
+            else
+            {
+                it.deferredGroups.push_back(it.nodesToUpload[g].groupIndex);
+                deferredNodes.push_back(it.nodesToUpload[g]);
+                for (NodeIndex ci = 0u; ci < NodeArity; ++ci) deferredBricks.push_back(it.bricksToUpload[g * NodeArity + ci]);
+            }
+        }
+        if (!it.deferredGroups.empty())
+        {
+            // The deferred groups go right after the dirty range, with the others that only need their nodes updated.
+            // (generation data offsets are unaffected, as staged bricks have none yet)
+            std::copy(deferredNodes.begin(), deferredNodes.end(), it.nodesToUpload.begin() + numDirty);
+            std::copy(deferredBricks.begin(), deferredBricks.end(), it.bricksToUpload.begin() + numDirty * NodeArity);
+            it.numDirtyGroups = numDirty;
+        }
+        UploadBrickSlots(stateIndex);
+    }
+
+    void Atmosphere::ReassignBrickSlots(std::vector<NodeIndex>& groups, unsigned stateIndex)
+    {
+        numUninterpolatedGroups = 0u;
+        if (groups.empty()) return;
+        const auto numGroups = groups.size();
+        groups.erase(std::remove_if(groups.begin(), groups.end(), [&](NodeIndex gi)
+        {
+            size_t bricks[NodeArity];
+            for (NodeIndex ci = 0u; ci < NodeArity; ++ci) bricks[ci] = Octree::GroupAndChildToNode(gi, ci);
+            return !brickSlots.Reassign(stateIndex, bricks, NodeArity);
+        }), groups.end());
+        numUninterpolatedGroups = numGroups - groups.size();
+        UploadBrickSlots(stateIndex);
+    }
+
+    void Atmosphere::GetDisplacedBrickGroups(unsigned stateIndex, std::vector<NodeIndex>& groups, size_t maxGroups) const
+    {
+        groups.clear();
+        const auto numBricks = brickSlots.GetNumBricks();
+        for (size_t brick = 0u; brick < numBricks && groups.size() < maxGroups; ++brick)
+        {
+            if (!brickSlots.IsDisplaced(stateIndex, brick)) continue;
+            groups.push_back(Octree::NodeToGroup(static_cast<NodeIndex>(brick)));
+            brick = size_t(groups.back() + 1u) * NodeArity - 1u; // (on to the next group)
+        }
+    }
+
+    void Atmosphere::UploadBrickSlots(unsigned stateIndex)
+    {
+        // - to do: only upload changed ranges (if this turns out to matter)
+        const auto& map = brickSlots.GetMap(stateIndex);
+        gpuStates[stateIndex].brickSlots.Upload(0, sizeof(BrickSlots::Slot) * map.size(), map.data());
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+    void Atmosphere::UpdateBrickPages(const UpdateIteration& it)
+    {
+        brickPages.BeginUsage();
+        for (const auto& group : it.nodesToUpload)
+        {
+            brickPages.UseBricks(size_t(group.groupIndex) * NodeArity, NodeArity);
+        }
+        if (copyOnWriteBricks)
+        {
+            // (bricks' own slots are covered by the above, and kept for as long as older states may use them)
+            for (auto slot = brickSlots.GetNumBricks(); slot < brickSlots.GetNumSlots(); ++slot)
+            {
+                if (brickSlots.IsSlotUsed(static_cast<BrickSlots::Slot>(slot))) brickPages.UseBricks(slot, 1u);
+            }
+        }
+        brickPages.EndUsage();
+
+        const auto committed = brickPages.TakeCommitted();
+        const auto decommitted = brickPages.TakeDecommitted();
+        if (brickPages.IsIdentity())
+        {
+            const auto pageTexels = glm::ivec3(pageBricks * BrickRes);
+            auto commit = [&](const std::vector<BrickPageTable::PageIndex>& pages, bool commit)
+            {
+                for (auto page : pages)
+                {
+                    glm::uvec3 p;
+                    p.z = page / (pagesRes.x * pagesRes.y);
+                    p.y = (page / pagesRes.x) % pagesRes.y;
+                    p.x = page % pagesRes.x;
+                    const auto offset = glm::ivec3(p) * pageTexels;
+                    ForEachBrickTexture([&](Util::Texture& tex)
+                    {
+                        tex.Commit(0, offset.x, offset.y, offset.z, pageTexels.x, pageTexels.y, pageTexels.z, commit);
+                    });
+                }
+            };
+            commit(decommitted, false);
+            commit(committed, true);
+        }
+        else if (brickPages.GetPhysicalPageCount() > size_t(pagesRes.x) * pagesRes.y * pagesRes.z)
+        {
+            // Pooled pages are reused as they're freed, so the pool only needs to grow past its high-water mark.
+            GrowBrickTextures(brickPages.GetPhysicalPageCount());
+        }
+
+        if (brickPages.TakeTableChanged())
+        {
+            const auto& table = brickPages.GetTable();
+            brickPageBuffer.Upload(0, sizeof(BrickPageTable::PageIndex) * table.size(), table.data());
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        }
+    }
+
+    void Atmosphere::GrowBrickTextures(size_t numPhysicalPages)
+    {
+        const auto slab = size_t(pagesRes.x) * pagesRes.y;
+        auto depth = glm::max((numPhysicalPages + slab - 1u) / slab, size_t(pagesRes.z) + pagesRes.z / 2u); // grow geometrically
+        depth = glm::min(depth, maxPagesDepth);
+        pagesRes.z = static_cast<unsigned>(depth);
+        texMap = pagesRes * pageBricks;
+        const auto texels = texMap * BrickRes;
+
+        // Physical pages keep their locations, since only the depth grows.
+        ForEachBrickTexture([&](Util::Texture& tex)
+        {
+            Util::Texture grown;
+            grown.Create(GL_TEXTURE_3D, 1u, tex.GetFormat(), texels.x, texels.y, texels.z);
+            glTextureParameteri(grown.GetId(), GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTextureParameteri(grown.GetId(), GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glCopyImageSubData(tex.GetId(), GL_TEXTURE_3D, 0, 0, 0, 0, grown.GetId(), GL_TEXTURE_3D, 0, 0, 0, 0, tex.GetWidth(), tex.GetHeight(), tex.GetDepth());
+            tex.Destroy();
+            tex = std::move(grown);
+        });
+        std::cout << "Brick page pool grown to " << pagesRes.x * pagesRes.y * pagesRes.z << " pages (" << texels.x << "*" << texels.y << "*" << texels.z << " texels)\n";
+    }
+
     void Atmosphere::SetUniforms(Util::Shader& shader)
     {
         shader.Uniform3u("uBricksRes", glm::uvec3{ texMap });
         shader.Uniform3f("bricksRes", glm::vec3{ texMap });
+        shader.Uniform3u("uPageBricks", pageBricks);
+        shader.Uniform3u("uPagesRes", pagesRes);
+        shader.Uniform1u("uBrickSlots", glm::uvec1{ copyOnWriteBricks ? 1u : 0u });
+    }
+
+    std::string Atmosphere::GetShaderDefines() const
+    {
+        const auto& format = GetBrickFormatInfo(brickFormat);
+        std::string defines;
+        defines += "#define BRICK_IMAGE_FORMAT " + std::string(format.imageQualifier) + "\n";
+        defines += "#define BRICK_SPLIT " + std::string(format.lightFormat ? "1" : "0") + "\n";
+        return defines;
+    }
+
+    bool Atmosphere::ReloadShaders(const std::string& path, bool wait)
+    {
+        shaderBatch.Cancel();
+        this->shaderPath = path;
+        shaderBrickFormat = brickFormat;
+        SubmitShaders([](const Util::Shader&) { return true; });
+        return wait ? FinishShaderReload() : true;
     }
 
-    bool Atmosphere::ReloadShaders(const std::string& path)
+    bool Atmosphere::ReloadChangedShaders()
     {
-        const std::string shaderPath = path + "atmosphere/";
+        // (while a batch is building, changes wait to be polled until it's done)
+        if (shaderPath.empty() || !shaderBatch.IsEmpty()) return false;
+        const auto changed = Util::Shader::GetSources().PollChanges();
+        if (changed.empty()) return false;
+        for (const auto& file : changed) std::cout << "Shader source changed: " << file << "\n";
+        SubmitShaders([&changed](const Util::Shader& shader) { return shader.DependsOn(changed); });
+        return true;
+    }
+
+    void Atmosphere::SubmitShaders(const std::function<bool(const Util::Shader&)>& filter)
+    {
+        const auto defines = GetShaderDefines();
+        const std::string shaderPath = this->shaderPath + "atmosphere/";
         auto loadShader = [&](Util::Shader& shader, const std::string& name, bool compute)
         {
+            if (!filter(shader)) return;
             const auto base = shaderPath + name;
             if (!compute)
-                return shader.Create({ base + "_vert.glsl", base + "_frag.glsl" });
+                shaderBatch.Add(shader, { base + "_vert.glsl", base + "_frag.glsl" }, defines);
             else
-                return shader.Create({ "", "", base + ".glsl" });
+                shaderBatch.Add(shader, { "", "", base + ".glsl" }, defines);
+        };
+        auto loadVariants = [&](Util::ShaderVariants& variants, const std::string& name, const Util::ShaderVariants::Defines& used)
+        {
+            variants.Submit(shaderBatch, { "", "", shaderPath + name + ".glsl" }, defines, filter, { used });
         };
         auto loadGenerator = [&](Generator& gen)
         {
-            return loadShader(gen.GetShader(), "generation/" + gen.GetShaderName(), true);
+            loadVariants(gen.GetShader(), "generation/" + gen.GetShaderName(), generatorVariant);
         };
 
-        if (!loadShader(postShader, "../post", false)) return false;
-        if (!loadShader(finalShader, "../final", false)) return false;
-        if (!loadShader(backdropShader, "../misc/backdrop", false)) return false;
-        if (!loadShader(transmittanceShader, "transmittance", true)) return false;
-        if (!loadShader(inscatterFirstShader, "inscatter_first", true)) return false;
-        if (!loadShader(updateShader, "update_nodes", true)) return false;
-
-        if (!loadGenerator(updater.generator)) return false;
-        if (!loadGenerator(updater.featureGenerator)) return false;
-
-        if (!loadShader(initSplitsShader, "init_splits", true)) return false;
-        if (!loadShader(updateFlagsShader, "update_flags", true)) return false;
-        if (!loadShader(updateLightPerGroupShader, "update_light_group", true)) return false;
-        if (!loadShader(updateLightShader, "update_lighting", true)) return false;
-        if (!loadShader(lightFilterShader, "filter_lighting", true)) return false;
-        if (!loadShader(updateOctreeMapShader, "update_octree_map", true)) return false;
-        //if (!loadShader(renderShader, "render", true)) return false;
-        if (!loadShader(renderInterpShader, "render_with_animation_interpolation", true)) return false;
-        if (!loadShader(renderNoInterpShader, "render_without_animation_interpolation", true)) return false;
-        if (!loadShader(resolveShader, "resolve", true)) return false;
+        // All are submitted before any is checked, for the driver to compile them concurrently.
+        shaderReloadStart = std::chrono::steady_clock::now();
+        shaderReloadStats = Util::Shader::GetCacheStats();
+        shaderReloadReads = Util::Shader::GetSources().GetNumReads();
+        loadShader(postShader, "../post", false);
+        loadShader(finalShader, "../final", false);
+        loadShader(backdropShader, "../misc/backdrop", false);
+        loadShader(transmittanceShader, "transmittance", true);
+        loadShader(inscatterFirstShader, "inscatter_first", true);
+        loadShader(updateShader, "update_nodes", true);
+
+        loadGenerator(updater.generator);
+        loadGenerator(updater.featureGenerator);
+
+        loadShader(initSplitsShader, "init_splits", true);
+        loadShader(updateFlagsShader, "update_flags", true);
+        loadShader(updateEmptyDistanceShader, "update_empty_distance", true);
+        loadShader(prefilterBricksShader, "prefilter_bricks", true);
+        loadVariants(updateLightPerGroupShader, "update_light_group", lightingVariant);
+        loadVariants(updateLightShader, "update_lighting", lightingVariant);
+        loadShader(lightFilterShader, "filter_lighting", true);
+        loadShader(encodeBricksShader, "encode_bricks", true);
+        loadShader(updateOctreeMapShader, "update_octree_map", true);
+        loadVariants(renderShader, "render", GetRenderVariant(animate));
+        loadShader(resolveShader, "resolve", true);
+        loadShader(classifyTilesShader, "classify_tiles", true);
+    }
+
+    Atmosphere::Statistics Atmosphere::GetStatistics()
+    {
+        // (the render iteration isn't touched by the worker thread)
+        const auto& it = updater.GetRenderIteration();
+        Statistics s;
+        s.nodeGroups = it.numNodeGroups;
+        s.nodeGroupCapacity = octree.GetNodeGroupCapacity();
+        s.iterations = updater.GetNumIterations();
+        s.splits = it.numSplits;
+        s.merges = it.numMerges;
+        s.uploadBytes = GetUploadBytes();
+        s.stagedNodeGroups = it.nodesToUpload.size();
+        s.dirtyNodeGroups = it.numDirtyGroups;
+        s.pendingRelights = it.numPendingRelights;
+        s.deferredNodeGroups = it.deferredGroups.size();
+        s.uninterpolatedNodeGroups = numUninterpolatedGroups;
+        s.pendingShaders = shaderBatch.GetSize();
+        s.residentBrickPages = GetResidentBrickPages();
+        s.brickPages = GetBrickPages();
+        return s;
+    }
+
+    std::vector<const Util::ShaderVariants*> Atmosphere::GetShaderVariants() const
+    {
+        return { &renderShader, &updateLightPerGroupShader, &updateLightShader,
+            &updater.generator.GetShader(), &updater.featureGenerator.GetShader() };
+    }
+
+    bool Atmosphere::FinishShaderReload()
+    {
+        const bool built = shaderBatch.Apply();
+        const auto stats = Util::Shader::GetCacheStats();
+        const auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - shaderReloadStart).count();
+        if (!built)
+        {
+            std::cerr << "Shaders failed to build (after " << ms << " ms); keeping the previous ones\n";
+            return false;
+        }
+        std::cout << "Loaded shaders in " << ms << " ms (" << stats.loaded - shaderReloadStats.loaded << " programs from the binary cache, "
+            << stats.compiled - shaderReloadStats.compiled << " compiled, "
+            << Util::Shader::GetSources().GetNumReads() - shaderReloadReads << " source files read)\n";
         return true;
     }
 
@@ -217,6 +704,8 @@ namespace Mulen::Atmosphere {
         const auto invViewProjMat = glm::inverse(viewProjMat);
         const auto prevViewProjMat = this->prevViewProjMat;
         this->prevViewProjMat = viewProjMat;
+        const auto prevCameraOffset = prevCameraPosition - camera.GetPosition();
+        prevCameraPosition = camera.GetPosition();
         this->viewProjMat = projMat * viewMat;
 
         Uniforms uniforms = {};
@@ -227,6 +716,7 @@ namespace Mulen::Atmosphere {
         uniforms.invViewProjMat = invViewProjMat;
         uniforms.worldMat = worldMat;
         uniforms.prevViewProjMat = prevViewProjMat;
+        uniforms.prevCameraOffset = glm::vec4(prevCameraOffset, 0.0);
         uniforms.time = static_cast<float>(renderTime);
         uniforms.animationTime = static_cast<float>(GetAnimationTime());
         uniforms.animationAlpha = static_cast<float>(updater.GetUpdateFraction());
@@ -280,9 +770,13 @@ namespace Mulen::Atmosphere {
 
     void Atmosphere::Update(double dt, const UpdateParams& params, const Camera& camera, const LightSource& light)
     {
-        auto t = timer.Begin("Atmosphere::Update");
+        auto t = timer.Begin(profilerRefs.atmosphereUpdate);
+
+        if (!shaderBatch.IsEmpty() && shaderBatch.IsDone()) FinishShaderReload();
 
         animate = params.animate;
+        lightingVariant = GetLightingVariant(params.lightingMode, params.perGroupLighting);
+        generatorVariant = GetGeneratorVariant(params.optimiseGeneration, params.cumulusWindCells);
         renderTime += dt;
         if (params.rotateLight) lightTime += dt;
         if (params.animate) time += dt;
@@ -307,31 +801,30 @@ namespace Mulen::Atmosphere {
         auto& it = u.GetRenderIteration();
         gpuUploadNodes.BindBase(GL_SHADER_STORAGE_BUFFER, 1u);
         gpuUploadBricks.BindBase(GL_SHADER_STORAGE_BUFFER, 2u);
+        brickPageBuffer.BindBase(GL_SHADER_STORAGE_BUFFER, 4u);
         // - to do: also bind the old texture for reading
         // (initially just testing writing directly to one)
 
         if (!hasTransmittance)
         {
             hasTransmittance = true;
-
+            ScatteringTables tables{ GetPhysicalParameters() };
+            if (scatteringCacheDirectory.empty() || !LoadScatteringTextures(tables)) ComputeScatteringTexturesGpu();
             {
-                auto t = timer.Begin("Transmittance");
-                u.SetShader(*this, transmittanceShader);
-                const glm::uvec3 workGroupSize{ 32u, 32u, 1u };
-                auto& tex = transmittanceTexture;
-                glBindImageTexture(0u, tex.GetId(), 0, GL_FALSE, 0, GL_WRITE_ONLY, tex.GetFormat());
-                glDispatchCompute(tex.GetWidth() / workGroupSize.x, tex.GetHeight() / workGroupSize.y, tex.GetDepth() / workGroupSize.z);
-                glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+                std::lock_guard<std::mutex> lock(scatteringMutex);
+                numScatteringOrders = glm::max(1u, tables.GetNumScatteringOrders());
             }
+            // The single scattering is usable right away; the higher orders follow as they're computed.
+            if (scatteringOrders > 1u && tables.GetNumScatteringOrders() < scatteringOrders) StartMultipleScattering(std::move(tables));
+        }
+        {
+            std::lock_guard<std::mutex> lock(scatteringMutex);
+            if (!finishedScattering.empty())
             {
-                transmittanceTexture.Bind(5u);
-                auto t = timer.Begin("Inscatter");
-                u.SetShader(*this, inscatterFirstShader);
-                const glm::uvec3 workGroupSize{ 8u, 8u, 8u };
-                auto& tex = scatterTexture;
-                glBindImageTexture(0u, tex.GetId(), 0, GL_FALSE, 0, GL_WRITE_ONLY, tex.GetFormat());
-                glDispatchCompute(tex.GetWidth() / workGroupSize.x, tex.GetHeight() / workGroupSize.y, tex.GetDepth() / workGroupSize.z);
-                glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+                auto t = timer.Begin("Upload scattering");
+                glTextureSubImage3D(scatterTexture.GetId(), 0, 0, 0, 0, scatterTexture.GetWidth(), scatterTexture.GetHeight(), scatterTexture.GetDepth(),
+                    GL_RGBA, GL_FLOAT, finishedScattering.data());
+                finishedScattering.clear();
             }
         }
 
@@ -345,6 +838,18 @@ namespace Mulen::Atmosphere {
             initUpdate = false;
             std::cout << "Uploading " << it.nodesToUpload.size() << " node groups\n";
             std::cout << "Generating " << it.bricksToUpload.size() << " bricks\n";
+            if (copyOnWriteBricks)
+            {
+                // All states share the initially generated bricks.
+                // (which leaves none dirty for when this iteration is next processed, since they're all up to date)
+                const auto numStates = std::extent<decltype(gpuStates)>::value;
+                for (auto i = 0u; i < numStates; ++i)
+                {
+                    it.numDirtyGroups = i ? 0u : it.nodesToUpload.size();
+                    UpdateBrickSlots(it, (1u + i) % numStates);
+                }
+            }
+            UpdateBrickPages(it);
 
             for (auto& uploadGroup : it.nodesToUpload)
             {
@@ -359,14 +864,38 @@ namespace Mulen::Atmosphere {
             {
                 auto& state = gpuStates[(1 + i) % std::extent<decltype(gpuStates)>::value];
                 state.gpuNodes.BindBase(GL_SHADER_STORAGE_BUFFER, 0u);
-                state.brickTexture.Bind(0u);
+                GetBrickWriteTexture(state).Bind(0u);
                 state.octreeMap.Bind(2u);
+                if (copyOnWriteBricks) state.brickSlots.BindBase(GL_SHADER_STORAGE_BUFFER, 5u);
 
                 u.UpdateNodes(*this, it.nodesToUpload.size());
                 u.UpdateMap(*this, state.octreeMap);
-                u.GenerateBricks(*this, state, defaultGenerator, 0u, it.bricksToUpload.size());
-                u.LightBricks(*this, state, 0u, it.bricksToUpload.size(), lightDir, Util::Timer::DurationMeta{1.0});
+                if (copyOnWriteBricks && i) // (the bricks are shared, so only flags need computing)
+                {
+                    u.UpdateBrickFlags(*this, state, 0u, it.bricksToUpload.size());
+                    u.UpdateEmptyDistances(*this, 0u, it.bricksToUpload.size());
+                    continue;
+                }
+                u.GenerateBricks(*this, state, defaultGenerator, generatorVariant, 0u, it.bricksToUpload.size());
+                if (LightingMode::Cones == params.lightingMode && !copyOnWriteBricks)
+                {
+                    u.CollectPrefilterNodes(it);
+                    for (const auto& level : u.prefilterLevels) u.PrefilterBricks(*this, state, u.prefilterNodes.data() + level.first, level.second);
+                }
+                u.UpdateEmptyDistances(*this, 0u, it.bricksToUpload.size());
+                if (LightingMode::Sweep == params.lightingMode)
+                {
+                    u.CollectSweepSlabs(it, lightDir);
+                    u.SweepLight(*this, lightDir, 0u, u.sweepSlabs.size());
+                }
+                u.LightBricks(*this, state, 0u, it.bricksToUpload.size(), lightDir, Util::Timer::DurationMeta{1.0},
+                    params.lightingMode, params.coneAperture, params.perGroupLighting);
                 u.FilterLighting(*this, state, 0u, it.bricksToUpload.size());
+                if (IsCompressed(brickFormat))
+                {
+                    u.CollectEncodePages(*this, it);
+                    u.EncodeBricks(*this, state, u.encodePages.data(), u.encodePages.size(), true);
+                }
             }
         }
 
@@ -381,6 +910,11 @@ namespace Mulen::Atmosphere {
             updaterParams.cameraPosition = cameraPos;
             updaterParams.lightDirection = lightDir;
             updaterParams.depthLimit = params.depthLimit;
+            updaterParams.lightingMode = params.lightingMode;
+            updaterParams.coneAperture = params.coneAperture;
+            updaterParams.perGroupLighting = params.perGroupLighting;
+            updaterParams.optimiseGeneration = params.optimiseGeneration;
+            updaterParams.cumulusWindCells = params.cumulusWindCells;
             updaterParams.generator = params.useFeatureGenerator ? &updater.featureGenerator : &updater.generator;
             updaterParams.scale = scale;
             updaterParams.height = height;
@@ -389,13 +923,52 @@ namespace Mulen::Atmosphere {
             updaterParams.viewFrustum.FromMatrix(viewProjMat);
 
             updater.OnFrame(*this, updaterParams, period);
+            uploadRing.Fence(); // guard this frame's staged uploads until the GPU is done with them
         }
     }
 
+    glm::uvec2 Atmosphere::GetFragOffset(const glm::uvec2& fragFactor, unsigned frame)
+    {
+        // Steps through the block by a stride coprime with its size near the golden ratio of it, so that consecutive
+        // frames trace pixels far apart, and each pixel is traced once every fragFactor.x * fragFactor.y frames.
+        // (for 2x2, that's the diagonals first)
+        const auto n = fragFactor.x * fragFactor.y;
+        auto stride = std::max(1u, unsigned(n * 0.618 + 0.5));
+        while (std::gcd(stride, n) != 1u) ++stride;
+        const auto i = (frame % n) * stride % n;
+        return glm::uvec2(i % fragFactor.x, i / fragFactor.x);
+    }
+
+    glm::uvec2 Atmosphere::ChooseFragFactor(const glm::ivec2& res)
+    {
+        if (traceBudget <= 0.0) return glm::uvec2(downscaleFactor);
+
+        // Cost per traced pixel, from the latest GPU timing of the rays (which arrives a few frames late).
+        auto& times = timer.GetTimings(profilerRefs.renderTrace).gpuTimes;
+        if (times.Size() && times[0].frame != traceCostFrame && times[0].meta.factor > 0.0)
+        {
+            const auto cost = times[0].duration / times[0].meta.factor;
+            traceCostPerPixel = traceCostFrame < 0 ? cost : glm::mix(traceCostPerPixel, cost, 0.2);
+            traceCostFrame = times[0].frame;
+        }
+        if (traceCostPerPixel <= 0.0) return fragFactor;
+
+        // The finest factor whose rays fit in the budget. Refining needs some headroom, to not flip back and forth.
+        static const glm::uvec2 factors[] = { { 1u, 1u }, { 2u, 1u }, { 2u, 2u }, { 3u, 2u }, { 3u, 3u }, { 4u, 3u }, { 4u, 4u } };
+        const auto affordable = traceBudget / traceCostPerPixel;
+        for (const auto& f : factors)
+        {
+            const auto traced = double((res.x + f.x - 1u) / f.x) * double((res.y + f.y - 1u) / f.y);
+            const auto headroom = f.x * f.y < fragFactor.x * fragFactor.y ? 0.85 : 1.0;
+            if (traced <= affordable * headroom) return f;
+        }
+        return factors[std::extent<decltype(factors)>::value - 1u];
+    }
+
     void Atmosphere::Render(const glm::ivec2& windowRes, const glm::ivec2& res, const Camera& camera, const LightSource& light)
     {
         auto& u = updater;
-        auto t = timer.Begin("Atmosphere::Render");
+        auto t = timer.Begin(profilerRefs.atmosphereRender);
 
         // Resize the render targets if resolution has changed.
         if (depthTexture.GetWidth() != res.x || depthTexture.GetHeight() != res.y)
@@ -415,12 +988,15 @@ namespace Mulen::Atmosphere {
                     glTextureParameteri(tex.GetId(), GL_TEXTURE_WRAP_S, clamp);
                     glTextureParameteri(tex.GetId(), GL_TEXTURE_WRAP_T, clamp);
                 };
-                // - to do: depth too
                 t.light.Create(GL_TEXTURE_2D, 1u, GL_RGBA16F, res.x, res.y);
                 setTextureClamp(t.light, GL_CLAMP_TO_EDGE);
                 t.transmittance.Create(GL_TEXTURE_2D, 1u, GL_RGBA16F, res.x, res.y);
                 setTextureClamp(t.transmittance, GL_CLAMP_TO_EDGE);
+                t.depth.Create(GL_TEXTURE_2D, 1u, GL_R32F, res.x, res.y);
+                setTextureClamp(t.depth, GL_CLAMP_TO_EDGE);
             }
+            tileTexture.Create(GL_TEXTURE_2D, 1u, GL_RG16F, (res.x + ScreenTileRes - 1u) / ScreenTileRes, (res.y + ScreenTileRes - 1u) / ScreenTileRes);
+            historyFrames = 0u;
 
             postTexture.Create(GL_TEXTURE_2D, 1u, GL_RGB8, res.x, res.y);
             postFbo.Create();
@@ -428,27 +1004,15 @@ namespace Mulen::Atmosphere {
         }
 
 
-        auto computeFragOffset = [&](unsigned i)
-        {
-            // - to do: better pattern
-            // (possibly Bayer matrix, though that might not be easily accomplished for 3) https://en.wikipedia.org/wiki/Ordered_dithering
-
-            if (downscaleFactor == 2u) // - for testing
-            {
-                glm::uvec2 offsets[] = { {0u, 0u}, {1u, 1u}, {1u, 0u}, {0u, 1u} };
-                return offsets[i];
-            }
-
-            return glm::uvec2(i % downscaleFactor, i / downscaleFactor);
-        };
-        const auto fragOffset = computeFragOffset(frame % (downscaleFactor * downscaleFactor));
+        fragFactor = ChooseFragFactor(res);
+        const auto fragOffset = GetFragOffset(fragFactor, frame);
         ++frame;
 
         auto setUpShader = [&](Util::Shader& shader) -> Util::Shader&
         {
             shader.Bind();
             shader.Uniform2u("fragOffset", fragOffset);
-            shader.Uniform2u("fragFactor", glm::uvec2{ downscaleFactor });
+            shader.Uniform2u("fragFactor", fragFactor);
             SetUniforms(shader);
             return shader;
         };
@@ -458,8 +1022,18 @@ namespace Mulen::Atmosphere {
         auto& prevState = gpuStates[(u.progress.stateIndex + 1u) % numStates];
         auto& state = gpuStates[(u.progress.stateIndex + 2u) % numStates];
         state.gpuNodes.BindBase(GL_SHADER_STORAGE_BUFFER, 0u);
-        prevState.brickTexture.Bind(0u);
-        state.brickTexture.Bind(1u);
+        GetBrickTexture(prevState).Bind(0u);
+        GetBrickTexture(state).Bind(1u);
+        if (IsSplit(brickFormat))
+        {
+            GetBrickLightTexture(prevState).Bind(8u);
+            GetBrickLightTexture(state).Bind(9u);
+        }
+        if (copyOnWriteBricks)
+        {
+            state.brickSlots.BindBase(GL_SHADER_STORAGE_BUFFER, 5u);
+            prevState.brickSlots.BindBase(GL_SHADER_STORAGE_BUFFER, 6u);
+        }
         state.octreeMap.Bind(2u);
         depthTexture.Bind(3u);
         transmittanceTexture.Bind(5u);
@@ -467,113 +1041,15 @@ namespace Mulen::Atmosphere {
         octreeMap.Bind(7u);
         vao.Bind();
 
-        glm::vec3 mapPosition, mapScale;
-        { // per-frame octree acceleration map aligned to view frustum
-
-
-            auto outvec3 = [&](glm::vec3 v)
-            {
-                std::cout << "(" << v.x << ", " << v.y << ", " << v.z;
-                return ")";
-            };
-
-            const auto planetLocation = GetPosition() - camera.GetPosition(); // - or negated? Hmm...
-            const auto R = GetPlanetRadius();
-            const auto cloudHeight = GetCloudMaxHeight();
-            const auto h = glm::max(0.0, glm::length(planetLocation) - R);
-            const auto planetHorizon = std::sqrt(h * (h + 2 * R));
-            const auto cloudHorizon = planetHorizon + std::sqrt(cloudHeight * (cloudHeight + 2 * R));
-
-            const auto viewMatrix = camera.GetViewMatrix();
-            // - to do: also inverse planet matrix, later on (to support orientation)
-            const auto mat = viewMatrix;
-            const auto invMat = glm::inverse(mat);
-            const auto invProjMat = glm::inverse(camera.GetProjectionMatrix() * mat);
-
-
-            // Compute atmosphere-space AABB of view frustum (extended to camera distance-to-cloud-layer-horizon):
-            const auto origin = -glm::vec3(planetLocation);
-            //std::cout << "origin: " << outvec3(origin) << " (cloudHorizon: " << cloudHorizon << ")\n";
-            const auto forward = glm::normalize(glm::vec3(invProjMat * glm::vec4(0.0, 0.0, 1.0, 1.0)));
-            auto min = origin, max = origin;
-            for (float y = -1.0; y < 2.0; y += 2.0)
-            {
-                for (float x = -1.0; x < 2.0; x += 2.0)
-                {
-                    auto d = glm::normalize(glm::vec3(invProjMat * glm::vec4(x, y, 1.0, 1.0)));
-                    //std::cout << outvec3(d) << "\n";
-                    d /= glm::dot(d, forward); // compensate for directions to the side not covering the spherical cap
-                    d *= cloudHorizon;
-                    d += origin;
-                    min = glm::min(min, d);
-                    max = glm::max(max, d);
-                }
-            }
-            // - to do: also consider the roughly hemispherical cap of the frustum
-            // (not taking that into account is making the map coverage far too small)
-
-            // Transform min/max to "octree space" (i.e. on [-1, 1]) and clamp:
-            const auto octreeMin = glm::vec3(-1.0), octreeMax = glm::vec3(1.0);
-            const auto octreeScale = static_cast<float>(planetRadius * scale);
-            min = glm::clamp(min / octreeScale, octreeMin, octreeMax);
-            max = glm::clamp(max / octreeScale, octreeMin, octreeMax);
-
-            // - to do: find correct (negative) power of two in relation to full octree size (round up)
-            auto extents = max - min;
-            const auto maxExtent = glm::max(extents.x, glm::max(extents.y, extents.z));
-            auto exponent = static_cast<int>(floor(log2(2.0 / maxExtent)));
-            // - to do: see if the AABB can be fit at this level, with regards to the map resolution
-            // (and if not, increment exponent once and fit at that level instead)
-
-            glm::vec3 mapMin, mapMax;
-            auto fitAabb = [&]()
-            {
-                const float res = static_cast<float>(state.octreeMap.GetWidth());
-                const float mapSize = 2.0f / static_cast<float>(exp2(exponent));
-                const float texelSize = mapSize / res;
-
-                // Extend correctly with regards to map resolution, so map texel boundaries line up with node boundaries
-                auto texel0 = floor((min + 1.0f) / texelSize),
-                    texel1 = ceil((max + 1.0f) / texelSize);
-                auto texelDiff = texel1 - texel0;
-                if (texelDiff.x > res || texelDiff.y > res || texelDiff.z > res)
-                {
-                    return false; // the AABB doesn't fit in this level; we need to go bigger sizes
-                }
-
-                texel1 = texel0 + static_cast<decltype(texel0)>(res);
-                mapMin = texel0 * texelSize - 1.0f;
-                mapMax = texel1 * texelSize - 1.0f;
-                return true; // the AABB can be mapped at this level
-            };
-            if (!fitAabb())
-            {
-                exponent -= 1;
-                if (!fitAabb())
-                {
-                    std::cout << "Error: could not fit view frustum AABB\n"; // - to do: better message
-                }
-            }
-
-            mapPosition = mapMin;
-            mapScale = mapMax - mapMin;
-            updater.UpdateMap(*this, octreeMap, mapPosition, mapScale, exponent);
-
-
-            if (false)
-            { // - debugging
-                static auto count = 0u;
-                if (count++ % 60u == 0u)
-                {
-                    std::cout << "AABB fit with exponent " << exponent;
-                    std::cout << " (min: " << outvec3(min) << ", max: " << outvec3(max) << ")\n";
-                    std::cout << " (position: " << outvec3(mapPosition) << ", scale: " << outvec3(mapScale) << ")";
-                    std::cout << "\n";
-                }
-            }
-
-            // - to do, in the future: experiment with a handful of maps for different distances/{sections of the frustum}
-            // (and correspondingly splitting the rendering into a handful of passes)
+        { // per-frame octree map of a cube around the camera, finer than the per-state one of the whole octree
+            // (a cube centred on the camera rather than fit to the frustum: nearby samples are the ones needing fine texels,
+            // and the frustum's bounds mostly spanned the whole octree anyway, leaving the map no finer than the state's)
+            const auto octreeScale = planetRadius * scale;
+            const auto center = (camera.GetPosition() - GetPosition()) / octreeScale;
+            viewMapPosition = glm::vec3(OctreeMap::Place(center, viewMapRes, viewMapLevels));
+            viewMapScale = glm::vec3(static_cast<float>(2.0 / exp2(viewMapLevels)));
+            updater.UpdateMap(*this, octreeMap, viewMapPosition, viewMapScale, viewMapLevels, true);
+            viewMapStateIndex = (updater.progress.stateIndex + 2u) % std::extent<decltype(gpuStates)>::value;
         }
 
         { // "planet" background (to do: spruce this up, maybe move elsewhere)
@@ -595,18 +1071,58 @@ namespace Mulen::Atmosphere {
         { 
             glBindImageTexture(unit, tex.GetId(), 0, GL_FALSE, 0, GL_READ_WRITE, tex.GetFormat()); 
         };
+
+        // Screen tiles by the previous frame's atmosphere, for the ray march to adapt its steps to.
+        const bool classifyTiles = adaptiveSteps && historyFrames > 0u;
+        { // (first reading back the rays per class counted in this buffer a few frames ago)
+            const auto bi = frame % std::extent<decltype(tileRaysBuffers)>::value;
+            auto& buffer = tileRaysBuffers[bi];
+            const auto numClasses = std::extent<decltype(Profiler_RenderRays)>::value;
+            if (!buffer.GetSize()) buffer.Create(sizeof(uint32_t) * numClasses, GL_DYNAMIC_STORAGE_BIT);
+            if (auto& fence = tileRaysFences[bi])
+            {
+                // (rather than stall on a GPU running that far behind, that frame's counts are left out)
+                const auto res = glClientWaitSync(fence, 0, 0u);
+                if (GL_ALREADY_SIGNALED == res || GL_CONDITION_SATISFIED == res)
+                {
+                    uint32_t rays[numClasses];
+                    glGetNamedBufferSubData(buffer.GetId(), 0, sizeof(rays), rays);
+                    for (size_t i = 0u; i < numClasses; ++i) timer.Count(profilerRefs.renderRays[i], double(rays[i]));
+                }
+                glDeleteSync(fence);
+                fence = nullptr;
+            }
+            if (classifyTiles)
+            {
+                auto t = timer.Begin(profilerRefs.renderClassify);
+                const uint32_t zeros[numClasses] = {};
+                buffer.Upload(0, sizeof(zeros), zeros);
+                buffer.BindBase(GL_SHADER_STORAGE_BUFFER, 7u);
+                setUpShader(classifyTilesShader);
+                previous.light.Bind(4u);
+                previous.transmittance.Bind(5u);
+                glBindImageTexture(0u, tileTexture.GetId(), 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RG16F);
+                glDispatchCompute(tileTexture.GetWidth(), tileTexture.GetHeight(), 1u);
+                glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+                tileRaysFences[bi] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                transmittanceTexture.Bind(5u); // (the ray march's)
+            }
+        }
         bindImage(current.light, 0u);
         bindImage(current.transmittance, 1u);
         bindImage(lightTexture, 2u);
+        bindImage(current.depth, 3u);
+        glBindImageTexture(4u, tileTexture.GetId(), 0, GL_FALSE, 0, GL_READ_ONLY, GL_RG16F);
 
         { // atmosphere
             //lightTexture.Bind(4u);
-            auto& shader = setUpShader(animate ? renderInterpShader : renderNoInterpShader);
-            shader.Uniform3f("mapPosition", mapPosition);
-            shader.Uniform3f("mapScale", mapScale);
+            auto& shader = setUpShader(renderShader.Get(GetRenderVariant(animate)));
+            shader.Uniform3f("mapPosition", viewMapPosition);
+            shader.Uniform3f("mapScale", viewMapScale);
+            shader.Uniform1i("adaptiveSteps", glm::ivec1{ classifyTiles });
             const glm::uvec3 workGroupSize{ 8u, 8u, 1u };
-            // - to do: correctly downscale resolution
-            auto downscaleRes = (res + glm::ivec2(downscaleFactor - 1)) / glm::ivec2(downscaleFactor);
+            const auto downscaleRes = (glm::uvec2(res) + fragFactor - 1u) / fragFactor;
+            auto t = timer.Begin(profilerRefs.renderTrace, { double(downscaleRes.x) * double(downscaleRes.y) });
             glDispatchCompute((downscaleRes.x + workGroupSize.x - 1u) / workGroupSize.x, (downscaleRes.y + workGroupSize.y - 1u) / workGroupSize.y, 1u);
             glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
         }
@@ -615,6 +1131,7 @@ namespace Mulen::Atmosphere {
             auto& shader = setUpShader(resolveShader);
             previous.light.Bind(4);
             previous.transmittance.Bind(5);
+            previous.depth.Bind(10);
             const glm::uvec3 workGroupSize{ 8u, 8u, 1u };
             glDispatchCompute((res.x + workGroupSize.x - 1u) / workGroupSize.x, (res.y + workGroupSize.y - 1u) / workGroupSize.y, 1u);
             glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
@@ -629,6 +1146,7 @@ namespace Mulen::Atmosphere {
             lightTexture.Bind(0u);
             glDrawArrays(GL_TRIANGLES, 0, 2u * 3u);
         }
+        ++historyFrames;
     }
 
     void Atmosphere::Finalise(const glm::ivec2& windowRes, const glm::ivec2& res)
@@ -643,4 +1161,293 @@ namespace Mulen::Atmosphere {
             glDrawArrays(GL_TRIANGLES, 0, 2u * 3u);
         }
     }
+
+    void Atmosphere::ComputeScatteringTexturesGpu()
+    {
+        {
+            auto t = timer.Begin("Transmittance");
+            updater.SetShader(*this, transmittanceShader);
+            const glm::uvec3 workGroupSize{ 32u, 32u, 1u };
+            auto& tex = transmittanceTexture;
+            glBindImageTexture(0u, tex.GetId(), 0, GL_FALSE, 0, GL_WRITE_ONLY, tex.GetFormat());
+            glDispatchCompute(tex.GetWidth() / workGroupSize.x, tex.GetHeight() / workGroupSize.y, tex.GetDepth() / workGroupSize.z);
+            glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+        }
+        {
+            transmittanceTexture.Bind(5u);
+            auto t = timer.Begin("Inscatter");
+            updater.SetShader(*this, inscatterFirstShader);
+            const glm::uvec3 workGroupSize{ 8u, 8u, 8u };
+            auto& tex = scatterTexture;
+            glBindImageTexture(0u, tex.GetId(), 0, GL_FALSE, 0, GL_WRITE_ONLY, tex.GetFormat());
+            glDispatchCompute(tex.GetWidth() / workGroupSize.x, tex.GetHeight() / workGroupSize.y, tex.GetDepth() / workGroupSize.z);
+            glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+        }
+    }
+
+    BrickStore::Parameters Atmosphere::GetPhysicalParameters() const
+    {
+        return { planetRadius, scale, height, cloudMaxHeight, HR, HM, betaR, absorptionExtinction,
+            absorptionMiddle, absorptionExtent, mieG, betaMSca, betaMEx };
+    }
+
+    bool Atmosphere::LoadScatteringTextures(ScatteringTables& tables)
+    {
+        auto t = timer.Begin("Atmosphere::LoadScatteringTextures");
+        if (transmittanceTexture.GetWidth() != ScatteringTables::TransmittanceWidth
+            || transmittanceTexture.GetHeight() != ScatteringTables::TransmittanceHeight
+            || scatterTexture.GetWidth() != ScatteringTables::ScatterNuSize * ScatteringTables::ScatterMuSSize
+            || scatterTexture.GetHeight() != ScatteringTables::ScatterMuSize || scatterTexture.GetDepth() != ScatteringTables::ScatterRSize)
+        {
+            std::cerr << "Scattering texture sizes differ from the CPU tables'; computing them on the GPU instead\n";
+            return false;
+        }
+
+        // With all the orders if they're cached, else the single scattering (for the rest to be computed meanwhile).
+        const auto path = tables.GetCachePath(scatteringCacheDirectory);
+        if (!tables.Load(tables.GetCachePath(scatteringCacheDirectory, scatteringOrders)) && !tables.Load(path))
+        {
+            const auto start = std::chrono::steady_clock::now();
+            tables.ComputeTransmittance();
+            tables.ComputeScattering();
+            const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            {
+                std::lock_guard<std::mutex> lock(scatteringMutex);
+                scatteringOrderSeconds.assign(1u, seconds);
+            }
+            std::cout << "Computed scattering tables in " << seconds << " s";
+            std::error_code error;
+            std::filesystem::create_directories(scatteringCacheDirectory, error);
+            if (tables.Save(path)) std::cout << " (cached as " << path << ")";
+            std::cout << "\n";
+        }
+        glTextureSubImage2D(transmittanceTexture.GetId(), 0, 0, 0, transmittanceTexture.GetWidth(), transmittanceTexture.GetHeight(),
+            GL_RGBA, GL_FLOAT, tables.transmittance.data());
+        glTextureSubImage3D(scatterTexture.GetId(), 0, 0, 0, 0, scatterTexture.GetWidth(), scatterTexture.GetHeight(), scatterTexture.GetDepth(),
+            GL_RGBA, GL_FLOAT, tables.scattering.data());
+        return true;
+    }
+
+    void Atmosphere::StartMultipleScattering(ScatteringTables&& tables)
+    {
+        StopMultipleScattering();
+        stopScattering = false;
+        // (leaving hardware threads for the updater thread, and the driver's)
+        const auto numThreads = glm::max(1u, std::thread::hardware_concurrency() / 2u);
+        scatteringThread = std::thread([this, numThreads, orders = scatteringOrders, directory = scatteringCacheDirectory,
+            tables = std::move(tables)]() mutable
+        {
+            auto computeOrder = [&](auto compute)
+            {
+                const auto start = std::chrono::steady_clock::now();
+                compute();
+                const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                std::cout << "Computed scattering order " << tables.GetNumScatteringOrders() << " in " << seconds << " s\n";
+                std::lock_guard<std::mutex> lock(scatteringMutex);
+                finishedScattering = tables.scattering;
+                numScatteringOrders = tables.GetNumScatteringOrders();
+                scatteringOrderSeconds.resize(numScatteringOrders, 0.0);
+                scatteringOrderSeconds.back() = seconds;
+            };
+            // (without the single scattering on the CPU - computed on the GPU, or loaded with fewer orders - start over)
+            if (tables.transmittance.empty()) tables.ComputeTransmittance(numThreads);
+            if (1u != tables.GetNumScatteringOrders()) computeOrder([&]() { tables.ComputeScattering(numThreads); });
+            while (tables.GetNumScatteringOrders() < orders && !stopScattering)
+            {
+                computeOrder([&]() { tables.ComputeNextScatteringOrder(numThreads); });
+            }
+            if (tables.GetNumScatteringOrders() == orders && !directory.empty())
+            {
+                std::error_code error;
+                std::filesystem::create_directories(directory, error);
+                tables.Save(tables.GetCachePath(directory, orders));
+            }
+        });
+    }
+
+    void Atmosphere::StopMultipleScattering()
+    {
+        if (!scatteringThread.joinable()) return;
+        stopScattering = true;
+        scatteringThread.join();
+        std::lock_guard<std::mutex> lock(scatteringMutex);
+        finishedScattering.clear();
+    }
+
+    unsigned Atmosphere::GetScatteringProgress(std::vector<double>& orderSeconds)
+    {
+        std::lock_guard<std::mutex> lock(scatteringMutex);
+        orderSeconds = scatteringOrderSeconds;
+        return numScatteringOrders;
+    }
+
+    bool Atmosphere::ValidateScatteringTables()
+    {
+        auto t = timer.Begin("Atmosphere::ValidateScatteringTables");
+        ScatteringTables tables{ GetPhysicalParameters() };
+        if (!tables.Load(tables.GetCachePath(scatteringCacheDirectory)))
+        {
+            tables.ComputeTransmittance();
+            tables.ComputeScattering();
+        }
+        ComputeScatteringTexturesGpu();
+
+        // Errors relative to the texel's value, with a floor relative to the table's largest (as values span magnitudes).
+        auto compare = [&](const char* name, Util::Texture& tex, const std::vector<glm::vec4>& expected, int numChannels)
+        {
+            std::vector<glm::vec4> texels(expected.size());
+            glGetTextureImage(tex.GetId(), 0, GL_RGBA, GL_FLOAT, GLsizei(sizeof(glm::vec4) * texels.size()), texels.data());
+            glm::dvec4 maxValue{ 0.0 };
+            for (const auto& v : expected) maxValue = glm::max(maxValue, glm::abs(glm::dvec4(v)));
+            double maxError = 0.0, sumSquares = 0.0;
+            for (size_t i = 0u; i < texels.size(); ++i)
+            for (int c = 0; c < numChannels; ++c)
+            {
+                const auto e = double(expected[i][c]);
+                const auto error = std::abs(double(texels[i][c]) - e) / (std::abs(e) + 1e-3 * maxValue[c] + 1e-30);
+                maxError = glm::max(maxError, error);
+                sumSquares += error * error;
+            }
+            const auto rms = std::sqrt(sumSquares / double(texels.size() * numChannels));
+            const bool valid = maxError < 2e-2; // (the GPU's are half floats, summed in single precision)
+            std::cout << name << " table: max relative error " << maxError << ", RMS " << rms << (valid ? "" : " (too large)") << "\n";
+            return valid;
+        };
+        bool valid = compare("Transmittance", transmittanceTexture, tables.transmittance, 3);
+        valid = compare("Scattering", scatterTexture, tables.scattering, 4) && valid;
+        hasTransmittance = false; // (to have Update restore the multiple scattering)
+        return valid;
+    }
+
+    bool Atmosphere::ValidateOctreeMaps()
+    {
+        auto t = timer.Begin("Atmosphere::ValidateOctreeMaps");
+        auto validate = [&](const char* name, Util::Texture& tex, unsigned stateIndex, const glm::dvec3& position, unsigned levels)
+        {
+            auto& state = gpuStates[stateIndex];
+            std::vector<NodeGroup> groups(static_cast<size_t>(state.gpuNodes.GetSize()) / sizeof(NodeGroup));
+            glGetNamedBufferSubData(state.gpuNodes.GetId(), 0, sizeof(NodeGroup) * groups.size(), groups.data());
+
+            const auto res = tex.GetWidth();
+            OctreeMap expected;
+            expected.Build(groups, octree.rootGroupIndex, res, position, levels);
+            auto map = expected; // (same placement, GPU texels)
+            auto& texels = map.GetTexels();
+            glGetTextureImage(tex.GetId(), 0, GL_RED_INTEGER, GL_UNSIGNED_INT, GLsizei(texels.size() * sizeof(OctreeMap::Texel)), texels.data());
+
+            std::string error;
+            if (!map.Validate(groups, octree.rootGroupIndex, &error))
+            {
+                std::cerr << name << " octree map is invalid:\n" << error;
+                return false;
+            }
+            const auto differing = texels.size() - std::inner_product(texels.begin(), texels.end(), expected.GetTexels().begin(),
+                size_t(0u), std::plus<size_t>(), std::equal_to<OctreeMap::Texel>());
+            std::cout << name << " octree map (" << res << "^3) is valid";
+            if (differing) std::cout << ", though " << differing << " texels differ from the CPU-built map";
+            std::cout << "\n";
+            return true;
+        };
+        const auto numStates = std::extent<decltype(gpuStates)>::value;
+        const auto stateIndex = (updater.progress.stateIndex + 2u) % numStates;
+        bool valid = validate("State", gpuStates[stateIndex].octreeMap, stateIndex, glm::dvec3(-1.0), 0u);
+        valid = validate("View", octreeMap, viewMapStateIndex, glm::dvec3(viewMapPosition), viewMapLevels) && valid;
+        return valid;
+    }
+
+    bool Atmosphere::ValidateBrickStorage()
+    {
+        std::string error;
+        bool valid = brickPages.Validate(&error);
+        if (!valid) std::cerr << "Brick page table is invalid: " << error << "\n";
+        if (copyOnWriteBricks && !brickSlots.Validate(&error))
+        {
+            std::cerr << "Brick slots are invalid: " << error << "\n";
+            valid = false;
+        }
+        if (valid)
+        {
+            std::cout << "Brick storage is valid (" << brickPages.GetNumResidentPages() << " resident pages";
+            if (copyOnWriteBricks) std::cout << ", " << brickSlots.GetNumOverflowUsed() << " overflow slots in use";
+            std::cout << ")\n";
+        }
+        return valid;
+    }
+
+    bool Atmosphere::CaptureBrickStore(BrickStore& store, const Camera& camera, const LightSource& light, const glm::ivec2& resolution)
+    {
+        auto t = timer.Begin("Atmosphere::CaptureBrickStore");
+        store.Clear();
+        store.params = GetPhysicalParameters();
+        store.view.origin = camera.GetPosition() - GetPosition();
+        store.view.invViewProj = glm::inverse(camera.GetProjectionMatrix() * camera.GetOrientationMatrix());
+        store.view.lightDir = lightDir;
+        store.view.sunIntensity = light.intensity;
+        store.view.resolution = resolution;
+
+        // The rendered state's nodes, as the GPU has them (with flags).
+        const auto numStates = std::extent<decltype(gpuStates)>::value;
+        const auto stateIndex = (updater.progress.stateIndex + 2u) % numStates;
+        auto& state = gpuStates[stateIndex];
+        store.rootGroupIndex = octree.rootGroupIndex;
+        store.groups.resize(static_cast<size_t>(state.gpuNodes.GetSize()) / sizeof(NodeGroup));
+        glGetNamedBufferSubData(state.gpuNodes.GetId(), 0, sizeof(NodeGroup) * store.groups.size(), store.groups.data());
+
+        // Group the state's bricks by physical page, to read each page back once.
+        const auto bricksPerPage = brickPages.GetBricksPerPage();
+        std::map<BrickPageTable::PageIndex, std::vector<std::pair<NodeIndex, size_t>>> pageReads; // brick, and place in page
+        store.ForEachGroup([&](NodeIndex gi)
+        {
+            for (NodeIndex ci = 0u; ci < NodeArity; ++ci)
+            {
+                const auto brick = Octree::GroupAndChildToNode(gi, ci);
+                const auto slot = copyOnWriteBricks ? brickSlots.GetMap(stateIndex)[brick] : brick;
+                if (BrickSlots::NoSlot == slot) continue;
+                const auto page = brickPages.GetPhysicalPage(slot);
+                if (BrickPageTable::NoPage != page) pageReads[page].push_back({ brick, slot % bricksPerPage });
+            }
+        });
+
+        auto indexTo3D = [](size_t index, const glm::uvec3& res)
+        {
+            return glm::uvec3(index % res.x, (index / res.x) % res.y, index / (res.x * res.y));
+        };
+        const auto pageTexels = pageBricks * BrickRes;
+        const auto numTexels = size_t(pageTexels.x) * pageTexels.y * pageTexels.z;
+        std::vector<glm::vec2> texels(numTexels);
+        std::vector<float> channel(numTexels);
+        auto readPage = [&](Util::Texture& tex, const glm::uvec3& offset, GLenum format, void* data, size_t size)
+        {
+            // (compressed formats are decompressed by the read)
+            glGetTextureSubImage(tex.GetId(), 0, offset.x, offset.y, offset.z, pageTexels.x, pageTexels.y, pageTexels.z,
+                format, GL_FLOAT, static_cast<GLsizei>(size), data);
+        };
+        for (const auto& pageRead : pageReads)
+        {
+            const auto offset = indexTo3D(pageRead.first, pagesRes) * pageTexels;
+            if (IsSplit(brickFormat))
+            {
+                readPage(GetBrickTexture(state), offset, GL_RED, channel.data(), sizeof(float) * numTexels);
+                for (size_t i = 0u; i < numTexels; ++i) texels[i].x = channel[i];
+                readPage(GetBrickLightTexture(state), offset, GL_RED, channel.data(), sizeof(float) * numTexels);
+                for (size_t i = 0u; i < numTexels; ++i) texels[i].y = channel[i];
+            }
+            else readPage(GetBrickTexture(state), offset, GL_RG, texels.data(), sizeof(glm::vec2) * numTexels);
+
+            for (const auto& read : pageRead.second)
+            {
+                auto& brick = store.AddBrick(read.first);
+                const auto brickOffset = indexTo3D(read.second, pageBricks) * BrickRes;
+                for (uint32_t z = 0u; z < BrickRes; ++z)
+                for (uint32_t y = 0u; y < BrickRes; ++y)
+                for (uint32_t x = 0u; x < BrickRes; ++x)
+                {
+                    const auto texel = brickOffset + glm::uvec3(x, y, z);
+                    brick.voxels[x + y * BrickRes + z * BrickRes2] = texels[texel.x + pageTexels.x * (texel.y + pageTexels.y * size_t(texel.z))];
+                }
+            }
+        }
+        std::cout << "Captured " << store.GetNumBricks() << " bricks in " << pageReads.size() << " pages.\n";
+        return true;
+    }
 }
@@ -1,9 +1,20 @@
 #pragma once
 #include "Common.hpp"
 #include <vector>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include "util/VertexArray.hpp"
 #include "util/Framebuffer.hpp"
+#include "util/RingBuffer.hpp"
+#include "util/MappedFile.hpp"
 #include "Updater.hpp"
+#include "BrickPages.hpp"
+#include "BrickSlots.hpp"
+#include "BrickStore.hpp"
+#include "Model.hpp"
 
 namespace Util {
     class Timer;
@@ -15,6 +26,7 @@ namespace Mulen {
 }
 
 namespace Mulen::Atmosphere {
+    class ScatteringTables;
 
     class Atmosphere : public Object
     {
@@ -22,16 +34,18 @@ namespace Mulen::Atmosphere {
 
         double scale = 1.1; // - should this also be configurable? Perhaps
 
-        // - to do: all of these managed by model instead
-        double planetRadius = 6371e3, height = 50e3, cloudMaxHeight = 25e3;
-        double HR = 8.0e3; // Rayleigh scale height
-        glm::dvec3 betaR = { 5.8e-6, 1.35e-5, 3.31e-5 };
-        double HM = 1.2e3; // Mie scale height
-        double mieG = 0.8;
-        double betaMSca = 2e-5 / 5.0; // Mie scattering
-        double betaMEx = betaMSca / 0.9; // Mie extinction
-        glm::dvec3 absorptionExtinction = { 6.497e-7, 1.881e-6, 8.502e-8 };
-        double absorptionMiddle = 25.0e3, absorptionExtent = 15.0e3;
+        // The physical constants, from the spectral model at the render wavelengths (red, green and blue):
+        const Model model;
+        const Model::Coefficients rgb = model.GetCoefficients();
+        double planetRadius = 6371e3, height = 50e3, cloudMaxHeight = 25e3; // - to do: managed by model too
+        double HR = model.rayleighScaleHeight;
+        glm::dvec3 betaR = rgb.rayleighScattering;
+        double HM = model.mieScaleHeight;
+        double mieG = model.miePhaseG;
+        double betaMSca = rgb.mieScattering.g; // Mie scattering (grey, as the model's Angstrom exponent is zero)
+        double betaMEx = rgb.mieExtinction.g; // Mie extinction
+        glm::dvec3 absorptionExtinction = rgb.absorptionExtinction;
+        double absorptionMiddle = model.absorptionMiddle, absorptionExtent = model.absorptionExtent;
 
         //NodeIndex rootGroupIndex; // - should really be here; the octree should be usable for several atmospheres at once, ideally
         Octree octree;
@@ -43,38 +57,151 @@ namespace Mulen::Atmosphere {
         Util::Texture depthTexture, lightTexture, postTexture;
         struct FrameTextures
         {
-            // - to do: probably also depth texture (to find the closest old pixel where needed)
             Util::Texture light, transmittance;
+            Util::Texture depth; // distance to where the atmosphere's light comes from (to validate reprojection)
         } frameTextures[2]; // previous and current
         unsigned frame = 0u;
         unsigned downscaleFactor = 1u;
+        // Temporal upsampling: each frame traces one pixel per fragFactor block, in a rotating order, and the resolve
+        // pass reprojects the rest from the previous frame. With a trace budget, fragFactor is chosen per frame so
+        // that the atmosphere rays fit in it, else it's the (uniform) downscale factor.
+        glm::uvec2 fragFactor{ 1u };
+        double traceBudget = 0.0; // GPU seconds per frame
+        double traceCostPerPixel = 0.0; // (smoothed, from the Render::Trace timings)
+        int traceCostFrame = -1;
+        glm::uvec2 ChooseFragFactor(const glm::ivec2& res);
+        static glm::uvec2 GetFragOffset(const glm::uvec2& fragFactor, unsigned frame);
+        // Adaptive ray march steps: screen tiles are classified by the previous frame (sky, haze, dense or occluded),
+        // each class with a step scale and a transmittance to stop rays at. The rays traced per class are counted
+        // on the GPU and read back a few frames later, into the profiler (if the GPU is done with them by then).
+        bool adaptiveSteps = true;
+        unsigned historyFrames = 0u; // frames rendered since the frame textures were (re)created
+        Util::Texture tileTexture;
+        Util::Buffer tileRaysBuffers[3];
+        GLsync tileRaysFences[3] = {}; // after the classification counting into each buffer, until read back
+        Util::Shader classifyTilesShader;
 
         GpuState gpuStates[3];
         Util::Texture brickLightTextureTemp, brickLightPerGroupTexture;
         Util::VertexArray vao;
-        Util::Shader backdropShader, renderInterpShader, renderNoInterpShader, resolveShader;
-        glm::uvec3 texMap;
-        Util::Texture octreeMap; // per-frame frustum-encompassing octree map
+        Util::Shader backdropShader, resolveShader;
+        Util::ShaderVariants renderShader; // (per ANIMATE_INTERPOLATION)
+        glm::uvec3 texMap; // brick texture size, in bricks
+
+        // Brick paging: bricks are addressed via a page table, and only pages of bricks in use are resident.
+        BrickPageTable brickPages;
+        Util::Buffer brickPageBuffer;
+        glm::uvec3 pageBricks, pagesRes; // page size in bricks, and brick texture size in pages
+        size_t maxPagesDepth = 0u;
+        size_t gpuMemPerGroup = 0u;
+        void UpdateBrickPages(const UpdateIteration&); // make the iteration's bricks resident (and release unused ones)
+        void GrowBrickTextures(size_t numPhysicalPages);
+        template<typename F> void ForEachBrickTexture(F f)
+        {
+            const auto split = IsSplit(brickFormat);
+            if (copyOnWriteBricks)
+            {
+                f(sharedBrickTexture);
+                if (split) f(sharedBrickLightTexture);
+            }
+            else for (auto& state : gpuStates)
+            {
+                f(state.brickTexture);
+                if (split) f(state.brickLightTexture);
+            }
+            if (IsCompressed(brickFormat)) f(brickWorkTexture);
+            f(brickLightTextureTemp);
+        }
+
+        // Brick format. Compressed bricks are written to an uncompressed work texture, and encoded into the state's
+        // brick texture once it's complete (from which point the work texture is free for the next state).
+        BrickFormat brickFormat = BrickFormat::RG8;
+        Util::Texture brickWorkTexture, brickBlockTexture; // (the latter holding encoded blocks on their way into place)
+        size_t encodeBatchPages = 0u; // capacity of the block texture
+        Util::Shader encodeBricksShader;
+        Util::Texture& GetBrickWriteTexture(GpuState& state) { return IsCompressed(brickFormat) ? brickWorkTexture : GetBrickTexture(state); }
+        Util::Texture& GetBrickLightTexture(GpuState& state) { return copyOnWriteBricks ? sharedBrickLightTexture : state.brickLightTexture; }
+        std::string shaderPath; // of the last shader load
+        BrickFormat shaderBrickFormat = BrickFormat::RG8; // which the shaders were last loaded for
+        Util::ShaderBatch shaderBatch; // being built (by the driver) to replace the current shaders
+        std::chrono::steady_clock::time_point shaderReloadStart;
+        Util::Shader::CacheStats shaderReloadStats; // at the start of the reload
+        size_t shaderReloadReads = 0u;
+        void SubmitShaders(const std::function<bool(const Util::Shader&)>& filter); // (to the batch)
+        bool FinishShaderReload();
+        std::string GetShaderDefines() const;
+
+        // Copy-on-write brick storage: states share one brick texture, each mapping bricks to slots in it.
+        bool copyOnWriteBricks = false;
+        BrickSlots brickSlots;
+        Util::Texture sharedBrickTexture, sharedBrickLightTexture;
+        Util::Texture& GetBrickTexture(GpuState& state) { return copyOnWriteBricks ? sharedBrickTexture : state.brickTexture; }
+        // Begins the state from the current one. Dirty groups which can't get brick slots of their own are moved out of
+        // the iteration's dirty range (into its deferredGroups), so that no brick another state uses is written into.
+        // New split groups are given slots first, and aren't deferred as long as they're within GetNumFreeBrickSlotGroups.
+        void UpdateBrickSlots(UpdateIteration&, unsigned stateIndex);
+        // Gives the groups' bricks slots of their own in the state, removing the groups for which there are none.
+        void ReassignBrickSlots(std::vector<NodeIndex>& groups, unsigned stateIndex);
+        size_t numUninterpolatedGroups = 0u; // (removed by the last reassignment)
+        // Groups whose bricks are sure to get slots of their own (even if none of their own slots are free).
+        size_t GetNumFreeBrickSlotGroups() const { return brickSlots.GetNumFreeOverflow() / NodeArity; }
+        void UploadBrickSlots(unsigned stateIndex);
+        void GetDisplacedBrickGroups(unsigned stateIndex, std::vector<NodeIndex>& groups, size_t maxGroups) const;
+        // Octree maps: a coarse one of the whole octree per state, and a finer per-frame one of a cube around the camera.
+        Util::Texture octreeMap; // (the per-frame one)
+        unsigned octreeMapRes = 64u, viewMapRes = 64u, viewMapLevels = 2u;
+        glm::vec3 viewMapPosition{ -1.0f }, viewMapScale{ 2.0f };
+        unsigned viewMapStateIndex = 0u; // which state's nodes the per-frame map was last made of
         Object::Mat4 prevViewProjMat, viewProjMat;
+        Object::Position prevCameraPosition{ 0.0 };
         
         // Update:
         Util::Texture brickUploadTexture;
         size_t maxToUpload; // maximum per frame
         Util::Buffer gpuUploadNodes, gpuUploadBricks, gpuGenData;
-        Util::Shader initSplitsShader, updateShader, updateFlagsShader, updateLightPerGroupShader, updateLightShader, updateOctreeMapShader, lightFilterShader;
+        Util::RingBuffer uploadRing; // persistently mapped staging for the above
+        struct IterationStaging
+        {
+            Util::Buffer buffer;
+            GLintptr nodesOffset = 0, bricksOffset = 0;
+            GLsizeiptr nodesSize = 0, bricksSize = 0;
+        } iterationStaging[2]; // for zero-copy uploads, one per update iteration
+        bool zeroCopyUploads = false;
+        Util::MappedFile stagingFile;
+        Util::Shader initSplitsShader, updateShader, updateFlagsShader, updateEmptyDistanceShader, prefilterBricksShader, updateOctreeMapShader, lightFilterShader;
+        Util::ShaderVariants updateLightPerGroupShader, updateLightShader; // (per LIGHTING_MODE)
 
         // Prepass:
         Util::Shader transmittanceShader, inscatterFirstShader;
         Util::Texture transmittanceTexture, scatterTexture;
         bool hasTransmittance = false; // - to do: per-atmosphere
+        std::string scatteringCacheDirectory;
+        void ComputeScatteringTexturesGpu();
+        bool LoadScatteringTextures(ScatteringTables&); // from the disk cache, computing (and caching) them on the CPU if not there
+        BrickStore::Parameters GetPhysicalParameters() const;
+        // Multiple scattering orders are computed by a background thread, after the single scattering is in use,
+        // and each order's table replaces the scattering texture's as it's finished.
+        unsigned scatteringOrders = 1u;
+        std::thread scatteringThread;
+        std::atomic<bool> stopScattering{ false }; // (checked between orders)
+        std::mutex scatteringMutex; // guards the following:
+        std::vector<glm::vec4> finishedScattering; // the latest order's table, for Update to upload
+        unsigned numScatteringOrders = 0u; // in the texture (or finished, to be uploaded)
+        std::vector<double> scatteringOrderSeconds; // per order computed on the CPU (zero for those loaded, or on the GPU)
+        void StartMultipleScattering(ScatteringTables&&);
+        void StopMultipleScattering();
 
         void SetUniforms(Util::Shader&);
         Object::Position lightDir;
 
 
         Util::Timer& timer;
+        const ProfilerRefs profilerRefs;
 
         bool animate = false;
+        // Shader variants selected by the last update's settings (built up front on reloads, as are those used before).
+        Util::ShaderVariants::Defines lightingVariant = GetLightingVariant(LightingMode::ShadowRays, true);
+        Util::ShaderVariants::Defines generatorVariant = GetGeneratorVariant(true, false);
         double renderTime = 0.0;
         double time = 0.0, lightTime = 0.0; // *animation* time and *light* time
 
@@ -85,18 +212,39 @@ namespace Mulen::Atmosphere {
 
     public:
         Atmosphere(Util::Timer&);
+        ~Atmosphere();
 
         // - maybe to do: separate this into technical and physical parameters?
         struct Params
         {
             // Technical:
             size_t memBudget, gpuMemBudget;
+            bool zeroCopyUploads = false; // have the updater thread write upload records straight into GPU-visible memory
+            std::string stagingFilePath; // if set (and not zero-copy), stage upload records in this memory-mapped file instead
+            bool sparseBricks = true; // commit brick texture pages sparsely (ARB_sparse_texture) if supported, else pool them
+            float budgetHeadroom = 2.0f; // node capacity relative to the budget; the budget can be raised this far without Init
+            bool copyOnWriteBricks = false; // keep one brick store, with states only having own copies of bricks which changed
+            float brickChangeFraction = 0.1f; // with copy-on-write bricks, the most that may change per update iteration
+            BrickFormat brickFormat = BrickFormat::RG8; // (compressed formats aren't combined with copy-on-write bricks)
+            unsigned octreeMapRes = 64u; // of the per-state maps of the whole octree (a power of two)
+            unsigned viewMapRes = 64u; // of the per-frame map around the camera (a power of two)
+            unsigned viewMapLevels = 2u; // the per-frame map covers 1 / 2^levels of the octree's extent, at finer texels
+            // Precomputed transmittance and scattering are cached here, keyed by the physical parameters
+            // (empty to compute them on the GPU instead, at every Init).
+            std::string scatteringCacheDirectory = "cache/";
+            unsigned scatteringOrders = 4u; // including single scattering (one to leave out multiple scattering)
 
             // Physical:
 
         };
         bool Init(const Params&);
-        bool ReloadShaders(const std::string& shaderPath);
+        bool SetMemoryBudget(size_t gpuMemBudget); // returns false if a full Init is needed for this budget
+        // Without waiting, the current shaders stay in use until the new ones are built (checked in Update).
+        bool ReloadShaders(const std::string& shaderPath, bool wait = true);
+        // Rebuilds (without waiting) the shaders whose sources changed, if any did.
+        bool ReloadChangedShaders();
+        // The shaders specialised by compile-time settings, and their variants compiled so far.
+        std::vector<const Util::ShaderVariants*> GetShaderVariants() const;
 
 
         struct UpdateParams
@@ -104,6 +252,12 @@ namespace Mulen::Atmosphere {
             bool update, animate, rotateLight, frustumCull;
             int depthLimit;
             bool useFeatureGenerator = false;
+            // Cones are cheaper than shadow rays but blur shadows more the further their occluders are.
+            LightingMode lightingMode = LightingMode::ShadowRays;
+            float coneAperture = 0.05f; // cone width increase per distance travelled
+            bool perGroupLighting = true;   // mini shadow maps per group to speed up shadow rays (PER_GROUP_LIGHTING)
+            bool optimiseGeneration = true; // skip the detail noise where the cloud mask is zero (OPTIMISE_GENERATION)
+            bool cumulusWindCells = false;  // experimental wind-aware cumulus mask (CUMULUS_WIND_CELLS)
         };
         void Update(double dt, const UpdateParams&, const Camera&, const LightSource&);
         void Render(const glm::ivec2& windowRes, const glm::ivec2& res, const Camera&, const LightSource&);
@@ -128,5 +282,43 @@ namespace Mulen::Atmosphere {
         void SetLightTime(double t) { lightTime = t; }
 
         void SetDownscaleFactor(unsigned f) { downscaleFactor = f; }
+        void SetTraceBudget(double seconds) { traceBudget = seconds; } // (zero to use the downscale factor)
+        glm::uvec2 GetFragFactor() const { return fragFactor; }
+        void SetAdaptiveSteps(bool b) { adaptiveSteps = b; }
+        size_t GetUploadBytes() const { return updater.GetUploadBytes(); }
+        // (for benchmarks; see Updater::SetDeterministic)
+        void SetDeterministicUpdates(bool b, const Updater::StageCosts& costs = {}) { updater.SetDeterministic(b, costs); }
+        Updater::StageCosts GetUpdateStageCosts() const { return updater.GetStageCosts(); }
+        size_t GetResidentBrickPages() const { return brickPages.GetNumResidentPages(); }
+        size_t GetBrickPages() const { return brickPages.GetNumVirtualPages(); }
+        BrickFormat GetBrickFormat() const { return brickFormat; }
+
+        // Figures for monitoring; those of iterations are of the latest handed over to rendering.
+        struct Statistics
+        {
+            size_t nodeGroups, nodeGroupCapacity; // octree occupancy
+            size_t iterations; // so far
+            size_t splits, merges; // in the iteration
+            size_t uploadBytes; // this frame
+            size_t stagedNodeGroups, dirtyNodeGroups; // of the iteration, to upload (dirty: with bricks to generate)
+            size_t pendingRelights; // groups queued for later iterations
+            size_t deferredNodeGroups; // (copy-on-write) dirty groups of the iteration left for later, for lack of brick slots
+            size_t uninterpolatedNodeGroups; // (copy-on-write) split groups left without their parents' data in the previous state
+            size_t pendingShaders; // programs building
+            size_t residentBrickPages, brickPages;
+        };
+        Statistics GetStatistics();
+
+        // Copies the rendered state and the view to the CPU, e.g. for the reference renderer (this stalls for the GPU).
+        bool CaptureBrickStore(BrickStore&, const Camera&, const LightSource&, const glm::ivec2& resolution);
+        // Reads back the current state's octree maps and checks them against the CPU builder (this stalls for the GPU).
+        bool ValidateOctreeMaps();
+        // Checks the brick page table and (with copy-on-write storage) the brick slot reference counts for consistency.
+        bool ValidateBrickStorage();
+        // Recomputes the transmittance and scattering textures on the GPU and compares them with the CPU's tables.
+        bool ValidateScatteringTables();
+        unsigned GetScatteringOrders() const { return scatteringOrders; }
+        // The number of scattering orders in use so far, and the time each took to compute.
+        unsigned GetScatteringProgress(std::vector<double>& orderSeconds);
     };
 }
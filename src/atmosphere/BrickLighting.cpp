@@ -0,0 +1,305 @@
+#include "BrickLighting.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include <thread>
+
+namespace Mulen::Atmosphere {
+
+    namespace {
+        const double Sqrt3 = 1.7320508075688772;
+
+        bool IntersectSphere(const glm::dvec3& ori, const glm::dvec3& dir, double radius, double& t0, double& t1)
+        {
+            const auto tca = glm::dot(-ori, dir);
+            const auto d2 = glm::dot(ori, ori) - tca * tca;
+            if (d2 > radius * radius) return false;
+            const auto thc = std::sqrt(radius * radius - d2);
+            t0 = tca - thc;
+            t1 = tca + thc;
+            return true;
+        }
+
+        void AabbIntersection(double& tmin, double& tmax, const glm::dvec3& bmin, const glm::dvec3& bmax, const glm::dvec3& o, const glm::dvec3& d)
+        {
+            const auto dinv = 1.0 / d;
+            const auto t0 = (bmin - o) * dinv, t1 = (bmax - o) * dinv;
+            const auto tmin3 = glm::min(t0, t1), tmax3 = glm::max(t0, t1);
+            tmin = glm::max(tmin3.x, glm::max(tmin3.y, tmin3.z));
+            tmax = glm::min(tmax3.x, glm::min(tmax3.y, tmax3.z));
+        }
+
+        glm::dvec3 Perpendicular(const glm::dvec3& v) // (as perpendicular in lighting.glsl)
+        {
+            const auto a = glm::cross(glm::dvec3(1, 0, 0), v), b = glm::cross(glm::dvec3(0, 1, 0), v);
+            return glm::normalize(glm::dot(a, a) > 1e-5 ? a : b);
+        }
+
+        glm::dvec3 ChildOffset(NodeIndex ci) { return glm::dvec3(glm::uvec3(ci, ci >> 1u, ci >> 2u) & 1u) * 2.0 - 1.0; }
+
+        // As OctreeTraversalData and OctreeDescend in common.glsl.
+        struct Traversal
+        {
+            glm::dvec3 p, center;
+            double size;
+            NodeIndex ni, gi, flags;
+        };
+        void Descend(const BrickStore& store, Traversal& o)
+        {
+            o.ni = GpuInvalidIndex;
+            o.gi = store.rootGroupIndex;
+            o.center = glm::dvec3(0.0);
+            o.size = 1.0;
+            o.flags = 0u;
+            while (GpuInvalidIndex != o.gi && o.gi < store.groups.size())
+            {
+                const auto ioffs = glm::clamp(glm::ivec3(glm::floor(o.p - o.center + 1.0)), glm::ivec3(0), glm::ivec3(1));
+                const auto child = NodeIndex(ioffs.x + ioffs.y * 2 + ioffs.z * 4);
+                o.ni = Octree::GroupAndChildToNode(o.gi, child);
+                o.size *= 0.5;
+                o.center += (glm::dvec3(ioffs) * 2.0 - 1.0) * o.size;
+                const auto children = store.groups[o.gi].nodes[child].children;
+                o.flags = children & ~GpuIndexMask;
+                o.gi = children & GpuIndexMask;
+            }
+        }
+
+        // Runs f(i, stats) for i in [0, num), spread over threads, and sums their stats.
+        template<typename F> void ParallelFor(size_t num, unsigned numThreads, BrickLighting::Stats& stats, F f)
+        {
+            numThreads = numThreads ? numThreads : std::thread::hardware_concurrency();
+            numThreads = static_cast<unsigned>(glm::clamp(size_t(numThreads), size_t(1u), glm::max(num, size_t(1u))));
+            std::atomic<size_t> next{ 0u };
+            std::mutex statsMutex;
+            auto work = [&]()
+            {
+                BrickLighting::Stats local;
+                for (auto i = next++; i < num; i = next++) f(i, local);
+                std::lock_guard<std::mutex> lock{ statsMutex };
+                stats.voxels += local.voxels;
+                stats.mapTexels += local.mapTexels;
+                stats.steps += local.steps;
+                stats.fullTraces += local.fullTraces;
+            };
+            std::vector<std::thread> threads;
+            for (unsigned i = 1u; i < numThreads; ++i) threads.emplace_back(work);
+            work();
+            for (auto& thread : threads) thread.join();
+        }
+    }
+
+    void BrickLighting::BuildSweepSlabs(std::vector<SweepGroup>& sweepGroups, unsigned maxSlabs, std::vector<std::pair<size_t, size_t>>& slabs)
+    {
+        slabs.clear();
+        if (sweepGroups.empty()) return;
+        std::sort(sweepGroups.begin(), sweepGroups.end(), [](const SweepGroup& a, const SweepGroup& b) { return a.key > b.key; });
+        const auto minThickness = (sweepGroups.front().key - sweepGroups.back().key) / double(glm::max(1u, maxSlabs));
+        for (size_t first = 0u; first < sweepGroups.size();)
+        {
+            const auto top = sweepGroups[first].key;
+            auto minHalfSize = sweepGroups[first].halfSize;
+            auto end = first + 1u;
+            for (; end < sweepGroups.size(); ++end)
+            {
+                const auto halfSize = glm::min(minHalfSize, sweepGroups[end].halfSize);
+                if (top - sweepGroups[end].key > glm::max(halfSize, minThickness)) break;
+                minHalfSize = halfSize;
+            }
+            slabs.push_back({ first, end - first });
+            first = end;
+        }
+    }
+
+    BrickLighting::BrickLighting(const BrickStore& store)
+        : store{ store }
+    {
+        const auto& p = store.params;
+        atmScale = p.planetRadius * p.scale;
+        atmosphereRadius = (p.planetRadius + p.height) / atmScale;
+        planetRadius = p.planetRadius / atmScale;
+        lightDir = glm::normalize(store.view.lightDir);
+        mapX = Perpendicular(lightDir);
+        mapY = glm::cross(lightDir, mapX);
+
+        if (store.rootGroupIndex >= store.groups.size()) return;
+        groupOrder.assign(store.groups.size(), ~0u);
+        std::vector<Group> stack{ { store.rootGroupIndex, glm::dvec3(0.0), 1.0 } };
+        while (!stack.empty())
+        {
+            const auto group = stack.back();
+            stack.pop_back();
+            groupOrder[group.index] = static_cast<uint32_t>(groups.size());
+            groups.push_back(group);
+            for (NodeIndex ci = 0u; ci < NodeArity; ++ci)
+            {
+                const auto children = store.groups[group.index].nodes[ci].children & GpuIndexMask;
+                if (GpuInvalidIndex == children || children >= store.groups.size()) continue;
+                const auto halfSize = group.halfSize * 0.5;
+                stack.push_back({ children, group.center + ChildOffset(ci) * halfSize, halfSize });
+            }
+        }
+    }
+
+    double BrickLighting::Trace(const glm::dvec3& ori, double dist, double maxDist, const Settings& settings, uint64_t& steps) const
+    {
+        // (as TraceTransmittance in lighting.glsl, in octree space, but with a hard planet shadow)
+        const auto& p = store.params;
+        const auto threshold = -std::log(1e-2) / p.betaMEx;
+        double t0, t1;
+        if (IntersectSphere(ori, lightDir, planetRadius, t0, t1) && t1 > dist) return 0.0;
+        if (!IntersectSphere(ori, lightDir, atmosphereRadius, t0, t1)) return 1.0;
+        maxDist = glm::min(maxDist, t1);
+
+        double opticalDepthM = 0.0, prevDensityM = 0.0;
+        while (dist < maxDist && opticalDepthM <= threshold)
+        {
+            Traversal o;
+            o.p = ori + dist * lightDir;
+            if (glm::any(glm::greaterThanEqual(glm::abs(o.p), glm::dvec3(1.0)))) break; // (left the octree)
+            Descend(store, o);
+            if (GpuInvalidIndex == o.ni) break;
+            const auto step = o.size * settings.stepFactor;
+            double tmin, tmax;
+            AabbIntersection(tmin, tmax, o.center - o.size, o.center + o.size, ori, lightDir);
+            tmax = glm::min(tmax, maxDist);
+            if (o.flags & EmptyBrickBit)
+            {
+                dist = glm::max(dist, tmax) + step;
+                continue;
+            }
+            do
+            {
+                const auto lc = glm::vec3((ori + dist * lightDir - o.center) / o.size);
+                const auto densityM = store.Sample(o.ni, lc).x * BrickStore::MieMul;
+                opticalDepthM += (prevDensityM + densityM) * 0.5 * step * atmScale;
+                prevDensityM = densityM;
+                dist += step;
+                ++steps;
+            } while (dist < tmax);
+        }
+        if (opticalDepthM > threshold) return 0.0;
+        return std::exp(-opticalDepthM * p.betaMEx);
+    }
+
+    glm::dvec3 BrickLighting::GetVoxelPosition(const Group& group, NodeIndex ci, unsigned voxel, double& voxelSize) const
+    {
+        const auto nodeHalfSize = group.halfSize * 0.5;
+        const auto nodeCenter = group.center + ChildOffset(ci) * nodeHalfSize;
+        const glm::uvec3 v{ voxel % BrickRes, (voxel / BrickRes) % BrickRes, voxel / BrickRes2 };
+        voxelSize = 2.0 * nodeHalfSize / double(BrickRes - 1u);
+        return nodeCenter + nodeHalfSize * (glm::dvec3(v) / double(BrickRes - 1u) * 2.0 - 1.0);
+    }
+
+    void BrickLighting::TraceVoxels(const Settings& settings, Light& light, Stats& stats) const
+    {
+        stats = {};
+        light.assign(groups.size() * NodeArity * BrickRes3, 1.0f);
+        const auto start = std::chrono::steady_clock::now();
+        ParallelFor(groups.size(), settings.numThreads, stats, [&](size_t gi, Stats& local)
+        {
+            for (NodeIndex ci = 0u; ci < NodeArity; ++ci)
+            for (unsigned v = 0u; v < BrickRes3; ++v)
+            {
+                double voxelSize;
+                const auto p = GetVoxelPosition(groups[gi], ci, v, voxelSize);
+                const auto dist = std::sqrt(2.0) * voxelSize; // (as update_lighting.glsl, to avoid self-shadowing)
+                light[(gi * NodeArity + ci) * BrickRes3 + v] = float(Trace(p, dist, 1e30, settings, local.steps));
+                ++local.voxels;
+            }
+        });
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    float BrickLighting::SampleMap(const Maps& maps, uint32_t group, const glm::dvec3& p) const
+    {
+        const auto& g = groups[group];
+        const auto local = (p - g.center) / (Sqrt3 * g.halfSize);
+        const auto tc = glm::clamp(glm::dvec2(glm::dot(local, mapX), glm::dot(local, mapY)) * 0.5 + 0.5, 0.0, 1.0) * double(MapRes - 1u);
+        const auto i0 = glm::min(glm::uvec2(tc), glm::uvec2(MapRes - 2u));
+        const auto f = tc - glm::dvec2(i0);
+        const auto* map = &maps[size_t(group) * MapRes * MapRes];
+        auto texel = [&](unsigned x, unsigned y) { return double(map[x + y * MapRes]); };
+        return float(glm::mix(
+            glm::mix(texel(i0.x, i0.y), texel(i0.x + 1u, i0.y), f.x),
+            glm::mix(texel(i0.x, i0.y + 1u), texel(i0.x + 1u, i0.y + 1u), f.x), f.y));
+    }
+
+    void BrickLighting::Sweep(const Settings& settings, Light& light, Stats& stats) const
+    {
+        stats = {};
+        light.assign(groups.size() * NodeArity * BrickRes3, 1.0f);
+        const auto start = std::chrono::steady_clock::now();
+
+        std::vector<SweepGroup> sweepGroups;
+        sweepGroups.reserve(groups.size());
+        std::vector<double> keys(groups.size());
+        for (size_t gi = 0u; gi < groups.size(); ++gi)
+        {
+            keys[gi] = GetSweepKey(groups[gi].center, groups[gi].halfSize, lightDir);
+            sweepGroups.push_back({ NodeIndex(gi), keys[gi], groups[gi].halfSize });
+        }
+        std::vector<std::pair<size_t, size_t>> slabs;
+        BuildSweepSlabs(sweepGroups, settings.maxSlabs, slabs);
+        stats.slabs = slabs.size();
+
+        // Boundary maps, front to back: each texel continues from the map of the group upstream of it,
+        // if that's in an earlier slab (as update_light_group.glsl tells by its key), else it's traced all the way.
+        Maps maps(groups.size() * MapRes * MapRes, 1.0f);
+        for (const auto& slab : slabs)
+        {
+            const auto slabTopKey = sweepGroups[slab.first].key;
+            ParallelFor(slab.second, settings.numThreads, stats, [&](size_t i, Stats& local)
+            {
+                const auto gi = sweepGroups[slab.first + i].index;
+                const auto& g = groups[gi];
+                auto* map = &maps[size_t(gi) * MapRes * MapRes];
+                for (unsigned y = 0u; y < MapRes; ++y)
+                for (unsigned x = 0u; x < MapRes; ++x)
+                {
+                    const auto s = (glm::dvec2(x, y) / double(MapRes - 1u) * 2.0 - 1.0) * Sqrt3 * g.halfSize;
+                    const auto q = g.center + s.x * mapX + s.y * mapY + SweepPlaneDistance * g.halfSize * lightDir;
+                    ++local.mapTexels;
+
+                    Traversal o;
+                    o.p = q;
+                    auto upstream = ~0u;
+                    if (glm::all(glm::lessThan(glm::abs(q), glm::dvec3(1.0))))
+                    {
+                        Descend(store, o);
+                        if (GpuInvalidIndex != o.ni) upstream = groupOrder[Octree::NodeToGroup(o.ni)];
+                    }
+                    if (~0u != upstream && upstream != gi && keys[upstream] > slabTopKey)
+                    {
+                        const auto maxDist = keys[upstream] - glm::dot(q, lightDir);
+                        map[x + y * MapRes] = float(Trace(q, 0.0, maxDist, settings, local.steps)) * SampleMap(maps, upstream, q);
+                    }
+                    else
+                    {
+                        map[x + y * MapRes] = float(Trace(q, 0.0, 1e30, settings, local.steps));
+                        ++local.fullTraces;
+                    }
+                }
+            });
+        }
+
+        // Then voxels, traced only to their group's map plane (as update_lighting.glsl with per-group lighting).
+        ParallelFor(groups.size(), settings.numThreads, stats, [&](size_t gi, Stats& local)
+        {
+            for (NodeIndex ci = 0u; ci < NodeArity; ++ci)
+            for (unsigned v = 0u; v < BrickRes3; ++v)
+            {
+                double voxelSize;
+                const auto p = GetVoxelPosition(groups[gi], ci, v, voxelSize);
+                const auto dist = std::sqrt(2.0) * voxelSize;
+                const auto maxDist = keys[gi] - glm::dot(p, lightDir);
+                auto transmittance = float(Trace(p, dist, maxDist, settings, local.steps));
+                if (transmittance > 0.0f) transmittance *= SampleMap(maps, uint32_t(gi), p);
+                light[(gi * NodeArity + ci) * BrickRes3 + v] = transmittance;
+                ++local.voxels;
+            }
+        });
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+}
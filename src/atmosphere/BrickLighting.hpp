@@ -0,0 +1,76 @@
+#pragma once
+#include "BrickStore.hpp"
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace Mulen::Atmosphere {
+
+    // CPU lighting (transmittance towards the light) of the voxels of a BrickStore, by two of the Light stage's algorithms:
+    // a shadow ray per voxel (as update_lighting.glsl with shadow rays, without the per-group maps), and the light-space
+    // sweep (as update_light_group.glsl in sweep mode), where groups are taken front to back along the light direction,
+    // slab by slab, and each group's boundary map is continued from the maps of the groups upstream of it.
+    // It's a reference to validate the sweep against the per-voxel tracer on captured states; it's free of GPU calls.
+    class BrickLighting
+    {
+    public:
+        struct Settings
+        {
+            unsigned numThreads = 0u;   // (zero for one per hardware thread)
+            double stepFactor = 0.4;    // step length relative to node size (as in update_lighting.glsl)
+            unsigned maxSlabs = 256u;
+        };
+        struct Stats
+        {
+            uint64_t voxels = 0u, mapTexels = 0u, steps = 0u;
+            uint64_t fullTraces = 0u; // map texels traced all the way (with nothing swept upstream of them yet)
+            size_t slabs = 0u;
+            double seconds = 0.0;
+        };
+        typedef std::vector<float> Light; // per voxel, in BrickRes3 blocks per node, by group in the order of GetGroups()
+
+        // Groups are swept in order of the light-space depth of their boundary map planes (nearest the light first),
+        // in slabs of groups whose maps are computed together. The map plane of a group is at SweepPlaneDistance times
+        // its half-size from its centre towards the light, as groupLightMat in Updater::LightBricks places it.
+        static constexpr double SweepPlaneDistance = 1.2679491924311228; // 3 - sqrt(3)
+        struct SweepGroup
+        {
+            NodeIndex index; // (of the caller's choosing)
+            double key, halfSize;
+        };
+        static double GetSweepKey(const glm::dvec3& center, double halfSize, const glm::dvec3& lightDir)
+        {
+            return glm::dot(center, lightDir) + SweepPlaneDistance * halfSize;
+        }
+        // Sorts the groups by key, descending, and splits them into slabs (offset and count) no thicker than the
+        // smallest group in them, or than the whole key range over maxSlabs if that's thicker.
+        static void BuildSweepSlabs(std::vector<SweepGroup>&, unsigned maxSlabs, std::vector<std::pair<size_t, size_t>>& slabs);
+
+        explicit BrickLighting(const BrickStore&);
+
+        struct Group
+        {
+            NodeIndex index;
+            glm::dvec3 center;
+            double halfSize;
+        };
+        const std::vector<Group>& GetGroups() const { return groups; }
+
+        void TraceVoxels(const Settings&, Light&, Stats&) const;
+        void Sweep(const Settings&, Light&, Stats&) const;
+
+    private:
+        const BrickStore& store;
+        glm::dvec3 lightDir, mapX, mapY; // (the map axes across the light direction)
+        double atmScale, atmosphereRadius, planetRadius; // (the radii in octree space)
+        std::vector<Group> groups;
+        std::vector<uint32_t> groupOrder; // store group index -> index into groups
+
+        double Trace(const glm::dvec3& ori, double dist, double maxDist, const Settings&, uint64_t& steps) const;
+        glm::dvec3 GetVoxelPosition(const Group&, NodeIndex ci, unsigned voxel, double& voxelSize) const;
+
+        static constexpr unsigned MapRes = BrickRes * 2u; // (as LightPerGroupRes)
+        typedef std::vector<float> Maps; // MapRes * MapRes per group, in the order of groups
+        float SampleMap(const Maps&, uint32_t group, const glm::dvec3& p) const;
+    };
+}
@@ -0,0 +1,170 @@
+#include "BrickPages.hpp"
+#include <sstream>
+#include <algorithm>
+
+namespace Mulen::Atmosphere {
+
+    bool BrickPageTable::Init(size_t numBricks, size_t bricksPerPage, bool identity, unsigned latency)
+    {
+        if (!bricksPerPage) return false;
+        this->bricksPerPage = bricksPerPage;
+        this->identity = identity;
+        this->latency = latency;
+        const auto numPages = (numBricks + bricksPerPage - 1u) / bricksPerPage;
+        table.assign(numPages, NoPage);
+        lastUsed.assign(numPages, 0u);
+        retiredAt.assign(numPages, NotRetired);
+        freePhysical = {};
+        committed.clear();
+        decommitted.clear();
+        numResident = physicalCount = 0u;
+        pass = 0u;
+        tableChanged = true;
+        inUsage = false;
+        return true;
+    }
+
+    void BrickPageTable::BeginUsage()
+    {
+        ++pass;
+        inUsage = true;
+    }
+
+    void BrickPageTable::UseBricks(size_t firstBrick, size_t count)
+    {
+        if (!inUsage || !count) return;
+        const auto firstPage = firstBrick / bricksPerPage;
+        const auto lastPage = std::min((firstBrick + count - 1u) / bricksPerPage, table.size() - 1u);
+        for (auto page = firstPage; page <= lastPage; ++page)
+        {
+            lastUsed[page] = pass;
+        }
+    }
+
+    BrickPageTable::PageIndex BrickPageTable::AllocatePhysical(PageIndex virtualPage)
+    {
+        PageIndex physical = virtualPage;
+        if (!identity)
+        {
+            if (freePhysical.empty())
+            {
+                physical = static_cast<PageIndex>(physicalCount);
+            }
+            else
+            {
+                physical = freePhysical.top();
+                freePhysical.pop();
+            }
+        }
+        physicalCount = std::max(physicalCount, static_cast<size_t>(physical) + 1u);
+        return physical;
+    }
+
+    void BrickPageTable::EndUsage()
+    {
+        if (!inUsage) return;
+        inUsage = false;
+
+        for (PageIndex page = 0u; page < table.size(); ++page)
+        {
+            auto& physical = table[page];
+            if (lastUsed[page] == pass)
+            {
+                retiredAt[page] = NotRetired;
+                if (NoPage != physical) continue;
+                physical = AllocatePhysical(page);
+                committed.push_back(physical);
+                ++numResident;
+                tableChanged = true;
+                continue;
+            }
+
+            if (NoPage == physical) continue;
+            if (NotRetired == retiredAt[page])
+            {
+                retiredAt[page] = pass;
+            }
+            if (pass - retiredAt[page] < latency) continue;
+
+            // Unused for long enough that no GPU state can still refer to it.
+            decommitted.push_back(physical);
+            if (!identity) freePhysical.push(physical);
+            physical = NoPage;
+            retiredAt[page] = NotRetired;
+            --numResident;
+            tableChanged = true;
+        }
+    }
+
+    std::vector<BrickPageTable::PageIndex> BrickPageTable::TakeCommitted()
+    {
+        std::vector<PageIndex> pages;
+        pages.swap(committed);
+        return pages;
+    }
+
+    std::vector<BrickPageTable::PageIndex> BrickPageTable::TakeDecommitted()
+    {
+        std::vector<PageIndex> pages;
+        pages.swap(decommitted);
+        return pages;
+    }
+
+    bool BrickPageTable::TakeTableChanged()
+    {
+        const auto changed = tableChanged;
+        tableChanged = false;
+        return changed;
+    }
+
+    BrickPageTable::PageIndex BrickPageTable::GetPhysicalPage(size_t brickIndex) const
+    {
+        const auto page = brickIndex / bricksPerPage;
+        return page < table.size() ? table[page] : NoPage;
+    }
+
+    bool BrickPageTable::Validate(std::string* error) const
+    {
+        auto fail = [&](const std::string& message)
+        {
+            if (error) *error = message;
+            return false;
+        };
+
+        std::vector<bool> physicalUsed(physicalCount, false);
+        size_t resident = 0u;
+        for (PageIndex page = 0u; page < table.size(); ++page)
+        {
+            const auto physical = table[page];
+            if (NoPage == physical) continue;
+            ++resident;
+            if (physical >= physicalCount) return fail("physical page beyond the page count");
+            if (identity && physical != page) return fail("non-identity mapping in identity mode");
+            if (physicalUsed[physical])
+            {
+                std::ostringstream ss;
+                ss << "physical page " << physical << " mapped more than once";
+                return fail(ss.str());
+            }
+            physicalUsed[physical] = true;
+        }
+        if (resident != numResident) return fail("resident page count mismatch");
+
+        if (!identity)
+        {
+            auto free = freePhysical;
+            size_t numFree = 0u;
+            while (!free.empty())
+            {
+                const auto physical = free.top();
+                free.pop();
+                if (physical >= physicalCount) return fail("free physical page beyond the page count");
+                if (physicalUsed[physical]) return fail("physical page both free and mapped");
+                physicalUsed[physical] = true;
+                ++numFree;
+            }
+            if (numFree + resident != physicalCount) return fail("physical pages leaked");
+        }
+        return true;
+    }
+}
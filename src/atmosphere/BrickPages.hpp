@@ -0,0 +1,62 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <queue>
+#include <string>
+#include <functional>
+
+namespace Mulen::Atmosphere {
+
+    // Maps pages of (virtual) brick indices to physical pages of the brick textures,
+    // so that only pages holding bricks of node groups in use need to be resident.
+    // This is kept free of GPU calls; the atmosphere applies the resulting commitments and table to its textures.
+    class BrickPageTable
+    {
+    public:
+        typedef uint32_t PageIndex;
+        static constexpr PageIndex NoPage = 0xffffffffu;
+
+        // With identity mapping (sparse textures) each virtual page has its own physical page,
+        // otherwise physical pages are pooled and handed out lowest first (to keep the pool compact).
+        // Pages which fall out of use are only released after `latency` further usage passes,
+        // since older GPU states may still be reading them.
+        bool Init(size_t numBricks, size_t bricksPerPage, bool identity, unsigned latency);
+
+        // Usage passes: mark all bricks in use between Begin and End.
+        void BeginUsage();
+        void UseBricks(size_t firstBrick, size_t count);
+        void EndUsage();
+
+        // Physical pages to make resident and to release, respectively, since the last call.
+        std::vector<PageIndex> TakeCommitted();
+        std::vector<PageIndex> TakeDecommitted();
+        bool TakeTableChanged(); // has the virtual-to-physical table changed since the last call?
+
+        const std::vector<PageIndex>& GetTable() const { return table; }
+        PageIndex GetPhysicalPage(size_t brickIndex) const;
+        size_t GetBricksPerPage() const { return bricksPerPage; }
+        size_t GetNumVirtualPages() const { return table.size(); }
+        size_t GetNumResidentPages() const { return numResident; }
+        size_t GetPhysicalPageCount() const { return physicalCount; } // highest physical page in use so far, plus one
+        bool IsIdentity() const { return identity; }
+
+        // Consistency check of the internal state (for testing and debugging).
+        bool Validate(std::string* error = nullptr) const;
+
+    private:
+        static constexpr uint32_t NotRetired = 0xffffffffu;
+
+        std::vector<PageIndex> table;       // virtual -> physical
+        std::vector<uint32_t> lastUsed;     // usage pass in which each virtual page was last used
+        std::vector<uint32_t> retiredAt;    // usage pass in which each resident page fell out of use
+        std::priority_queue<PageIndex, std::vector<PageIndex>, std::greater<PageIndex>> freePhysical;
+        std::vector<PageIndex> committed, decommitted;
+        size_t bricksPerPage = 1u, numResident = 0u, physicalCount = 0u;
+        uint32_t pass = 0u;
+        unsigned latency = 0u;
+        bool identity = false, tableChanged = false, inUsage = false;
+
+        PageIndex AllocatePhysical(PageIndex virtualPage);
+    };
+}
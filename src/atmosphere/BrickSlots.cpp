@@ -0,0 +1,162 @@
+#include "BrickSlots.hpp"
+#include <sstream>
+
+namespace Mulen::Atmosphere {
+
+    bool BrickSlots::Init(size_t numBricks, size_t numOverflowSlots, unsigned numStates)
+    {
+        if (!numStates) return false;
+        this->numBricks = numBricks;
+        maps.assign(numStates, std::vector<Slot>(numBricks, NoSlot));
+        refs.assign(numBricks + numOverflowSlots, 0u);
+        freeOverflow = {};
+        for (auto slot = numBricks; slot < refs.size(); ++slot)
+        {
+            freeOverflow.push(static_cast<Slot>(slot));
+        }
+        numOverflowUsed = 0u;
+        current = source = 0u;
+        return true;
+    }
+
+    void BrickSlots::Reference(Slot slot)
+    {
+        if (!refs[slot]++ && slot >= numBricks) ++numOverflowUsed;
+    }
+
+    void BrickSlots::Release(Slot slot)
+    {
+        if (NoSlot == slot || !refs[slot]) return;
+        if (--refs[slot] || slot < numBricks) return;
+        --numOverflowUsed;
+        freeOverflow.push(slot);
+    }
+
+    BrickSlots::Slot BrickSlots::Allocate(size_t brick)
+    {
+        if (!refs[brick]) return static_cast<Slot>(brick); // the brick's own slot is free
+        while (!freeOverflow.empty())
+        {
+            const auto slot = freeOverflow.top();
+            freeOverflow.pop();
+            if (!refs[slot]) return slot;
+        }
+        return NoSlot;
+    }
+
+    void BrickSlots::Unallocate()
+    {
+        for (auto slot : allocated)
+        {
+            if (NoSlot != slot && slot >= numBricks) freeOverflow.push(slot); // (own slots need no returning)
+        }
+        allocated.assign(allocated.size(), NoSlot);
+    }
+
+    void BrickSlots::BeginState(unsigned state, unsigned from)
+    {
+        current = state;
+        source = from;
+        auto& map = maps[state];
+        for (auto& slot : map)
+        {
+            Release(slot);
+            slot = NoSlot;
+        }
+    }
+
+    bool BrickSlots::Use(const size_t* bricks, size_t num, bool dirty)
+    {
+        // Slots are allocated for all the bricks first (allocation only takes slots nobody references, so they're all
+        // different), and only referenced once they all have one.
+        auto& map = maps[current];
+        allocated.assign(num, NoSlot);
+        bool enough = true;
+        for (size_t i = 0u; i < num && enough; ++i)
+        {
+            const auto brick = bricks[i];
+            if (brick >= numBricks || NoSlot != map[brick]) continue; // (already mapped in this pass)
+            const auto shared = current != source ? maps[source][brick] : NoSlot;
+            if (!dirty && NoSlot != shared) continue;
+            allocated[i] = Allocate(brick);
+            enough = NoSlot != allocated[i];
+        }
+        if (!enough) Unallocate();
+
+        for (size_t i = 0u; i < num; ++i)
+        {
+            const auto brick = bricks[i];
+            if (brick >= numBricks || NoSlot != map[brick]) continue;
+            auto slot = allocated[i];
+            if (NoSlot == slot)
+            {
+                // Sharing (which for a dirty brick means stale data), or if the source lacks the brick, its own slot,
+                // holding what an earlier state left there.
+                slot = current != source ? maps[source][brick] : NoSlot;
+                if (NoSlot == slot) slot = static_cast<Slot>(brick);
+            }
+            map[brick] = slot;
+            Reference(slot);
+        }
+        return enough;
+    }
+
+    bool BrickSlots::Reassign(unsigned state, const size_t* bricks, size_t num)
+    {
+        auto& map = maps[state];
+        allocated.assign(num, NoSlot);
+        for (size_t i = 0u; i < num; ++i)
+        {
+            const auto brick = bricks[i];
+            if (brick >= numBricks) continue;
+            if (NoSlot != map[brick] && 1u == refs[map[brick]]) continue; // already its own
+            allocated[i] = Allocate(brick);
+            if (NoSlot != allocated[i]) continue;
+            Unallocate();
+            return false;
+        }
+        for (size_t i = 0u; i < num; ++i)
+        {
+            if (NoSlot == allocated[i]) continue;
+            auto& slot = map[bricks[i]];
+            Release(slot);
+            slot = allocated[i];
+            Reference(slot);
+        }
+        return true;
+    }
+
+    bool BrickSlots::Validate(std::string* error) const
+    {
+        auto fail = [&](const std::string& message)
+        {
+            if (error) *error = message;
+            return false;
+        };
+
+        std::vector<unsigned> counted(refs.size(), 0u);
+        for (auto& map : maps)
+        {
+            for (auto slot : map)
+            {
+                if (NoSlot == slot) continue;
+                if (slot >= refs.size()) return fail("slot out of range");
+                ++counted[slot];
+            }
+        }
+        size_t overflowUsed = 0u;
+        for (size_t slot = 0u; slot < refs.size(); ++slot)
+        {
+            if (counted[slot] != refs[slot])
+            {
+                std::ostringstream ss;
+                ss << "slot " << slot << " has " << unsigned(refs[slot]) << " references but " << counted[slot] << " users";
+                return fail(ss.str());
+            }
+            if (slot >= numBricks && refs[slot]) ++overflowUsed;
+        }
+        if (overflowUsed != numOverflowUsed) return fail("overflow slot count mismatch");
+        if (freeOverflow.size() + numOverflowUsed != refs.size() - numBricks) return fail("free overflow slot count mismatch");
+        return true;
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <queue>
+#include <string>
+#include <functional>
+
+namespace Mulen::Atmosphere {
+
+    // Copy-on-write brick storage: each GPU state maps bricks to slots of one shared brick store,
+    // with states sharing the slots of bricks which haven't changed between them.
+    // Brick b preferably uses slot b; bricks which need another slot while that's taken get one past the bricks.
+    // This is kept free of GPU calls; the atmosphere uploads the per-state maps.
+    class BrickSlots
+    {
+    public:
+        typedef uint32_t Slot;
+        static constexpr Slot NoSlot = 0xffffffffu;
+
+        bool Init(size_t numBricks, size_t numOverflowSlots, unsigned numStates);
+
+        // Starts over the state's map as a copy-to-be of another state's, releasing the slots it referenced before.
+        void BeginState(unsigned state, unsigned from);
+        // Maps bricks (say, a node group's) in the state begun last: clean bricks share the slot they have in the source
+        // state, while dirty ones (or ones the source lacks) get a slot of their own. That's all or none of them: if there
+        // aren't enough slots, false is returned, and all share what they can (or keep their own slot's stale data),
+        // so the bricks must not be written into then.
+        bool Use(const size_t* bricks, size_t num, bool dirty);
+        // Gives bricks of an existing state slots of their own (e.g. to write data only that state should see),
+        // all or none of them (returning false, and leaving them as they were).
+        bool Reassign(unsigned state, const size_t* bricks, size_t num);
+
+        const std::vector<Slot>& GetMap(unsigned state) const { return maps[state]; }
+        size_t GetNumBricks() const { return numBricks; }
+        size_t GetNumSlots() const { return refs.size(); }
+        bool IsSlotUsed(Slot slot) const { return refs[slot] > 0u; }
+        // Is the brick kept in an overflow slot while its own is free? Regenerating it would then move it back,
+        // freeing the overflow slot (which would otherwise stay taken for as long as the brick doesn't change).
+        bool IsDisplaced(unsigned state, size_t brick) const { return maps[state][brick] >= numBricks && NoSlot != maps[state][brick] && !refs[brick]; }
+        size_t GetNumOverflowUsed() const { return numOverflowUsed; }
+        size_t GetNumFreeOverflow() const { return freeOverflow.size(); }
+
+        // Consistency check of the internal state (for testing and debugging).
+        bool Validate(std::string* error = nullptr) const;
+
+    private:
+        std::vector<std::vector<Slot>> maps; // per state, brick -> slot
+        std::vector<uint8_t> refs; // number of states referencing each slot
+        std::priority_queue<Slot, std::vector<Slot>, std::greater<Slot>> freeOverflow;
+        size_t numBricks = 0u, numOverflowUsed = 0u;
+        unsigned current = 0u, source = 0u;
+        std::vector<Slot> allocated; // (scratch space of Use and Reassign)
+
+        Slot Allocate(size_t brick); // (not yet referenced)
+        void Unallocate(); // returns the allocated slots unused
+        void Reference(Slot);
+        void Release(Slot);
+    };
+}
@@ -0,0 +1,240 @@
+#include "BrickStore.hpp"
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+
+namespace Mulen::Atmosphere {
+
+    namespace {
+        const char FileMagic[8] = { 'M', 'U', 'L', 'E', 'N', 'B', 'S', 0 };
+        const uint32_t FileVersion = 2u; // (2: node metadata)
+
+        template<typename T> void Write(std::ostream& os, const T& value)
+        {
+            os.write(reinterpret_cast<const char*>(&value), sizeof(T));
+        }
+        template<typename T> bool Read(std::istream& is, T& value)
+        {
+            return static_cast<bool>(is.read(reinterpret_cast<char*>(&value), sizeof(T)));
+        }
+    }
+
+    void BrickStore::Clear()
+    {
+        rootGroupIndex = InvalidIndex;
+        groups.clear();
+        brickSlots.clear();
+        bricks.clear();
+    }
+
+    BrickStore::VoxelBrick& BrickStore::AddBrick(NodeIndex brick)
+    {
+        if (brick >= brickSlots.size()) brickSlots.resize(brick + 1u, NoBrick);
+        auto& slot = brickSlots[brick];
+        if (NoBrick == slot)
+        {
+            slot = static_cast<uint32_t>(bricks.size());
+            bricks.emplace_back();
+        }
+        return bricks[slot];
+    }
+
+    glm::vec2 BrickStore::Sample(NodeIndex brick, glm::vec3 lc) const
+    {
+        const auto* b = GetBrick(brick);
+        if (!b) return glm::vec2(0.0f);
+
+        // Voxels are at brick corners, so the local coordinate range spans BrickRes - 1 voxel intervals.
+        const auto v = glm::clamp(lc * 0.5f + 0.5f, glm::vec3(0.0f), glm::vec3(1.0f)) * float(BrickRes - 1u);
+        const auto i0 = glm::min(glm::uvec3(v), glm::uvec3(BrickRes - 2u));
+        const auto f = v - glm::vec3(i0);
+        auto voxel = [&](unsigned x, unsigned y, unsigned z)
+        {
+            return b->voxels[x + y * BrickRes + z * BrickRes2];
+        };
+        glm::vec2 result{ 0.0f };
+        for (unsigned corner = 0u; corner < 8u; ++corner)
+        {
+            const glm::uvec3 o{ corner & 1u, (corner >> 1u) & 1u, (corner >> 2u) & 1u };
+            const auto w = glm::mix(1.0f - f, f, glm::vec3(o));
+            result += w.x * w.y * w.z * voxel(i0.x + o.x, i0.y + o.y, i0.z + o.z);
+        }
+        return result;
+    }
+
+    void BrickStore::BuildNodeMeta()
+    {
+        if (rootGroupIndex >= groups.size()) return;
+        struct Location
+        {
+            glm::dvec3 center;
+            double size; // (half the extent)
+            unsigned depth;
+        };
+        const auto octreeScale = params.planetRadius * params.scale;
+
+        // Flags and density range of each node, from its brick.
+        std::vector<std::pair<NodeIndex, Location>> emptyLeaves;
+        std::vector<std::pair<NodeIndex, Location>> stack{ { rootGroupIndex, { glm::dvec3(0.0), 1.0, 0u - 1u } } };
+        while (!stack.empty())
+        {
+            const auto [gi, group] = stack.back();
+            stack.pop_back();
+            for (NodeIndex ci = 0u; ci < NodeArity; ++ci)
+            {
+                const auto ni = Octree::GroupAndChildToNode(gi, ci);
+                Location location{ glm::dvec3(0.0), group.size * 0.5, group.depth + 1u };
+                location.center = group.center + (glm::dvec3(ci & 1u, (ci >> 1u) & 1u, (ci >> 2u) & 1u) * 2.0 - 1.0) * location.size;
+
+                float minDensity = 0.0f, maxDensity = 0.0f;
+                if (const auto* brick = GetBrick(ni))
+                {
+                    minDensity = maxDensity = brick->voxels[0].x;
+                    for (const auto& voxel : brick->voxels)
+                    {
+                        minDensity = glm::min(minDensity, voxel.x);
+                        maxDensity = glm::max(maxDensity, voxel.x);
+                    }
+                }
+                const auto isEmpty = 0.0f == minDensity && 0.0f == maxDensity;
+                const auto voxelSize = 2.0 / double(BrickRes - 1u) * location.size * octreeScale;
+                const auto isOpaque = minDensity * MieMul * params.betaMEx * voxelSize >= NodeMeta::OpaqueOpticalDepth;
+
+                auto& node = groups[gi].nodes[ci];
+                const auto children = node.children & GpuIndexMask;
+                node.children = children | (isEmpty ? EmptyBrickBit : 0u);
+                node.meta = NodeMeta::Encode(minDensity, maxDensity, isOpaque);
+                if (GpuInvalidIndex != children && children < groups.size()) stack.push_back({ children, location });
+                else if (isEmpty) emptyLeaves.push_back({ ni, location });
+            }
+        }
+
+        // Is the node-sized cube around p (at the depth) wholly covered by empty leaves? (as IsEmptyAt on the GPU)
+        auto isEmptyAt = [&](const glm::dvec3& p, unsigned depth)
+        {
+            if (glm::any(glm::greaterThanEqual(glm::abs(p), glm::dvec3(1.0)))) return true;
+            glm::dvec3 center{ 0.0 };
+            double size = 1.0;
+            NodeIndex gi = rootGroupIndex, children = GpuInvalidIndex;
+            for (unsigned d = 0u; ; ++d)
+            {
+                const auto ioffs = glm::clamp(glm::ivec3(glm::floor(p - center + 1.0)), glm::ivec3(0), glm::ivec3(1));
+                const auto ci = NodeIndex(ioffs.x + ioffs.y * 2 + ioffs.z * 4);
+                size *= 0.5;
+                center += (glm::dvec3(ioffs) * 2.0 - 1.0) * size;
+                children = groups[gi].nodes[ci].children;
+                gi = children & GpuIndexMask;
+                if (GpuInvalidIndex == gi || gi >= groups.size()) return 0u != (children & EmptyBrickBit);
+                if (d >= depth) return false; // (subdivided further)
+            }
+        };
+        for (const auto& [ni, location] : emptyLeaves)
+        {
+            uint32_t distance = 0u;
+            bool empty = true;
+            for (int k = 1; k <= int(NodeMeta::MaxEmptyDistance) && empty; ++k)
+            {
+                for (int z = -k; z <= k && empty; ++z)
+                for (int y = -k; y <= k && empty; ++y)
+                {
+                    const int xStep = std::abs(y) == k || std::abs(z) == k ? 1 : 2 * k;
+                    for (int x = -k; x <= k && empty; x += xStep)
+                    {
+                        empty = isEmptyAt(location.center + glm::dvec3(x, y, z) * (2.0 * location.size), location.depth);
+                    }
+                }
+                if (empty) distance = uint32_t(k);
+            }
+            auto& meta = groups[Octree::NodeToGroup(ni)].nodes[ni % NodeArity].meta;
+            meta = NodeMeta::SetEmptyDistance(meta, distance);
+        }
+    }
+
+    bool BrickStore::Save(const std::string& path) const
+    {
+        std::ofstream file{ path, std::ios::binary };
+        if (!file.is_open())
+        {
+            std::cerr << "Could not open brick store file " << path << " for writing.\n";
+            return false;
+        }
+        file.write(FileMagic, sizeof(FileMagic));
+        Write(file, FileVersion);
+        Write(file, params);
+        Write(file, view);
+        Write(file, rootGroupIndex);
+
+        // Only the groups in use are stored, with their indices (which the node data refers to).
+        std::vector<NodeIndex> used;
+        ForEachGroup([&](NodeIndex gi) { used.push_back(gi); });
+        Write(file, static_cast<uint32_t>(groups.size()));
+        Write(file, static_cast<uint32_t>(used.size()));
+        for (auto gi : used)
+        {
+            Write(file, gi);
+            Write(file, groups[gi]);
+        }
+
+        Write(file, static_cast<uint32_t>(bricks.size()));
+        for (NodeIndex brick = 0u; brick < brickSlots.size(); ++brick)
+        {
+            if (NoBrick == brickSlots[brick]) continue;
+            Write(file, brick);
+            Write(file, bricks[brickSlots[brick]]);
+        }
+        if (!file)
+        {
+            std::cerr << "Could not write brick store file " << path << ".\n";
+            return false;
+        }
+        return true;
+    }
+
+    bool BrickStore::Load(const std::string& path)
+    {
+        Clear();
+        std::ifstream file{ path, std::ios::binary };
+        if (!file.is_open())
+        {
+            std::cerr << "Could not open brick store file " << path << ".\n";
+            return false;
+        }
+        char magic[sizeof(FileMagic)];
+        uint32_t version = 0u;
+        if (!file.read(magic, sizeof(magic)) || std::memcmp(magic, FileMagic, sizeof(magic)) || !Read(file, version))
+        {
+            std::cerr << path << " is not a brick store file.\n";
+            return false;
+        }
+        if (FileVersion != version)
+        {
+            std::cerr << "Brick store file " << path << " has version " << version << " (expected " << FileVersion << ").\n";
+            return false;
+        }
+
+        auto fail = [&]()
+        {
+            std::cerr << "Brick store file " << path << " is truncated or corrupt.\n";
+            Clear();
+            return false;
+        };
+        uint32_t numGroups = 0u, numUsed = 0u, numBricks = 0u;
+        if (!Read(file, params) || !Read(file, view) || !Read(file, rootGroupIndex) || !Read(file, numGroups) || !Read(file, numUsed)) return fail();
+        if (numUsed > numGroups) return fail();
+        groups.resize(numGroups);
+        for (uint32_t i = 0u; i < numUsed; ++i)
+        {
+            NodeIndex gi;
+            if (!Read(file, gi) || gi >= numGroups || !Read(file, groups[gi])) return fail();
+        }
+        if (!Read(file, numBricks)) return fail();
+        bricks.reserve(numBricks);
+        for (uint32_t i = 0u; i < numBricks; ++i)
+        {
+            NodeIndex brick;
+            if (!Read(file, brick) || brick / NodeArity >= numGroups || !Read(file, AddBrick(brick))) return fail();
+        }
+        return true;
+    }
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include "Octree.hpp"
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+
+namespace Mulen::Atmosphere {
+
+    // CPU copy of one atmosphere state: its node groups and the density and filtered light of its bricks,
+    // along with the physical parameters and view it was captured with.
+    // This is kept free of GPU calls, so captures can be rendered by the reference renderer on machines without one.
+    class BrickStore
+    {
+    public:
+        typedef BrickBase<glm::vec2, BrickRes> VoxelBrick; // density in x, filtered light in y
+        static constexpr double MieMul = 100.0 * 4.0 * 4.0; // density sample to Mie density (as mieMul in common.glsl)
+
+        struct Parameters
+        {
+            double planetRadius, scale, height, cloudMaxHeight;
+            double HR, HM; // Rayleigh and Mie scale heights
+            glm::dvec3 betaR, absorptionExtinction;
+            double absorptionMiddle, absorptionExtent;
+            double mieG, betaMSca, betaMEx;
+        } params = {};
+        struct View
+        {
+            glm::dvec3 origin; // camera position, relative to the planet
+            glm::dmat4 invViewProj; // of the camera orientation and projection (so clip coordinates map to directions)
+            glm::dvec3 lightDir;
+            double sunIntensity;
+            glm::ivec2 resolution;
+        } view = {};
+
+        NodeIndex rootGroupIndex = InvalidIndex;
+        std::vector<NodeGroup> groups; // (only those reachable from the root are meaningful)
+
+        void Clear();
+        VoxelBrick& AddBrick(NodeIndex brick); // (overwriting any previous data of the brick)
+        const VoxelBrick* GetBrick(NodeIndex brick) const
+        {
+            return brick < brickSlots.size() && NoBrick != brickSlots[brick] ? &bricks[brickSlots[brick]] : nullptr;
+        }
+        size_t GetNumBricks() const { return bricks.size(); }
+
+        // Trilinearly interpolated voxel data at local coordinates in [-1, 1] (as the GPU samples bricks).
+        glm::vec2 Sample(NodeIndex brick, glm::vec3 lc) const;
+
+        // Recomputes the nodes' empty flags and NodeMeta from the bricks, as update_flags.glsl and
+        // update_empty_distance.glsl do (so that a capture's can be compared, or those of other definitions tried).
+        void BuildNodeMeta();
+
+        // Calls f(groupIndex) for each group reachable from the root, parents before children.
+        template<typename F> void ForEachGroup(F f) const
+        {
+            if (rootGroupIndex >= groups.size()) return;
+            std::vector<NodeIndex> stack{ rootGroupIndex };
+            while (!stack.empty())
+            {
+                const auto gi = stack.back();
+                stack.pop_back();
+                f(gi);
+                for (const auto& node : groups[gi].nodes)
+                {
+                    const auto child = node.children & GpuIndexMask;
+                    if (GpuInvalidIndex != child && child < groups.size()) stack.push_back(child);
+                }
+            }
+        }
+
+        bool Save(const std::string& path) const;
+        bool Load(const std::string& path);
+
+    private:
+        static constexpr uint32_t NoBrick = 0xffffffffu;
+        std::vector<uint32_t> brickSlots; // brick index -> index into bricks
+        std::vector<VoxelBrick> bricks;
+    };
+}
@@ -2,8 +2,10 @@
 #include "Octree.hpp"
 #include <glm/glm.hpp>
 #include "util/Buffer.hpp"
+#include "util/StagingArray.hpp"
 #include "util/Texture.hpp"
 #include "util/Shader.hpp"
+#include "util/Timer.hpp"
 #include "Object.hpp"
 
 namespace Mulen {
@@ -61,27 +63,143 @@ namespace Mulen {
     struct GpuState
     {
         Util::Buffer gpuNodes;
-        Util::Texture brickTexture;
+        Util::Texture brickTexture; // (unused with copy-on-write brick storage, where states share one)
+        Util::Texture brickLightTexture; // filtered light, with split brick formats (else it's kept in brickTexture)
+        Util::Buffer brickSlots;    // brick-to-slot map, with copy-on-write brick storage
         Util::Texture octreeMap;
     };
 
-    // - to do: consider two channels so bricks store both last and next values, to let rendering interpolate between
-    static const auto
-        BrickFormat = GL_RG8, // - visible banding if only 8 bits per channel. Maybe can be resolved with generation dithering?
-        BrickLightFormat = GL_R8;
+    // Brick voxel formats, for (Mie) density and filtered light.
+    enum class BrickFormat
+    {
+        RG8,    // - visible banding if only 8 bits per channel. Maybe can be resolved with generation dithering?
+        RG16,
+        Split8, // density and light in separate R8 textures, so that density-only passes fetch half as much
+        BC5,    // block-compressed (RGTC2) copies of an uncompressed RG8 work texture, encoded as states complete
+        Count
+    };
+    struct BrickFormatInfo
+    {
+        const char* name;
+        GLenum format;              // of the brick textures which are rendered from
+        GLenum imageFormat;         // of the texture updates write to (the brick texture, or a work texture if compressed)
+        const char* imageQualifier; // GLSL layout qualifier matching imageFormat
+        GLenum lightFormat;         // of the separate light textures, if split (else zero)
+        double voxelSize;           // bytes per voxel of one brick store (both channels)
+        double workVoxelSize;       // bytes per voxel of the work texture, if any
+    };
+    inline const BrickFormatInfo& GetBrickFormatInfo(BrickFormat format)
+    {
+        static const BrickFormatInfo infos[] =
+        {
+            { "RG8",   GL_RG8,  GL_RG8,  "rg8",  0u,    2.0, 0.0 },
+            { "RG16",  GL_RG16, GL_RG16, "rg16", 0u,    4.0, 0.0 },
+            { "R8+R8", GL_R8,   GL_R8,   "r8",   GL_R8, 2.0, 0.0 },
+            { "BC5",   GL_COMPRESSED_RG_RGTC2, GL_RG8, "rg8", 0u, 1.0, 2.0 },
+        };
+        static_assert(std::extent<decltype(infos)>::value == size_t(BrickFormat::Count), "missing brick format info");
+        return infos[size_t(format)];
+    }
+    inline bool IsCompressed(BrickFormat format) { return GetBrickFormatInfo(format).workVoxelSize > 0.0; }
+    inline bool IsSplit(BrickFormat format) { return GetBrickFormatInfo(format).lightFormat != 0u; }
+    inline bool ParseBrickFormat(const std::string& name, BrickFormat& format)
+    {
+        for (size_t i = 0u; i < size_t(BrickFormat::Count); ++i)
+        {
+            if (name != GetBrickFormatInfo(BrickFormat(i)).name) continue;
+            format = BrickFormat(i);
+            return true;
+        }
+        return false;
+    }
+
+    // How bricks are lit in the update's Light stage.
+    enum class LightingMode
+    {
+        ShadowRays, // a shadow ray per voxel through the leaves (after per-group shadow maps)
+        Cones,      // a cone per voxel through prefiltered parent bricks, stepping further as it widens
+        Sweep,      // per-group shadow maps propagated front to back along the light, then short per-voxel rays
+        Count
+    };
+    inline const char* GetLightingModeName(LightingMode mode)
+    {
+        static const char* names[] = { "Shadow rays", "Cones", "Sweep" };
+        static_assert(std::extent<decltype(names)>::value == size_t(LightingMode::Count), "missing lighting mode name");
+        return names[size_t(mode)];
+    }
+    inline bool ParseLightingMode(const std::string& name, LightingMode& mode)
+    {
+        for (size_t i = 0u; i < size_t(LightingMode::Count); ++i)
+        {
+            if (name != GetLightingModeName(LightingMode(i))) continue;
+            mode = LightingMode(i);
+            return true;
+        }
+        return false;
+    }
+
+    // Keys of the shader variants selected by update settings (see Util::ShaderVariants).
+    // (only shadow rays can do without the per-group shadow maps, which the sweep builds on and cones ignore)
+    inline Util::ShaderVariants::Defines GetLightingVariant(LightingMode mode, bool perGroupLighting)
+    {
+        const bool perGroup = perGroupLighting || LightingMode::ShadowRays != mode;
+        return { { "LIGHTING_MODE", std::to_string(unsigned(mode)) + "u" }, { "PER_GROUP_LIGHTING", perGroup ? "true" : "false" } };
+    }
+    inline Util::ShaderVariants::Defines GetGeneratorVariant(bool optimiseGeneration, bool cumulusWindCells)
+    {
+        return { { "OPTIMISE_GENERATION", optimiseGeneration ? "true" : "false" }, { "CUMULUS_WIND_CELLS", cumulusWindCells ? "1" : "0" } };
+    }
+    inline Util::ShaderVariants::Defines GetRenderVariant(bool animate)
+    {
+        return { { "ANIMATE_INTERPOLATION", animate ? "true" : "false" } };
+    }
+
+    static const auto BrickLightFormat = GL_R8; // temporary lighting
 
     static const auto LightPerGroupRes = BrickRes * 2u;
 
+    static const auto ScreenTileRes = 8u; // (as TileRes in common.glsl)
+
     static const std::string
         Profiler_UpdateInit = "Update::Init",
         Profiler_UpdateInitSplits = "Update::InitSplits",
         Profiler_UpdateGenerate = "Update::Generate",
+        Profiler_UpdatePrefilter = "Update::Prefilter",
         Profiler_UpdateMap = "Update::Map",
+        Profiler_UpdateMeta = "Update::Meta",
         Profiler_UpdateLight = "Update::Light",
         Profiler_UpdateLightPerGroup = "Update::LightPerGroup",
         Profiler_UpdateLightPerVoxel = "Update::LightPerVoxel",
-        Profiler_UpdateFilter = "Update::Filter"
+        Profiler_UpdateLightSweep = "Update::LightSweep",
+        Profiler_UpdateFilter = "Update::Filter",
+        Profiler_UpdateEncode = "Update::Encode",
+        Profiler_UpdateUpload = "Update::Upload",           // transfer of staged data to where the GPU reads it
+        Profiler_UpdateUploadCopy = "Update::UploadCopy",   // CPU copies into staging memory
+        Profiler_UpdateCompute = "Update::Compute",         // worker thread iteration (CPU), with the scopes below
+        Profiler_UpdateComputeGenerate = "Update::Compute::Generate",
+        Profiler_UpdateComputePriorities = "Update::Compute::Priorities",
+        Profiler_UpdateComputeSplits = "Update::Compute::Splits",
+        Profiler_UpdateComputeStaging = "Update::Compute::Staging",
+        Profiler_RenderTrace = "Render::Trace",             // atmosphere rays (with the traced pixel count as factor)
+        Profiler_RenderClassify = "Render::Classify"        // screen tiles, for adaptive ray march steps
         ;
+    // Rays traced per frame in screen tiles of each class (counts, as classify_tiles.glsl orders the classes).
+    static const std::string Profiler_RenderRays[] =
+    {
+        "Render::Rays::Sky",
+        "Render::Rays::Haze",
+        "Render::Rays::Dense",
+        "Render::Rays::Occluded",
+    };
+    // Handles of the names above, registered with the timer up front (so that the per-frame paths don't hash them).
+    struct ProfilerRefs
+    {
+        explicit ProfilerRefs(Util::Timer&);
+        Util::Timer::NameRef atmosphereUpdate, atmosphereRender;
+        Util::Timer::NameRef updateInitSplits, updateLightPerGroup, updateLightPerVoxel, updateUpload, updateUploadCopy;
+        Util::Timer::NameRef updateCompute, updateComputeGenerate, updateComputePriorities, updateComputeSplits, updateComputeStaging;
+        Util::Timer::NameRef renderTrace, renderClassify, renderRays[std::extent<decltype(Profiler_RenderRays)>::value];
+    };
 
     struct Structure
     {
@@ -99,21 +217,39 @@ namespace Mulen {
             Frustum viewFrustum;
             Object::Position lightDirection;
             unsigned depthLimit;
+            LightingMode lightingMode;
+            float coneAperture; // cone width increase per distance travelled, with cone lighting
+            bool perGroupLighting; // per-group shadow maps ahead of shadow rays
+            bool optimiseGeneration, cumulusWindCells; // generator variant
 
             double scale, height, planetRadius; // atmosphere scale, height, and planet radius
 
             Atmosphere::Generator* generator; // - to do: don't use a raw pointer
         } params;
 
-        std::vector<UploadNodeGroup> nodesToUpload;
-        std::vector<UploadBrick> bricksToUpload;
+        // (these may be backed by GPU-visible memory, in which case records are written straight into it)
+        Util::StagingArray<UploadNodeGroup> nodesToUpload;
+        Util::StagingArray<UploadBrick> bricksToUpload;
         std::vector<NodeIndex> splitGroups; // indices of groups resulting from splits in this update
         std::vector<uint32_t> genData;
+        size_t numDirtyGroups = 0u; // the groups staged first whose bricks have changed (the rest only need their nodes updated)
+        std::vector<NodeIndex> displacedGroups; // (copy-on-write) groups whose bricks could move back to their own slots; set on hand-over
+        std::vector<NodeIndex> deferredGroups; // (copy-on-write) dirty groups left unregenerated for lack of brick slots; set on hand-over
+        size_t maxSplitGroups = 0u; // (copy-on-write) splits sure to get brick slots of their own, as of the hand-over
 
         unsigned maxDepth;
         // - to do: full depth distribution? Assuming 32 as max depth should be plenty
-        // - to do: more stats
+        size_t numSplits = 0u, numMerges = 0u;
+        size_t numNodeGroups = 0u; // in use, after the splits and merges
+        size_t numPendingRelights = 0u; // (copy-on-write) groups left to relight in later iterations
+
 
+        // Have the upload records written directly into the given memory (or owned memory, if null).
+        void SetStorage(void* nodes, size_t nodeCapacity, void* bricks, size_t brickCapacity)
+        {
+            nodesToUpload.SetStorage(nodes, nodeCapacity);
+            bricksToUpload.SetStorage(bricks, brickCapacity);
+        }
 
         void Reset()
         {
@@ -121,7 +257,9 @@ namespace Mulen {
             bricksToUpload.resize(0u);
             splitGroups.resize(0u);
             genData.resize(0u);
+            numDirtyGroups = 0u;
             maxDepth = 0u;
+            numSplits = numMerges = numNodeGroups = numPendingRelights = 0u;
         }
     };
 }
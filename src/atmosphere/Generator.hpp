@@ -7,11 +7,12 @@ namespace Mulen::Atmosphere {
     class Generator
     {
         const std::string shaderName;
-        Util::Shader shader; // brick generation shader
+        Util::ShaderVariants shader; // brick generation shader (per OPTIMISE_GENERATION, CUMULUS_WIND_CELLS)
 
     public:
         const std::string& GetShaderName() { return shaderName; }
-        Util::Shader& GetShader() { return shader; }
+        Util::ShaderVariants& GetShader() { return shader; }
+        const Util::ShaderVariants& GetShader() const { return shader; }
         Generator(const std::string& shaderName)
             : shaderName{ shaderName } 
         {}
@@ -0,0 +1,118 @@
+#include "LightDependencies.hpp"
+#include <algorithm>
+#include <cmath>
+
+namespace Mulen::Atmosphere {
+
+    bool LightDependencies::SetLight(const glm::dvec3& dir, double radius, size_t groupCapacity)
+    {
+        if (dir == lightDir && radius == atmosphereRadius && groupCapacity == capsules.size()) return false;
+        lightDir = dir;
+        atmosphereRadius = radius;
+        capsules.assign(groupCapacity, Capsule{ glm::dvec3(0.0), 0.0, 0.0 });
+        dependencies.assign(groupCapacity, {});
+        dependants.assign(groupCapacity, {});
+        numRecorded = 0u;
+        return true;
+    }
+
+    glm::dvec4 LightDependencies::GetGroupBounds(const Octree& octree, NodeIndex gi)
+    {
+        const auto parent = octree.nodes[gi].parent;
+        if (InvalidIndex == parent) return glm::dvec4(0.0, 0.0, 0.0, 1.0);
+        const auto bounds = GetGroupBounds(octree, Octree::NodeToGroup(parent));
+        const auto ci = parent % NodeArity;
+        const auto halfSize = bounds.w * 0.5;
+        const auto offset = glm::dvec3(glm::uvec3(ci, ci >> 1u, ci >> 2u) & 1u) * 2.0 - 1.0;
+        return glm::dvec4(glm::dvec3(bounds) + offset * halfSize, halfSize);
+    }
+
+    LightDependencies::Capsule LightDependencies::GetCapsule(const glm::dvec4& bounds) const
+    {
+        Capsule c;
+        c.origin = glm::dvec3(bounds);
+        c.radius = std::sqrt(3.0) * bounds.w;
+        // Distance to where the atmosphere ends, towards the light.
+        const auto b = glm::dot(c.origin, lightDir);
+        const auto disc = b * b - (glm::dot(c.origin, c.origin) - atmosphereRadius * atmosphereRadius);
+        c.length = disc > 0.0 ? glm::max(0.0, -b + std::sqrt(disc)) : 0.0;
+        return c;
+    }
+
+    bool LightDependencies::Intersects(const Capsule& c, const glm::dvec4& bounds) const
+    {
+        const auto p = glm::dvec3(bounds) - c.origin;
+        const auto t = glm::clamp(glm::dot(p, lightDir), 0.0, c.length);
+        const auto r = c.radius + std::sqrt(3.0) * bounds.w;
+        const auto d = p - lightDir * t;
+        return glm::dot(d, d) <= r * r;
+    }
+
+    void LightDependencies::Forget(NodeIndex gi)
+    {
+        for (auto di : dependencies[gi])
+        {
+            auto& list = dependants[di];
+            list.erase(std::remove(list.begin(), list.end(), gi), list.end());
+        }
+        if (capsules[gi].radius > 0.0) --numRecorded;
+        dependencies[gi].clear();
+        capsules[gi].radius = 0.0;
+    }
+
+    void LightDependencies::Record(const Octree& octree, NodeIndex gi)
+    {
+        if (gi >= capsules.size() || InvalidIndex == octree.rootGroupIndex) return;
+        Forget(gi);
+        const auto capsule = GetCapsule(GetGroupBounds(octree, gi));
+        capsules[gi] = capsule;
+        ++numRecorded;
+
+        // Descend through the groups the capsule touches (children lie within their parents' bounds).
+        auto& deps = dependencies[gi];
+        std::vector<std::pair<NodeIndex, glm::dvec4>> stack{ { octree.rootGroupIndex, glm::dvec4(0.0, 0.0, 0.0, 1.0) } };
+        while (!stack.empty())
+        {
+            const auto [qi, bounds] = stack.back();
+            stack.pop_back();
+            if (!Intersects(capsule, bounds)) continue;
+            bool hasLeaves = false;
+            for (NodeIndex ci = 0u; ci < NodeArity; ++ci)
+            {
+                const auto children = octree.nodes[qi].nodes[ci].children;
+                if (InvalidIndex == children)
+                {
+                    hasLeaves = true;
+                    continue;
+                }
+                const auto halfSize = bounds.w * 0.5;
+                const auto offset = glm::dvec3(glm::uvec3(ci, ci >> 1u, ci >> 2u) & 1u) * 2.0 - 1.0;
+                stack.push_back({ children, glm::dvec4(glm::dvec3(bounds) + offset * halfSize, halfSize) });
+            }
+            if (!hasLeaves || qi == gi) continue; // (only leaves are sampled, and a group needn't track itself)
+            deps.push_back(qi);
+            dependants[qi].push_back(gi);
+        }
+    }
+
+    void LightDependencies::CollectSplitDependants(const Octree& octree, NodeIndex gi, std::vector<NodeIndex>& out) const
+    {
+        // Shadow rays through the new group went through the node it subdivides, and so were recorded for its parent group.
+        const auto parent = octree.nodes[gi].parent;
+        if (InvalidIndex == parent || gi >= capsules.size()) return;
+        const auto bounds = GetGroupBounds(octree, gi);
+        for (auto di : dependants[Octree::NodeToGroup(parent)])
+        {
+            if (Intersects(capsules[di], bounds)) out.push_back(di);
+        }
+    }
+
+    void LightDependencies::CollectMergeDependants(NodeIndex gi, std::vector<NodeIndex>& out)
+    {
+        if (gi >= capsules.size()) return;
+        out.insert(out.end(), dependants[gi].begin(), dependants[gi].end());
+        // Those will be recorded anew when relit (through the merged node's group instead).
+        Forget(gi);
+        dependants[gi].clear();
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "Octree.hpp"
+#include <glm/glm.hpp>
+#include <vector>
+
+namespace Mulen::Atmosphere {
+
+    // Light dependencies between node groups, so that changes of the octree need only relight the groups they shadow.
+    // For a fixed light direction, this records which groups each group's shadow rays pass through when it's lit
+    // (and so, inversely, which groups each group's lighting depends on).
+    // A group's shadow rays are bounded by its bounding sphere swept towards the light to the edge of the atmosphere,
+    // which makes the dependencies conservative. This is kept free of GPU calls.
+    class LightDependencies
+    {
+    public:
+        // Forgets everything if the light direction (in octree space, towards the light) or the group capacity has changed.
+        // The atmosphere radius is in octree space too. Returns whether dependencies were forgotten.
+        bool SetLight(const glm::dvec3& lightDir, double atmosphereRadius, size_t groupCapacity);
+
+        // Records the groups (with leaves) which the shadow rays of a group pass through, replacing any previous record.
+        void Record(const Octree&, NodeIndex gi);
+
+        // Appends the groups whose lighting a change affects to out (possibly repeating some):
+        // a new group, just split from a node of an existing group,
+        void CollectSplitDependants(const Octree&, NodeIndex gi, std::vector<NodeIndex>& out) const;
+        // or a group about to be merged (which is then forgotten, so call this before the octree frees it).
+        void CollectMergeDependants(NodeIndex gi, std::vector<NodeIndex>& out);
+
+        size_t GetNumRecorded() const { return numRecorded; }
+
+        // Centre and half-size of the volume a group subdivides, in octree space ([-1, 1]).
+        static glm::dvec4 GetGroupBounds(const Octree&, NodeIndex gi);
+
+    private:
+        struct Capsule
+        {
+            glm::dvec3 origin;
+            double radius, length; // (zero radius if not recorded)
+        };
+        Capsule GetCapsule(const glm::dvec4& bounds) const;
+        bool Intersects(const Capsule&, const glm::dvec4& bounds) const;
+        void Forget(NodeIndex gi);
+
+        glm::dvec3 lightDir{ 0.0 };
+        double atmosphereRadius = 0.0;
+        std::vector<Capsule> capsules;
+        std::vector<std::vector<NodeIndex>> dependencies; // groups each group's shadow rays pass through
+        std::vector<std::vector<NodeIndex>> dependants; // groups whose shadow rays pass through each group
+        size_t numRecorded = 0u;
+    };
+}
@@ -1,7 +1,5 @@
 #include "Model.hpp"
-#include <vector>
-#include <iostream>
-#include <glm/glm.hpp>
+#include <cmath>
 
 namespace Mulen::Atmosphere {
 
@@ -53,69 +51,55 @@ namespace Mulen::Atmosphere {
         constexpr double kMieSingleScatteringAlbedo = 0.9;
         constexpr double kMiePhaseFunctionG = 0.8;
 
-        std::vector<double>
-            wavelengths,
-            solarIrradiance,
-            rayleighScattering,
-            mieScattering,
-            mieExtinction,
-            absorptionExtinction;
         for (int l = kLambdaMin; l <= kLambdaMax; l += 10)
         {
             double lambda = static_cast<double>(l) * 1e-3;  // micro-meters
             double mie =
-                kMieAngstromBeta / kMieScaleHeight * pow(lambda, -kMieAngstromAlpha);
+                kMieAngstromBeta / kMieScaleHeight * std::pow(lambda, -kMieAngstromAlpha);
             wavelengths.push_back(l);
             solarIrradiance.push_back(kSolarIrradiance[(l - kLambdaMin) / 10]);
-            rayleighScattering.push_back(kRayleigh * pow(lambda, -4));
+            rayleighScattering.push_back(kRayleigh * std::pow(lambda, -4));
             mieScattering.push_back(mie * kMieSingleScatteringAlbedo);
             mieExtinction.push_back(mie);
             absorptionExtinction.push_back(kMaxOzoneNumberDensity * kOzoneCrossSection[(l - kLambdaMin) / 10]);
         }
 
-        // - to do: add scale heights for Rayleigh and Mie to model
-        
+        rayleighScaleHeight = kRayleighScaleHeight;
+        mieScaleHeight = kMieScaleHeight;
+        miePhaseG = kMiePhaseFunctionG;
+
         // Ozone density increases linearly from 0 to 1 between 10 and 25 km, and
         // decreases linearly from 1 to 0 between 25 and 40 km. This is an approximate
         // profile from http://www.kln.ac.lk/science/Chemistry/Teaching_Resources/
         // Documents/Introduction%20to%20atmospheric%20chemistry.pdf (page 10).
-        glm::dvec2 absorptionLayer{ 25.0e3, 15.0e3 }; // center, half extent
-
+        absorptionMiddle = 25.0e3;
+        absorptionExtent = 15.0e3;
+    }
 
-        auto Interpolate = [&wavelengths](double wavelength, const std::vector<double>& v)
+    Model::Coefficients Model::GetCoefficients(const glm::dvec3& lambdas) const
+    {
+        auto Interpolate = [this](double wavelength, const std::vector<double>& v)
         {
             for (size_t i = 1u; i < wavelengths.size(); ++i)
             {
                 if (wavelength > wavelengths[i]) continue;
-                return glm::mix(v[i - 1u], v[i], (wavelength - wavelengths[i - 1u]) / (wavelengths[i] - wavelengths[i - 1u]));
+                return glm::mix(v[i - 1u], v[i], glm::max(0.0, wavelength - wavelengths[i - 1u]) / (wavelengths[i] - wavelengths[i - 1u]));
             }
             return v.back();
         };
-        auto Interpolate3 = [&Interpolate, &wavelengths](const glm::dvec3& lambdas, const std::vector<double>& v)
+        auto Interpolate3 = [&Interpolate](const glm::dvec3& lambdas, const std::vector<double>& v)
         {
             return glm::dvec3(Interpolate(lambdas.r, v), Interpolate(lambdas.g, v), Interpolate(lambdas.b, v));
         };
-
-        glm::dvec3 lambdas{ 680.0, 550.0, 440.0 };
-
-        { // display values
-            auto betaR = Interpolate3(lambdas, rayleighScattering);
-            auto mieS = Interpolate3(lambdas, mieScattering);
-            auto mieEx = Interpolate3(lambdas, mieExtinction);
-            auto aEx = Interpolate3(lambdas, absorptionExtinction);
-
-            auto disp3 = [](const char* name, const glm::dvec3& v)
-            {
-                std::cout << name << ": (" << v.r << ", " << v.g << ", " << v.b << ")\n";
-            };
-            disp3("lambdas", lambdas);
-            disp3("betaR", betaR);
-            disp3("mieS", mieS);
-            disp3("mieEx", mieEx);
-            disp3("ozoneEx", aEx);
-        }
-
-        // - to do: make use of these values
+        return
+        {
+            lambdas,
+            Interpolate3(lambdas, solarIrradiance),
+            Interpolate3(lambdas, rayleighScattering),
+            Interpolate3(lambdas, mieScattering),
+            Interpolate3(lambdas, mieExtinction),
+            Interpolate3(lambdas, absorptionExtinction)
+        };
     }
 
 }
@@ -1,12 +1,33 @@
 #pragma once
+#include <vector>
+#include <glm/glm.hpp>
 
 namespace Mulen::Atmosphere {
+    // Spectral physical constants of an Earth-like atmosphere, from which those used at render wavelengths are taken.
     class Model
     {
-        // - to do: move all physical atmosphere constants here
+        // - to do: move the remaining physical atmosphere constants here (radii)
 
     public:
         Model();
 
+        // The spectral values, interpolated at three wavelengths (in nm).
+        struct Coefficients
+        {
+            glm::dvec3 wavelengths, solarIrradiance, rayleighScattering, mieScattering, mieExtinction, absorptionExtinction;
+        };
+        Coefficients GetCoefficients(const glm::dvec3& wavelengths = { 680.0, 550.0, 440.0 }) const;
+
+        double rayleighScaleHeight, mieScaleHeight, miePhaseG;
+        double absorptionMiddle, absorptionExtent; // of the (tent-shaped) absorption layer's density
+
+    private:
+        std::vector<double>
+            wavelengths,
+            solarIrradiance,
+            rayleighScattering,
+            mieScattering,
+            mieExtinction,
+            absorptionExtinction;
     };
 }
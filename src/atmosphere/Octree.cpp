@@ -20,6 +20,7 @@ namespace Mulen {
         {
             auto& node = group.nodes[ci];
             node.children = InvalidIndex;
+            node.meta = 0u;
             for (auto& neighbour : node.neighbours)
             {
                 neighbour = InvalidIndex;
@@ -74,6 +75,7 @@ namespace Mulen {
             auto childIndex = GroupAndChildToNode(parent.children, ci);
             auto& node = group.nodes[ci];
             node.children = InvalidIndex;
+            node.meta = 0u;
             for (auto d = 0u; d < 3u; ++d) // iterate over the axes to set up neighbours
             {
                 const auto bit = 1u << d;
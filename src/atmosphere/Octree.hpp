@@ -4,6 +4,7 @@
 #include <cinttypes>
 #include <vector>
 #include <array>
+#include <cmath>
 
 namespace Mulen {
 
@@ -31,6 +32,7 @@ namespace Mulen {
     {
         NodeIndex children;                     // group index
         std::array<NodeIndex, 3> neighbours;    // node indices (only non-same-allocation neighbours are stored explicitly)
+        uint32_t meta;                          // NodeMeta (computed on the GPU, from the node's brick and surroundings)
         // - add brick index if bricks should be allocated separately
     };
     struct NodeGroup
@@ -47,10 +49,42 @@ namespace Mulen {
     };
     static constexpr NodeIndex InvalidIndex = std::numeric_limits<NodeIndex>::max();
 
+    // GPU node encoding (as in the shaders): child group indices carry flags in their top bits.
+    static constexpr NodeIndex GpuIndexMask = 0x00ffffffu;
+    static constexpr NodeIndex GpuInvalidIndex = InvalidIndex & GpuIndexMask;
+    static constexpr NodeIndex EmptyBrickBit = 0x80000000u;
+
+    // Per-node metadata for empty-space skipping (as in common.glsl):
+    // quantised density range of the node's brick, whether it's opaque, and how far around it is empty.
+    struct NodeMeta
+    {
+        static constexpr uint32_t MinShift = 0u, MaxShift = 8u; // density range, in 1/255 (rounded outwards)
+        static constexpr uint32_t OpaqueBit = 1u << 16u;        // light is extinguished within a voxel length anywhere in it
+        static constexpr uint32_t DistanceShift = 17u, DistanceMask = 3u;
+        static constexpr uint32_t MaxEmptyDistance = 2u; // (further is costly to find, and rarely more useful)
+        static constexpr double OpaqueOpticalDepth = 10.0; // (Mie optical depth across one voxel)
+
+        // Empty distance d of an empty leaf: all leaves within d node extents of it (Chebyshev distance) are empty too.
+        static uint32_t Encode(float minDensity, float maxDensity, bool opaque, uint32_t emptyDistance = 0u)
+        {
+            const auto quantise = [](float v) { return v <= 0.0f ? 0.0f : v >= 1.0f ? 255.0f : v * 255.0f; };
+            const auto minQ = uint32_t(std::floor(quantise(minDensity))), maxQ = uint32_t(std::ceil(quantise(maxDensity)));
+            return minQ << MinShift | maxQ << MaxShift | (opaque ? OpaqueBit : 0u)
+                | (emptyDistance < DistanceMask ? emptyDistance : DistanceMask) << DistanceShift;
+        }
+        static float GetMinDensity(uint32_t meta) { return float((meta >> MinShift) & 0xffu) / 255.0f; }
+        static float GetMaxDensity(uint32_t meta) { return float((meta >> MaxShift) & 0xffu) / 255.0f; }
+        static bool IsOpaque(uint32_t meta) { return 0u != (meta & OpaqueBit); }
+        static bool IsUniform(uint32_t meta) { return ((meta >> MinShift) & 0xffu) == ((meta >> MaxShift) & 0xffu); }
+        static uint32_t GetEmptyDistance(uint32_t meta) { return (meta >> DistanceShift) & DistanceMask; }
+        static uint32_t SetEmptyDistance(uint32_t meta, uint32_t d) { return (meta & ~(DistanceMask << DistanceShift)) | d << DistanceShift; }
+    };
+
     template<typename Data, typename Index> struct Pool
     {
         std::vector<Data> data;
         Index firstFree, numFree;
+        Index limit = 0u; // maximum number of elements in use at once (may be lower than the size)
 
         Index* GetNextFree(Index i)
         {
@@ -62,6 +96,7 @@ namespace Mulen {
         {
             data.resize(num);
             numFree = static_cast<Index>(data.size());
+            limit = numFree;
             firstFree = 0u;
             for (Index i = 1u; i < numFree; ++i)
             {
@@ -73,7 +108,7 @@ namespace Mulen {
 
         Index Allocate()
         {
-            if (!numFree) return InvalidIndex;
+            if (!GetNumFree()) return InvalidIndex;
             const auto i = firstFree;
             firstFree = *GetNextFree(i);
             --numFree;
@@ -86,8 +121,15 @@ namespace Mulen {
             ++numFree;
         }
         Index GetSize() const { return static_cast<Index>(data.size()); }
-        Index GetNumFree() const { return numFree; }
-        Index GetNumUsed() const { return GetSize() - GetNumFree(); }
+        // Lowering the limit below the number in use leaves it to the user to free elements until within it.
+        void SetLimit(Index l) { limit = l < GetSize() ? l : GetSize(); }
+        Index GetLimit() const { return limit; }
+        Index GetNumFree() const
+        {
+            const auto used = GetNumUsed();
+            return used >= limit ? 0u : limit - used;
+        }
+        Index GetNumUsed() const { return GetSize() - numFree; }
         Data& operator[](Index i) { return data[i]; }
         const Data& operator[](Index i) const { return data[i]; }
     };
@@ -0,0 +1,200 @@
+#include "OctreeMap.hpp"
+#include <sstream>
+#include <cmath>
+
+namespace Mulen::Atmosphere {
+
+    namespace {
+        // As OctreeTraversalData and its functions in common.glsl.
+        struct Traversal
+        {
+            glm::dvec3 p, center;
+            double size;
+            NodeIndex ni, gi;
+            uint32_t depth;
+        };
+
+        void InitAtRoot(Traversal& o, NodeIndex rootGroup)
+        {
+            o.depth = 0u - 1u;
+            o.ni = GpuInvalidIndex;
+            o.gi = rootGroup;
+            o.center = glm::dvec3(0.0);
+            o.size = 1.0;
+        }
+
+        void InitAtEntry(Traversal& o, const OctreeMap::Entry& entry)
+        {
+            o.depth = entry.depth;
+            o.gi = entry.group;
+            const auto nodesAtDepth = std::exp2(double(o.depth + 1u));
+            const auto pn = glm::floor((o.p * 0.5 + 0.5) * nodesAtDepth) / nodesAtDepth;
+            o.size = 1.0 / nodesAtDepth;
+            o.center = pn * 2.0 - 1.0 + o.size;
+            o.ni = GpuInvalidIndex;
+        }
+
+        void DescendLoop(const std::vector<NodeGroup>& groups, Traversal& o, uint32_t maxDepth = ~0u)
+        {
+            while (GpuInvalidIndex != o.gi && o.gi < groups.size())
+            {
+                const auto ioffs = glm::clamp(glm::ivec3(glm::floor(o.p - o.center + 1.0)), glm::ivec3(0), glm::ivec3(1));
+                const auto child = NodeIndex(ioffs.x + ioffs.y * 2 + ioffs.z * 4);
+                o.ni = Octree::GroupAndChildToNode(o.gi, child);
+                o.size *= 0.5;
+                o.center += (glm::dvec3(ioffs) * 2.0 - 1.0) * o.size;
+                o.gi = groups[o.gi].nodes[child].children & GpuIndexMask;
+                ++o.depth;
+                if (o.depth >= maxDepth) break;
+            }
+        }
+
+        bool HasChildren(const std::vector<NodeGroup>& groups, NodeIndex ni)
+        {
+            return GpuInvalidIndex != (groups[Octree::NodeToGroup(ni)].nodes[ni % NodeArity].children & GpuIndexMask);
+        }
+    }
+
+    OctreeMap::Texel OctreeMap::Encode(const Entry& entry)
+    {
+        return (entry.group & ((1u << IndexBits) - 1u))
+            | ((entry.childFlags & ((1u << ChildBits) - 1u)) << IndexBits)
+            | ((entry.depth & ((1u << DepthBits) - 1u)) << (IndexBits + ChildBits));
+    }
+
+    OctreeMap::Entry OctreeMap::Decode(Texel texel)
+    {
+        Entry entry;
+        entry.group = texel & ((1u << IndexBits) - 1u);
+        entry.childFlags = (texel >> IndexBits) & ((1u << ChildBits) - 1u);
+        entry.depth = (texel >> (IndexBits + ChildBits)) & ((1u << DepthBits) - 1u);
+        return entry;
+    }
+
+    unsigned OctreeMap::GetMaxDepth(unsigned res, unsigned levels)
+    {
+        unsigned log2Res = 0u;
+        while ((2u << log2Res) <= res) ++log2Res;
+        return log2Res - 1u + levels;
+    }
+
+    glm::dvec3 OctreeMap::Place(const glm::dvec3& center, unsigned res, unsigned levels)
+    {
+        const auto size = 2.0 / std::exp2(double(levels));
+        const auto texelSize = size / res;
+        const auto position = glm::round((center - size * 0.5 + 1.0) / texelSize) * texelSize - 1.0;
+        return glm::clamp(position, glm::dvec3(-1.0), glm::dvec3(1.0 - size));
+    }
+
+    void OctreeMap::Build(const std::vector<NodeGroup>& groups, NodeIndex rootGroup, unsigned res, const glm::dvec3& position, unsigned levels)
+    {
+        this->res = res;
+        this->levels = levels;
+        this->position = position;
+        size = 2.0 / std::exp2(double(levels));
+        texels.assign(size_t(res) * res * res, 0u);
+        const auto texelSize = size / res;
+        const auto maxDepth = GetMaxDepth(res, levels);
+        for (unsigned z = 0u; z < res; ++z)
+        for (unsigned y = 0u; y < res; ++y)
+        for (unsigned x = 0u; x < res; ++x)
+        {
+            Traversal o;
+            o.p = position + (glm::dvec3(x, y, z) + 0.5) * texelSize;
+            InitAtRoot(o, rootGroup);
+            DescendLoop(groups, o, maxDepth);
+            if (GpuInvalidIndex == o.ni) continue; // (no root)
+
+            Entry entry;
+            entry.depth = o.depth;
+            entry.group = groups[Octree::NodeToGroup(o.ni)].nodes[o.ni % NodeArity].children & GpuIndexMask;
+            if (GpuInvalidIndex == entry.group) // a leaf, so continue from its own group
+            {
+                entry.group = Octree::NodeToGroup(o.ni);
+                entry.depth -= 1u;
+            }
+            entry.childFlags = 0u;
+            for (NodeIndex ci = 0u; ci < NodeArity; ++ci)
+            {
+                if (HasChildren(groups, Octree::GroupAndChildToNode(entry.group, ci))) entry.childFlags |= 1u << ci;
+            }
+            texels[x + res * (y + size_t(res) * z)] = Encode(entry);
+        }
+    }
+
+    NodeIndex OctreeMap::Descend(const std::vector<NodeGroup>& groups, NodeIndex rootGroup, const glm::dvec3& p, bool useMap) const
+    {
+        Traversal o;
+        o.p = p;
+        const auto tc = (p - position) / (size / res);
+        if (useMap && res && glm::all(glm::greaterThanEqual(tc, glm::dvec3(0.0))) && glm::all(glm::lessThan(tc, glm::dvec3(res))))
+        {
+            const auto t = glm::uvec3(tc);
+            InitAtEntry(o, Decode(texels[t.x + res * (t.y + size_t(res) * t.z)]));
+        }
+        else InitAtRoot(o, rootGroup);
+        DescendLoop(groups, o);
+        return o.ni;
+    }
+
+    bool OctreeMap::Validate(const std::vector<NodeGroup>& groups, NodeIndex rootGroup, std::string* error) const
+    {
+        std::ostringstream errors;
+        size_t numErrors = 0u;
+        auto fail = [&](const glm::uvec3& t, const char* what)
+        {
+            if (numErrors++ < 8u) errors << "texel (" << t.x << ", " << t.y << ", " << t.z << "): " << what << "\n";
+        };
+        if (texels.size() != size_t(res) * res * res) fail(glm::uvec3(0u), "map size doesn't match its resolution");
+
+        const auto texelSize = size / res;
+        for (unsigned z = 0u; z < res && texels.size() == size_t(res) * res * res; ++z)
+        for (unsigned y = 0u; y < res; ++y)
+        for (unsigned x = 0u; x < res; ++x)
+        {
+            const glm::uvec3 t{ x, y, z };
+            const auto entry = Decode(texels[x + res * (y + size_t(res) * z)]);
+            if (entry.group >= groups.size())
+            {
+                fail(t, "group index out of range");
+                continue;
+            }
+            if (entry.depth + 1u >= (1u << DepthBits) - 1u)
+            {
+                fail(t, "invalid depth");
+                continue;
+            }
+            uint32_t childFlags = 0u;
+            for (NodeIndex ci = 0u; ci < NodeArity; ++ci)
+            {
+                if (HasChildren(groups, Octree::GroupAndChildToNode(entry.group, ci))) childFlags |= 1u << ci;
+            }
+            if (childFlags != entry.childFlags) fail(t, "child flags differ from the group's nodes");
+
+            // The centre and (slightly inset) corners of the texel.
+            const auto texelMin = position + glm::dvec3(t) * texelSize;
+            for (unsigned s = 0u; s <= 8u; ++s)
+            {
+                const auto offset = 8u == s ? glm::dvec3(0.5) : glm::mix(glm::dvec3(0.01), glm::dvec3(0.99), glm::dvec3(s & 1u, (s >> 1u) & 1u, (s >> 2u) & 1u));
+                Traversal fromMap, fromRoot;
+                fromMap.p = fromRoot.p = texelMin + offset * texelSize;
+                InitAtEntry(fromMap, entry);
+                DescendLoop(groups, fromMap);
+                InitAtRoot(fromRoot, rootGroup);
+                DescendLoop(groups, fromRoot);
+                if (fromMap.ni != fromRoot.ni)
+                {
+                    fail(t, "descending from the entry ends in another node than from the root");
+                    break;
+                }
+            }
+        }
+        if (numErrors)
+        {
+            if (numErrors > 8u) errors << "(and " << numErrors - 8u << " more)\n";
+            if (error) *error = errors.str();
+            return false;
+        }
+        return true;
+    }
+}
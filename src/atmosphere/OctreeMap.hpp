@@ -0,0 +1,58 @@
+#pragma once
+#include "Octree.hpp"
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+
+namespace Mulen::Atmosphere {
+
+    // Octree map: a grid over a cube of the octree, with each texel telling where to start descending for points in it
+    // (the deepest node group wholly containing the texel), so traversals needn't start at the root.
+    // This builds maps as update_octree_map.glsl does, in the same encoding, and validates them; it's free of GPU calls.
+    // Node groups are expected in GPU encoding (flags in the top bits of child indices), though plain ones work too.
+    class OctreeMap
+    {
+    public:
+        typedef uint32_t Texel;
+        static constexpr uint32_t DepthBits = 5u, ChildBits = 8u;
+        static constexpr uint32_t IndexBits = 32u - DepthBits - ChildBits;
+
+        struct Entry
+        {
+            NodeIndex group;        // to continue descending in
+            uint32_t childFlags;    // which of the group's nodes have children
+            uint32_t depth;         // of the node which the group subdivides
+        };
+        static Texel Encode(const Entry&);
+        static Entry Decode(Texel);
+
+        // The deepest node depth a map of this resolution distinguishes, for a map of the whole octree
+        // or one covering a cube `levels` halvings smaller.
+        static unsigned GetMaxDepth(unsigned res, unsigned levels = 0u);
+        // Placement of a map of that cube around a point, snapped so that texels line up with nodes.
+        // Returns the minimum corner (the size being 2 / 2^levels), in octree space ([-1, 1]).
+        static glm::dvec3 Place(const glm::dvec3& center, unsigned res, unsigned levels);
+
+        void Build(const std::vector<NodeGroup>& groups, NodeIndex rootGroup, unsigned res,
+            const glm::dvec3& position = glm::dvec3(-1.0), unsigned levels = 0u);
+
+        // Checks that descending from each texel's entry ends in the same node as descending from the root,
+        // at the texel's centre and near its corners.
+        bool Validate(const std::vector<NodeGroup>& groups, NodeIndex rootGroup, std::string* error = nullptr) const;
+
+        const std::vector<Texel>& GetTexels() const { return texels; }
+        std::vector<Texel>& GetTexels() { return texels; } // (e.g. to validate a map read back from the GPU)
+        unsigned GetResolution() const { return res; }
+        const glm::dvec3& GetPosition() const { return position; }
+        double GetSize() const { return size; }
+
+        // Leaf node index at p, descending from the root, or from the map if it covers p.
+        NodeIndex Descend(const std::vector<NodeGroup>& groups, NodeIndex rootGroup, const glm::dvec3& p, bool useMap = true) const;
+
+    private:
+        std::vector<Texel> texels;
+        unsigned res = 0u, levels = 0u;
+        glm::dvec3 position{ -1.0 };
+        double size = 2.0;
+    };
+}
@@ -0,0 +1,293 @@
+#include "ReferenceRenderer.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <thread>
+
+namespace Mulen::Atmosphere {
+
+    namespace {
+        const double PI = 3.14159265358979323846;
+        const double LightScale = 3.0; // (as the final factor in render.glsl)
+
+        bool IntersectSphere(const glm::dvec3& ori, const glm::dvec3& dir, double radius, double& t0, double& t1)
+        {
+            const auto tca = glm::dot(-ori, dir);
+            const auto d2 = glm::dot(ori, ori) - tca * tca;
+            if (d2 > radius * radius) return false;
+            const auto thc = std::sqrt(radius * radius - d2);
+            t0 = glm::max(0.0, tca - thc);
+            t1 = tca + thc;
+            return t1 >= t0;
+        }
+
+        void AabbIntersection(double& tmin, double& tmax, const glm::dvec3& bmin, const glm::dvec3& bmax, const glm::dvec3& o, const glm::dvec3& d)
+        {
+            const auto dinv = 1.0 / d;
+            const auto t0 = (bmin - o) * dinv, t1 = (bmax - o) * dinv;
+            const auto tmin3 = glm::min(t0, t1), tmax3 = glm::max(t0, t1);
+            tmin = glm::max(tmin3.x, glm::max(tmin3.y, tmin3.z));
+            tmax = glm::min(tmax3.x, glm::min(tmax3.y, tmax3.z));
+        }
+
+        float Rand3D(const glm::vec3& co)
+        {
+            const auto v = std::sin(glm::dot(co, glm::vec3(12.9898f, 78.233f, 144.7272f))) * 43758.5453f;
+            return v - std::floor(v);
+        }
+    }
+
+    ReferenceRenderer::ReferenceRenderer(const BrickStore& store)
+        : store{ store }
+        , tables{ store.params }
+    {
+        const auto& p = store.params;
+        Rg = p.planetRadius;
+        Rt = p.planetRadius + p.height * 2.0;
+        cloudRadius = p.planetRadius + p.cloudMaxHeight;
+        atmScale = p.planetRadius * p.scale;
+
+        tables.ComputeTransmittance();
+    }
+
+    void ReferenceRenderer::Descend(Traversal& o, RayStats& rayStats) const
+    {
+        const auto& groups = store.groups;
+        o.depth = 0u - 1u;
+        o.ni = GpuInvalidIndex;
+        o.gi = store.rootGroupIndex;
+        o.center = glm::dvec3(0.0);
+        o.size = 1.0;
+        o.flags = 0u;
+        while (GpuInvalidIndex != o.gi && o.gi < groups.size())
+        {
+            const auto ioffs = glm::clamp(glm::ivec3(o.p - o.center + 1.0), glm::ivec3(0), glm::ivec3(1));
+            const auto child = NodeIndex(ioffs.x + ioffs.y * 2 + ioffs.z * 4);
+            o.ni = Octree::GroupAndChildToNode(o.gi, child);
+            o.size *= 0.5;
+            o.center += (glm::dvec3(ioffs) * 2.0 - 1.0) * o.size;
+            const auto children = groups[o.gi].nodes[child].children;
+            o.flags = children & ~GpuIndexMask;
+            o.gi = children & GpuIndexMask;
+            ++o.depth;
+            ++rayStats.nodesVisited;
+        }
+    }
+
+    glm::dvec3 ReferenceRenderer::TraceRay(const Settings& settings, const glm::dvec2& fragCoords, const glm::dvec3& dir, RayStats& rayStats) const
+    {
+        const auto& p = store.params;
+        const auto& view = store.view;
+        const auto& ori = view.origin;
+        const auto& lightDir = view.lightDir;
+
+        double solidDepth = std::numeric_limits<double>::infinity(), t0, t1;
+        if (IntersectSphere(ori, dir, Rg, t0, t1)) solidDepth = t0;
+
+        glm::dvec3 transmittance{ 1.0 }, color{ 0.0 };
+        double outerMin, outerMax, innerMin, innerMax;
+        const auto intersectsOuter = IntersectSphere(ori, dir, Rt, outerMin, outerMax);
+        const auto intersectsInner = IntersectSphere(ori, dir, cloudRadius, innerMin, innerMax);
+        const auto outerLength = intersectsInner ? innerMin - outerMin : outerMax - outerMin;
+        if (intersectsOuter && outerLength > 0.0)
+        {
+            const auto q = ori + dir * outerMin;
+            const auto r = glm::length(q);
+            transmittance *= tables.GetTransmittance(r, glm::dot(dir, q) / r, outerLength, solidDepth < outerMax);
+        }
+        if (!intersectsInner) return color;
+        rayStats.marched = true;
+
+        double tmin = innerMin, tmax = innerMax;
+        solidDepth = glm::min(solidDepth, tmax);
+        const auto marchStart = tmin;
+        const auto hit = ori + dir * tmin;
+
+        Traversal o;
+        o.p = hit / atmScale;
+        Descend(o, rayStats);
+
+        double dist = 1e-5; // don't start at a face/edge/corner
+        const auto randOffs = settings.jitter
+            ? (double(Rand3D(glm::vec3(glm::vec2(fragCoords), 1.0f))) * 0.5 + 0.5) * 2.0 * settings.stepFactor
+            : settings.stepFactor;
+        dist += randOffs * o.size * atmScale;
+
+        const auto nu = glm::dot(lightDir, dir);
+        const auto g = p.mieG;
+        const auto phaseR = (3.0 / (16.0 * PI)) * (1.0 + nu * nu);
+        const auto phaseM = 1.5 / (4.0 * PI) * (1.0 - g * g) * std::pow(1.0 + g * g - 2.0 * g * nu, -1.5) * (1.0 + nu * nu) / (2.0 + g * g);
+
+        double depthR = 0.0, depthM = 0.0, depthA = 0.0;
+        double lastR = 0.0, lastM = 0.0, lastA = 0.0;
+        glm::dvec3 T{ 1.0 };
+        while (GpuInvalidIndex != o.ni)
+        {
+            const auto isEmpty = 0u != (o.flags & EmptyBrickBit);
+            const auto meta = settings.useNodeMeta ? store.groups[Octree::NodeToGroup(o.ni)].nodes[o.ni % NodeArity].meta : 0u;
+            const auto center = o.center * atmScale;
+            const auto size = o.size * atmScale;
+            const auto atmStep = size * settings.stepFactor * (settings.doubleStepsInEmptyBricks && isEmpty ? 2.0 : 1.0)
+                * (isEmpty ? double(1u + NodeMeta::GetEmptyDistance(meta)) : 1.0);
+
+            AabbIntersection(tmin, tmax, center - size, center + size, hit, dir);
+            tmax = glm::min(tmax, solidDepth - marchStart);
+            if (NodeMeta::IsOpaque(meta)) tmax = glm::min(tmax, dist + 4.0 * size / double(BrickRes - 1u));
+            const auto localStart = (hit - center) / size;
+
+            // (at least one step per node, as on the GPU, to avoid returning to the same node)
+            do
+            {
+                const auto lc = localStart + dist / size * dir;
+                const auto voxel = store.Sample(o.ni, glm::vec3(lc));
+
+                const auto q = hit + dist * dir;
+                const auto r = glm::length(q);
+                const auto transm = tables.GetTransmittanceToSun(r, glm::dot(q / r, lightDir));
+                const auto storedLight = double(voxel.y) * transm;
+
+                const auto h = r - Rg;
+                const auto rayleighDensity = std::exp(-h / p.HR);
+                const auto mieDensity = std::exp(-h / p.HM) + double(voxel.x) * BrickStore::MieMul;
+                const auto absorptionDensity = glm::max(1.0 - std::abs(h - p.absorptionMiddle) / p.absorptionExtent, 0.0);
+                const auto cloudFactor = 1.0 - std::exp(-2e-4 * mieDensity);
+
+                T = transmittance * glm::exp(-(depthR * p.betaR + glm::dvec3(depthM * p.betaMEx) + depthA * p.absorptionExtinction));
+                auto newLight = (phaseR * p.betaR * rayleighDensity + glm::dvec3(phaseM * p.betaMSca * mieDensity)) * storedLight;
+                if (settings.approximateHigherOrderLighting) newLight += cloudFactor * phaseM * p.betaMSca * mieDensity * transm;
+                color += newLight * T * atmStep;
+
+                depthR += (lastR + rayleighDensity) * 0.5 * atmStep;
+                depthM += (lastM + mieDensity) * 0.5 * atmStep;
+                depthA += (lastA + absorptionDensity) * 0.5 * atmStep;
+                lastR = rayleighDensity; // (render.glsl carries only the Rayleigh density over; kept alike for comparability)
+
+                dist += atmStep;
+                if (++rayStats.steps >= settings.maxStepsPerRay)
+                {
+                    rayStats.truncated = true;
+                    break;
+                }
+            } while (dist < tmax);
+            ++rayStats.bricks;
+
+            if (rayStats.truncated) break;
+            if (glm::length(T) < 1e-4) break; // stop early if transmittance is low
+            if (dist + marchStart > solidDepth) break;
+
+            o.p = (hit + dist * dir) / atmScale;
+            Descend(o, rayStats);
+        }
+        return color;
+    }
+
+    glm::ivec2 ReferenceRenderer::Render(const Settings& settings, Image& image, Stats& stats) const
+    {
+        const auto res = settings.resolution.x > 0 && settings.resolution.y > 0 ? settings.resolution : store.view.resolution;
+        stats = {};
+        image.assign(size_t(glm::max(0, res.x)) * size_t(glm::max(0, res.y)), glm::vec3(0.0f));
+        if (image.empty()) return res;
+
+        const auto tileSize = int(glm::max(1u, settings.tileSize));
+        const auto tiles = (res + tileSize - 1) / tileSize;
+        const auto numTiles = unsigned(tiles.x * tiles.y);
+        auto numThreads = settings.numThreads ? settings.numThreads : std::thread::hardware_concurrency();
+        numThreads = glm::clamp(numThreads, 1u, numTiles);
+        const auto lightIntensity = store.view.sunIntensity * LightScale;
+
+        std::atomic<unsigned> nextTile{ 0u };
+        std::mutex statsMutex;
+        auto work = [&]()
+        {
+            Stats local;
+            for (auto tile = nextTile++; tile < numTiles; tile = nextTile++)
+            {
+                const auto x0 = int(tile % unsigned(tiles.x)) * tileSize, y0 = int(tile / unsigned(tiles.x)) * tileSize;
+                for (int y = y0; y < glm::min(y0 + tileSize, res.y); ++y)
+                for (int x = x0; x < glm::min(x0 + tileSize, res.x); ++x)
+                {
+                    const glm::dvec2 fragCoords{ x + 0.5, y + 0.5 };
+                    const auto clipCoords = glm::dvec4(fragCoords / glm::dvec2(res) * 2.0 - 1.0, 1.0, 1.0);
+                    const auto dir = glm::normalize(glm::dvec3(store.view.invViewProj * clipCoords));
+                    RayStats rayStats;
+                    image[size_t(x) + size_t(y) * size_t(res.x)] = glm::vec3(TraceRay(settings, fragCoords, dir, rayStats) * lightIntensity);
+
+                    ++local.rays;
+                    local.marchedRays += rayStats.marched;
+                    local.truncatedRays += rayStats.truncated;
+                    local.nodesVisited += rayStats.nodesVisited;
+                    local.bricks += rayStats.bricks;
+                    local.steps += rayStats.steps;
+                }
+            }
+            std::lock_guard<std::mutex> lock{ statsMutex };
+            stats.rays += local.rays;
+            stats.marchedRays += local.marchedRays;
+            stats.truncatedRays += local.truncatedRays;
+            stats.nodesVisited += local.nodesVisited;
+            stats.bricks += local.bricks;
+            stats.steps += local.steps;
+        };
+
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (unsigned i = 1u; i < numThreads; ++i)
+        {
+            threads.emplace_back(work);
+        }
+        work();
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return res;
+    }
+
+    bool ReferenceRenderer::WriteHdr(const std::string& path, const glm::ivec2& res, const Image& image)
+    {
+        std::ofstream file{ path, std::ios::binary };
+        if (!file.is_open())
+        {
+            std::cerr << "Could not open " << path << " for writing.\n";
+            return false;
+        }
+        file << "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y " << res.y << " +X " << res.x << "\n";
+
+        // Uncompressed scanlines, top row first.
+        std::vector<unsigned char> row(size_t(res.x) * 4u);
+        for (int y = res.y - 1; y >= 0; --y)
+        {
+            for (int x = 0; x < res.x; ++x)
+            {
+                auto c = image[size_t(x) + size_t(y) * size_t(res.x)];
+                c = glm::max(c, glm::vec3(0.0f)); // (also flushes NaNs)
+                const auto m = glm::max(c.r, glm::max(c.g, c.b));
+                auto* rgbe = &row[size_t(x) * 4u];
+                if (m < 1e-32f)
+                {
+                    rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0u;
+                    continue;
+                }
+                int e;
+                const auto v = std::frexp(m, &e) * 256.0f / m;
+                rgbe[0] = static_cast<unsigned char>(c.r * v);
+                rgbe[1] = static_cast<unsigned char>(c.g * v);
+                rgbe[2] = static_cast<unsigned char>(c.b * v);
+                rgbe[3] = static_cast<unsigned char>(e + 128);
+            }
+            file.write(reinterpret_cast<const char*>(row.data()), row.size());
+        }
+        if (!file)
+        {
+            std::cerr << "Could not write " << path << ".\n";
+            return false;
+        }
+        return true;
+    }
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include "BrickStore.hpp"
+#include "ScatteringTables.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Mulen::Atmosphere {
+
+    // Multithreaded CPU ray marcher over a BrickStore, following the GPU render path (render.glsl):
+    // the same octree descent, node-by-node march with steps proportional to node size, and lighting.
+    // It's a reference for image output, and for judging traversal changes by their cost per ray before they reach GLSL.
+    // Differences from the GPU: descents always start at the root (the octree map only shortcuts them to the same node),
+    // sky scattering outside of the cloud shell isn't added (the GPU looks it up from a precomputed texture),
+    // and the planet's surface is a plain sphere rather than a depth buffer.
+    class ReferenceRenderer
+    {
+    public:
+        struct Settings
+        {
+            glm::ivec2 resolution{ 0 };     // (zero to use the captured view's)
+            unsigned numThreads = 0u;       // (zero for one per hardware thread)
+            unsigned tileSize = 16u;
+            double stepFactor = 0.2;        // step length relative to node size
+            bool jitter = true;             // per-pixel start offsets as on the GPU (at time zero, so deterministic)
+            bool doubleStepsInEmptyBricks = false;
+            bool useNodeMeta = true;        // larger steps in empty space and early stops in opaque nodes (as useNodeMeta)
+            bool approximateHigherOrderLighting = true;
+            uint64_t maxStepsPerRay = 1u << 16u; // (a safeguard; the GPU has none)
+        };
+        struct Stats
+        {
+            uint64_t rays = 0u, marchedRays = 0u, truncatedRays = 0u; // (marched rays enter the cloud shell)
+            uint64_t nodesVisited = 0u, bricks = 0u, steps = 0u;
+            double seconds = 0.0;
+
+            double GetRaysPerSecond() const { return seconds > 0.0 ? double(rays) / seconds : 0.0; }
+            double GetNodesPerRay() const { return rays ? double(nodesVisited) / double(rays) : 0.0; }
+            double GetBricksPerRay() const { return rays ? double(bricks) / double(rays) : 0.0; }
+            double GetStepsPerRay() const { return rays ? double(steps) / double(rays) : 0.0; }
+        };
+        typedef std::vector<glm::vec3> Image; // rows from the bottom up (as GL fragment coordinates)
+
+        explicit ReferenceRenderer(const BrickStore&);
+
+        // Returns the resolution rendered at.
+        glm::ivec2 Render(const Settings&, Image&, Stats&) const;
+
+        // Radiance RGBE (.hdr) output.
+        static bool WriteHdr(const std::string& path, const glm::ivec2& resolution, const Image&);
+
+    private:
+        const BrickStore& store;
+        double Rg, Rt, cloudRadius, atmScale;
+
+        ScatteringTables tables; // (only the transmittance, for its lookups)
+
+        struct RayStats
+        {
+            uint64_t nodesVisited = 0u, bricks = 0u, steps = 0u;
+            bool marched = false, truncated = false;
+        };
+        struct Traversal
+        {
+            glm::dvec3 p; // in [-1, 1] over the octree
+            glm::dvec3 center;
+            double size;
+            NodeIndex ni, gi, flags;
+            unsigned depth;
+        };
+        void Descend(Traversal&, RayStats&) const;
+        glm::dvec3 TraceRay(const Settings&, const glm::dvec2& fragCoords, const glm::dvec3& dir, RayStats&) const;
+    };
+}
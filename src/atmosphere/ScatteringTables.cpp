@@ -0,0 +1,455 @@
+#include "ScatteringTables.hpp"
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+namespace Mulen::Atmosphere {
+
+    namespace {
+        const char FileMagic[8] = { 'M', 'U', 'L', 'E', 'N', 'S', 'T', 0 };
+        const uint32_t FileVersion = 2u; // (bump this if the integrals change, to invalidate old caches)
+
+        double UnitCoordToTextureCoord(double x, double texSize) { return 0.5 / texSize + x * (1.0 - 1.0 / texSize); }
+        double TextureCoordToUnitCoord(double x, double texSize) { return (x - 0.5 / texSize) / (1.0 - 1.0 / texSize); }
+
+        const double PI = 3.14159265358979323846;
+
+        double PhaseRayleigh(double v) { return 3.0 / (16.0 * PI) * (1.0 + v * v); }
+        double PhaseMie(double v, double g)
+        {
+            return 1.5 / (4.0 * PI) * (1.0 - g * g) * std::pow(1.0 + g * g - 2.0 * g * v, -1.5) * (1.0 + v * v) / (2.0 + g * g);
+        }
+
+        template<typename F> void ParallelFor(size_t num, unsigned numThreads, F f)
+        {
+            numThreads = numThreads ? numThreads : std::thread::hardware_concurrency();
+            numThreads = static_cast<unsigned>(glm::clamp(size_t(numThreads), size_t(1u), glm::max(num, size_t(1u))));
+            std::atomic<size_t> next{ 0u };
+            auto work = [&]() { for (auto i = next++; i < num; i = next++) f(i); };
+            std::vector<std::thread> threads;
+            for (unsigned i = 1u; i < numThreads; ++i) threads.emplace_back(work);
+            work();
+            for (auto& thread : threads) thread.join();
+        }
+
+        // FNV-1a, over the values the tables depend on.
+        struct Hasher
+        {
+            uint64_t hash = 14695981039346656037ull;
+            template<typename T> void Add(const T& value)
+            {
+                const auto bytes = reinterpret_cast<const unsigned char*>(&value);
+                for (size_t i = 0u; i < sizeof(T); ++i) hash = (hash ^ bytes[i]) * 1099511628211ull;
+            }
+        };
+    }
+
+    ScatteringTables::ScatteringTables(const BrickStore::Parameters& p)
+        : params{ p }
+    {
+        Rg = p.planetRadius;
+        Rt = p.planetRadius + p.height * 2.0; // (as Rt in Atmosphere::UpdateUniforms)
+
+        Hasher h;
+        h.Add(FileVersion);
+        for (const auto v : { Rg, Rt, p.HR, p.betaR.x, p.betaR.y, p.betaR.z, p.HM, p.mieG, p.betaMSca, p.betaMEx,
+            p.absorptionExtinction.x, p.absorptionExtinction.y, p.absorptionExtinction.z, p.absorptionMiddle, p.absorptionExtent })
+        {
+            h.Add(v);
+        }
+        for (const auto size : { TransmittanceWidth, TransmittanceHeight, ScatterRSize, ScatterMuSize, ScatterMuSSize, ScatterNuSize })
+        {
+            h.Add(size);
+        }
+        key = h.hash;
+    }
+
+    glm::dvec3 ScatteringTables::ComputeTransmittance(double r0, double mu) const
+    {
+        const auto& p = params;
+        const int NumSteps = 512;
+        const auto dx = glm::max(0.0, -r0 * mu + std::sqrt(glm::max(0.0, Rt * Rt + r0 * r0 * (mu * mu - 1.0)))) / NumSteps;
+        double lastR = 0.0, lastM = 0.0, lastA = 0.0, depthR = 0.0, depthM = 0.0, depthA = 0.0;
+        for (int step = 0; step <= NumSteps; ++step)
+        {
+            const auto t = dx * step;
+            const auto h = std::sqrt(t * t + r0 * r0 + 2.0 * t * r0 * mu) - Rg;
+            const auto densityR = std::exp(-h / p.HR), densityM = std::exp(-h / p.HM);
+            const auto densityA = glm::max(1.0 - std::abs(h - p.absorptionMiddle) / p.absorptionExtent, 0.0);
+            depthR += (densityR + lastR) * 0.5 * dx;
+            depthM += (densityM + lastM) * 0.5 * dx;
+            depthA += (densityA + lastA) * 0.5 * dx;
+            lastR = densityR;
+            lastM = densityM;
+            lastA = densityA;
+        }
+        return glm::exp(-(p.betaR * depthR + glm::dvec3(p.betaMEx * depthM) + p.absorptionExtinction * depthA));
+    }
+
+    void ScatteringTables::ComputeTransmittance(unsigned numThreads)
+    {
+        // At texel centres, as transmittance.glsl.
+        transmittance.resize(size_t(TransmittanceWidth) * TransmittanceHeight);
+        const auto H = std::sqrt(Rt * Rt - Rg * Rg);
+        ParallelFor(TransmittanceHeight, numThreads, [&](size_t y)
+        {
+            for (int x = 0; x < TransmittanceWidth; ++x)
+            {
+                const auto x_mu = TextureCoordToUnitCoord((x + 0.5) / TransmittanceWidth, TransmittanceWidth);
+                const auto x_r = TextureCoordToUnitCoord((y + 0.5) / TransmittanceHeight, TransmittanceHeight);
+                const auto rho = x_r * H;
+                const auto r = std::sqrt(rho * rho + Rg * Rg);
+                const auto d_min = Rt - r, d_max = rho + H;
+                const auto d = x_mu * (d_max - d_min) + d_min;
+                const auto mu = d == 0.0 ? 1.0 : glm::clamp((H * H - rho * rho - d * d) / (2.0 * r * d), -1.0, 1.0);
+                transmittance[x + y * TransmittanceWidth] = glm::vec4(ComputeTransmittance(r, mu), 0.0f);
+            }
+        });
+    }
+
+    glm::dvec3 ScatteringTables::GetTransmittanceToAtmosphereTop(double r, double mu) const
+    {
+        const auto H = std::sqrt(Rt * Rt - Rg * Rg);
+        const auto rho = std::sqrt(glm::max(0.0, r * r - Rg * Rg));
+        const auto d = glm::max(0.0, -r * mu + std::sqrt(glm::max(0.0, Rt * Rt + r * r * (mu * mu - 1.0))));
+        const auto d_min = Rt - r, d_max = rho + H;
+        const glm::dvec2 uv
+        {
+            UnitCoordToTextureCoord((d - d_min) / (d_max - d_min), TransmittanceWidth),
+            UnitCoordToTextureCoord(rho / H, TransmittanceHeight)
+        };
+
+        // Bilinear filtering, clamped to the edges.
+        const glm::dvec2 size{ TransmittanceWidth, TransmittanceHeight };
+        const auto tc = glm::clamp(uv * size - 0.5, glm::dvec2(0.0), size - 1.0);
+        const auto i0 = glm::min(glm::ivec2(tc), glm::ivec2(size) - 2);
+        const auto f = tc - glm::dvec2(i0);
+        auto texel = [&](int x, int y) { return glm::dvec3(transmittance[x + y * TransmittanceWidth]); };
+        return glm::mix(
+            glm::mix(texel(i0.x, i0.y), texel(i0.x + 1, i0.y), f.x),
+            glm::mix(texel(i0.x, i0.y + 1), texel(i0.x + 1, i0.y + 1), f.x), f.y);
+    }
+
+    glm::dvec3 ScatteringTables::GetTransmittanceToSun(double r, double mu_s) const
+    {
+        const auto sunAngularRadius = 0.00935 / 2.0;
+        const auto sin_theta_h = Rg / r;
+        const auto cos_theta_h = -std::sqrt(glm::max(1.0 - sin_theta_h * sin_theta_h, 0.0));
+        const auto occlusion = glm::smoothstep(-sin_theta_h * sunAngularRadius, sin_theta_h * sunAngularRadius, mu_s - cos_theta_h);
+        return GetTransmittanceToAtmosphereTop(r, mu_s) * occlusion;
+    }
+
+    glm::dvec3 ScatteringTables::GetTransmittance(double r, double mu, double d, bool intersectsGround) const
+    {
+        const auto r_d = glm::clamp(std::sqrt(d * d + 2.0 * r * mu * d + r * r), Rg, Rt);
+        const auto mu_d = glm::clamp((r * mu + d) / r_d, -1.0, 1.0);
+        if (intersectsGround)
+        {
+            return glm::min(glm::dvec3(1.0), GetTransmittanceToAtmosphereTop(r_d, -mu_d) / GetTransmittanceToAtmosphereTop(r, -mu));
+        }
+        return glm::min(glm::dvec3(1.0), GetTransmittanceToAtmosphereTop(r, mu) / GetTransmittanceToAtmosphereTop(r_d, mu_d));
+    }
+
+    void ScatteringTables::ComputeSingleScattering(double r, double mu, double mu_s, double nu, bool intersectsGround, glm::dvec3& rayleigh, glm::dvec3& mie) const
+    {
+        const auto& p = params;
+        const unsigned NumSteps = 128u;
+        const auto distance = intersectsGround
+            ? glm::max(0.0, -r * mu - std::sqrt(glm::max(0.0, Rg * Rg + r * r * (mu * mu - 1.0))))
+            : glm::max(0.0, -r * mu + std::sqrt(glm::max(0.0, Rt * Rt + r * r * (mu * mu - 1.0))));
+        const auto dx = distance / NumSteps;
+        rayleigh = mie = glm::dvec3(0.0);
+        for (unsigned step = 0u; step < NumSteps; ++step)
+        {
+            const auto d = dx * step;
+            const auto r_d = glm::clamp(std::sqrt(d * d + r * r + 2.0 * r * mu * d), Rg, Rt);
+            const auto mu_s_d = glm::clamp((r * mu_s + d * nu) / r_d, -1.0, 1.0);
+            const auto T = GetTransmittance(r, mu, d, intersectsGround) * GetTransmittanceToSun(r_d, mu_s_d);
+            const auto H = r_d - Rg;
+            rayleigh += T * std::exp(-H / p.HR);
+            mie += T * std::exp(-H / p.HM);
+        }
+        rayleigh *= p.betaR * dx;
+        mie *= p.betaMSca * dx;
+    }
+
+    void ScatteringTables::GetScatteringTexelParameters(int x, int y, int z, double& r, double& mu, double& mu_s, double& nu, bool& intersectsGround) const
+    {
+        // At texel centres, parameterised as inscatter_first.glsl (RMuMuSNuFromScatteringFragCoord) does.
+        const auto H = std::sqrt(Rt * Rt - Rg * Rg);
+        const glm::dvec3 fragCoord{ x + 0.5, y + 0.5, z + 0.5 };
+        const glm::dvec4 uvwz = glm::dvec4(std::floor(fragCoord.x / ScatterMuSSize), std::fmod(fragCoord.x, double(ScatterMuSSize)), fragCoord.y, fragCoord.z)
+            / glm::dvec4(ScatterNuSize - 1, ScatterMuSSize, ScatterMuSize, ScatterRSize);
+
+        const auto rho = H * TextureCoordToUnitCoord(uvwz.w, ScatterRSize);
+        r = std::sqrt(rho * rho + Rg * Rg);
+        if (uvwz.z < 0.5)
+        {
+            const auto d_min = r - Rg, d_max = rho;
+            const auto d = d_min + (d_max - d_min) * TextureCoordToUnitCoord(1.0 - 2.0 * uvwz.z, ScatterMuSize / 2);
+            mu = d == 0.0 ? -1.0 : glm::clamp(-(rho * rho + d * d) / (2.0 * r * d), -1.0, 1.0);
+            intersectsGround = true;
+        }
+        else
+        {
+            const auto d_min = Rt - r, d_max = rho + H;
+            const auto d = d_min + (d_max - d_min) * TextureCoordToUnitCoord(2.0 * uvwz.z - 1.0, ScatterMuSize / 2);
+            mu = d == 0.0 ? 1.0 : glm::clamp((H * H - rho * rho - d * d) / (2.0 * r * d), -1.0, 1.0);
+            intersectsGround = false;
+        }
+        const auto x_mu_s = TextureCoordToUnitCoord(uvwz.y, ScatterMuSSize);
+        const auto d_min = Rt - Rg, d_max = H;
+        const auto A = -2.0 * MuSMin * Rg / (d_max - d_min);
+        const auto a = (A - x_mu_s * A) / (1.0 + x_mu_s * A);
+        const auto d = d_min + glm::min(a, A) * (d_max - d_min);
+        mu_s = d == 0.0 ? 1.0 : glm::clamp((H * H - d * d) / (2.0 * Rg * d), -1.0, 1.0);
+        nu = glm::clamp(uvwz.x * 2.0 - 1.0, -1.0, 1.0);
+        const auto s = std::sqrt((1.0 - mu * mu) * (1.0 - mu_s * mu_s));
+        nu = glm::clamp(nu, mu * mu_s - s, mu * mu_s + s);
+    }
+
+    void ScatteringTables::ComputeScattering(unsigned numThreads)
+    {
+        const int width = ScatterNuSize * ScatterMuSSize;
+        scattering.resize(size_t(width) * ScatterMuSize * ScatterRSize);
+        ParallelFor(size_t(ScatterMuSize) * ScatterRSize, numThreads, [&](size_t row)
+        {
+            const auto y = int(row % ScatterMuSize), z = int(row / ScatterMuSize);
+            for (int x = 0; x < width; ++x)
+            {
+                double r, mu, mu_s, nu;
+                bool intersectsGround;
+                GetScatteringTexelParameters(x, y, z, r, mu, mu_s, nu, intersectsGround);
+                glm::dvec3 rayleigh, mie;
+                ComputeSingleScattering(r, mu, mu_s, nu, intersectsGround, rayleigh, mie);
+                scattering[x + (y + size_t(z) * ScatterMuSize) * width] = glm::vec4(rayleigh, mie.r);
+            }
+        });
+        numOrders = 1u;
+        deltaScattering.clear();
+    }
+
+    glm::dvec4 ScatteringTables::LookUpScattering(const std::vector<glm::vec4>& table, double r, double mu, double mu_s, double nu, bool intersectsGround) const
+    {
+        // As ScatteringUvwzFromRMuMuSNu and LookUpScattering in common.glsl.
+        const auto H = std::sqrt(Rt * Rt - Rg * Rg);
+        const auto rho = std::sqrt(glm::max(0.0, r * r - Rg * Rg));
+        const auto u_r = UnitCoordToTextureCoord(rho / H, ScatterRSize);
+
+        const auto r_mu = r * mu;
+        const auto discriminant = r_mu * r_mu - r * r + Rg * Rg;
+        double u_mu;
+        if (intersectsGround)
+        {
+            const auto d = -r_mu - std::sqrt(glm::max(0.0, discriminant));
+            const auto d_min = r - Rg, d_max = rho;
+            u_mu = 0.5 - 0.5 * UnitCoordToTextureCoord(d_max == d_min ? 0.0 : (d - d_min) / (d_max - d_min), ScatterMuSize / 2);
+        }
+        else
+        {
+            const auto d = -r_mu + std::sqrt(glm::max(0.0, discriminant + H * H));
+            const auto d_min = Rt - r, d_max = rho + H;
+            u_mu = 0.5 + 0.5 * UnitCoordToTextureCoord((d - d_min) / (d_max - d_min), ScatterMuSize / 2);
+        }
+
+        const auto d = glm::max(0.0, -Rg * mu_s + std::sqrt(glm::max(0.0, Rt * Rt + Rg * Rg * (mu_s * mu_s - 1.0))));
+        const auto d_min = Rt - Rg, d_max = H;
+        const auto a = (d - d_min) / (d_max - d_min);
+        const auto A = -2.0 * MuSMin * Rg / (d_max - d_min);
+        const auto u_mu_s = UnitCoordToTextureCoord(glm::max(1.0 - a / A, 0.0) / (1.0 + a), ScatterMuSSize);
+        const auto u_nu = (nu + 1.0) / 2.0;
+
+        // Trilinear filtering, clamped to the edges, within the two nearest nu slices, and linear between them.
+        const int width = ScatterNuSize * ScatterMuSSize;
+        const glm::dvec3 size{ width, ScatterMuSize, ScatterRSize };
+        auto sample = [&](const glm::dvec3& uvw)
+        {
+            const auto tc = glm::clamp(uvw * size - 0.5, glm::dvec3(0.0), size - 1.0);
+            const auto i0 = glm::min(glm::ivec3(tc), glm::ivec3(size) - 2);
+            const auto f = tc - glm::dvec3(i0);
+            auto texel = [&](int x, int y, int z) { return glm::dvec4(table[x + (y + size_t(z) * ScatterMuSize) * width]); };
+            auto bilinear = [&](int z)
+            {
+                return glm::mix(
+                    glm::mix(texel(i0.x, i0.y, z), texel(i0.x + 1, i0.y, z), f.x),
+                    glm::mix(texel(i0.x, i0.y + 1, z), texel(i0.x + 1, i0.y + 1, z), f.x), f.y);
+            };
+            return glm::mix(bilinear(i0.z), bilinear(i0.z + 1), f.z);
+        };
+        const auto texCoordX = u_nu * (ScatterNuSize - 1);
+        const auto texX = std::floor(texCoordX);
+        const auto lerp = texCoordX - texX;
+        const glm::dvec3 uvw0{ (texX + u_mu_s) / ScatterNuSize, u_mu, u_r };
+        const glm::dvec3 uvw1{ (texX + 1.0 + u_mu_s) / ScatterNuSize, u_mu, u_r };
+        return glm::mix(sample(uvw0), sample(uvw1), lerp);
+    }
+
+    glm::dvec3 ScatteringTables::ComputeScatteringDensity(double r, double mu, double mu_s, double nu) const
+    {
+        // The previous order's light arriving from all directions omega_i, scattered towards the view direction omega
+        // (light reflected by the ground is left out).
+        const auto& p = params;
+        const unsigned NumThetaSamples = 8u, NumPhiSamples = 2u * NumThetaSamples;
+        const auto dTheta = PI / NumThetaSamples, dPhi = 2.0 * PI / NumPhiSamples;
+        const glm::dvec3 omega{ std::sqrt(glm::max(0.0, 1.0 - mu * mu)), 0.0, mu };
+        const auto sunX = omega.x == 0.0 ? 0.0 : (nu - mu * mu_s) / omega.x;
+        const glm::dvec3 omegaS{ sunX, std::sqrt(glm::max(0.0, 1.0 - sunX * sunX - mu_s * mu_s)), mu_s };
+        const auto h = r - Rg;
+        const auto densityR = std::exp(-h / p.HR), densityM = std::exp(-h / p.HM);
+
+        glm::dvec3 density{ 0.0 };
+        for (unsigned l = 0u; l < NumThetaSamples; ++l)
+        {
+            const auto theta = (l + 0.5) * dTheta;
+            const auto cosTheta = std::cos(theta), sinTheta = std::sin(theta);
+            const bool intersectsGround = cosTheta < 0.0 && r * r * (cosTheta * cosTheta - 1.0) + Rg * Rg >= 0.0;
+            const auto dOmegaI = dTheta * dPhi * sinTheta;
+            for (unsigned m = 0u; m < NumPhiSamples; ++m)
+            {
+                const auto phi = (m + 0.5) * dPhi;
+                const glm::dvec3 omegaI{ std::cos(phi) * sinTheta, std::sin(phi) * sinTheta, cosTheta };
+                const auto nu1 = glm::dot(omegaS, omegaI);
+                glm::dvec3 incident;
+                if (1u == numOrders)
+                {
+                    const auto single = LookUpScattering(scattering, r, omegaI.z, mu_s, nu1, intersectsGround);
+                    incident = glm::dvec3(single) * PhaseRayleigh(nu1) + glm::dvec3(single.w * PhaseMie(nu1, p.mieG));
+                }
+                else
+                {
+                    incident = glm::dvec3(LookUpScattering(deltaScattering, r, omegaI.z, mu_s, nu1, intersectsGround));
+                }
+                const auto nu2 = glm::dot(omega, omegaI);
+                density += incident * dOmegaI
+                    * (p.betaR * (densityR * PhaseRayleigh(nu2)) + glm::dvec3(p.betaMSca * densityM * PhaseMie(nu2, p.mieG)));
+            }
+        }
+        return density;
+    }
+
+    glm::dvec3 ScatteringTables::ComputeMultipleScattering(double r, double mu, double mu_s, double nu, bool intersectsGround) const
+    {
+        const unsigned NumSteps = 50u;
+        const auto distance = intersectsGround
+            ? glm::max(0.0, -r * mu - std::sqrt(glm::max(0.0, Rg * Rg + r * r * (mu * mu - 1.0))))
+            : glm::max(0.0, -r * mu + std::sqrt(glm::max(0.0, Rt * Rt + r * r * (mu * mu - 1.0))));
+        const auto dx = distance / NumSteps;
+        glm::dvec3 scattered{ 0.0 };
+        for (unsigned step = 0u; step <= NumSteps; ++step)
+        {
+            const auto d = dx * step;
+            const auto r_d = glm::clamp(std::sqrt(d * d + r * r + 2.0 * r * mu * d), Rg, Rt);
+            const auto mu_d = glm::clamp((r * mu + d) / r_d, -1.0, 1.0);
+            const auto mu_s_d = glm::clamp((r * mu_s + d * nu) / r_d, -1.0, 1.0);
+            const auto weight = 0u == step || NumSteps == step ? 0.5 : 1.0; // (trapezoidal)
+            scattered += GetTransmittance(r, mu, d, intersectsGround)
+                * glm::dvec3(LookUpScattering(scatteringDensity, r_d, mu_d, mu_s_d, nu, intersectsGround)) * (dx * weight);
+        }
+        return scattered;
+    }
+
+    void ScatteringTables::ComputeNextScatteringOrder(unsigned numThreads)
+    {
+        if (transmittance.empty()) ComputeTransmittance(numThreads);
+        // (the previous order isn't stored with the tables, so loaded multiple scattering has to start over)
+        if (0u == numOrders || (numOrders > 1u && deltaScattering.empty())) ComputeScattering(numThreads);
+
+        const int width = ScatterNuSize * ScatterMuSSize;
+        const size_t numRows = size_t(ScatterMuSize) * ScatterRSize;
+        auto forEachTexel = [&](auto f)
+        {
+            ParallelFor(numRows, numThreads, [&](size_t row)
+            {
+                const auto y = int(row % ScatterMuSize), z = int(row / ScatterMuSize);
+                for (int x = 0; x < width; ++x)
+                {
+                    double r, mu, mu_s, nu;
+                    bool intersectsGround;
+                    GetScatteringTexelParameters(x, y, z, r, mu, mu_s, nu, intersectsGround);
+                    f(x + row * width, r, mu, mu_s, nu, intersectsGround);
+                }
+            });
+        };
+
+        scatteringDensity.resize(scattering.size());
+        forEachTexel([&](size_t i, double r, double mu, double mu_s, double nu, bool)
+        {
+            scatteringDensity[i] = glm::vec4(ComputeScatteringDensity(r, mu, mu_s, nu), 0.0f);
+        });
+        std::vector<glm::vec4> delta(scattering.size());
+        forEachTexel([&](size_t i, double r, double mu, double mu_s, double nu, bool intersectsGround)
+        {
+            const auto scattered = ComputeMultipleScattering(r, mu, mu_s, nu, intersectsGround);
+            delta[i] = glm::vec4(scattered, 0.0f);
+            scattering[i] += glm::vec4(scattered / PhaseRayleigh(nu), 0.0f);
+        });
+        deltaScattering = std::move(delta);
+        scatteringDensity = {}; // (only needed within an order)
+        ++numOrders;
+    }
+
+    std::string ScatteringTables::GetCachePath(const std::string& directory, unsigned orders) const
+    {
+        std::ostringstream ss;
+        ss << directory << "scattering_" << std::hex << std::setw(16) << std::setfill('0') << key << std::dec << "_" << orders << ".tables";
+        return ss.str();
+    }
+
+    bool ScatteringTables::Save(const std::string& path) const
+    {
+        std::ofstream file{ path, std::ios::binary };
+        if (!file.is_open())
+        {
+            std::cerr << "Could not open scattering tables file " << path << " for writing.\n";
+            return false;
+        }
+        file.write(FileMagic, sizeof(FileMagic));
+        file.write(reinterpret_cast<const char*>(&FileVersion), sizeof(FileVersion));
+        file.write(reinterpret_cast<const char*>(&key), sizeof(key));
+        const uint32_t orders = numOrders;
+        file.write(reinterpret_cast<const char*>(&orders), sizeof(orders));
+        file.write(reinterpret_cast<const char*>(transmittance.data()), sizeof(glm::vec4) * transmittance.size());
+        file.write(reinterpret_cast<const char*>(scattering.data()), sizeof(glm::vec4) * scattering.size());
+        if (!file)
+        {
+            std::cerr << "Could not write scattering tables file " << path << ".\n";
+            return false;
+        }
+        return true;
+    }
+
+    bool ScatteringTables::Load(const std::string& path)
+    {
+        std::ifstream file{ path, std::ios::binary };
+        if (!file.is_open()) return false;
+        char magic[sizeof(FileMagic)];
+        uint32_t version = 0u;
+        uint64_t fileKey = 0u;
+        uint32_t orders = 0u;
+        if (!file.read(magic, sizeof(magic)) || std::memcmp(magic, FileMagic, sizeof(magic))
+            || !file.read(reinterpret_cast<char*>(&version), sizeof(version)) || FileVersion != version
+            || !file.read(reinterpret_cast<char*>(&fileKey), sizeof(fileKey)) || key != fileKey
+            || !file.read(reinterpret_cast<char*>(&orders), sizeof(orders)) || !orders)
+        {
+            return false;
+        }
+        std::vector<glm::vec4> t(size_t(TransmittanceWidth) * TransmittanceHeight);
+        std::vector<glm::vec4> s(size_t(ScatterNuSize * ScatterMuSSize) * ScatterMuSize * ScatterRSize);
+        if (!file.read(reinterpret_cast<char*>(t.data()), sizeof(glm::vec4) * t.size())
+            || !file.read(reinterpret_cast<char*>(s.data()), sizeof(glm::vec4) * s.size()))
+        {
+            std::cerr << "Scattering tables file " << path << " is truncated.\n";
+            return false;
+        }
+        transmittance = std::move(t);
+        scattering = std::move(s);
+        numOrders = orders;
+        deltaScattering.clear();
+        return true;
+    }
+}
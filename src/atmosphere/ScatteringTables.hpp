@@ -0,0 +1,61 @@
+#pragma once
+#include "BrickStore.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Mulen::Atmosphere {
+
+    // CPU computation of the precomputed transmittance and single scattering tables, as transmittance.glsl and
+    // inscatter_first.glsl compute them into transmittanceTexture and scatterTexture, with a disk cache of the results.
+    // The tables only depend on the physical parameters (and their sizes), so they're keyed by a hash of those.
+    // This is kept free of GPU calls; it also serves as a reference for the GPU tables and for the reference renderer.
+    class ScatteringTables
+    {
+    public:
+        static constexpr int TransmittanceWidth = 256, TransmittanceHeight = 64; // (as in common.glsl)
+        static constexpr int ScatterRSize = 32, ScatterMuSize = 128, ScatterMuSSize = 32, ScatterNuSize = 16;
+        static constexpr double MuSMin = -0.2;
+
+        explicit ScatteringTables(const BrickStore::Parameters&);
+
+        // rgb transmittance to the atmosphere top, TransmittanceWidth * TransmittanceHeight texels.
+        std::vector<glm::vec4> transmittance;
+        // Rayleigh rgb and Mie r single scattering, (ScatterNuSize * ScatterMuSSize) * ScatterMuSize * ScatterRSize texels.
+        std::vector<glm::vec4> scattering;
+
+        void ComputeTransmittance(unsigned numThreads = 0u); // (zero threads for one per hardware thread)
+        void ComputeScattering(unsigned numThreads = 0u); // (after the transmittance, which it looks up)
+        // Multiple scattering, progressively: each call adds the next order (after the single scattering) to the
+        // scattering table, so that it's usable after any of them. As in Bruneton's, it's added to the Rayleigh
+        // channels, divided by the Rayleigh phase function (which the lookup multiplies it by). Light reflected by the
+        // ground isn't included.
+        void ComputeNextScatteringOrder(unsigned numThreads = 0u);
+        unsigned GetNumScatteringOrders() const { return numOrders; } // that the scattering table includes
+
+        uint64_t GetKey() const { return key; }
+        std::string GetCachePath(const std::string& directory, unsigned numOrders = 1u) const;
+        bool Save(const std::string& path) const;
+        bool Load(const std::string& path); // fails quietly if there's no such file (or it's for other parameters)
+
+        // Lookups in the transmittance table, as in common.glsl (bilinear, clamped to the edges).
+        glm::dvec3 GetTransmittanceToAtmosphereTop(double r, double mu) const;
+        glm::dvec3 GetTransmittanceToSun(double r, double mu_s) const;
+        glm::dvec3 GetTransmittance(double r, double mu, double d, bool intersectsGround) const;
+
+    private:
+        BrickStore::Parameters params;
+        double Rg, Rt;
+        uint64_t key;
+        unsigned numOrders = 0u;
+        // The previous order's scattering (phase functions included), and the density of light it scatters.
+        std::vector<glm::vec4> deltaScattering, scatteringDensity;
+
+        glm::dvec3 ComputeTransmittance(double r, double mu) const;
+        void ComputeSingleScattering(double r, double mu, double mu_s, double nu, bool intersectsGround, glm::dvec3& rayleigh, glm::dvec3& mie) const;
+        void GetScatteringTexelParameters(int x, int y, int z, double& r, double& mu, double& mu_s, double& nu, bool& intersectsGround) const;
+        glm::dvec4 LookUpScattering(const std::vector<glm::vec4>& table, double r, double mu, double mu_s, double nu, bool intersectsGround) const;
+        glm::dvec3 ComputeScatteringDensity(double r, double mu, double mu_s, double nu) const;
+        glm::dvec3 ComputeMultipleScattering(double r, double mu, double mu_s, double nu, bool intersectsGround) const;
+    };
+}
@@ -1,17 +1,22 @@
 #include "Updater.hpp"
 #include "Atmosphere.hpp"
+#include "OctreeMap.hpp"
 #include <functional>
 #include <queue>
 #include <unordered_set>
 #include <iostream>
 #include "util/Timer.hpp"
 #include <numeric>
+#include <cstring>
+#include <algorithm>
 
 namespace Mulen::Atmosphere {
 
     Updater::Updater(Atmosphere& atmosphere)
         : generator{ "generator" }
         , featureGenerator{ "feature_generator" }
+        , timer{ atmosphere.timer }
+        , profilerRefs{ atmosphere.profilerRefs }
         , thread(&Updater::UpdateLoop, this)
         , octree{ atmosphere.octree }
     {
@@ -59,6 +64,12 @@ namespace Mulen::Atmosphere {
     {
         WaitForUpdateReady();
         progress = {};
+        stages.clear(); // (rebuilt for the atmosphere's brick format)
+        totalStagesTime = 0.0;
+        hasLastParams = false;
+        refreshCursor = refreshRemaining = 0u;
+        lightDependencies = {};
+        pendingRelight.clear();
 
         // Then split to a predefined depth.
         // - to do: enable splitting to a determined depth and location, especially for use in benchmarking)
@@ -123,101 +134,196 @@ namespace Mulen::Atmosphere {
         return shader;
     }
 
-    void Updater::UpdateMap(Atmosphere& atmosphere, Util::Texture& octreeMap, glm::vec3 pos, glm::vec3 scale, unsigned depthOffset)
+    void Updater::UpdateMap(Atmosphere& atmosphere, Util::Texture& octreeMap, glm::vec3 pos, glm::vec3 scale, unsigned depthOffset, bool fromStateMap)
     {
         auto& shader = SetShader(atmosphere, atmosphere.updateOctreeMapShader);
         const glm::uvec3 resolution{ octreeMap.GetWidth(), octreeMap.GetHeight(), octreeMap.GetDepth() };
         shader.Uniform3f("resolution", glm::vec3(resolution));
         shader.Uniform3f("mapPosition", pos);
         shader.Uniform3f("mapScale", scale / glm::vec3(resolution));
-        shader.Uniform1u("maxDepth", glm::uvec1(static_cast<unsigned>(log2(static_cast<float>(resolution.x)) - 1u + depthOffset)));
+        shader.Uniform1u("maxDepth", glm::uvec1(OctreeMap::GetMaxDepth(resolution.x, depthOffset)));
+        shader.Uniform1u("useStateMap", glm::uvec1(fromStateMap ? 1u : 0u));
         glBindImageTexture(0u, octreeMap.GetId(), 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R32UI);
         const auto groups = resolution / 8u;
         glDispatchCompute(groups.x, groups.y, groups.z);
         glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
     }
 
-    void Updater::UpdateNodes(Atmosphere& atmosphere, uint64_t num)
+    void Updater::UpdateNodes(Atmosphere& atmosphere, uint64_t num, uint64_t first)
     {
-        SetShader(atmosphere, atmosphere.updateShader);
+        auto& shader = SetShader(atmosphere, atmosphere.updateShader);
+        shader.Uniform1u("nodeUploadOffset", glm::uvec1{ (unsigned)first });
         glDispatchCompute((GLuint)num, 1u, 1u);
         glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
     }
 
-    void Updater::GenerateBricks(Atmosphere& atmosphere, GpuState& state, Generator& gen, uint64_t first, uint64_t num)
+    void Updater::GenerateBricks(Atmosphere& atmosphere, GpuState& state, Generator& gen, const Util::ShaderVariants::Defines& variant, uint64_t first, uint64_t num)
     {
-        glBindImageTexture(0u, state.brickTexture.GetId(), 0, GL_TRUE, 0, GL_READ_WRITE, BrickFormat);
+        const auto& format = GetBrickFormatInfo(atmosphere.brickFormat);
+        glBindImageTexture(0u, atmosphere.GetBrickWriteTexture(state).GetId(), 0, GL_TRUE, 0, GL_READ_WRITE, format.imageFormat);
         {
             //auto t = timer.Begin("Generation");
-            auto& shader = SetShader(atmosphere, gen.GetShader());
+            auto& shader = SetShader(atmosphere, gen.GetShader().Get(variant));
             shader.Uniform1u("brickUploadOffset", glm::uvec1{ (unsigned)first });
             glDispatchCompute((GLuint)num, 1u, 1u);
             glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
         }
-        { // "optimisation" pass (compute constancy flags, possibly more)
-            auto& shader = SetShader(atmosphere, atmosphere.updateFlagsShader);
-            shader.Uniform1u("brickUploadOffset", glm::uvec1{ (unsigned)first });
-            glDispatchCompute((GLuint)num, 1u, 1u);
-            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        UpdateBrickFlags(atmosphere, state, first, num);
+    }
+
+    void Updater::UpdateBrickFlags(Atmosphere& atmosphere, GpuState& state, uint64_t first, uint64_t num)
+    {
+        // "optimisation" pass (compute constancy flags, possibly more)
+        const auto& format = GetBrickFormatInfo(atmosphere.brickFormat);
+        glBindImageTexture(0u, atmosphere.GetBrickWriteTexture(state).GetId(), 0, GL_TRUE, 0, GL_READ_ONLY, format.imageFormat);
+        auto& shader = SetShader(atmosphere, atmosphere.updateFlagsShader);
+        shader.Uniform1u("brickUploadOffset", glm::uvec1{ (unsigned)first });
+        glDispatchCompute((GLuint)num, 1u, 1u);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+    void Updater::UpdateEmptyDistances(Atmosphere& atmosphere, uint64_t first, uint64_t num)
+    {
+        auto& shader = SetShader(atmosphere, atmosphere.updateEmptyDistanceShader);
+        shader.Uniform1u("brickUploadOffset", glm::uvec1{ (unsigned)first });
+        shader.Uniform1u("numBricks", glm::uvec1{ (unsigned)num });
+        const auto workGroupSize = 64u;
+        glDispatchCompute((GLuint)((num + workGroupSize - 1u) / workGroupSize), 1u, 1u);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+    void Updater::CollectPrefilterNodes(const UpdateIteration& it)
+    {
+        // Parent nodes by depth, deepest first, so that each level averages already prefiltered children.
+        std::vector<std::vector<NodeIndex>> depths;
+        for (const auto& upload : it.nodesToUpload)
+        {
+            const auto depth = upload.nodeGroup.GetDepth();
+            for (NodeIndex ci = 0u; ci < NodeArity; ++ci)
+            {
+                if (InvalidIndex == upload.nodeGroup.nodes[ci].children) continue;
+                if (depths.size() <= depth) depths.resize(depth + 1u);
+                depths[depth].push_back(Octree::GroupAndChildToNode(upload.groupIndex, ci));
+            }
+        }
+        prefilterNodes.clear();
+        prefilterLevels.clear();
+        for (auto d = depths.rbegin(); d != depths.rend(); ++d)
+        {
+            if (d->empty()) continue;
+            prefilterLevels.push_back({ prefilterNodes.size(), d->size() });
+            prefilterNodes.insert(prefilterNodes.end(), d->begin(), d->end());
         }
     }
 
-    void Updater::LightBricks(Atmosphere& atmosphere, GpuState& state, uint64_t first, uint64_t num, const Object::Position& lightDir, const Util::Timer::DurationMeta& timerMeta)
+    void Updater::PrefilterBricks(Atmosphere& atmosphere, GpuState& state, const NodeIndex* nodes, size_t num)
+    {
+        if (!num) return;
+        const auto& format = GetBrickFormatInfo(atmosphere.brickFormat);
+        glBindImageTexture(0u, atmosphere.GetBrickWriteTexture(state).GetId(), 0, GL_TRUE, 0, GL_READ_WRITE, format.imageFormat);
+        UploadAndBind(atmosphere, atmosphere.gpuGenData, 3u, sizeof(NodeIndex) * num, nodes);
+        SetShader(atmosphere, atmosphere.prefilterBricksShader);
+        glDispatchCompute((GLuint)num, 1u, 1u);
+        // (the next level reads these bricks, and later stages their flags)
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+    Util::Shader& Updater::SetLightShader(Atmosphere& atmosphere, Util::ShaderVariants& variants, uint64_t first, const Object::Position& lightDir,
+        LightingMode mode, float coneAperture, bool perGroupLighting)
     {
-        const auto numGroups = num / NodeArity; // - to do: num groups as parameter instead, to disallow incorrect use
         auto& groupsTex = atmosphere.brickLightPerGroupTexture;
+        auto& shader = SetShader(atmosphere, variants.Get(GetLightingVariant(mode, perGroupLighting)));
+        shader.Uniform1u("brickUploadOffset", glm::uvec1{ (unsigned)first });
 
-        auto setShader = [&](Util::Shader& shader)
-        {
-            SetShader(atmosphere, shader);
-            shader.Uniform1u("brickUploadOffset", glm::uvec1{ (unsigned)first });
+        // Scale to cover the node group, translate outside it, and rotate to face the light.
+        auto ori = Object::Position{ 0, 0, 1 }; // original facing
+        auto axis = glm::cross(ori, lightDir);
+        Object::Orientation q = Object::Orientation(glm::dot(ori, lightDir), axis);
+        q.w += glm::length(q);
+        q = glm::normalize(q);
+
+        const auto scaleFactor = sqrt(3.0);
+        Object::Mat4 mat = glm::scale(Object::Mat4{ 1.0 }, Object::Position(scaleFactor));
+        mat = glm::translate(mat, glm::dvec3(0.0, 0.0, sqrt(3.0)));
+        mat = glm::toMat4(q) * mat;
+
+        // Translation is unnecessary for the lookup.
+        Object::Mat4 invMat = glm::scale(Object::Mat4{ 1.0 }, Object::Position(1.0 / scaleFactor))
+            * glm::toMat4(glm::conjugate(q));
+
+        shader.UniformMat4("groupLightMat", mat);
+        shader.UniformMat4("invGroupLightMat", invMat);
+        shader.Uniform3u("uGroupsRes", glm::uvec3(groupsTex.GetWidth(), groupsTex.GetHeight(), groupsTex.GetDepth()) / LightPerGroupRes);
+        shader.Uniform1f("coneAperture", glm::vec1{ coneAperture });
+        return shader;
+    }
 
-            // Scale to cover the node group, translate outside it, and rotate to face the light.
-            auto ori = Object::Position{ 0, 0, 1 }; // original facing
-            auto axis = glm::cross(ori, lightDir);
-            Object::Orientation q = Object::Orientation(glm::dot(ori, lightDir), axis);
-            q.w += glm::length(q);
-            q = glm::normalize(q);
-
-            const auto scaleFactor = sqrt(3.0);
-            Object::Mat4 mat = glm::scale(Object::Mat4{ 1.0 }, Object::Position(scaleFactor));
-            mat = glm::translate(mat, glm::dvec3(0.0, 0.0, sqrt(3.0)));
-            mat = glm::toMat4(q) * mat;
-
-            // Translation is unnecessary for the lookup.
-            Object::Mat4 invMat = glm::scale(Object::Mat4{ 1.0 }, Object::Position(1.0 / scaleFactor))
-                * glm::toMat4(glm::conjugate(q));
-
-            shader.UniformMat4("groupLightMat", mat);
-            shader.UniformMat4("invGroupLightMat", invMat);
-            shader.Uniform3u("uGroupsRes", glm::uvec3(groupsTex.GetWidth(), groupsTex.GetHeight(), groupsTex.GetDepth()) / LightPerGroupRes);
-        };
+    void Updater::LightBricks(Atmosphere& atmosphere, GpuState& state, uint64_t first, uint64_t num, const Object::Position& lightDir, const Util::Timer::DurationMeta& timerMeta,
+        LightingMode mode, float coneAperture, bool perGroupLighting)
+    {
+        const auto numGroups = num / NodeArity; // - to do: num groups as parameter instead, to disallow incorrect use
 
-        // First mini 2D shadow maps per group.
+        // First mini 2D shadow maps per group (which cones do without, and the sweep has made already).
+        if (LightingMode::ShadowRays == mode && perGroupLighting)
         {
-            auto t = atmosphere.timer.Begin(Profiler_UpdateLightPerGroup, timerMeta);
+            auto t = atmosphere.timer.Begin(atmosphere.profilerRefs.updateLightPerGroup, timerMeta);
             glBindImageTexture(0u, atmosphere.brickLightPerGroupTexture.GetId(), 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R16);
-            setShader(atmosphere.updateLightPerGroupShader);
+            SetLightShader(atmosphere, atmosphere.updateLightPerGroupShader, first, lightDir, mode, coneAperture, perGroupLighting);
             glDispatchCompute((GLuint)numGroups, 1u, 1u);
             glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
         }
 
         // Then per-voxel shadowing, accelerated by the per-group shadow maps.
         {
-            auto t = atmosphere.timer.Begin(Profiler_UpdateLightPerVoxel, timerMeta);
+            auto t = atmosphere.timer.Begin(atmosphere.profilerRefs.updateLightPerVoxel, timerMeta);
             atmosphere.brickLightPerGroupTexture.Bind(3u);
             glBindImageTexture(0u, atmosphere.brickLightTextureTemp.GetId(), 0, GL_TRUE, 0, GL_WRITE_ONLY, BrickLightFormat);
-            setShader(atmosphere.updateLightShader);
+            SetLightShader(atmosphere, atmosphere.updateLightShader, first, lightDir, mode, coneAperture, perGroupLighting);
             glDispatchCompute((GLuint)num, 1u, 1u);
             glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
         }
     }
 
+    void Updater::CollectSweepSlabs(const UpdateIteration& it, const Object::Position& lightDir)
+    {
+        // All groups of the iteration get maps (not just those to be relit), since downstream ones continue from them.
+        sweepGroups.clear();
+        for (size_t i = 0u; i < it.nodesToUpload.size(); ++i)
+        {
+            const auto& loc = it.bricksToUpload[i * NodeArity].nodeLocation; // (of the group's first node)
+            const auto halfSize = 2.0 * loc.w;
+            const auto center = Object::Position(glm::vec3(loc)) + double(loc.w);
+            sweepGroups.push_back({ NodeIndex(i), BrickLighting::GetSweepKey(center, halfSize, lightDir), halfSize });
+        }
+        const auto maxSlabs = 256u; // (as BrickLighting::Settings, so that the CPU reference sweeps alike)
+        BrickLighting::BuildSweepSlabs(sweepGroups, maxSlabs, sweepSlabs);
+        sweepUploads.resize(sweepGroups.size());
+        for (size_t i = 0u; i < sweepGroups.size(); ++i) sweepUploads[i] = sweepGroups[i].index;
+    }
+
+    void Updater::SweepLight(Atmosphere& atmosphere, const Object::Position& lightDir, size_t firstSlab, size_t numSlabs)
+    {
+        // Each slab reads the maps of earlier ones (at unit 3) while writing its own.
+        auto& groupsTex = atmosphere.brickLightPerGroupTexture;
+        groupsTex.Bind(3u);
+        glBindImageTexture(0u, groupsTex.GetId(), 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R16);
+        auto& shader = SetLightShader(atmosphere, atmosphere.updateLightPerGroupShader, 0u, lightDir, LightingMode::Sweep, 0.0f, true);
+        for (auto si = firstSlab; si < firstSlab + numSlabs; ++si)
+        {
+            const auto& slab = sweepSlabs[si];
+            UploadAndBind(atmosphere, atmosphere.gpuGenData, 3u, sizeof(uint32_t) * slab.second, sweepUploads.data() + slab.first);
+            shader.Uniform1f("slabTopKey", glm::vec1{ float(sweepGroups[slab.first].key) });
+            glDispatchCompute((GLuint)slab.second, 1u, 1u);
+            glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+        }
+    }
+
     void Updater::FilterLighting(Atmosphere& atmosphere, GpuState& state, uint64_t first, uint64_t num)
     {
         //auto t = timer.Begin("Light filter");
-        //glBindImageTexture(0u, state.brickLightTexture.GetId(), 0, GL_TRUE, 0, GL_WRITE_ONLY, BrickLightFormat);
-        glBindImageTexture(0u, state.brickTexture.GetId(), 0, GL_TRUE, 0, GL_READ_WRITE, BrickFormat);
+        const auto& format = GetBrickFormatInfo(atmosphere.brickFormat);
+        if (format.lightFormat) glBindImageTexture(0u, atmosphere.GetBrickLightTexture(state).GetId(), 0, GL_TRUE, 0, GL_WRITE_ONLY, format.lightFormat);
+        else glBindImageTexture(0u, atmosphere.GetBrickWriteTexture(state).GetId(), 0, GL_TRUE, 0, GL_READ_WRITE, format.imageFormat);
         auto& shader = SetShader(atmosphere, atmosphere.lightFilterShader);
         shader.Uniform1u("brickUploadOffset", glm::uvec1{ (unsigned)first });
         atmosphere.brickLightTextureTemp.Bind(1u);
@@ -225,10 +331,153 @@ namespace Mulen::Atmosphere {
         glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
     }
 
+    void Updater::CollectEncodePages(Atmosphere& atmosphere, const UpdateIteration& it)
+    {
+        // (every brick of the iteration is rewritten, since compressed formats aren't used with copy-on-write bricks,
+        // so whole pages can be encoded)
+        const auto& pages = atmosphere.brickPages;
+        encodePages.clear();
+        for (const auto& group : it.nodesToUpload)
+        {
+            for (NodeIndex ci = 0u; ci < NodeArity; ++ci)
+            {
+                const auto page = pages.GetPhysicalPage(Octree::GroupAndChildToNode(group.groupIndex, ci));
+                if (BrickPageTable::NoPage != page) encodePages.push_back(page);
+            }
+        }
+        std::sort(encodePages.begin(), encodePages.end());
+        encodePages.erase(std::unique(encodePages.begin(), encodePages.end()), encodePages.end());
+    }
+
+    void Updater::EncodeBricks(Atmosphere& atmosphere, GpuState& state, const uint32_t* units, size_t num, bool pages)
+    {
+        auto& a = atmosphere;
+        if (!num) return;
+        const auto bricksPerPage = a.pageBricks.x * a.pageBricks.y * a.pageBricks.z;
+        const auto unitRes = pages ? a.pageBricks : glm::uvec3{ 1u };
+        const auto unitBricks = unitRes.x * unitRes.y * unitRes.z;
+        const auto unitTexels = unitRes * BrickRes;
+        // (single bricks are stacked in depth too, so more of them fit in the block texture)
+        const size_t batchUnits = a.brickBlockTexture.GetDepth() / unitTexels.z;
+        auto indexTo3D = [](uint32_t index, const glm::uvec3& res)
+        {
+            return glm::uvec3(index % res.x, (index / res.x) % res.y, index / (res.x * res.y));
+        };
+
+        auto& shader = SetShader(a, a.encodeBricksShader);
+        shader.Uniform1u("uEncodeUnitBricks", glm::uvec1{ unitBricks });
+        shader.Uniform3u("uEncodeUnitRes", unitRes);
+        a.brickWorkTexture.Bind(0u);
+        glBindImageTexture(0u, a.brickBlockTexture.GetId(), 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32UI);
+        auto& compressed = a.GetBrickTexture(state);
+        for (size_t first = 0u; first < num; first += batchUnits)
+        {
+            const auto batch = glm::min(batchUnits, num - first);
+            UploadAndBind(a, a.gpuGenData, 3u, sizeof(uint32_t) * batch, units + first);
+            glDispatchCompute(GLuint(batch * unitBricks), 1u, 1u);
+            glMemoryBarrier(GL_ALL_BARRIER_BITS); // (copies aren't clearly covered by any one bit)
+
+            // Each block texel becomes a 4*4 texel block of the compressed texture.
+            for (size_t i = 0u; i < batch; ++i)
+            {
+                const auto unit = units[first + i];
+                auto brick = indexTo3D(pages ? unit : unit / bricksPerPage, a.pagesRes) * a.pageBricks;
+                if (!pages) brick += indexTo3D(unit % bricksPerPage, a.pageBricks);
+                const auto offset = glm::ivec3(brick * BrickRes);
+                glCopyImageSubData(a.brickBlockTexture.GetId(), GL_TEXTURE_3D, 0, 0, 0, GLint(i * unitTexels.z),
+                    compressed.GetId(), GL_TEXTURE_3D, 0, offset.x, offset.y, offset.z,
+                    unitTexels.x / 4u, unitTexels.y / 4u, unitTexels.z);
+            }
+        }
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    }
+
+    void Updater::UploadAndBind(Atmosphere& atmosphere, Util::Buffer& buffer, GLuint binding, GLsizeiptr size, const void* data)
+    {
+        if (!size) return;
+        uploadBytes += size;
+        auto region = atmosphere.uploadRing.Allocate(size);
+        if (!region.data) // fall back to a plain upload if the ring buffer can't accommodate this
+        {
+            auto t = atmosphere.timer.Begin(atmosphere.profilerRefs.updateUpload);
+            buffer.Upload(0, size, data);
+            buffer.BindBase(GL_SHADER_STORAGE_BUFFER, binding);
+            return;
+        }
+        {
+            auto t = atmosphere.timer.Begin(atmosphere.profilerRefs.updateUploadCopy);
+            std::memcpy(region.data, data, size);
+        }
+        atmosphere.uploadRing.BindRange(GL_SHADER_STORAGE_BUFFER, binding, region.offset, size);
+    }
+
+    void Updater::UploadInto(Atmosphere& atmosphere, Util::Buffer& buffer, GLintptr offset, GLsizeiptr size, const void* data)
+    {
+        if (!size) return;
+        uploadBytes += size;
+        auto region = atmosphere.uploadRing.Allocate(size);
+        if (!region.data)
+        {
+            auto t = atmosphere.timer.Begin(atmosphere.profilerRefs.updateUpload);
+            buffer.Upload(offset, size, data);
+            return;
+        }
+        {
+            auto t = atmosphere.timer.Begin(atmosphere.profilerRefs.updateUploadCopy);
+            std::memcpy(region.data, data, size);
+        }
+        auto t = atmosphere.timer.Begin(atmosphere.profilerRefs.updateUpload);
+        // (a copy is ordered with the shader reads of later commands; barriers are for shaders' own incoherent writes)
+        glCopyNamedBufferSubData(atmosphere.uploadRing.GetId(), buffer.GetId(), region.offset, offset, size);
+    }
+
+    void Updater::BindIterationStaging(Atmosphere& atmosphere)
+    {
+        auto& s = atmosphere.iterationStaging[GetRenderIterationIndex()];
+        s.buffer.BindRange(GL_SHADER_STORAGE_BUFFER, 1u, s.nodesOffset, s.nodesSize);
+        s.buffer.BindRange(GL_SHADER_STORAGE_BUFFER, 2u, s.bricksOffset, s.bricksSize);
+    }
+
+    bool Updater::RenderIterationReleased(bool wait)
+    {
+        // The fence is placed after the last commands that could have read the render iteration's staged records.
+        if (!renderIterationFence) renderIterationFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        auto res = glClientWaitSync(renderIterationFence, GL_SYNC_FLUSH_COMMANDS_BIT, 0u);
+        while (wait && GL_TIMEOUT_EXPIRED == res) res = glClientWaitSync(renderIterationFence, 0, 1000000000u);
+        if (GL_TIMEOUT_EXPIRED == res) return false;
+        glDeleteSync(renderIterationFence);
+        renderIterationFence = nullptr;
+        return true;
+    }
+
+    void Updater::SetDeterministic(bool enable, const StageCosts& costs)
+    {
+        deterministic = enable;
+        fixedStageCosts = enable ? costs : StageCosts{};
+        ApplyFixedStageCosts();
+    }
+
+    void Updater::ApplyFixedStageCosts()
+    {
+        totalStagesTime = 0.0;
+        for (auto& stage : stages)
+        {
+            const auto it = fixedStageCosts.find(stage.str);
+            if (fixedStageCosts.end() != it) stage.cost = it->second;
+            totalStagesTime += stage.cost;
+        }
+    }
+
+    Updater::StageCosts Updater::GetStageCosts() const
+    {
+        StageCosts costs;
+        for (const auto& stage : stages) costs[stage.str] = stage.cost;
+        return costs;
+    }
+
     void Updater::OnFrame(Atmosphere& atmosphere, const UpdateIteration::Parameters& params, double period)
     {
         auto& a = atmosphere;
-        auto& timer = a.timer;
         const auto fps = 60.0; // - to do: measure/adjust
         const auto rate = period / fps;
         const auto dt = 1.0 / 60.0; // - to do: use actual time (though maybe not *directly*)
@@ -240,13 +489,19 @@ namespace Mulen::Atmosphere {
 
             stages.push_back({ Stage::Id::Init,         Profiler_UpdateInit, 0.1 });
             stages.push_back({ Stage::Id::Generate,     Profiler_UpdateGenerate, 40.0 });
+            stages.push_back({ Stage::Id::Prefilter,    Profiler_UpdatePrefilter, 2.0 });
             stages.push_back({ Stage::Id::Map,          Profiler_UpdateMap, 1.0 });
+            stages.push_back({ Stage::Id::Meta,         Profiler_UpdateMeta, 5.0 });
+            stages.push_back({ Stage::Id::Sweep,        Profiler_UpdateLightSweep, 20.0 });
             stages.push_back({ Stage::Id::Light,        Profiler_UpdateLight, 200.0 });
             stages.push_back({ Stage::Id::Filter,       Profiler_UpdateFilter, 15.0 });
+            if (IsCompressed(a.brickFormat)) stages.push_back({ Stage::Id::Encode, Profiler_UpdateEncode, 10.0 });
 
-            for (auto& stage : stages) totalStagesTime += stage.cost;
+            for (auto& stage : stages) stage.timerRef = timer.NameToRef(stage.str);
+            ApplyFixedStageCosts();
         }
 
+        uploadBytes = 0u;
         auto frameCost = 0.0;
         const auto maxFrameCost = dt / period;
         //std::cout << std::endl << "Beginning update loop" << std::endl << std::endl;
@@ -255,8 +510,12 @@ namespace Mulen::Atmosphere {
             auto& it = GetRenderIteration();
             auto& state = a.gpuStates[progress.stateIndex];
             state.gpuNodes.BindBase(GL_SHADER_STORAGE_BUFFER, 0u);
-            state.brickTexture.Bind(0u);
+            a.GetBrickWriteTexture(state).Bind(0u);
             state.octreeMap.Bind(2u);
+            const auto copyOnWrite = a.copyOnWriteBricks;
+            if (copyOnWrite) state.brickSlots.BindBase(GL_SHADER_STORAGE_BUFFER, 5u);
+            const auto zeroCopy = a.zeroCopyUploads;
+            if (zeroCopy) BindIterationStaging(atmosphere);
 
             auto& stage = stages[progress.stage];
             const auto relativeStageCost = stage.cost / totalStagesTime;
@@ -281,18 +540,21 @@ namespace Mulen::Atmosphere {
             {
             case Stage::Id::Init:
             {
-                auto t = timer.Begin(stage.str, timerMeta);
+                auto t = timer.Begin(stage.timerRef, timerMeta);
 
-                // Update stage costs based on measured GPU times.
-                bool allStagesProfiled = true;
+                // Update stage costs based on measured GPU times (unless they're fixed).
+                bool allStagesProfiled = !deterministic;
                 for (auto& stage : stages)
                 {
-                    if (!timer.GetTimings(stage.str).gpuTimes.Size())
+                    if (!timer.GetTimings(stage.timerRef).gpuTimes.Size())
                     {
                         allStagesProfiled = false;
                         break;
                     }
                 }
+                // (GPU times that lag far behind are of the work of a while ago, so until they catch up the costs are kept)
+                const auto latency = timer.GetGpuLatency(latencyWindow);
+                if (latency.frames > maxGpuLatencyFrames) allStagesProfiled = false;
                 if (allStagesProfiled)
                 {
                     //std::cout << "Profile data available on init." << std::endl;
@@ -301,17 +563,10 @@ namespace Mulen::Atmosphere {
                     for (auto& stage : stages)
                     {
                         const size_t window = 50ull; // - to do: adjust
-                        auto& t = timer.GetTimings(stage.str).gpuTimes;
-                        const auto num = static_cast<int>(glm::min(window, t.Size()));
-                        auto sum = 0.0;
-                        for (auto i = 0; i < num; ++i)
-                        {
-                            sum += t[-i].duration / t[-i].meta.factor;
-                        }
-                        auto duration = sum / double(num);
+                        auto duration = timer.GetTimings(stage.timerRef).gpuTimes.AverageScaled(window);
                         duration *= 1e3;
                         
-                        //std::cout << stage.str << ": " << duration << " (over " << num << ")" << std::endl;
+                        //std::cout << stage.str << ": " << duration << std::endl;
                         stage.cost = duration;
                         totalStagesTime += duration;
                     }
@@ -319,42 +574,84 @@ namespace Mulen::Atmosphere {
 
                 // Communicate with the update thread.
                 std::unique_lock<std::mutex> lk{ mutex };
-                if (nextUpdateReady) // has the worker thread completed its iteration?
+                if (deterministic) cv.wait(lk, [&] { return nextUpdateReady; });
+                if (!nextUpdateReady) // has the worker thread completed its iteration?
                 {
-                    nextUpdateReady = false;
-                    updateIteration = (updateIteration + 1ull) % std::extent<decltype(iterations)>::value;
-                    // - actually wrong time (to do: compute correct one-second-into-the-future-from-last-iteration)
-                    GetUpdateIteration().params = params;
-                    lk.unlock();
-                    cv.notify_one();
+                    return; // nothing to do (update-wise) until the worker thread is done
                 }
-                else
+                // With zero-copy staging the GPU reads the render iteration's records in place,
+                // so it can't be handed back to the worker thread until the GPU is done with it.
+                if (zeroCopy && !RenderIterationReleased(deterministic)) return;
+                nextUpdateReady = false;
+                updateIteration = (updateIteration + 1ull) % std::extent<decltype(iterations)>::value;
+                ++numIterations;
+                // - actually wrong time (to do: compute correct one-second-into-the-future-from-last-iteration)
+                GetUpdateIteration().params = params;
+                const auto numStates = std::extent<decltype(a.gpuStates)>::value;
+                const auto stateIndex = (progress.stateIndex + 1u) % numStates;
+                const auto prevStateIndex = (stateIndex + 1u) % numStates;
+                if (copyOnWrite)
                 {
-                    return; // nothing to do (update-wise) until the worker thread is done
+                    a.GetDisplacedBrickGroups(progress.stateIndex, GetUpdateIteration().displacedGroups, maxDirtyGroups);
+                    // The new state shares the unchanged bricks of the current one, and new split children
+                    // get slots of their own in the previous state (for the parent data written into them below).
+                    a.UpdateBrickSlots(GetRenderIteration(), stateIndex);
+                    a.ReassignBrickSlots(priorSplitGroups, prevStateIndex);
+                    // (before the worker thread starts on the next iteration, whose splits are sure of the slots left)
+                    GetUpdateIteration().maxSplitGroups = a.GetNumFreeBrickSlotGroups();
                 }
+                lk.unlock();
+                cv.notify_one();
 
-                progress.stateIndex = (progress.stateIndex + 1ull) % std::extent<decltype(a.gpuStates)>::value;
+                progress.stateIndex = stateIndex;
                 progress.fraction = 0.0;
                 totalItems = numToDo = 1u;
 
+                // Make the bricks of the new iteration resident (and release those no state uses any more).
+                a.UpdateBrickPages(GetRenderIteration());
+
                 // Interpolate old state for split nodes using their current parents.
                 // (to avoid temporal seams in animation interpolation)
                 {
-                    auto t = timer.Begin(Profiler_UpdateInitSplits);
+                    auto t = timer.Begin(a.profilerRefs.updateInitSplits);
 
-                    auto& prevState = atmosphere.gpuStates[(progress.stateIndex + 1u) % std::extent<decltype(atmosphere.gpuStates)>::value];
-                    auto& state = atmosphere.gpuStates[(progress.stateIndex + 2u) % std::extent<decltype(atmosphere.gpuStates)>::value];
+                    auto& prevState = atmosphere.gpuStates[prevStateIndex];
+                    auto& state = atmosphere.gpuStates[(progress.stateIndex + 2u) % numStates];
 
                     state.gpuNodes.BindBase(GL_SHADER_STORAGE_BUFFER, 0u);
-                    prevState.brickTexture.Bind(0u);
-                    glBindImageTexture(0u, prevState.brickTexture.GetId(), 0, GL_TRUE, 0, GL_READ_WRITE, BrickFormat);
+                    if (copyOnWrite) prevState.brickSlots.BindBase(GL_SHADER_STORAGE_BUFFER, 5u);
+                    const auto& format = GetBrickFormatInfo(a.brickFormat);
+                    a.GetBrickTexture(prevState).Bind(0u);
+                    // (with compressed bricks, the work texture is free to write into at this point, for encoding below)
+                    glBindImageTexture(0u, a.GetBrickWriteTexture(prevState).GetId(), 0, GL_TRUE, 0, GL_READ_WRITE, format.imageFormat);
+                    if (format.lightFormat)
+                    {
+                        auto& prevLightTexture = a.GetBrickLightTexture(prevState);
+                        prevLightTexture.Bind(8u);
+                        glBindImageTexture(1u, prevLightTexture.GetId(), 0, GL_TRUE, 0, GL_WRITE_ONLY, format.lightFormat);
+                    }
 
-                    atmosphere.gpuGenData.Upload(0, sizeof(NodeIndex) * priorSplitGroups.size(), priorSplitGroups.data());
-                    atmosphere.gpuGenData.BindBase(GL_SHADER_STORAGE_BUFFER, 3u);
+                    UploadAndBind(atmosphere, atmosphere.gpuGenData, 3u, sizeof(NodeIndex) * priorSplitGroups.size(), priorSplitGroups.data());
                     auto& shader = SetShader(atmosphere, atmosphere.initSplitsShader);
                     glDispatchCompute((GLuint)(priorSplitGroups.size() * NodeArity), 1u, 1u);
                     glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
 
+                    if (IsCompressed(a.brickFormat))
+                    {
+                        const auto bricksPerPage = size_t(a.pageBricks.x) * a.pageBricks.y * a.pageBricks.z;
+                        encodeBricks.clear();
+                        for (auto gi : priorSplitGroups)
+                        {
+                            for (NodeIndex ci = 0u; ci < NodeArity; ++ci)
+                            {
+                                const auto brick = Octree::GroupAndChildToNode(gi, ci);
+                                const auto page = a.brickPages.GetPhysicalPage(brick);
+                                if (BrickPageTable::NoPage != page) encodeBricks.push_back(static_cast<uint32_t>(page * bricksPerPage + brick % bricksPerPage));
+                            }
+                        }
+                        EncodeBricks(atmosphere, prevState, encodeBricks.data(), encodeBricks.size(), false);
+                    }
+
                     priorSplitGroups.swap(GetRenderIteration().splitGroups);
                 }
 
@@ -365,7 +662,7 @@ namespace Mulen::Atmosphere {
                 computeWorkSize(it.nodesToUpload.size()); // assuming num bricks = num node groups * NodeArity (which should always be true)
                 if (numToDo)
                 {
-                    auto t = timer.Begin(stage.str, timerMeta);
+                    auto t = timer.Begin(stage.timerRef, timerMeta);
                     const auto bricksOffset = last * NodeArity, numBricks = numToDo * NodeArity;
 
                     // Convert generation data offsets and sizes.
@@ -379,45 +676,124 @@ namespace Mulen::Atmosphere {
                     }
                     if (genDataSize) // upload generator-specific data, if it exists
                     {
-                        a.gpuGenData.Upload(0, genDataSize * sizeof(decltype(it.genData)::value_type), it.genData.data() + startingOffset);
+                        UploadAndBind(atmosphere, a.gpuGenData, 3u, genDataSize * sizeof(decltype(it.genData)::value_type), it.genData.data() + startingOffset);
                         // - maybe to do: automatically resize GPU buffer if needed? At least check for overflow and log the error
                     }
                     // - to do: use generator-specific shader for brick generation
 
-                    a.gpuUploadNodes.Upload(0, sizeof(UploadNodeGroup) * numToDo, it.nodesToUpload.data() + last);
-                    UpdateNodes(atmosphere, numToDo);
-                    a.gpuUploadBricks.Upload(sizeof(UploadBrick) * bricksOffset, sizeof(UploadBrick) * numBricks, it.bricksToUpload.data() + bricksOffset);
-                    GenerateBricks(atmosphere, state, *params.generator, bricksOffset, numBricks);
+                    if (zeroCopy)
+                    {
+                        // The records are already resident (and bound), so there's nothing to copy.
+                        uploadBytes += sizeof(UploadNodeGroup) * numToDo + sizeof(UploadBrick) * numBricks;
+                        UpdateNodes(atmosphere, numToDo, last);
+                    }
+                    else
+                    {
+                        UploadAndBind(atmosphere, a.gpuUploadNodes, 1u, sizeof(UploadNodeGroup) * numToDo, it.nodesToUpload.data() + last);
+                        UpdateNodes(atmosphere, numToDo);
+                        // (bricks are indexed by later stages as well, so these are copied into place rather than bound)
+                        UploadInto(atmosphere, a.gpuUploadBricks, sizeof(UploadBrick) * bricksOffset, sizeof(UploadBrick) * numBricks, it.bricksToUpload.data() + bricksOffset);
+                    }
+                    const auto variant = GetGeneratorVariant(it.params.optimiseGeneration, it.params.cumulusWindCells);
+                    if (copyOnWrite)
+                    {
+                        // Only changed bricks are regenerated, but flags are recomputed for all (since node uploads reset them).
+                        const auto dirtyBricks = it.numDirtyGroups * NodeArity;
+                        const auto numGenerated = dirtyBricks > bricksOffset ? glm::min(dirtyBricks - bricksOffset, (size_t)numBricks) : 0u;
+                        if (numGenerated) GenerateBricks(atmosphere, state, *params.generator, variant, bricksOffset, numGenerated);
+                        if (numBricks > numGenerated) UpdateBrickFlags(atmosphere, state, bricksOffset + numGenerated, numBricks - numGenerated);
+                    }
+                    else GenerateBricks(atmosphere, state, *params.generator, variant, bricksOffset, numBricks);
+                }
+                break;
+            }
+            case Stage::Id::Prefilter:
+            {
+                // Only cone lighting reads parent bricks as averages of their children.
+                // (not with copy-on-write bricks, whose parents may be shared with the other states;
+                // cones then see the parents' own, coarser, generated density)
+                if (LightingMode::Cones != it.params.lightingMode || copyOnWrite) break;
+                if (!last) CollectPrefilterNodes(it);
+                computeWorkSize(prefilterLevels.size());
+                if (numToDo)
+                {
+                    auto t = timer.Begin(stage.timerRef, timerMeta);
+                    for (auto i = last; i < last + numToDo; ++i)
+                    {
+                        const auto& level = prefilterLevels[i];
+                        PrefilterBricks(atmosphere, state, prefilterNodes.data() + level.first, level.second);
+                    }
                 }
                 break;
             }
             case Stage::Id::Map:
             {
-                auto t = timer.Begin(stage.str, timerMeta);
+                auto t = timer.Begin(stage.timerRef, timerMeta);
                 UpdateMap(atmosphere, state.octreeMap);
                 totalItems = numToDo = 1u;
                 break;
             }
+            case Stage::Id::Meta:
+            {
+                computeWorkSize(it.bricksToUpload.size());
+                if (numToDo)
+                {
+                    auto t = timer.Begin(stage.timerRef, timerMeta);
+                    UpdateEmptyDistances(atmosphere, last, numToDo);
+                }
+                break;
+            }
+            case Stage::Id::Sweep:
+            {
+                if (LightingMode::Sweep != it.params.lightingMode) break;
+                if (!last) CollectSweepSlabs(it, params.lightDirection);
+                computeWorkSize(sweepSlabs.size());
+                if (numToDo)
+                {
+                    auto t = timer.Begin(stage.timerRef, timerMeta);
+                    SweepLight(atmosphere, params.lightDirection, last, numToDo);
+                }
+                break;
+            }
             case Stage::Id::Light:
             {
-                computeWorkSize(it.bricksToUpload.size() / NodeArity);
+                computeWorkSize(copyOnWrite ? it.numDirtyGroups : it.bricksToUpload.size() / NodeArity);
                 if (numToDo)
                 {
-                    auto t = timer.Begin(stage.str, timerMeta);
-                    LightBricks(atmosphere, state, last * NodeArity, numToDo * NodeArity, params.lightDirection, timerMeta);
+                    auto t = timer.Begin(stage.timerRef, timerMeta);
+                    LightBricks(atmosphere, state, last * NodeArity, numToDo * NodeArity, params.lightDirection, timerMeta,
+                        it.params.lightingMode, it.params.coneAperture, it.params.perGroupLighting);
                 }
                 break;
             }
             case Stage::Id::Filter:
             {
-                computeWorkSize(it.bricksToUpload.size());
+                computeWorkSize(copyOnWrite ? it.numDirtyGroups * NodeArity : it.bricksToUpload.size());
                 if (numToDo)
                 {
-                    auto t = timer.Begin(stage.str, timerMeta);
+                    auto t = timer.Begin(stage.timerRef, timerMeta);
                     FilterLighting(atmosphere, state, last, numToDo);
                 }
                 break;
             }
+            case Stage::Id::Encode:
+            {
+                // The state is complete in the work texture; compress it into the state's own brick texture.
+                if (!last) CollectEncodePages(atmosphere, it);
+                computeWorkSize(encodePages.size());
+                if (numToDo)
+                {
+                    auto t = timer.Begin(stage.timerRef, timerMeta);
+                    EncodeBricks(atmosphere, state, encodePages.data() + last, numToDo, true);
+                }
+                break;
+            }
+            }
+            if (!totalItems) // nothing to do in this stage this iteration (e.g. no changed bricks to light)
+            {
+                progress.stage = (progress.stage + 1) % stages.size();
+                progress.stageIndex0 = progress.stageIndex1 = 0;
+                continue;
             }
             if (!numToDo) return; // - feels... hacky. Think about this
             last += numToDo;
@@ -439,11 +815,11 @@ namespace Mulen::Atmosphere {
         // - to do: check that we don't exceed maxNumUpload here, or leave that to the caller?
         uint32_t genData = 0u;
         genData |= uint32_t(type) << 24u;
-        UploadNodeGroup upload{};
-        upload.groupIndex = groupIndex;
-        upload.genData = genData;
-        upload.nodeGroup = octree.GetGroup(groupIndex);
-        it.nodesToUpload.push_back(upload);
+        auto upload = it.nodesToUpload.Append(); // written in place (possibly straight into GPU-visible memory)
+        if (!upload) return;
+        upload->groupIndex = groupIndex;
+        upload->genData = genData;
+        upload->nodeGroup = octree.GetGroup(groupIndex);
     }
 
     void Updater::StageBrick(UpdateIteration& it, UploadType type, NodeIndex nodeIndex, const glm::vec4& nodePos, uint32_t genDataOffset, uint32_t genDataSize)
@@ -451,18 +827,19 @@ namespace Mulen::Atmosphere {
         // - to do: check that we don't exceed maxNumUpload here, or leave that to the caller?
         const auto brickIndex = nodeIndex;
 
-        UploadBrick upload{};
-        upload.nodeIndex = nodeIndex;
-        upload.brickIndex = brickIndex;
-        upload.genDataOffset = genDataOffset;
-        upload.genDataSize = genDataSize;
-        upload.nodeLocation = nodePos;
-
-        it.bricksToUpload.push_back(upload);
+        auto upload = it.bricksToUpload.Append();
+        if (!upload) return;
+        upload->nodeIndex = nodeIndex;
+        upload->brickIndex = brickIndex;
+        upload->genDataOffset = genDataOffset;
+        upload->genDataSize = genDataSize;
+        upload->nodeLocation = nodePos;
     }
 
     void Updater::StageSplit(UpdateIteration& it, NodeIndex gi, const glm::vec4& nodePos)
     {
+        // Keep groups and bricks in step (NodeArity bricks per group), also if fixed staging memory runs out.
+        if (it.nodesToUpload.full() || (it.bricksToUpload.IsExternal() && it.bricksToUpload.size() + NodeArity > it.bricksToUpload.capacity())) return;
         StageNodeGroup(it, UploadType::Split, gi);
         for (NodeIndex ci = 0u; ci < NodeArity; ++ci)
         {
@@ -495,12 +872,15 @@ namespace Mulen::Atmosphere {
 
     void Updater::ComputeIteration(UpdateIteration& it)
     {
-        const auto startTime = Util::Timer::Clock::now();
+        auto t = timer.Begin(profilerRefs.updateCompute); // (CPU-only, on the worker thread)
 
         it.Reset();
 
         // - to do: reset generator-specific data? Or it can do that itself
-        generator.Generate(it);
+        {
+            auto t = timer.Begin(profilerRefs.updateComputeGenerate);
+            generator.Generate(it);
+        }
 
         struct PriorityNode
         {
@@ -627,12 +1007,42 @@ namespace Mulen::Atmosphere {
             }
             return hasGrandchildren;
         };
-        computePriority(octree.rootGroupIndex, 0u, {0, 0, 0, 1});
+        {
+            auto t = timer.Begin(profilerRefs.updateComputePriorities);
+            computePriority(octree.rootGroupIndex, 0u, {0, 0, 0, 1});
+        }
+
+        // Copy-on-write: find which lit groups the splits and merges below change the shadows of.
+        std::vector<NodeIndex> relight;
+        relight.swap(it.deferredGroups); // (left for lack of brick slots when this iteration's storage was last handed over)
+        if (maxDirtyGroups)
+        {
+            const auto atmosphereRadius = (1.0 + it.params.height / it.params.planetRadius) / it.params.scale; // (in octree space)
+            lightDependencies.SetLight(it.params.lightDirection, atmosphereRadius, octree.GetNodeGroupCapacity());
+        }
+        auto merge = [&](NodeIndex ni)
+        {
+            if (maxDirtyGroups) lightDependencies.CollectMergeDependants(octree.GetNode(ni).children, relight);
+            octree.Merge(ni);
+        };
 
-        const auto maxSplits = octree.GetNodeGroupCapacity() / 10u; // - this is fairly arbitrary. Maybe make it configurable?
+        auto maxSplits = octree.GetNodeGroupCapacity() / 10u; // - this is fairly arbitrary. Maybe make it configurable?
+        if (maxDirtyGroups) maxSplits = glm::min(maxSplits, glm::min(maxDirtyGroups, it.maxSplitGroups)); // (split groups must be regenerated)
         auto numSplits = 0ull, numMerges = 0ull;
         // - to do: compute merge threshold (below which nodes won't be merged unless needed)
         auto mergeThreshold = 1e20; // - arbitrary (but it shouldn't be)
+        auto canMerge = [&](NodeIndex ni)
+        {
+            const auto children = octree.GetNode(ni).children;
+            for (auto ci = 0u; ci < NodeArity; ++ci)
+            {
+                if (octree.GetNode(Octree::GroupAndChildToNode(children, ci)).children != InvalidIndex)
+                {
+                    return false; // this node can no longer be merged (because a child was split)
+                }
+            }
+            return true;
+        };
         auto doSplits = [&]()
         {
             while (!splitPrio.empty())
@@ -640,42 +1050,40 @@ namespace Mulen::Atmosphere {
                 auto toSplit = splitPrio.top();
                 splitPrio.pop();
 
-                if (!octree.nodes.GetNumFree()) // are we out of octree memory?
+                while (!octree.nodes.GetNumFree()) // are we out of octree memory (or over a lowered limit)?
                 {
-                    while (true)
-                    {
-                        if (mergePrio.empty()) return; // no more to merge
-                        auto toMerge = mergePrio.top();
-                        if (toMerge.priority > toSplit.priority) return; // all merge candidates are of higher priority than split candidates
-                        mergePrio.pop();
-
-                        auto hasGrandchildren = false;
-                        const auto children = octree.GetNode(toMerge.index).children;
-                        for (auto ci = 0u; ci < NodeArity; ++ci)
-                        {
-                            if (octree.GetNode(Octree::GroupAndChildToNode(children, ci)).children != InvalidIndex)
-                            {
-                                hasGrandchildren = true;
-                                break;
-                            }
-                        }
-                        if (hasGrandchildren) continue; // this node can no longer be merged (because a child was split)
-
-                        ++numMerges;
-                        octree.Merge(toMerge.index);
-                        break;
-                    }
+                    if (mergePrio.empty()) return; // no more to merge
+                    auto toMerge = mergePrio.top();
+                    if (toMerge.priority > toSplit.priority) return; // all merge candidates are of higher priority than split candidates
+                    mergePrio.pop();
+                    if (!canMerge(toMerge.index)) continue;
+
+                    ++numMerges;
+                    merge(toMerge.index);
                 }
                 
                 octree.Split(toSplit.index);
                 it.splitGroups.push_back(octree.GetNode(toSplit.index).children);
+                if (maxDirtyGroups) lightDependencies.CollectSplitDependants(octree, it.splitGroups.back(), relight);
                 if (++numSplits >= maxSplits) break;
             }
         };
-        doSplits();
+        {
+            auto t = timer.Begin(profilerRefs.updateComputeSplits);
+            doSplits();
+        }
 
         //std::cout << "Splits: " << numSplits << ", merges: " << numMerges << std::endl;
         
+        // Merge down to within the node limit, in case it has been lowered.
+        while (!mergePrio.empty() && octree.nodes.GetNumUsed() > octree.nodes.GetLimit())
+        {
+            auto toMerge = mergePrio.top();
+            mergePrio.pop();
+            if (!canMerge(toMerge.index)) continue;
+            ++numMerges;
+            merge(toMerge.index);
+        }
         while (!mergePrio.empty())
         {
             // - to do: merge remaining merge candidates, if possible (and not below merge threshold)
@@ -683,6 +1091,7 @@ namespace Mulen::Atmosphere {
         }
 
         // Update upload buffers:
+        auto stagingTiming = timer.Begin(profilerRefs.updateComputeStaging);
         std::function<void(NodeIndex, unsigned, glm::dvec4)> stageGroup = [&](NodeIndex gi, unsigned depth, glm::dvec4 pos)
         {
             StageSplit(it, gi, pos);
@@ -697,12 +1106,113 @@ namespace Mulen::Atmosphere {
                 stageGroup(children, depth + 1u, childPos);
             }
         };
-        stageGroup(octree.rootGroupIndex, 0u, {0, 0, 0, 1});
+        if (!maxDirtyGroups)
+        {
+            stageGroup(octree.rootGroupIndex, 0u, {0, 0, 0, 1});
+            it.numDirtyGroups = it.nodesToUpload.size();
+        }
+        else
+        {
+            // Copy-on-write brick storage: stage the groups whose bricks have changed first, and at most maxDirtyGroups of them.
+            // New split groups always have. If anything affecting all bricks has changed (time, light, generator),
+            // the rest are regenerated in turns, continuing where the last iteration left off.
+            std::vector<std::pair<NodeIndex, glm::dvec4>> groups;
+            std::function<void(NodeIndex, glm::dvec4)> collectGroups = [&](NodeIndex gi, glm::dvec4 pos)
+            {
+                groups.push_back({ gi, pos });
+                for (NodeIndex ci = 0u; ci < NodeArity; ++ci)
+                {
+                    auto childPos = pos;
+                    childPos.w *= 0.5;
+                    childPos += (glm::dvec4(glm::uvec3(ci, ci >> 1u, ci >> 2u) & 1u, 0.5) * 2.0 - 1.0)* childPos.w;
+                    const auto children = octree.GetNode(Octree::GroupAndChildToNode(gi, ci)).children;
+                    if (InvalidIndex != children) collectGroups(children, childPos);
+                }
+            };
+            collectGroups(octree.rootGroupIndex, { 0, 0, 0, 1 });
+
+            dirtyGroups.assign(octree.GetNodeGroupCapacity(), false);
+            size_t numDirty = 0u;
+            for (auto gi : it.splitGroups)
+            {
+                if (!dirtyGroups[gi]) ++numDirty;
+                dirtyGroups[gi] = true;
+            }
+            const auto& p = it.params;
+            if (!hasLastParams || p.time != lastParams.time || p.lightDirection != lastParams.lightDirection || p.generator != lastParams.generator
+                || p.lightingMode != lastParams.lightingMode || p.coneAperture != lastParams.coneAperture || p.perGroupLighting != lastParams.perGroupLighting
+                || p.optimiseGeneration != lastParams.optimiseGeneration || p.cumulusWindCells != lastParams.cumulusWindCells)
+            {
+                lastParams = p;
+                hasLastParams = true;
+                refreshRemaining = groups.size(); // everything is to be regenerated
+                pendingRelight.clear(); // (which includes relighting)
+            }
+            // Bricks left in overflow slots are moved back home by regenerating them, lest the overflow slots run out.
+            if (!it.displacedGroups.empty())
+            {
+                std::vector<bool> displaced(dirtyGroups.size(), false);
+                for (auto gi : it.displacedGroups) displaced[gi] = true;
+                for (auto& group : groups) // (only groups still in use)
+                {
+                    if (numDirty >= maxDirtyGroups) break;
+                    const auto gi = group.first;
+                    if (!displaced[gi] || dirtyGroups[gi]) continue;
+                    dirtyGroups[gi] = true;
+                    ++numDirty;
+                }
+            }
+            // Then the groups shadowed by changes (including those left over from earlier iterations).
+            {
+                std::vector<bool> inUse(dirtyGroups.size(), false);
+                for (auto& group : groups) inUse[group.first] = true;
+                pendingRelight.insert(pendingRelight.end(), relight.begin(), relight.end());
+                size_t kept = 0u;
+                for (auto gi : pendingRelight)
+                {
+                    if (!inUse[gi] || dirtyGroups[gi]) continue; // (merged away, or already to be regenerated)
+                    if (numDirty < maxDirtyGroups)
+                    {
+                        dirtyGroups[gi] = true;
+                        ++numDirty;
+                        continue;
+                    }
+                    inUse[gi] = false; // (so that it's kept only once)
+                    pendingRelight[kept++] = gi;
+                }
+                pendingRelight.resize(kept);
+            }
+            if (!groups.empty()) refreshCursor %= groups.size();
+            for (size_t visited = 0u; refreshRemaining && numDirty < maxDirtyGroups && visited < groups.size(); ++visited)
+            {
+                const auto gi = groups[refreshCursor].first;
+                refreshCursor = (refreshCursor + 1u) % groups.size();
+                --refreshRemaining;
+                if (dirtyGroups[gi]) continue;
+                dirtyGroups[gi] = true;
+                ++numDirty;
+            }
 
-        // - to do: better way to time
-        auto endTime = Util::Timer::Clock::now();
-        auto time = endTime - startTime;
-        auto duration = time / std::chrono::milliseconds(1);
-        //std::cout << "Atmosphere update in " << duration << " ms\n"; // - to do: record this time, somewhere
+            for (auto& group : groups)
+            {
+                if (!dirtyGroups[group.first]) continue;
+                const auto numStaged = it.nodesToUpload.size();
+                StageSplit(it, group.first, group.second);
+                if (it.nodesToUpload.size() > numStaged) lightDependencies.Record(octree, group.first); // (as it will be lit)
+            }
+            it.numDirtyGroups = it.nodesToUpload.size();
+            for (auto& group : groups)
+            {
+                if (!dirtyGroups[group.first]) StageSplit(it, group.first, group.second);
+            }
+        }
+        it.numSplits = numSplits;
+        it.numMerges = numMerges;
+        it.numNodeGroups = octree.nodes.GetNumUsed();
+        it.numPendingRelights = pendingRelight.size();
+        if (it.nodesToUpload.size() < octree.nodes.GetNumUsed())
+        {
+            std::cerr << "Out of upload staging memory (" << it.nodesToUpload.size() << " of " << octree.nodes.GetNumUsed() << " node groups staged)\n";
+        }
     }
 }
@@ -3,9 +3,12 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <map>
 #include "util/Timer.hpp"
 #include "Generator.hpp"
 #include "FeatureGenerator.hpp"
+#include "LightDependencies.hpp"
+#include "BrickLighting.hpp"
 
 namespace Mulen::Atmosphere {
     class Atmosphere;
@@ -22,23 +25,73 @@ namespace Mulen::Atmosphere {
         std::vector<NodeIndex> priorSplitGroups;
         UpdateIteration iterations[2];
         unsigned updateIteration = 0u; // - to do: better name (this is specifically the threaded CPU index)
+        size_t numIterations = 0u; // handed over to the render thread, so far
         bool nextUpdateReady = true;
 
         void StageNodeGroup(UpdateIteration&, UploadType, NodeIndex);
         void StageBrick(UpdateIteration&, UploadType, NodeIndex, const glm::vec4& nodePos, uint32_t genDataOffset, uint32_t genDataSize);
         void StageSplit(UpdateIteration&, NodeIndex gi, const glm::vec4& groupPos);
 
+        // Stage data through the atmosphere's persistently mapped upload ring (falling back to plain uploads if it doesn't fit).
+        void UploadAndBind(Atmosphere&, Util::Buffer&, GLuint binding, GLsizeiptr size, const void* data);
+        void UploadInto(Atmosphere&, Util::Buffer&, GLintptr offset, GLsizeiptr size, const void* data);
+        size_t uploadBytes = 0u; // this frame
+
+        // Zero-copy staging (where the worker thread writes records straight into GPU-visible memory):
+        void BindIterationStaging(Atmosphere&);
+        bool RenderIterationReleased(bool wait = false); // has the GPU finished reading the render iteration's records?
+        GLsync renderIterationFence = nullptr;
+
         Util::Shader& SetShader(Atmosphere&, Util::Shader&);
-        void UpdateMap(Atmosphere&, Util::Texture&, glm::vec3 pos = glm::vec3(-1.0f), glm::vec3 scale = glm::vec3(2.0f), unsigned depthOffset = 0u);
-        void UpdateNodes(Atmosphere&, uint64_t num);
-        void GenerateBricks(Atmosphere&, GpuState&, Generator&, uint64_t first, uint64_t num);
-        void LightBricks(Atmosphere&, GpuState&, uint64_t first, uint64_t num, const Object::Position& lightDir, const Util::Timer::DurationMeta&);
+        // (fromStateMap: start descents from the state's whole-octree map, bound to unit 2, rather than from the root)
+        void UpdateMap(Atmosphere&, Util::Texture&, glm::vec3 pos = glm::vec3(-1.0f), glm::vec3 scale = glm::vec3(2.0f), unsigned depthOffset = 0u, bool fromStateMap = false);
+        void UpdateNodes(Atmosphere&, uint64_t num, uint64_t first = 0u);
+        void GenerateBricks(Atmosphere&, GpuState&, Generator&, const Util::ShaderVariants::Defines& variant, uint64_t first, uint64_t num);
+        void UpdateBrickFlags(Atmosphere&, GpuState&, uint64_t first, uint64_t num);
+        void UpdateEmptyDistances(Atmosphere&, uint64_t first, uint64_t num);
+        void LightBricks(Atmosphere&, GpuState&, uint64_t first, uint64_t num, const Object::Position& lightDir, const Util::Timer::DurationMeta&,
+            LightingMode = LightingMode::ShadowRays, float coneAperture = 0.0f, bool perGroupLighting = true);
+
+        // Sets the uniforms of the per-group and per-voxel lighting shaders (the maps facing the light, and the mode).
+        Util::Shader& SetLightShader(Atmosphere&, Util::ShaderVariants&, uint64_t first, const Object::Position& lightDir, LightingMode, float coneAperture,
+            bool perGroupLighting);
+
+        // Sweep lighting: per-group shadow maps in order along the light, slab by slab, each continuing from those upstream.
+        void CollectSweepSlabs(const UpdateIteration&, const Object::Position& lightDir);
+        void SweepLight(Atmosphere&, const Object::Position& lightDir, size_t firstSlab, size_t numSlabs);
+        std::vector<BrickLighting::SweepGroup> sweepGroups;
+        std::vector<uint32_t> sweepUploads; // sweepGroups' upload indices, in slab order
+        std::vector<std::pair<size_t, size_t>> sweepSlabs;
+
+        // Cone lighting: parent bricks become averages of their children's, one depth at a time (deepest first).
+        void CollectPrefilterNodes(const UpdateIteration&); // parents among the iteration's groups, into the lists below
+        void PrefilterBricks(Atmosphere&, GpuState&, const NodeIndex* nodes, size_t num); // (nodes of one depth)
+        std::vector<NodeIndex> prefilterNodes;
+        std::vector<std::pair<size_t, size_t>> prefilterLevels; // offset into prefilterNodes, and count
         void FilterLighting(Atmosphere&, GpuState&, uint64_t first, uint64_t num);
+
+        // Compressed brick formats: encode bricks of the work texture into the state's brick texture,
+        // in units of whole (physical) pages, or of single bricks (page * bricks per page + brick within the page).
+        void CollectEncodePages(Atmosphere&, const UpdateIteration&); // all pages with bricks of the iteration
+        void EncodeBricks(Atmosphere&, GpuState&, const uint32_t* units, size_t num, bool pages);
+        std::vector<uint32_t> encodePages, encodeBricks;
         void ComputeIteration(UpdateIteration&);
 
         bool NodeInAtmosphere(const UpdateIteration&, const glm::dvec4& nodePosAndScale);
 
-        UpdateIteration& GetRenderIteration() { return iterations[(updateIteration + 1u) % std::extent<decltype(iterations)>::value]; }
+        // Copy-on-write brick storage (worker thread state):
+        size_t maxDirtyGroups = 0u; // per iteration; zero if not using copy-on-write storage (so all bricks are regenerated)
+        size_t refreshCursor = 0u, refreshRemaining = 0u; // regeneration in turns, if everything has changed but not all fits
+        std::vector<bool> dirtyGroups;
+        UpdateIteration::Parameters lastParams;
+        bool hasLastParams = false;
+        // Incremental relighting: groups shadowed by changes of the octree are relit (regenerated, as their bricks are
+        // copied on write) along with the changes, or in later iterations if over the budget.
+        LightDependencies lightDependencies;
+        std::vector<NodeIndex> pendingRelight;
+
+        unsigned GetRenderIterationIndex() const { return (updateIteration + 1u) % std::extent<decltype(iterations)>::value; }
+        UpdateIteration& GetRenderIteration() { return iterations[GetRenderIterationIndex()]; }
         UpdateIteration& GetUpdateIteration() { return iterations[updateIteration]; }
 
         struct Stage
@@ -47,15 +100,25 @@ namespace Mulen::Atmosphere {
             {
                 Init,       // begin a new generation pass
                 Generate,   // upload node and brick data, generate cloud density values
+                Prefilter,  // average child bricks into their parents' (only for cone lighting)
                 Map,        // create octree traversal optimisation map
+                Meta,       // find how far around empty nodes is empty too (needs the map)
+                Sweep,      // propagate per-group shadow maps along the light (only for sweep lighting)
                 Light,      // cast shadow rays to compute lighting
                 Filter,     // filter lighting and combine with brick density values
+                Encode,     // compress bricks (only with compressed brick formats)
             } id;
             const std::string str;
             double cost; // time
+            Util::Timer::NameRef timerRef = Util::Timer::NoRef; // (of str)
         };
         std::vector<Stage> stages;
         double totalStagesTime = 0.0;
+        void ApplyFixedStageCosts();
+        // Stage costs are re-estimated only while the GPU times measured are at most this many frames old (on average
+        // over the last few frames read back).
+        double maxGpuLatencyFrames = 8.0;
+        static const size_t latencyWindow = 10u;
 
         struct Progress
         {
@@ -75,6 +138,14 @@ namespace Mulen::Atmosphere {
             Finished
         } updateStage = UpdateStage::Finished;*/
 
+        // Deterministic updates: the render thread waits for the worker thread's iteration (and the GPU's release of the
+        // last one) rather than leaving the frame's update work for later, and stage costs stay fixed instead of following
+        // measured GPU times. Each frame then makes the same update progress, to the same octree, on any machine.
+        bool deterministic = false;
+        std::map<std::string, double> fixedStageCosts; // (stages not given keep their built-in estimates)
+
+        Util::Timer& timer; // (shared with the render thread; scopes on the worker thread are CPU-only)
+        const ProfilerRefs& profilerRefs;
         bool done = false;
         std::mutex mutex;
         std::condition_variable cv;
@@ -93,5 +164,12 @@ namespace Mulen::Atmosphere {
         void InitialSetup(Atmosphere&);
         void OnFrame(Atmosphere&, const UpdateIteration::Parameters&, double period);
         double GetUpdateFraction() const { return progress.fraction; }
+        size_t GetUploadBytes() const { return uploadBytes; }
+        size_t GetNumIterations() const { return numIterations; }
+
+        using StageCosts = std::map<std::string, double>; // by stage (timer) name, in milliseconds
+        void SetDeterministic(bool, const StageCosts& = {});
+        bool IsDeterministic() const { return deterministic; }
+        StageCosts GetStageCosts() const; // (as currently estimated)
     };
 }
@@ -1,10 +1,213 @@
 #include "App.hpp"
+#include "atmosphere/ReferenceRenderer.hpp"
+#include "atmosphere/BrickLighting.hpp"
+#include "CameraSequence.hpp"
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <string>
+
+namespace {
+    // Parses a whole argument as a number of at least min (rather than std::stoul's throwing on "abc", taking the 12 of
+    // "12x", and wrapping "-1" around).
+    bool ParseUnsigned(const char* arg, unsigned min, unsigned& value)
+    {
+        if (!std::isdigit(static_cast<unsigned char>(arg[0]))) return false;
+        char* end = nullptr;
+        errno = 0;
+        const auto v = std::strtoul(arg, &end, 10);
+        if (*end || ERANGE == errno || v < min || v > std::numeric_limits<unsigned>::max()) return false;
+        value = static_cast<unsigned>(v);
+        return true;
+    }
+
+    // Usage: --reference <capture> <output.hdr> [--size <width> <height>] [--threads <n>] [--no-jitter]
+    //     [--rebuild-meta] [--compare-meta]
+    // (--rebuild-meta recomputes the node metadata on the CPU; --compare-meta also renders without it, and compares)
+    // Renders a captured atmosphere state on the CPU (no window or GPU is needed).
+    int RunReferenceRenderer(int argc, char* argv[])
+    {
+        using namespace Mulen::Atmosphere;
+        auto usage = [&]()
+        {
+            std::cerr << "Usage: " << argv[0] << " --reference <capture> <output.hdr> [--size <width> <height>] [--threads <n>] [--no-jitter]"
+                " [--rebuild-meta] [--compare-meta]\n";
+            return 1;
+        };
+        if (argc < 4) return usage();
+        ReferenceRenderer::Settings settings;
+        bool rebuildMeta = false, compareMeta = false;
+        for (int i = 4; i < argc; ++i)
+        {
+            const std::string arg = argv[i];
+            if (arg == "--size" && i + 2 < argc)
+            {
+                const unsigned maxSize = 1u << 16u;
+                unsigned width, height;
+                if (!ParseUnsigned(argv[i + 1], 1u, width) || !ParseUnsigned(argv[i + 2], 1u, height) || width > maxSize || height > maxSize)
+                {
+                    std::cerr << "Invalid size " << argv[i + 1] << "*" << argv[i + 2] << " (each from 1 to " << maxSize << ")\n";
+                    return usage();
+                }
+                settings.resolution = glm::ivec2(width, height);
+                i += 2;
+            }
+            else if (arg == "--threads" && i + 1 < argc)
+            {
+                if (!ParseUnsigned(argv[++i], 0u, settings.numThreads))
+                {
+                    std::cerr << "Invalid thread count " << argv[i] << " (zero for one per hardware thread)\n";
+                    return usage();
+                }
+            }
+            else if (arg == "--no-jitter") settings.jitter = false;
+            else if (arg == "--rebuild-meta") rebuildMeta = true;
+            else if (arg == "--compare-meta") compareMeta = true;
+            else
+            {
+                std::cerr << "Unknown reference renderer argument " << arg << "\n";
+                return usage();
+            }
+        }
+
+        BrickStore store;
+        if (!store.Load(argv[2])) return 1;
+        if (rebuildMeta) store.BuildNodeMeta();
+        ReferenceRenderer renderer{ store };
+        auto printStats = [&](const glm::ivec2& res, const ReferenceRenderer::Stats& stats)
+        {
+            std::cout << "Rendered " << res.x << "*" << res.y << " (" << store.GetNumBricks() << " bricks) in " << stats.seconds << " s\n"
+                << "Rays per second: " << stats.GetRaysPerSecond() << "\n"
+                << "Nodes visited per ray: " << stats.GetNodesPerRay() << "\n"
+                << "Bricks per ray: " << stats.GetBricksPerRay() << "\n"
+                << "Steps per ray: " << stats.GetStepsPerRay() << "\n"
+                << "Rays marched: " << stats.marchedRays << " (truncated: " << stats.truncatedRays << ")\n";
+        };
+        ReferenceRenderer::Image image;
+        ReferenceRenderer::Stats stats;
+        const auto res = renderer.Render(settings, image, stats);
+        printStats(res, stats);
+
+        if (compareMeta && settings.useNodeMeta)
+        {
+            auto baselineSettings = settings;
+            baselineSettings.useNodeMeta = false;
+            ReferenceRenderer::Image baseline;
+            ReferenceRenderer::Stats baselineStats;
+            std::cout << "\nWithout node metadata:\n";
+            printStats(renderer.Render(baselineSettings, baseline, baselineStats), baselineStats);
+
+            double maxDifference = 0.0, sumSquared = 0.0;
+            for (size_t i = 0u; i < image.size(); ++i)
+            {
+                const auto d = glm::dvec3(image[i] - baseline[i]) / glm::max(1e-3, double(glm::max(baseline[i].x, glm::max(baseline[i].y, baseline[i].z))));
+                maxDifference = glm::max(maxDifference, glm::max(std::abs(d.x), glm::max(std::abs(d.y), std::abs(d.z))));
+                sumSquared += glm::dot(d, d) / 3.0;
+            }
+            std::cout << "\nWith node metadata: " << stats.GetStepsPerRay() / glm::max(1e-9, baselineStats.GetStepsPerRay()) << " of the steps, "
+                << stats.seconds / glm::max(1e-9, baselineStats.seconds) << " of the time; relative difference RMS "
+                << std::sqrt(sumSquared / double(glm::max(size_t(1u), image.size()))) << ", max " << maxDifference << "\n";
+        }
+        return ReferenceRenderer::WriteHdr(argv[3], res, image) ? 0 : 1;
+    }
+
+    // Usage: --compare-lighting <capture> [--threads <n>] [--slabs <n>]
+    // Lights a captured atmosphere state's voxels on the CPU by the light-space sweep and by a shadow ray per voxel,
+    // and compares the two.
+    int RunLightingComparison(int argc, char* argv[])
+    {
+        using namespace Mulen::Atmosphere;
+        auto usage = [&]()
+        {
+            std::cerr << "Usage: " << argv[0] << " --compare-lighting <capture> [--threads <n>] [--slabs <n>]\n";
+            return 1;
+        };
+        if (argc < 3) return usage();
+        BrickLighting::Settings settings;
+        for (int i = 3; i < argc; ++i)
+        {
+            const std::string arg = argv[i];
+            if (arg == "--threads" && i + 1 < argc)
+            {
+                if (!ParseUnsigned(argv[++i], 0u, settings.numThreads))
+                {
+                    std::cerr << "Invalid thread count " << argv[i] << " (zero for one per hardware thread)\n";
+                    return usage();
+                }
+            }
+            else if (arg == "--slabs" && i + 1 < argc)
+            {
+                if (!ParseUnsigned(argv[++i], 1u, settings.maxSlabs))
+                {
+                    std::cerr << "Invalid slab count " << argv[i] << " (at least 1)\n";
+                    return usage();
+                }
+            }
+            else
+            {
+                std::cerr << "Unknown lighting comparison argument " << arg << "\n";
+                return usage();
+            }
+        }
+
+        BrickStore store;
+        if (!store.Load(argv[2])) return 1;
+        BrickLighting lighting{ store };
+        BrickLighting::Light traced, swept;
+        BrickLighting::Stats tracedStats, sweptStats;
+        lighting.TraceVoxels(settings, traced, tracedStats);
+        lighting.Sweep(settings, swept, sweptStats);
+
+        double maxDifference = 0.0, sumSquared = 0.0;
+        for (size_t i = 0u; i < traced.size(); ++i)
+        {
+            const auto d = double(swept[i]) - double(traced[i]);
+            maxDifference = glm::max(maxDifference, std::abs(d));
+            sumSquared += d * d;
+        }
+        const auto numVoxels = glm::max(size_t(1u), traced.size());
+        std::cout << "Lit " << tracedStats.voxels << " voxels of " << lighting.GetGroups().size() << " groups\n"
+            << "Shadow rays: " << tracedStats.seconds << " s, " << double(tracedStats.steps) / double(numVoxels) << " steps per voxel\n"
+            << "Sweep: " << sweptStats.seconds << " s, " << double(sweptStats.steps) / double(numVoxels) << " steps per voxel (including "
+            << sweptStats.mapTexels << " map texels in " << sweptStats.slabs << " slabs, " << sweptStats.fullTraces << " of them traced in full)\n"
+            << "Transmittance difference: RMS " << std::sqrt(sumSquared / double(numVoxels)) << ", max " << maxDifference << "\n";
+        return 0;
+    }
+
+    // Usage: --convert-sequence <sequence.json> <sequence.mseq>
+    // Converts a benchmark configuration's camera sequence from JSON to the compact binary format.
+    int RunSequenceConversion(int argc, char* argv[])
+    {
+        if (argc < 4)
+        {
+            std::cerr << "Usage: " << argv[0] << " --convert-sequence <sequence.json> <sequence" << Mulen::CameraSequence::Extension << ">\n";
+            return 1;
+        }
+        return Mulen::CameraSequence::ConvertJson(argv[2], argv[3]) ? 0 : 1;
+    }
+}
 
 int main(int argc, char* argv[]) 
 {
+    if (argc > 1 && std::string(argv[1]) == "--reference") return RunReferenceRenderer(argc, argv);
+    if (argc > 1 && std::string(argv[1]) == "--compare-lighting") return RunLightingComparison(argc, argv);
+    if (argc > 1 && std::string(argv[1]) == "--convert-sequence") return RunSequenceConversion(argc, argv);
+
+    // --metrics-port <port> (or MULEN_METRICS_PORT) serves metrics for monitoring on the loopback interface.
+    unsigned long metricsPort = 0u;
+    if (const auto env = std::getenv("MULEN_METRICS_PORT")) metricsPort = std::strtoul(env, nullptr, 10);
+    for (int i = 1; i + 1 < argc; ++i)
+    {
+        if (std::string(argv[i]) == "--metrics-port") metricsPort = std::strtoul(argv[i + 1], nullptr, 10);
+    }
+
     Window window{ "Mulen", glm::uvec2(1280, 720) };
     {
         Mulen::App mulen{ window };
+        if (metricsPort) mulen.StartMetricsServer(static_cast<uint16_t>(metricsPort));
         window.Run(mulen);
     }
     return 0;
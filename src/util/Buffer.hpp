@@ -29,6 +29,16 @@ namespace Util {
             glNamedBufferSubData(id, offset, size, data);
         }
 
+        void* Map(GLintptr offset, Size size, GLbitfield access)
+        {
+            return glMapNamedBufferRange(id, offset, size, access);
+        }
+
+        void Unmap()
+        {
+            glUnmapNamedBuffer(id);
+        }
+
         void Bind(GLenum target)
         {
             glBindBuffer(target, id);
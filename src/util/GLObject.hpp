@@ -21,6 +21,7 @@ namespace Util {
 			if (this == &o) return *this;
 			Destroy();
 			id = std::exchange(o.id, Invalid);
+			return *this;
 		}
 
 		void Destroy()
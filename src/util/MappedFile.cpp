@@ -0,0 +1,91 @@
+#include "MappedFile.hpp"
+#include <iostream>
+#include <cstdint>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace Util {
+
+    bool MappedFile::Create(const std::string& path, size_t size)
+    {
+        Close();
+        if (!size) return false;
+
+#ifdef _WIN32
+        auto file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (INVALID_HANDLE_VALUE == file)
+        {
+            std::cerr << "Failed to create mapped file " << path << std::endl;
+            return false;
+        }
+        const auto sizeHigh = static_cast<DWORD>(static_cast<uint64_t>(size) >> 32u), sizeLow = static_cast<DWORD>(size & 0xffffffffu);
+        auto mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, sizeHigh, sizeLow, nullptr);
+        if (!mapping)
+        {
+            std::cerr << "Failed to create file mapping for " << path << std::endl;
+            CloseHandle(file);
+            return false;
+        }
+        data = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+        if (!data)
+        {
+            std::cerr << "Failed to map " << path << std::endl;
+            CloseHandle(mapping);
+            CloseHandle(file);
+            return false;
+        }
+        fileHandle = file;
+        mappingHandle = mapping;
+#else
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            std::cerr << "Failed to create mapped file " << path << std::endl;
+            return false;
+        }
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0)
+        {
+            std::cerr << "Failed to resize mapped file " << path << " to " << size << " bytes" << std::endl;
+            close(fd);
+            fd = -1;
+            return false;
+        }
+        auto p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (MAP_FAILED == p)
+        {
+            std::cerr << "Failed to map " << path << std::endl;
+            close(fd);
+            fd = -1;
+            return false;
+        }
+        data = p;
+#endif
+        this->size = size;
+        return true;
+    }
+
+    void MappedFile::Close()
+    {
+        if (!data) return;
+#ifdef _WIN32
+        UnmapViewOfFile(data);
+        CloseHandle(mappingHandle);
+        CloseHandle(fileHandle);
+        mappingHandle = fileHandle = nullptr;
+#else
+        munmap(data, size);
+        close(fd);
+        fd = -1;
+#endif
+        data = nullptr;
+        size = 0u;
+    }
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <string>
+#include <cstddef>
+
+namespace Util {
+    // File mapped into memory for reading and writing (shared, so other processes mapping it see the same data).
+    class MappedFile
+    {
+        void* data = nullptr;
+        size_t size = 0u;
+#ifdef _WIN32
+        void* fileHandle = nullptr;
+        void* mappingHandle = nullptr;
+#else
+        int fd = -1;
+#endif
+
+    public:
+        MappedFile() {}
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        ~MappedFile() { Close(); }
+
+        // Creates (or truncates) the file to the given size and maps it.
+        bool Create(const std::string& path, size_t size);
+        void Close();
+
+        void* GetData() const { return data; }
+        size_t GetSize() const { return size; }
+        bool IsOpen() const { return nullptr != data; }
+    };
+}
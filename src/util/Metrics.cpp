@@ -0,0 +1,248 @@
+#include "Metrics.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+namespace Util {
+
+    size_t Histogram::GetIndex(uint64_t value)
+    {
+        if (value < SubBuckets) return size_t(value);
+        int exponent = SubBucketBits; // (of the highest bit set)
+        while (value >> (exponent + 1)) ++exponent;
+        const auto sub = (value >> (exponent - SubBucketBits)) - SubBuckets;
+        return size_t((exponent - SubBucketBits + 1) * SubBuckets + sub);
+    }
+
+    uint64_t Histogram::GetLowerBound(size_t index)
+    {
+        if (index < SubBuckets) return index;
+        const auto exponent = int(index / SubBuckets) + SubBucketBits - 1;
+        return (SubBuckets + index % SubBuckets) << (exponent - SubBucketBits);
+    }
+
+    void Histogram::Record(double value)
+    {
+        if (!(value >= 0.0)) value = 0.0;
+        const auto units = uint64_t(std::min(value / unit + 0.5, 4e18));
+        const auto index = GetIndex(units);
+        if (counts.size() <= index) counts.resize(index + 1u);
+        ++counts[index];
+        ++count;
+        sum += value;
+    }
+
+    void Histogram::Merge(const Histogram& other)
+    {
+        if (counts.size() < other.counts.size()) counts.resize(other.counts.size());
+        for (size_t i = 0u; i < other.counts.size(); ++i) counts[i] += other.counts[i];
+        count += other.count;
+        sum += other.sum;
+    }
+
+    double Histogram::GetQuantile(double q) const
+    {
+        const auto rank = uint64_t(std::ceil(q * double(count)));
+        uint64_t cumulative = 0u;
+        for (size_t i = 0u; i < counts.size(); ++i)
+        {
+            cumulative += counts[i];
+            if (cumulative >= rank && counts[i]) return double(GetLowerBound(i + 1u) - 1u) * unit;
+        }
+        return 0.0;
+    }
+
+    void Histogram::Format(std::ostream& out, const std::string& name, const std::string& labels) const
+    {
+        // Cumulative buckets (of values up to and including le), with bounds one unit below each power of two: 0, 1, 3, 7...
+        // These are the last values of sub-buckets, so the counts are exact. From the first holding any up to the last.
+        const auto prefix = name + "_bucket{" + (labels.empty() ? "" : labels + ",") + "le=\"";
+        uint64_t cumulative = 0u;
+        size_t i = 0u;
+        for (uint64_t end = 1u; i < counts.size(); end *= 2u)
+        {
+            for (; i < counts.size() && GetLowerBound(i + 1u) <= end; ++i) cumulative += counts[i];
+            if (!cumulative && i < counts.size()) continue;
+            out << prefix << double(end - 1u) * unit << "\"} " << cumulative << "\n";
+        }
+        out << prefix << "+Inf\"} " << count << "\n";
+        const auto suffix = labels.empty() ? std::string{} : "{" + labels + "}";
+        out << name << "_sum" << suffix << " " << sum << "\n";
+        out << name << "_count" << suffix << " " << count << "\n";
+    }
+
+    Metrics::Family& Metrics::GetFamily(const std::string& name, const char* type)
+    {
+        auto& family = families[name];
+        if (family.type.empty()) family.type = type;
+        return family;
+    }
+
+    void Metrics::Describe(const std::string& name, const std::string& help)
+    {
+        std::lock_guard<std::mutex> lock{ mutex };
+        families[name].help = help;
+    }
+
+    void Metrics::SetGauge(const std::string& name, double value, const std::string& labels)
+    {
+        std::lock_guard<std::mutex> lock{ mutex };
+        GetFamily(name, "gauge").values[labels] = value;
+    }
+
+    void Metrics::AddCounter(const std::string& name, double increment, const std::string& labels)
+    {
+        std::lock_guard<std::mutex> lock{ mutex };
+        GetFamily(name, "counter").values[labels] += increment;
+    }
+
+    void Metrics::Observe(const std::string& name, double value, double unit, const std::string& labels)
+    {
+        std::lock_guard<std::mutex> lock{ mutex };
+        auto& histograms = GetFamily(name, "histogram").histograms;
+        auto it = histograms.find(labels);
+        if (histograms.end() == it) it = histograms.emplace(labels, Histogram{ unit }).first;
+        it->second.Record(value);
+    }
+
+    std::string Metrics::Format() const
+    {
+        std::ostringstream out;
+        out.precision(10);
+        std::lock_guard<std::mutex> lock{ mutex };
+        for (const auto& f : families)
+        {
+            if (f.second.type.empty()) continue; // (described, but not yet set)
+            if (!f.second.help.empty()) out << "# HELP " << f.first << " " << f.second.help << "\n";
+            out << "# TYPE " << f.first << " " << f.second.type << "\n";
+            for (const auto& v : f.second.values)
+            {
+                out << f.first;
+                if (!v.first.empty()) out << "{" << v.first << "}";
+                out << " " << v.second << "\n";
+            }
+            for (const auto& h : f.second.histograms) h.second.Format(out, f.first, h.first);
+        }
+        return out.str();
+    }
+
+    std::string Metrics::Label(const std::string& key, const std::string& value)
+    {
+        std::string label = key + "=\"";
+        for (auto c : value)
+        {
+            if ('\\' == c || '"' == c) label += '\\';
+            if ('\n' == c) label += "\\n";
+            else label += c;
+        }
+        return label + "\"";
+    }
+
+    bool MetricsServer::Start(uint16_t port)
+    {
+        Stop();
+#ifndef _WIN32
+        listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+        if (listenSocket < 0)
+        {
+            std::cerr << "Could not create the metrics socket: " << std::strerror(errno) << "\n";
+            return false;
+        }
+        const int reuse = 1;
+        setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // (not exposed beyond this machine)
+        address.sin_port = htons(port);
+        if (bind(listenSocket, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0 || listen(listenSocket, 4) < 0)
+        {
+            std::cerr << "Could not serve metrics on port " << port << ": " << std::strerror(errno) << "\n";
+            close(listenSocket);
+            listenSocket = -1;
+            return false;
+        }
+        stop = false;
+        thread = std::thread(&MetricsServer::Serve, this);
+        std::cout << "Serving metrics at http://127.0.0.1:" << port << "/metrics\n";
+        return true;
+#else
+        std::cerr << "Serving metrics is not supported on this platform (port " << port << ")\n";
+        return false;
+#endif
+    }
+
+    void MetricsServer::Stop()
+    {
+        if (!thread.joinable()) return;
+        stop = true;
+        thread.join();
+#ifndef _WIN32
+        close(listenSocket);
+#endif
+        listenSocket = -1;
+    }
+
+    void MetricsServer::Serve()
+    {
+#ifndef _WIN32
+        while (!stop)
+        {
+            pollfd fd = { listenSocket, POLLIN, 0 };
+            if (poll(&fd, 1, 200) <= 0) continue; // (checking for a stop every 200 ms)
+            const auto connection = accept(listenSocket, nullptr, nullptr);
+            if (connection < 0) continue;
+            Respond(connection);
+            close(connection);
+        }
+#endif
+    }
+
+    void MetricsServer::Respond(int connection)
+    {
+#ifndef _WIN32
+        // Only the request line matters (and a slow client is not waited for long).
+        timeval timeout = { 1, 0 };
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        std::string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192u)
+        {
+            const auto num = recv(connection, buffer, sizeof(buffer), 0);
+            if (num <= 0) break;
+            request.append(buffer, size_t(num));
+        }
+        std::istringstream line{ request.substr(0u, request.find("\r\n")) };
+        std::string method, path;
+        line >> method >> path;
+
+        std::string status = "200 OK", body;
+        if (method != "GET") status = "405 Method Not Allowed";
+        else if (path == "/metrics" || path == "/") body = metrics.Format();
+        else status = "404 Not Found";
+        const auto response = "HTTP/1.1 " + status + "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+            + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+
+        for (size_t sent = 0u; sent < response.size();)
+        {
+#ifdef MSG_NOSIGNAL
+            const auto num = send(connection, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+#else
+            const auto num = send(connection, response.data() + sent, response.size() - sent, 0);
+#endif
+            if (num <= 0) break;
+            sent += size_t(num);
+        }
+#endif
+    }
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Util {
+    // A histogram of non-negative values with logarithmic buckets of bounded relative error, as HDR histograms have:
+    // values are counted in integer units, exactly below SubBuckets and in SubBuckets linear sub-buckets per power of
+    // two above (so within about 6%). Histograms of the same unit merge by adding their counts.
+    class Histogram
+    {
+    public:
+        explicit Histogram(double unit = 1.0) : unit{ unit } {}
+
+        void Record(double value);
+        void Merge(const Histogram&);
+
+        uint64_t GetCount() const { return count; }
+        double GetSum() const { return sum; }
+        double GetQuantile(double q) const; // (the last value of the bucket it falls in)
+
+        // In the Prometheus text format: cumulative buckets up to one unit below each power of two of the recorded range,
+        // the sum and the count (labels as formatted by Metrics::Label, if any).
+        void Format(std::ostream&, const std::string& name, const std::string& labels) const;
+
+    private:
+        static constexpr int SubBucketBits = 4;
+        static constexpr uint64_t SubBuckets = 1u << SubBucketBits;
+        double unit;
+        std::vector<uint64_t> counts; // (grown to the largest bucket recorded)
+        uint64_t count = 0u;
+        double sum = 0.0;
+
+        static size_t GetIndex(uint64_t value);
+        static uint64_t GetLowerBound(size_t index);
+    };
+
+    // Named gauges, counters and histograms, each possibly with labelled series, to be scraped by Prometheus (say).
+    // Safe to update and format from different threads.
+    class Metrics
+    {
+    public:
+        void Describe(const std::string& name, const std::string& help);
+        void SetGauge(const std::string& name, double value, const std::string& labels = "");
+        void AddCounter(const std::string& name, double increment, const std::string& labels = "");
+        void Observe(const std::string& name, double value, double unit = 1.0, const std::string& labels = "");
+
+        std::string Format() const; // all of them, in the Prometheus text exposition format
+
+        static std::string Label(const std::string& key, const std::string& value); // key="value" (escaped)
+
+    private:
+        struct Family
+        {
+            std::string type, help;
+            std::map<std::string, double> values; // by labels
+            std::map<std::string, Histogram> histograms; // by labels
+        };
+        std::map<std::string, Family> families;
+        mutable std::mutex mutex;
+
+        Family& GetFamily(const std::string& name, const char* type);
+    };
+
+    // Serves metrics over HTTP on the loopback interface (at /metrics, or /), on a thread of its own.
+    // (Only with POSIX sockets, so far.)
+    class MetricsServer
+    {
+    public:
+        explicit MetricsServer(const Metrics& metrics) : metrics{ metrics } {}
+        ~MetricsServer() { Stop(); }
+        MetricsServer(const MetricsServer&) = delete;
+        MetricsServer& operator=(const MetricsServer&) = delete;
+
+        bool Start(uint16_t port);
+        void Stop();
+        bool IsRunning() const { return thread.joinable(); }
+
+    private:
+        const Metrics& metrics;
+        std::thread thread;
+        std::atomic<bool> stop{ false };
+        int listenSocket = -1;
+
+        void Serve();
+        void Respond(int connection);
+    };
+}
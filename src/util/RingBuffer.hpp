@@ -0,0 +1,135 @@
+#pragma once
+#include "Buffer.hpp"
+#include <deque>
+#include <iostream>
+
+namespace Util {
+    // Persistently and coherently mapped buffer, written to by the CPU in a ring-like fashion.
+    // Regions handed out are guarded by fences, so that they aren't overwritten while the GPU may still be reading them.
+    class RingBuffer : public Buffer {
+    protected:
+        void GLDestroy()
+        {
+            if (mapped) Unmap();
+            mapped = nullptr;
+            while (!fenced.empty())
+            {
+                const auto s = fenced.front().sync; // - each sync may be shared by several regions
+                fenced.pop_front();
+                if (s && (fenced.empty() || fenced.front().sync != s)) glDeleteSync(s);
+            }
+            head = 0u;
+            Buffer::GLDestroy();
+        }
+
+        struct FencedRange
+        {
+            GLintptr begin, end;
+            GLsync sync; // null until the next Fence()
+        };
+        std::deque<FencedRange> fenced; // oldest first
+        uint8_t* mapped = nullptr;
+        GLintptr head = 0u;
+        Size alignment = 1u;
+
+        // Wait until no pending region overlaps [begin, end).
+        void WaitForRange(GLintptr begin, GLintptr end)
+        {
+            auto last = -1;
+            for (auto i = 0; i < static_cast<int>(fenced.size()); ++i)
+            {
+                const auto& f = fenced[i];
+                if (f.begin < end && begin < f.end) last = i;
+            }
+            if (last < 0) return;
+
+            if (!fenced[last].sync)
+            {
+                // - this means more was allocated than fits in the buffer in one go. Fence what we have and wait
+                std::cerr << "Util::RingBuffer: ring buffer of " << size << " bytes overrun within a single fence\n";
+                Fence();
+            }
+
+            // Fences are signalled in order, so waiting for the last overlapping one is enough.
+            const auto sync = fenced[last].sync;
+            const GLuint64 timeout = 1000000000u; // 1 s
+            while (true)
+            {
+                const auto res = glClientWaitSync(sync, GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+                if (GL_ALREADY_SIGNALED == res || GL_CONDITION_SATISFIED == res) break;
+                if (GL_WAIT_FAILED == res)
+                {
+                    std::cerr << "Util::RingBuffer: glClientWaitSync failed\n";
+                    break;
+                }
+            }
+
+            // Release all regions up to and including those guarded by the awaited sync.
+            while (last + 1 < static_cast<int>(fenced.size()) && fenced[last + 1].sync == sync) ++last;
+            for (auto i = 0; i <= last; ++i)
+            {
+                const auto s = fenced.front().sync;
+                fenced.pop_front();
+                if (fenced.empty() || fenced.front().sync != s) glDeleteSync(s);
+            }
+        }
+
+    public:
+        struct Region
+        {
+            GLintptr offset = 0u;
+            Size size = 0u;
+            void* data = nullptr;
+        };
+
+        void Create(Size size)
+        {
+            Destroy();
+            const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            Buffer::Create(size, flags);
+            mapped = static_cast<uint8_t*>(Map(0, size, flags));
+            if (!mapped)
+            {
+                std::cerr << "Util::RingBuffer: failed to map " << size << " bytes\n";
+            }
+
+            // Regions may be bound as any of these, so respect the strictest alignment.
+            GLint uboAlignment = 1, ssboAlignment = 1;
+            glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uboAlignment);
+            glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &ssboAlignment);
+            alignment = static_cast<Size>(uboAlignment > ssboAlignment ? uboAlignment : ssboAlignment);
+        }
+
+        // Returns a mapped region of (at least) the requested size, waiting for the GPU if necessary.
+        // The region stays valid for writing until the next call to Fence(); after that it belongs to the GPU.
+        Region Allocate(Size regionSize)
+        {
+            Region region;
+            if (!mapped || regionSize > size) return region;
+
+            auto offset = (head + alignment - 1) / alignment * alignment;
+            if (offset + regionSize > size) offset = 0; // wrap around
+            WaitForRange(offset, offset + regionSize);
+
+            head = offset + regionSize;
+            fenced.push_back({ offset, head, nullptr });
+            region.offset = offset;
+            region.size = regionSize;
+            region.data = mapped + offset;
+            return region;
+        }
+
+        // Guard all regions allocated since the last call. Call after the commands reading them have been issued.
+        void Fence()
+        {
+            if (fenced.empty() || fenced.back().sync) return;
+            const auto sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            for (auto it = fenced.rbegin(); it != fenced.rend() && !it->sync; ++it)
+            {
+                it->sync = sync;
+            }
+        }
+
+        bool IsMapped() const { return nullptr != mapped; }
+    };
+}
@@ -1,106 +1,299 @@
 #include "Shader.hpp"
-#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <iomanip>
 #include <sstream>
+#include <vector>
 
 namespace Util {
-    bool Shader::Create(const FileNames& files)
+    namespace {
+        std::string binaryCacheDirectory;
+        Shader::CacheStats cacheStats;
+
+        // FNV-1a.
+        uint64_t Hash(uint64_t hash, const std::string& s)
+        {
+            for (const auto c : s) hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+            return (hash ^ 0xffu) * 1099511628211ull; // (terminated, so that consecutive strings can't shift into each other)
+        }
+        std::string GetGLString(GLenum name)
+        {
+            const auto s = glGetString(name);
+            return s ? reinterpret_cast<const char*>(s) : "";
+        }
+
+        bool LoadProgramBinary(GLuint program, const std::string& path)
+        {
+            std::ifstream file(path, std::ios::binary);
+            if (!file.is_open()) return false;
+            GLenum format = 0u;
+            if (!file.read(reinterpret_cast<char*>(&format), sizeof(format))) return false;
+            const std::vector<char> binary{ std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+            glProgramBinary(program, format, binary.data(), static_cast<GLsizei>(binary.size()));
+            // (drivers reject binaries from other versions, in which case the program is compiled anew)
+            GLint status = GL_FALSE;
+            glGetProgramiv(program, GL_LINK_STATUS, &status);
+            return GL_TRUE == status;
+        }
+        void SaveProgramBinary(GLuint program, const std::string& path)
+        {
+            GLint length = 0;
+            glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+            if (length <= 0) return;
+            std::vector<char> binary(static_cast<size_t>(length));
+            GLenum format = 0u;
+            glGetProgramBinary(program, length, &length, &format, binary.data());
+            std::error_code error;
+            std::filesystem::create_directories(binaryCacheDirectory, error);
+            std::ofstream file(path, std::ios::binary);
+            file.write(reinterpret_cast<const char*>(&format), sizeof(format));
+            file.write(binary.data(), length);
+            if (!file) std::cerr << "Could not write shader program binary " << path << "\n";
+        }
+    }
+
+    void Shader::SetBinaryCacheDirectory(const std::string& directory)
     {
-        Destroy();
-        id = glCreateProgram();
-        GLint status, logLength;
-        std::string info;
+        binaryCacheDirectory = directory;
+    }
 
-        std::function<void(const std::string&, std::string&, unsigned)> appendSource
-            = [&](const std::string& name, std::string& src, unsigned level)
+    Shader::CacheStats Shader::GetCacheStats()
+    {
+        return cacheStats;
+    }
+
+    ShaderSources& Shader::GetSources()
+    {
+        static ShaderSources sources;
+        return sources;
+    }
+
+    bool Shader::DependsOn(const std::vector<std::string>& files) const
+    {
+        return ShaderSources::DependsOn(sourceFiles, files);
+    }
+
+    bool Shader::Create(const FileNames& files, const std::string& defines)
+    {
+        SubmitBuild(files, defines);
+        if (CheckBuild())
         {
-            std::string line;
-            std::ifstream file(name);
-            if (!file.is_open())
-            {
-                std::cerr << "Could not open include file " << name << "\n";
-                return;
-            }
-            auto nextLineNumber = 1u;
-            while (std::getline(file, line))
+            ApplyBuild();
+            return true;
+        }
+        CancelBuild();
+        return false;
+    }
+
+    void Shader::SubmitBuild(const FileNames& files, const std::string& defines)
+    {
+        CancelBuild();
+#ifdef GL_KHR_parallel_shader_compile
+        static bool compilerThreadsSet = false;
+        if (GLAD_GL_KHR_parallel_shader_compile && !compilerThreadsSet)
+        {
+            glMaxShaderCompilerThreadsKHR(0xffffffffu); // (as many as the driver likes)
+            compilerThreadsSet = true;
+        }
+#endif
+        build.program = glCreateProgram();
+        build.name = files.compute.size() ? files.compute : files.vert;
+        const auto program = build.program;
+
+        // Expand the sources first, as they (and the driver) key the binary cache.
+        struct Stage
+        {
+            GLenum type;
+            const std::string& name;
+            std::string src;
+        };
+        std::vector<Stage> stages;
+        const bool hasFrag = files.frag.size(), hasCompute = files.compute.size();
+        if (hasCompute) // only compute
+        {
+            stages.push_back({ GL_COMPUTE_SHADER, files.compute });
+        }
+        else // vertex and fragment
+        {
+            stages.push_back({ GL_VERTEX_SHADER, files.vert });
+            if (hasFrag) stages.push_back({ GL_FRAGMENT_SHADER, files.frag });
+        }
+        sourceFiles.clear();
+        for (auto& stage : stages)
+        {
+            stage.src = GetSources().Expand(stage.name, defines, sourceFiles);
+            if (!stage.src.size())
             {
-                ++nextLineNumber;
-                static const std::string includeStart("#include");
-                if (line.size() > includeStart.size() && line.find(includeStart) == 0)
-                {
-                    std::istringstream iss(line);
-                    std::string preproc, include;
-                    iss >> preproc >> include;
-                    if (include.size() > 2 && include[0] == include.back() && include[0] == '"')
-                    {
-                        include = include.substr(1, include.size() - 2);
-                        const auto stop = name.find_last_of('/');
-                        const auto dir = name.substr(0, stop == std::string::npos ? 0 : stop + 1);
-                        include = dir + include;
-
-                        src += "#line 1\n";
-                        appendSource(include, src, level + 1u);
-                        src += "#line " + std::to_string(nextLineNumber) + "\n";
-                    }
-                    else std::cerr << "Invalid include \"" << include << "\" in " << name << "\n";
-                    continue;
-                }
-                src += line + '\n';
+                std::cerr << "Error: empty shader source file " << stage.name << "\n";
             }
-        };
+        }
 
-        auto createShader = [&](GLenum type, const std::string& name) -> GLuint
+        GLint numBinaryFormats = 0;
+        if (!binaryCacheDirectory.empty()) glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numBinaryFormats);
+        if (numBinaryFormats > 0)
         {
-            //const auto src = GetFileContents(name);
-            std::string src;
-            appendSource(name, src, 0);
-            if (!src.size())
+            auto hash = 14695981039346656037ull;
+            for (const auto name : { GL_VENDOR, GL_RENDERER, GL_VERSION }) hash = Hash(hash, GetGLString(name));
+            hash = Hash(hash, defines);
+            for (const auto& stage : stages) hash = Hash(Hash(hash, std::to_string(stage.type)), stage.src);
+            std::ostringstream ss;
+            ss << binaryCacheDirectory << std::hex << std::setw(16) << std::setfill('0') << hash << ".bin";
+            build.binaryPath = ss.str();
+            if (LoadProgramBinary(program, build.binaryPath))
             {
-                std::cerr << "Error: empty shader source file " << name << "\n";
+                build.fromBinary = true;
+                return;
             }
-            const GLint srcSize = (GLint)src.size();
-            const auto srcPointer = src.c_str();
-            auto shader = glCreateShader(type);
+        }
+
+        // Neither compile nor link status is queried here, so that the driver can build several programs at once.
+        for (const auto& stage : stages)
+        {
+            const GLint srcSize = (GLint)stage.src.size();
+            const auto srcPointer = stage.src.c_str();
+            auto shader = glCreateShader(stage.type);
             glShaderSource(shader, 1, (const GLchar**)&srcPointer, &srcSize);
             glCompileShader(shader);
-            glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+            glAttachShader(program, shader);
+            build.shaders.push_back({ shader, stage.name });
+        }
+        if (!build.binaryPath.empty()) glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glLinkProgram(program);
+    }
+
+    bool Shader::IsBuildDone() const
+    {
+        if (!build.program || build.fromBinary) return true;
+#ifdef GL_KHR_parallel_shader_compile
+        if (GLAD_GL_KHR_parallel_shader_compile)
+        {
+            GLint done = GL_FALSE;
+            glGetProgramiv(build.program, GL_COMPLETION_STATUS_KHR, &done);
+            return GL_TRUE == done;
+        }
+#endif
+        return true; // (there's no telling without blocking)
+    }
+
+    bool Shader::CheckBuild()
+    {
+        if (!build.program) return false;
+        GLint status, logLength;
+        std::string info;
+        if (build.fromBinary)
+        {
+            ++cacheStats.loaded;
+            return true;
+        }
+        for (const auto& stage : build.shaders)
+        {
+            glGetShaderiv(stage.shader, GL_COMPILE_STATUS, &status);
             if (GL_FALSE == status)
             {
-                glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &logLength);
+                glGetShaderiv(stage.shader, GL_INFO_LOG_LENGTH, &logLength);
                 info.resize(logLength);
-                glGetShaderInfoLog(shader, logLength, &logLength, info.data());
-                std::cerr << "Error: unable to compile shader " << name << "\n" << info << "\n";
-                return 0;
+                glGetShaderInfoLog(stage.shader, logLength, &logLength, info.data());
+                std::cerr << "Error: unable to compile shader " << stage.name << "\n" << info << "\n";
             }
-            glAttachShader(id, shader);
-            return shader;
-        };
-        GLuint vert = 0u, frag = 0u, compute = 0u;
-        const bool hasFrag = files.frag.size(), hasCompute = files.compute.size();
-        if (hasCompute) // only compute
-        {
-            compute = createShader(GL_COMPUTE_SHADER, files.compute);
         }
-        else // vertex and fragment
+        glGetProgramiv(build.program, GL_LINK_STATUS, &status);
+        // (the program keeps what it needs of the shader objects once linked)
+        for (const auto& stage : build.shaders)
         {
-            vert = createShader(GL_VERTEX_SHADER, files.vert);
-            if (hasFrag) frag = createShader(GL_FRAGMENT_SHADER, files.frag);
-            //if (hasGeom) geom = createShader(GL_GEOMETRY_SHADER, files.geom);
-            //if (!vert || (hasFrag && !frag) || (hasGeom && !geom)) return false;
+            glDetachShader(build.program, stage.shader);
+            glDeleteShader(stage.shader);
         }
-
-        glLinkProgram(id);
-        glGetProgramiv(id, GL_LINK_STATUS, &status);
+        build.shaders.clear();
         if (GL_FALSE == status)
         {
-            glGetProgramiv(id, GL_INFO_LOG_LENGTH, &logLength);
+            glGetProgramiv(build.program, GL_INFO_LOG_LENGTH, &logLength);
             info.resize(logLength);
-            glGetProgramInfoLog(id, (GLsizei)info.size(), &logLength, info.data());
-            std::cerr << "Error: unable to link shader program (" << files.vert << ")\n" << info << "\n";
+            glGetProgramInfoLog(build.program, (GLsizei)info.size(), &logLength, info.data());
+            std::cerr << "Error: unable to link shader program (" << build.name << ")\n" << info << "\n";
             return false;
         }
+        ++cacheStats.compiled;
+
+        if (!build.binaryPath.empty()) SaveProgramBinary(build.program, build.binaryPath);
+        return true;
+    }
+
+    void Shader::ApplyBuild()
+    {
+        if (!build.program) return;
+        Destroy();
+        id = std::exchange(build.program, 0u);
+        build = {};
+    }
 
-        // - to do: destroy shader objects
+    void Shader::CancelBuild()
+    {
+        for (const auto& stage : build.shaders) glDeleteShader(stage.shader);
+        if (build.program) glDeleteProgram(build.program);
+        build = {};
+    }
 
+    void ShaderBatch::Add(Shader& shader, const Shader::FileNames& files, const std::string& defines)
+    {
+        shader.SubmitBuild(files, defines);
+        shaders.push_back(&shader);
+    }
+
+    bool ShaderBatch::IsDone() const
+    {
+        for (const auto shader : shaders)
+        {
+            if (!shader->IsBuildDone()) return false;
+        }
         return true;
     }
+
+    bool ShaderBatch::Apply()
+    {
+        bool built = true;
+        for (const auto shader : shaders) built = shader->CheckBuild() && built;
+        for (const auto shader : shaders) built ? shader->ApplyBuild() : shader->CancelBuild();
+        shaders.clear();
+        return built;
+    }
+
+    void ShaderBatch::Cancel()
+    {
+        for (const auto shader : shaders) shader->CancelBuild();
+        shaders.clear();
+    }
+
+    std::string ShaderVariants::GetDefines(const Defines& variant) const
+    {
+        auto result = defines;
+        for (const auto& define : variant) result += "#define " + define.first + " " + define.second + "\n";
+        return result;
+    }
+
+    void ShaderVariants::Submit(ShaderBatch& batch, const Shader::FileNames& files, const std::string& defines,
+        const std::function<bool(const Shader&)>& filter, const std::vector<Defines>& used)
+    {
+        this->files = files;
+        this->defines = defines;
+        for (const auto& variant : used) variants[variant];
+        for (auto& variant : variants)
+        {
+            if (filter(variant.second)) batch.Add(variant.second, files, GetDefines(variant.first));
+        }
+    }
+
+    Shader& ShaderVariants::Get(const Defines& variant)
+    {
+        const auto found = variants.find(variant);
+        if (variants.end() != found) return found->second;
+        const auto start = std::chrono::steady_clock::now();
+        auto& shader = variants[variant];
+        if (!shader.Create(files, GetDefines(variant)))
+        {
+            std::cerr << "Error: unable to build a variant of " << GetName() << "\n";
+        }
+        lazyCompileSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return shader;
+    }
 }
@@ -1,9 +1,13 @@
 #pragma once
 #include "GLObject.hpp"
 #include "Files.hpp"
+#include "ShaderSources.hpp"
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <map>
+#include <functional>
 #include <string>
+#include <vector>
 #include <iostream>
 
 namespace Util {
@@ -12,15 +16,53 @@ namespace Util {
         void GLDestroy() override {	glDeleteProgram(id); }
         typedef const GLchar* Name;
 
+        struct Build
+        {
+            GLuint program = 0u;
+            struct Stage
+            {
+                GLuint shader;
+                std::string name;
+            };
+            std::vector<Stage> shaders;
+            std::string name, binaryPath;
+            bool fromBinary = false;
+        } build; // the program being built, which replaces this one once checked
+        std::vector<std::string> sourceFiles; // that the last build submitted was expanded from
+
     public:
         Shader() {}
-        Shader(Shader&& o) noexcept : GLObject(std::move(o)) {}
+        Shader(Shader&& o) noexcept : GLObject(std::move(o)), build(std::exchange(o.build, {})), sourceFiles(std::move(o.sourceFiles)) {}
 
         struct FileNames
         {
             std::string vert, frag, compute;
         };
-        bool Create(const FileNames&);
+        // The defines (if any) are inserted after the #version directive.
+        // If it fails, the previous program (if any) is kept.
+        bool Create(const FileNames&, const std::string& defines = "");
+
+        // Building in steps, for several programs to be compiled concurrently (see ShaderBatch): submitting starts
+        // compiling and linking without waiting for either, IsBuildDone polls (without blocking only given
+        // GL_KHR_parallel_shader_compile), CheckBuild waits and reports errors, and ApplyBuild replaces the program.
+        void SubmitBuild(const FileNames&, const std::string& defines = "");
+        bool IsBuildDone() const;
+        bool CheckBuild();
+        void ApplyBuild();
+        void CancelBuild();
+
+        // Linked programs are cached as binaries in this directory (if set), keyed by a hash of their expanded sources
+        // (defines included) and the driver, so that unchanged programs are loaded rather than compiled.
+        static void SetBinaryCacheDirectory(const std::string&);
+        struct CacheStats
+        {
+            unsigned loaded = 0u, compiled = 0u; // programs, so far
+        };
+        static CacheStats GetCacheStats();
+
+        // The source files, shared by all shaders (so that each is only read once until it changes).
+        static ShaderSources& GetSources();
+        bool DependsOn(const std::vector<std::string>& files) const; // (normalised paths, as ShaderSources reports)
 
         void Bind()
         {
@@ -47,4 +89,45 @@ namespace Util {
             glProgramUniformMatrix4fv(id, GetUniformLocation(name), 1u, false, glm::value_ptr(v));
         }
     };
+
+    // Builds programs concurrently, replacing the old ones all at once when they're all built, or none of them if any
+    // fails. The old programs remain usable meanwhile, so that reloading needn't block rendering.
+    class ShaderBatch
+    {
+        std::vector<Shader*> shaders;
+
+    public:
+        void Add(Shader&, const Shader::FileNames&, const std::string& defines = "");
+        bool IsEmpty() const { return shaders.empty(); }
+        size_t GetSize() const { return shaders.size(); }
+        bool IsDone() const;
+        bool Apply(); // (waits for any still building)
+        void Cancel();
+    };
+
+    // A program specialised at compile time by #defines (e.g. { { "LIGHTING_MODE", "2u" } }), rather than branching on
+    // uniforms. Each variant is compiled when it's first used, and kept, with reloads rebuilding those there are.
+    class ShaderVariants
+    {
+    public:
+        using Defines = std::map<std::string, std::string>; // name, value
+
+        // Sets the source (and the defines common to all variants), and submits the variants there are to be rebuilt
+        // if the filter accepts them, along with those given (the ones in use, so that they needn't compile on first use).
+        void Submit(ShaderBatch&, const Shader::FileNames&, const std::string& defines, const std::function<bool(const Shader&)>& filter,
+            const std::vector<Defines>& used);
+        Shader& Get(const Defines& = {}); // (compiles the variant if it's new, which stalls)
+
+        const std::string& GetName() const { return files.compute.size() ? files.compute : files.vert; }
+        size_t GetNumVariants() const { return variants.size(); }
+        double GetLazyCompileSeconds() const { return lazyCompileSeconds; } // spent on first uses, so far
+
+    private:
+        Shader::FileNames files;
+        std::string defines;
+        std::map<Defines, Shader> variants;
+        double lazyCompileSeconds = 0.0;
+
+        std::string GetDefines(const Defines&) const;
+    };
 }
@@ -0,0 +1,178 @@
+#include "ShaderSources.hpp"
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace Util {
+
+    ShaderSources::ShaderSources(bool useInotify)
+    {
+#ifdef __linux__
+        if (!useInotify) return;
+        inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotifyFd < 0) std::cerr << "Could not initialise inotify; watching shader modification times instead\n";
+#endif
+    }
+
+    ShaderSources::~ShaderSources()
+    {
+#ifdef __linux__
+        if (inotifyFd >= 0) close(inotifyFd);
+#endif
+    }
+
+    std::string ShaderSources::Normalise(const std::string& path)
+    {
+        return std::filesystem::path(path).lexically_normal().generic_string();
+    }
+
+    bool ShaderSources::DependsOn(const std::vector<std::string>& closure, const std::vector<std::string>& files)
+    {
+        for (const auto& file : files)
+        {
+            if (closure.end() != std::find(closure.begin(), closure.end(), file)) return true;
+        }
+        return false;
+    }
+
+    const ShaderSources::File* ShaderSources::GetFile(const std::string& path)
+    {
+        const auto cached = files.find(path);
+        if (files.end() != cached) return &cached->second;
+
+        std::ifstream in(path);
+        if (!in.is_open()) return nullptr;
+        ++numReads;
+        const auto stop = path.find_last_of('/');
+        const auto dir = path.substr(0, stop == std::string::npos ? 0 : stop + 1);
+        File file;
+        std::error_code error;
+        file.writeTime = std::filesystem::last_write_time(path, error);
+        std::string line;
+        while (std::getline(in, line))
+        {
+            static const std::string includeStart("#include");
+            if (line.size() > includeStart.size() && line.find(includeStart) == 0)
+            {
+                std::istringstream iss(line);
+                std::string preproc, include;
+                iss >> preproc >> include;
+                if (include.size() > 2 && include[0] == include.back() && include[0] == '"')
+                {
+                    file.lines.push_back({ "", Normalise(dir + include.substr(1, include.size() - 2)) });
+                }
+                else
+                {
+                    std::cerr << "Invalid include \"" << include << "\" in " << path << "\n";
+                    file.lines.push_back({});
+                }
+                continue;
+            }
+            file.lines.push_back({ line + '\n', "" });
+        }
+        Watch(dir);
+        return &files.emplace(path, std::move(file)).first->second;
+    }
+
+    void ShaderSources::Watch(const std::string& directory)
+    {
+#ifdef __linux__
+        if (inotifyFd < 0) return;
+        for (const auto& watched : watchedDirectories)
+        {
+            if (watched.second == directory) return;
+        }
+        // (editors save either in place or by renaming a new file over the old one)
+        const auto wd = inotify_add_watch(inotifyFd, directory.empty() ? "." : directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd >= 0) watchedDirectories[wd] = directory;
+#endif
+    }
+
+    std::string ShaderSources::Expand(const std::string& path, const std::string& defines, std::vector<std::string>& closure)
+    {
+        const unsigned MaxIncludeDepth = 32u;
+        std::string src;
+        bool definesInserted = false;
+        std::function<void(const std::string&, unsigned)> append = [&](const std::string& name, unsigned level)
+        {
+            if (closure.end() == std::find(closure.begin(), closure.end(), name)) closure.push_back(name);
+            if (level > MaxIncludeDepth)
+            {
+                std::cerr << "Includes nested too deeply (cyclic?) at " << name << "\n";
+                return;
+            }
+            const auto file = GetFile(name);
+            if (!file)
+            {
+                std::cerr << "Could not open include file " << name << "\n";
+                return;
+            }
+            auto nextLineNumber = 1u;
+            for (const auto& line : file->lines)
+            {
+                ++nextLineNumber;
+                if (!line.include.empty())
+                {
+                    src += "#line 1\n";
+                    append(line.include, level + 1u);
+                    src += "#line " + std::to_string(nextLineNumber) + "\n";
+                    continue;
+                }
+                src += line.text;
+                static const std::string versionStart("#version");
+                if (!definesInserted && !defines.empty() && line.text.find(versionStart) == 0)
+                {
+                    definesInserted = true;
+                    src += defines;
+                    src += "#line " + std::to_string(nextLineNumber) + "\n";
+                }
+            }
+        };
+        append(Normalise(path), 0u);
+        return src;
+    }
+
+    std::vector<std::string> ShaderSources::PollChanges()
+    {
+        std::vector<std::string> changed;
+        auto addChanged = [&](const std::string& path)
+        {
+            if (files.count(path) && changed.end() == std::find(changed.begin(), changed.end(), path)) changed.push_back(path);
+        };
+#ifdef __linux__
+        if (inotifyFd >= 0)
+        {
+            alignas(inotify_event) char buffer[4096];
+            for (;;)
+            {
+                const auto length = read(inotifyFd, buffer, sizeof(buffer));
+                if (length <= 0) break; // (nothing more, as it doesn't block)
+                for (auto p = buffer; p < buffer + length; )
+                {
+                    const auto event = reinterpret_cast<const inotify_event*>(p);
+                    const auto watched = watchedDirectories.find(event->wd);
+                    if (event->len && watchedDirectories.end() != watched) addChanged(Normalise(watched->second + event->name));
+                    p += sizeof(inotify_event) + event->len;
+                }
+            }
+        }
+        else
+#endif
+        {
+            for (const auto& file : files)
+            {
+                std::error_code error;
+                const auto writeTime = std::filesystem::last_write_time(file.first, error);
+                if (error || writeTime != file.second.writeTime) addChanged(file.first);
+            }
+        }
+        for (const auto& path : changed) files.erase(path);
+        return changed;
+    }
+}
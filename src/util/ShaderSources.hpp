@@ -0,0 +1,48 @@
+#pragma once
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace Util {
+    // Shader source files, parsed into lines and #include directives once and cached (as is thereby the include graph)
+    // until they change. Changes are noticed with inotify where that's available, and by modification times otherwise.
+    // This is free of GL calls.
+    class ShaderSources
+    {
+    public:
+        explicit ShaderSources(bool useInotify = true); // (else modification times are compared, as where it isn't available)
+        ~ShaderSources();
+        ShaderSources(const ShaderSources&) = delete;
+        ShaderSources& operator=(const ShaderSources&) = delete;
+
+        // The file with its includes expanded (marked by #line directives), and the defines (if any) inserted after the
+        // #version directive. The files it consists of are added to `closure` (as normalised paths).
+        std::string Expand(const std::string& path, const std::string& defines, std::vector<std::string>& closure);
+        // The cached files changed since the last call, which are also dropped from the cache.
+        std::vector<std::string> PollChanges();
+
+        static std::string Normalise(const std::string& path);
+        // Whether any of the files is in the closure (as Expand gave it).
+        static bool DependsOn(const std::vector<std::string>& closure, const std::vector<std::string>& files);
+        size_t GetNumReads() const { return numReads; } // of files from disk, so far
+
+    private:
+        struct Line
+        {
+            std::string text, include; // either (the include normalised, and an invalid one leaving both empty)
+        };
+        struct File
+        {
+            std::vector<Line> lines;
+            std::filesystem::file_time_type writeTime;
+        };
+        std::map<std::string, File> files;
+        size_t numReads = 0u;
+        int inotifyFd = -1;
+        std::map<int, std::string> watchedDirectories; // by watch descriptor
+
+        const File* GetFile(const std::string& path);
+        void Watch(const std::string& directory);
+    };
+}
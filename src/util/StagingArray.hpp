@@ -0,0 +1,76 @@
+#pragma once
+#include <vector>
+#include <cstddef>
+
+namespace Util {
+    // Vector-like array that either owns its storage or writes straight into externally provided memory
+    // (e.g. a persistently mapped GPU buffer or a memory-mapped file), in which case its capacity is fixed.
+    template<typename T> class StagingArray
+    {
+        std::vector<T> owned;
+        T* external = nullptr;
+        size_t externalSize = 0u, externalCapacity = 0u;
+        size_t overflow = 0u; // number of elements dropped for lack of external capacity
+
+    public:
+        typedef T value_type;
+
+        void SetStorage(void* memory, size_t capacity)
+        {
+            owned.clear();
+            owned.shrink_to_fit();
+            external = static_cast<T*>(memory);
+            externalSize = 0u;
+            externalCapacity = memory ? capacity : 0u;
+            overflow = 0u;
+        }
+        void ResetStorage() { SetStorage(nullptr, 0u); }
+        bool IsExternal() const { return nullptr != external; }
+
+        // Returns a pointer to a new element to be written in place, or nullptr if the external storage is full.
+        T* Append()
+        {
+            if (!external)
+            {
+                owned.emplace_back();
+                return &owned.back();
+            }
+            if (externalSize >= externalCapacity)
+            {
+                ++overflow;
+                return nullptr;
+            }
+            return external + externalSize++;
+        }
+        bool push_back(const T& value)
+        {
+            auto p = Append();
+            if (!p) return false;
+            *p = value;
+            return true;
+        }
+
+        void resize(size_t n)
+        {
+            if (!external) { owned.resize(n); return; }
+            externalSize = n < externalCapacity ? n : externalCapacity;
+            if (!n) overflow = 0u;
+        }
+        void clear() { resize(0u); }
+
+        size_t size() const { return external ? externalSize : owned.size(); }
+        size_t capacity() const { return external ? externalCapacity : owned.capacity(); }
+        bool empty() const { return !size(); }
+        bool full() const { return external && externalSize >= externalCapacity; }
+        size_t GetOverflow() const { return overflow; }
+
+        T* data() { return external ? external : owned.data(); }
+        const T* data() const { return external ? external : owned.data(); }
+        T& operator[](size_t i) { return data()[i]; }
+        const T& operator[](size_t i) const { return data()[i]; }
+        T* begin() { return data(); }
+        T* end() { return data() + size(); }
+        const T* begin() const { return data(); }
+        const T* end() const { return data() + size(); }
+    };
+}
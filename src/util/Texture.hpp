@@ -11,22 +11,27 @@ namespace Util {
 		Dim width = 0u, height = 0u, depth = 0u;
 		Dim levels = 0u;
 		GLenum internalformat;
+		GLenum target = GL_TEXTURE_2D;
+		bool sparse = false;
 
-	public:
-		Dim GetWidth () const { return width; }
-		Dim GetHeight() const { return height; }
-		Dim GetDepth () const { return depth; }
-		GLenum GetFormat() const { return internalformat; }
-
-		void Create(GLenum target, Dim levels, GLenum internalformat, Dim width, Dim height = 1u, Dim depth = 1u)
+		void Allocate(GLenum target, Dim levels, GLenum internalformat, Dim width, Dim height, Dim depth, bool sparse)
 		{
 			Destroy();
+			this->target = target;
 			this->width = width;
 			this->height = height;
 			this->depth = depth;
 			this->levels = levels;
 			this->internalformat = internalformat;
+			this->sparse = sparse;
 			glCreateTextures(target, 1, &id);
+#ifdef GL_ARB_sparse_texture
+			if (sparse)
+			{
+				glTextureParameteri(id, GL_TEXTURE_SPARSE_ARB, GL_TRUE);
+				glTextureParameteri(id, GL_VIRTUAL_PAGE_SIZE_INDEX_ARB, 0);
+			}
+#endif
 			switch (target) {
 			case GL_TEXTURE_1D: glTextureStorage1D(id, levels, internalformat, width); break;
 			case GL_TEXTURE_2D: glTextureStorage2D(id, levels, internalformat, width, height); break;
@@ -34,6 +39,84 @@ namespace Util {
 			}
 		}
 
+	public:
+		Dim GetWidth () const { return width; }
+		Dim GetHeight() const { return height; }
+		Dim GetDepth () const { return depth; }
+		GLenum GetFormat() const { return internalformat; }
+		bool IsSparse() const { return sparse; }
+
+		void Create(GLenum target, Dim levels, GLenum internalformat, Dim width, Dim height = 1u, Dim depth = 1u)
+		{
+			Allocate(target, levels, internalformat, width, height, depth, false);
+		}
+
+		// Not all formats can be used with all targets (e.g. block-compressed 3D textures are optional).
+		static bool FormatSupported(GLenum target, GLenum internalformat)
+		{
+			GLint supported = GL_FALSE;
+			glGetInternalformativ(target, internalformat, GL_INTERNALFORMAT_SUPPORTED, 1, &supported);
+			return GL_TRUE == supported;
+		}
+
+		// Sparse (ARB_sparse_texture) textures only have memory backing the pages committed through Commit.
+		static bool SparseSupported()
+		{
+#ifdef GL_ARB_sparse_texture
+			return GLAD_GL_ARB_sparse_texture;
+#else
+			return false;
+#endif
+		}
+		// Retrieves the (first) virtual page size for the format, returning false if there is none.
+		static bool GetSparsePageSize(GLenum target, GLenum internalformat, GLint size[3])
+		{
+#ifdef GL_ARB_sparse_texture
+			if (!SparseSupported()) return false;
+			GLint num = 0;
+			glGetInternalformativ(target, internalformat, GL_NUM_VIRTUAL_PAGE_SIZES_ARB, 1, &num);
+			if (num <= 0) return false;
+			glGetInternalformativ(target, internalformat, GL_VIRTUAL_PAGE_SIZE_X_ARB, 1, &size[0]);
+			glGetInternalformativ(target, internalformat, GL_VIRTUAL_PAGE_SIZE_Y_ARB, 1, &size[1]);
+			glGetInternalformativ(target, internalformat, GL_VIRTUAL_PAGE_SIZE_Z_ARB, 1, &size[2]);
+			return size[0] > 0 && size[1] > 0 && size[2] > 0;
+#else
+			return false;
+#endif
+		}
+		void CreateSparse(GLenum target, Dim levels, GLenum internalformat, Dim width, Dim height = 1u, Dim depth = 1u)
+		{
+			Allocate(target, levels, internalformat, width, height, depth, true);
+		}
+		// The region must be aligned to the virtual page size. Texture bindings are left as they were.
+		void Commit(GLint level, GLint x, GLint y, GLint z, GLsizei w, GLsizei h, GLsizei d, bool commit)
+		{
+#ifdef GL_ARB_sparse_texture
+			if (!sparse) return;
+#ifdef glTexturePageCommitmentEXT
+			if (glTexturePageCommitmentEXT) // (the direct state access form, with EXT_direct_state_access)
+			{
+				glTexturePageCommitmentEXT(id, level, x, y, z, w, h, d, commit ? GL_TRUE : GL_FALSE);
+				return;
+			}
+#endif
+			// (else through the active unit, whose binding is restored, as it's used mid-frame)
+			GLint bound = 0;
+			glGetIntegerv(GetBindingQuery(target), &bound);
+			glBindTexture(target, id);
+			glTexPageCommitmentARB(target, level, x, y, z, w, h, d, commit ? GL_TRUE : GL_FALSE);
+			glBindTexture(target, static_cast<GLuint>(bound));
+#endif
+		}
+		static GLenum GetBindingQuery(GLenum target)
+		{
+			switch (target) {
+			case GL_TEXTURE_1D: return GL_TEXTURE_BINDING_1D;
+			case GL_TEXTURE_3D: return GL_TEXTURE_BINDING_3D;
+			default: return GL_TEXTURE_BINDING_2D;
+			}
+		}
+
 		void Bind(GLuint unit)
 		{
 			glBindTextureUnit(unit, id);
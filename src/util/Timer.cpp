@@ -4,74 +4,188 @@ namespace Util {
 
     void Timer::Timings::DurationVector::Insert(Duration d, size_t maxLength)
     {
-        if (durations.size() <= nextIndex) durations.resize(nextIndex + 1u);
-        durations[nextIndex] = d;
+        if (durations.size() <= nextIndex)
+        {
+            const auto size = nextIndex + 1u;
+            durations.resize(size);
+            factors.resize(size);
+            sumsBefore.resize(size);
+            scaledSumsBefore.resize(size);
+            frames.resize(size);
+        }
+        durations[nextIndex] = d.duration;
+        factors[nextIndex] = d.meta.factor;
+        frames[nextIndex] = d.frame;
+        sumsBefore[nextIndex] = sum;
+        scaledSumsBefore[nextIndex] = scaledSum;
+        ++numInserted;
+        sum += d.duration;
+        if (d.meta.factor > 0.0) scaledSum += d.duration / d.meta.factor;
         nextIndex = (nextIndex + 1ULL) % maxLength;
     }
 
-    Timer::GpuQuery Timer::AllocateGpuQuery()
+    uint32_t Timer::AllocateGpuQueries(GpuFrame& f)
     {
-        GpuQuery q;
-        if (freeGpuQueries.empty())
+        if (f.queries.size() < f.numUsed + 2u)
         {
-            glCreateQueries(GL_TIMESTAMP, 1, &q);
-            static unsigned count = 0u;
-            //std::cout << "Created " << ++count << " timestamp queries." << std::endl;
+            const auto num = glm::max<size_t>(64u, f.queries.size()); // (doubling)
+            f.queries.resize(f.queries.size() + num);
+            glCreateQueries(GL_TIMESTAMP, GLsizei(num), f.queries.data() + f.queries.size() - num);
         }
-        else
+        const auto index = uint32_t(f.numUsed);
+        f.numUsed += 2u;
+        return index;
+    }
+
+    bool Timer::ReadGpuFrame(GpuFrame& f, bool wait)
+    {
+        if (!f.fence) return true;
+        const GLuint64 timeout = wait ? 1000000000u : 0u; // 1 s
+        const auto res = glClientWaitSync(f.fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0u, timeout);
+        if (GL_TIMEOUT_EXPIRED == res && !wait) return false;
+        if (GL_ALREADY_SIGNALED != res && GL_CONDITION_SATISFIED != res)
         {
-            q = freeGpuQueries.top();
-            freeGpuQueries.pop();
+            std::cerr << "Util::Timer: glClientWaitSync failed for frame " << f.frame << "'s queries\n";
         }
-        return q;
+        glDeleteSync(f.fence);
+        f.fence = nullptr;
+
+        // (all are available now, so reading them doesn't stall)
+        GLuint64 lastEnd = 0u;
+        for (const auto& q : f.pending)
+        {
+            GLuint64 start = 0u, end = 0u;
+            glGetQueryObjectui64v(f.queries[q.gpuQueries], GL_QUERY_RESULT, &start);
+            glGetQueryObjectui64v(f.queries[q.gpuQueries + 1u], GL_QUERY_RESULT, &end);
+            const auto gpuDuration = (end - start) * 1e-9;
+            GetTimings(q.nameRef).gpuTimes.Insert({ gpuDuration, f.frame, q.meta }, maxTimesStored);
+            lastEnd = glm::max(lastEnd, end);
+        }
+        f.pending.clear();
+
+        Count(latencyFramesRef, double(frame - f.frame));
+        Count(latencyRef, glm::max(0.0, (double(lastEnd) - double(f.submitTime)) * 1e-9));
+        return true;
     }
-    void Timer::FreeGpuQuery(Timer::GpuQuery& q)
+
+    Timer::Timer()
+        : latencyFramesRef{ NameToRef("Timer::GpuLatencyFrames") }
+        , latencyRef{ NameToRef("Timer::GpuLatency") }
+    {
+    }
+
+    namespace {
+        // The innermost active scope of the calling thread (of whichever timer).
+        thread_local Timer::ActiveTiming* currentScope = nullptr;
+    }
+
+    void Timer::ThreadEvents::Push(const ScopeEvent& e)
     {
-        freeGpuQueries.push(q);
-        q = 0u;
+        const auto w = written.load(std::memory_order_relaxed);
+        if (w - read.load(std::memory_order_acquire) >= events.size())
+        {
+            dropped.fetch_add(1u, std::memory_order_relaxed);
+            return;
+        }
+        events[w % events.size()] = e;
+        written.store(w + 1u, std::memory_order_release);
+    }
+
+    bool Timer::ThreadEvents::Pop(ScopeEvent& e)
+    {
+        const auto r = read.load(std::memory_order_relaxed);
+        if (r == written.load(std::memory_order_acquire)) return false;
+        e = events[r % events.size()];
+        read.store(r + 1u, std::memory_order_release);
+        return true;
+    }
+
+    Timer::ThreadEvents& Timer::GetThreadEvents()
+    {
+        // (a thread is assumed not to outlive the timer it has used)
+        thread_local const Timer* cachedTimer = nullptr;
+        thread_local ThreadEvents* cachedEvents = nullptr;
+        if (cachedTimer != this)
+        {
+            std::lock_guard<std::mutex> lock{ mutex };
+            threadEvents.push_back(std::make_unique<ThreadEvents>());
+            cachedTimer = this;
+            cachedEvents = threadEvents.back().get();
+        }
+        return *cachedEvents;
+    }
+
+    void Timer::Record(NameRef ref, NameRef parent, double duration, double selfDuration, const DurationMeta& meta)
+    {
+        auto& t = GetTimings(ref);
+        if (NoRef == t.parent && ref != parent) t.parent = parent;
+        t.cpuTimes.Insert({ duration, frame, meta }, maxTimesStored);
+        t.selfTimes.Insert({ selfDuration, frame, meta }, maxTimesStored);
     }
 
     void Timer::StartTiming(Timer::ActiveTiming& t)
     {
+        t.parent = currentScope && &currentScope->timer == this ? currentScope : nullptr;
+        currentScope = &t;
+        t.gpu = std::this_thread::get_id() == ownerThread;
+        if (t.gpu)
+        {
+            auto& f = gpuFrames[frame % MaxFramesInFlight];
+            t.gpuQueries = AllocateGpuQueries(f);
+            f.pending.push_back({ t.nameRef, t.gpuQueries, t.meta });
+            glQueryCounter(f.queries[t.gpuQueries], GL_TIMESTAMP);
+        }
         t.startTime = Clock::now();
-        t.queries[0] = AllocateGpuQuery();
-        t.queries[1] = AllocateGpuQuery();
-        pendingGpuQueries.push({ t.nameRef, t.queries[0], t.queries[1], frame, t.meta });
-        glQueryCounter(t.queries[0], GL_TIMESTAMP);
     }
 
     void Timer::EndTiming(Timer::ActiveTiming& t)
     {
-        glQueryCounter(t.queries[1], GL_TIMESTAMP);
         auto endTime = Clock::now();
+        if (t.gpu)
+        {
+            auto& f = gpuFrames[frame % MaxFramesInFlight];
+            glQueryCounter(f.queries[t.gpuQueries + 1u], GL_TIMESTAMP);
+        }
+        currentScope = t.parent;
         auto time = endTime - t.startTime;
         auto duration = 1e-6 * (time / std::chrono::microseconds(1));
+        if (t.parent) t.parent->childDuration += duration;
+        const auto parentRef = t.parent ? t.parent->nameRef : NoRef;
+        const auto selfDuration = glm::max(0.0, duration - t.childDuration);
         //std::cout << refToName[t.nameRef] << " took " << duration * 1e3 << " ms" << std::endl;
-        timings[t.nameRef].cpuTimes.Insert({ duration, frame, t.meta }, maxTimesStored);
+        if (t.gpu) Record(t.nameRef, parentRef, duration, selfDuration, t.meta);
+        else GetThreadEvents().Push({ t.nameRef, parentRef, duration, selfDuration, t.meta });
     }
 
     void Timer::EndFrame()
     {
-        while (!pendingGpuQueries.empty())
+        // The frame's queries are fenced, and any frames' whose fences are signalled are read back.
+        auto& current = gpuFrames[frame % MaxFramesInFlight];
+        if (!current.pending.empty())
         {
-            auto& q = pendingGpuQueries.front();
-            GLuint64 start = 0u, end = 0u;
-            glGetQueryObjectui64v(q.gpuQueries[1], GL_QUERY_RESULT_NO_WAIT, &end);
-            if (0u == end) break; // not yet ready
-            glGetQueryObjectui64v(q.gpuQueries[0], GL_QUERY_RESULT, &start);
-
-            const auto gpuDuration = (end - start) * 1e-9;
-            timings[q.nameRef].gpuTimes.Insert({ gpuDuration, q.frame, q.meta }, maxTimesStored);
-
-            FreeGpuQuery(q.gpuQueries[0]);
-            FreeGpuQuery(q.gpuQueries[1]);
-            pendingGpuQueries.pop();
+            current.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            glGetInteger64v(GL_TIMESTAMP, &current.submitTime);
+        }
+        for (auto& f : gpuFrames) ReadGpuFrame(f, false);
 
-            //std::cout << "GPU query \"" << refToName[q.nameRef] << "\": " << gpuDuration * 1e3 << " ms (next index: " << timings[q.nameRef].nextGpuIndex << ")" << std::endl;
+        // Other threads' scopes count towards the frame they're collected in.
+        {
+            std::lock_guard<std::mutex> lock{ mutex };
+            for (auto& events : threadEvents)
+            {
+                ScopeEvent e;
+                while (events->Pop(e)) Record(e.nameRef, e.parent, e.duration, e.selfDuration, e.meta);
+                if (const auto dropped = events->dropped.exchange(0u))
+                    std::cerr << "Timer: dropped " << dropped << " scopes of another thread\n";
+            }
         }
 
-        // - testing:
-        //std::cout << "Handled " << num << " queries. Pending queries: " << pendingGpuQueries.size() << std::endl;
         ++frame;
+
+        // The next frame reuses the pool of the one MaxFramesInFlight frames before it (which it waits for, if need be).
+        auto& next = gpuFrames[frame % MaxFramesInFlight];
+        ReadGpuFrame(next, true);
+        next.frame = frame;
+        next.numUsed = 0u;
     }
 }
@@ -3,12 +3,21 @@
 #include <chrono>
 #include <iostream>
 #include "GLObject.hpp"
-#include <stack>
 #include <unordered_map>
-#include <queue>
+#include <vector>
+#include <deque>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <glm/glm.hpp>
 
 namespace Util {
+    // Scopes nest: each records the scope it was begun within (on the same thread) as its parent, and its self time
+    // (its duration minus its children's). GPU timestamps are only queried on the thread the timer was created on
+    // (with the GL context); other threads' scopes are CPU-only, and are passed on through per-thread event buffers
+    // that EndFrame collects.
     class Timer
     {
     public:
@@ -24,16 +33,29 @@ namespace Util {
             DurationMeta meta;
         };
 
-        typedef std::vector<Duration>::size_type NameRef;
+        // Handles of names, from NameToRef: registering names up front (e.g. on construction of their users) keeps
+        // string hashing out of Begin calls on hot paths.
+        typedef size_t NameRef;
+        static constexpr NameRef NoRef = ~NameRef(0u);
 
     private:
         struct Timings
         {
+            // A fixed-capacity ring, stored as a structure of arrays. Each entry also stores the running sums of all
+            // values inserted before it, so that averages over any window are the difference of two sums.
             class DurationVector
             {
                 friend class Timer;
-                std::vector<Duration> durations;
-                size_t nextIndex = 0u;
+                std::vector<double> durations, factors, sumsBefore, scaledSumsBefore;
+                std::vector<int> frames;
+                size_t nextIndex = 0u, numInserted = 0u;
+                double sum = 0.0, scaledSum = 0.0; // of all inserted (scaled: divided by the meta factors)
+
+                size_t Index(int i) const // (zero for the newest, negative for older)
+                {
+                    const auto size = durations.size();
+                    return (nextIndex + size + i + size - 1u) % size;
+                }
 
             public:
                 void Insert(Duration d, size_t maxLength);
@@ -42,50 +64,86 @@ namespace Util {
                 {
                     return durations.size();
                 }
+                size_t GetNumInserted() const { return numInserted; } // (ever, so that readers can tell what's new)
 
-                const Duration& operator[](int i)
+                Duration operator[](int i) const
                 {
-                    const auto size = static_cast<int>(durations.size());
-                    return durations[(nextIndex + i + size - 1) % size];
+                    const auto index = Index(i);
+                    return { durations[index], frames[index], { factors[index] } };
                 }
 
-                double Average(size_t window)
+                double Average(size_t window) const
                 {
                     if (!Size()) return 0.0;
-                    const auto num = static_cast<int>(glm::min(window, Size()));
-                    auto sum = 0.0;
-                    for (auto i = 0; i < num; ++i)
-                    {
-                        sum += (*this)[-i].duration;
-                    }
-                    auto duration = sum / double(num);
-                    return duration;
+                    const auto num = glm::min(window, Size());
+                    return (sum - sumsBefore[Index(1 - int(num))]) / double(num);
                 }
-            } cpuTimes, gpuTimes;
-            
-            // - maybe storing a few sets of query objects here would actually be better
-            // (fully dynamic handling might be overkill - do we ever really need e.g. a latency of more than 4 frames?)
+                double AverageScaled(size_t window) const // (of the durations divided by their meta factors)
+                {
+                    if (!Size()) return 0.0;
+                    const auto num = glm::min(window, Size());
+                    return (scaledSum - scaledSumsBefore[Index(1 - int(num))]) / double(num);
+                }
+            } cpuTimes, gpuTimes, counts; // (counts: per-frame values other than durations, see Count)
+            DurationVector selfTimes; // CPU, excluding nested scopes
+            NameRef parent = NoRef; // the scope this was first begun within (if any)
         };
         size_t maxTimesStored = 128u; // - arbitrary (to do: make this configurable)
 
-        std::vector<Timings> timings;
+        std::vector<Timings> timings; // (only used on the owner thread, and resized as names are added)
         std::unordered_map<std::string, NameRef> nameToRef;
-        std::vector<std::string> refToName;
+        std::deque<std::string> refToName; // (so that references stay valid as names are added)
+        std::mutex mutex; // for the names and the thread event buffers, which any thread may add to
+        const std::thread::id ownerThread = std::this_thread::get_id();
 
+        // Scopes ended on other threads than the owner's, until EndFrame (single producer, single consumer).
+        struct ScopeEvent
+        {
+            NameRef nameRef, parent;
+            double duration, selfDuration;
+            DurationMeta meta;
+        };
+        class ThreadEvents
+        {
+            std::array<ScopeEvent, 1024u> events;
+            std::atomic<size_t> written{ 0u }, read{ 0u };
+
+        public:
+            std::atomic<size_t> dropped{ 0u }; // (if EndFrame doesn't keep up)
+            void Push(const ScopeEvent&);
+            bool Pop(ScopeEvent&);
+        };
+        std::vector<std::unique_ptr<ThreadEvents>> threadEvents;
+        ThreadEvents& GetThreadEvents(); // of the calling thread
+
+        void Record(NameRef, NameRef parent, double duration, double selfDuration, const DurationMeta&);
+
+        // Timestamp queries, in a pool per frame in flight, with a fence per frame: a frame's queries are all read back
+        // together once its fence is signalled (whether or not earlier frames' are), and its pool is reused once they
+        // are. A frame that finds its pool still pending (MaxFramesInFlight frames later) waits for the results.
+        static constexpr size_t MaxFramesInFlight = 4u;
         typedef GLuint GpuQuery;
-        std::stack<GpuQuery> freeGpuQueries;
         struct PendingGpuQuery
         {
             NameRef nameRef;
-            GpuQuery gpuQueries[2];
-            int frame;
+            uint32_t gpuQueries; // index of the start query in the frame's pool (the end query follows it)
             DurationMeta meta;
         };
-        std::queue<PendingGpuQuery> pendingGpuQueries;
-        // - to do: sync objects with associated numbers of pending queries
-
-        GpuQuery AllocateGpuQuery();
-        void FreeGpuQuery(GpuQuery&);
+        struct GpuFrame
+        {
+            std::vector<GpuQuery> queries; // (grown as needed, and then kept)
+            size_t numUsed = 0u;
+            std::vector<PendingGpuQuery> pending;
+            GLsync fence = nullptr; // (after the frame's last query)
+            GLint64 submitTime = 0; // GPU time when the fence was issued
+            int frame = 0;
+        } gpuFrames[MaxFramesInFlight];
+        // The latency of GPU times: in frames, from a frame's end to reading back its queries, and in time, from the
+        // frame's commands being submitted to the GPU completing them (both recorded as counts).
+        NameRef latencyFramesRef, latencyRef;
+
+        uint32_t AllocateGpuQueries(GpuFrame&); // (a start and end pair)
+        bool ReadGpuFrame(GpuFrame&, bool wait);
 
         int frame = 0;
 
@@ -95,25 +153,33 @@ namespace Util {
         void StartTiming(ActiveTiming&);
         void EndTiming(ActiveTiming&);
 
+        Timer();
+
         size_t GetFrame() const { return frame; }
 
         NameRef NameToRef(const std::string& name)
         {
+            std::lock_guard<std::mutex> lock{ mutex };
             auto it = nameToRef.find(name);
             if (it != nameToRef.end()) return it->second;
-            const auto ref = timings.size();
-            timings.push_back({});
+            const auto ref = refToName.size();
             refToName.push_back(name);
             nameToRef[name] = ref;
             return ref;
         }
         const std::string& RefToName(NameRef ref)
         {
+            std::lock_guard<std::mutex> lock{ mutex };
             return refToName[ref];
         }
-        size_t GetNumNames() const { return refToName.size(); }
-        Timings& GetTimings(NameRef ref)
+        size_t GetNumNames()
         {
+            std::lock_guard<std::mutex> lock{ mutex };
+            return refToName.size();
+        }
+        Timings& GetTimings(NameRef ref) // (on the owner thread)
+        {
+            if (timings.size() <= ref) timings.resize(ref + 1u);
             return timings[ref];
         }
         Timings& GetTimings(const std::string& name)
@@ -121,7 +187,8 @@ namespace Util {
             return GetTimings(NameToRef(name));
         }
 
-        typedef std::chrono::high_resolution_clock Clock;
+
+        typedef std::chrono::steady_clock Clock; // (monotonic, and comparable across threads)
 
         class ActiveTiming
         {
@@ -130,11 +197,14 @@ namespace Util {
             NameRef nameRef;
             DurationMeta meta;
             Clock::time_point startTime;
-            GLuint queries[2];
+            uint32_t gpuQueries = 0u; // (in the pool of the frame it began in)
+            bool gpu = false; // (on the owner thread)
+            ActiveTiming* parent = nullptr;
+            double childDuration = 0.0; // of the scopes nested in this one, so far
 
-            ActiveTiming(Timer& timer, const std::string& name, const DurationMeta& meta)
+            ActiveTiming(Timer& timer, NameRef nameRef, const DurationMeta& meta)
                 : timer{ timer }
-                , nameRef { timer.NameToRef(name) }
+                , nameRef{ nameRef }
                 , meta{ meta }
             {
                 timer.StartTiming(*this);
@@ -147,11 +217,34 @@ namespace Util {
             }
         };
 
-        ActiveTiming Begin(const std::string& name, DurationMeta meta = { 1.0 })
+        ActiveTiming Begin(NameRef ref, DurationMeta meta = { 1.0 })
         {
-            return { *this, name, meta };
+            return { *this, ref, meta };
+        }
+        ActiveTiming Begin(const std::string& name, DurationMeta meta = { 1.0 }) // (for scopes off the hot paths)
+        {
+            return { *this, NameToRef(name), meta };
+        }
+
+        // Records a per-frame value other than a duration (e.g. a number of rays), to be averaged like durations.
+        void Count(NameRef ref, double value) // (on the owner thread)
+        {
+            GetTimings(ref).counts.Insert({ value, frame, { 1.0 } }, maxTimesStored);
+        }
+        void Count(const std::string& name, double value)
+        {
+            Count(NameToRef(name), value);
         }
 
         void EndFrame();
+
+        struct Latency
+        {
+            double frames, microseconds;
+        };
+        Latency GetGpuLatency(size_t window = 100u) // (averages, on the owner thread)
+        {
+            return { GetTimings(latencyFramesRef).counts.Average(window), 1e6 * GetTimings(latencyRef).counts.Average(window) };
+        }
     };
 }
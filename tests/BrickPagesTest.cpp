@@ -0,0 +1,117 @@
+#include "atmosphere/BrickPages.hpp"
+#include "Check.hpp"
+#include <algorithm>
+#include <initializer_list>
+
+using namespace Mulen::Atmosphere;
+using PageIndex = BrickPageTable::PageIndex;
+
+namespace {
+    const size_t BricksPerPage = 4u;
+    const unsigned NumStates = 3u; // (the release latency, as the atmosphere uses)
+
+    // A usage pass over whole virtual pages.
+    void Pass(BrickPageTable& pages, std::initializer_list<PageIndex> used)
+    {
+        pages.BeginUsage();
+        for (auto page : used) pages.UseBricks(page * BricksPerPage, BricksPerPage);
+        pages.EndUsage();
+    }
+
+    bool Contains(const std::vector<PageIndex>& pages, PageIndex page)
+    {
+        return std::find(pages.begin(), pages.end(), page) != pages.end();
+    }
+
+    void TestPooled()
+    {
+        BrickPageTable pages;
+        CHECK(pages.Init(8u * BricksPerPage, BricksPerPage, false, NumStates));
+        CHECK(pages.TakeTableChanged());
+
+        // Pages used for the first time get physical pages, lowest first.
+        Pass(pages, { 0u, 1u });
+        auto committed = pages.TakeCommitted();
+        CHECK(committed.size() == 2u && Contains(committed, 0u) && Contains(committed, 1u));
+        CHECK(pages.GetPhysicalPage(0u) == 0u && pages.GetPhysicalPage(BricksPerPage) == 1u);
+        CHECK(pages.TakeTableChanged());
+        CHECK_VALID(pages);
+
+        // A page falling out of use stays resident for as many passes as there are states (which may still read it)...
+        for (unsigned i = 0u; i < NumStates; ++i)
+        {
+            Pass(pages, { 1u, 3u });
+            CHECK(pages.TakeDecommitted().empty());
+            CHECK(pages.GetPhysicalPage(0u) == 0u);
+            CHECK_VALID(pages);
+        }
+        CHECK(pages.GetPhysicalPage(3u * BricksPerPage) == 2u);
+        // ...and is released after them.
+        Pass(pages, { 1u, 3u });
+        auto decommitted = pages.TakeDecommitted();
+        CHECK(decommitted.size() == 1u && Contains(decommitted, 0u));
+        CHECK(pages.GetPhysicalPage(0u) == BrickPageTable::NoPage);
+        CHECK(pages.GetNumResidentPages() == 2u);
+        CHECK_VALID(pages);
+
+        // Its physical page is reused (the lowest free one) rather than the pool growing.
+        pages.TakeCommitted();
+        Pass(pages, { 1u, 2u, 3u });
+        committed = pages.TakeCommitted();
+        CHECK(committed.size() == 1u && Contains(committed, 0u));
+        CHECK(pages.GetPhysicalPage(2u * BricksPerPage) == 0u);
+        CHECK(pages.GetPhysicalPageCount() == 3u);
+        CHECK_VALID(pages);
+
+        // A page used again within its grace passes keeps its physical page.
+        Pass(pages, { 1u, 2u });
+        Pass(pages, { 1u, 2u, 3u });
+        CHECK(pages.TakeCommitted().empty() && pages.TakeDecommitted().empty());
+        CHECK(pages.GetPhysicalPage(3u * BricksPerPage) == 2u);
+        CHECK_VALID(pages);
+
+        // With no free physical pages left, the pool grows.
+        Pass(pages, { 0u, 1u, 2u, 3u, 4u });
+        committed = pages.TakeCommitted();
+        CHECK(committed.size() == 2u && Contains(committed, 3u) && Contains(committed, 4u));
+        CHECK(pages.GetPhysicalPageCount() == 5u);
+        CHECK(pages.GetNumResidentPages() == 5u);
+        CHECK_VALID(pages);
+
+        // Bricks spanning pages mark all of them, and the last page may be partial.
+        pages.BeginUsage();
+        pages.UseBricks(6u * BricksPerPage - 1u, BricksPerPage + 1u);
+        pages.EndUsage();
+        CHECK(pages.GetPhysicalPage(5u * BricksPerPage) != BrickPageTable::NoPage);
+        CHECK(pages.GetPhysicalPage(6u * BricksPerPage) != BrickPageTable::NoPage);
+        CHECK(pages.GetPhysicalPage(7u * BricksPerPage) == BrickPageTable::NoPage);
+        CHECK_VALID(pages);
+
+        // Everything is released once nothing is used for long enough.
+        for (unsigned i = 0u; i <= NumStates; ++i) Pass(pages, {});
+        CHECK(pages.GetNumResidentPages() == 0u);
+        CHECK_VALID(pages);
+    }
+
+    void TestIdentity()
+    {
+        BrickPageTable pages;
+        CHECK(pages.Init(8u * BricksPerPage, BricksPerPage, true, NumStates));
+        Pass(pages, { 2u, 5u });
+        const auto committed = pages.TakeCommitted();
+        CHECK(committed.size() == 2u && Contains(committed, 2u) && Contains(committed, 5u));
+        CHECK(pages.GetPhysicalPage(5u * BricksPerPage + 1u) == 5u);
+        CHECK_VALID(pages);
+        for (unsigned i = 0u; i <= NumStates; ++i) Pass(pages, { 5u });
+        const auto decommitted = pages.TakeDecommitted();
+        CHECK(decommitted.size() == 1u && Contains(decommitted, 2u));
+        CHECK_VALID(pages);
+    }
+}
+
+int main()
+{
+    TestPooled();
+    TestIdentity();
+    return Test::Finish("BrickPagesTest");
+}
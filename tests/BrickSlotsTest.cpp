@@ -0,0 +1,182 @@
+#include "atmosphere/BrickSlots.hpp"
+#include "Check.hpp"
+#include <algorithm>
+#include <vector>
+
+using namespace Mulen::Atmosphere;
+using Slot = BrickSlots::Slot;
+
+namespace {
+    const size_t GroupSize = 8u; // (bricks per node group)
+    const unsigned NumStates = 3u;
+
+    std::vector<size_t> Group(size_t group)
+    {
+        std::vector<size_t> bricks(GroupSize);
+        for (size_t i = 0u; i < GroupSize; ++i) bricks[i] = group * GroupSize + i;
+        return bricks;
+    }
+
+    unsigned CountReferences(const BrickSlots& slots, Slot slot)
+    {
+        unsigned num = 0u;
+        for (unsigned state = 0u; state < NumStates; ++state)
+        {
+            for (auto s : slots.GetMap(state)) num += s == slot;
+        }
+        return num;
+    }
+
+    // Is every brick of the group in the state in a slot no other state (or brick) refers to, i.e. safe to write into?
+    bool OwnsSlots(const BrickSlots& slots, unsigned state, size_t group)
+    {
+        for (auto brick : Group(group))
+        {
+            const auto slot = slots.GetMap(state)[brick];
+            if (BrickSlots::NoSlot == slot || 1u != CountReferences(slots, slot)) return false;
+        }
+        return true;
+    }
+
+    bool SharesSlots(const BrickSlots& slots, unsigned state, unsigned source, size_t group)
+    {
+        for (auto brick : Group(group))
+        {
+            if (slots.GetMap(state)[brick] != slots.GetMap(source)[brick]) return false;
+        }
+        return true;
+    }
+
+    // A pass as the atmosphere makes them: the next state begun from the current one, with the given groups dirty.
+    struct Passes
+    {
+        BrickSlots& slots;
+        unsigned state = 0u;
+
+        std::vector<bool> Next(size_t numGroups, const std::vector<size_t>& dirty)
+        {
+            const auto source = state;
+            state = (state + 1u) % NumStates;
+            slots.BeginState(state, source);
+            std::vector<bool> result(numGroups);
+            for (size_t g = 0u; g < numGroups; ++g)
+            {
+                const auto isDirty = std::find(dirty.begin(), dirty.end(), g) != dirty.end();
+                const auto bricks = Group(g);
+                result[g] = slots.Use(bricks.data(), bricks.size(), isDirty);
+            }
+            return result;
+        }
+    };
+
+    void TestReferences()
+    {
+        // (enough overflow slots for every group to have moved, as displaced groups aren't moved back here)
+        const size_t numGroups = 4u;
+        BrickSlots slots;
+        CHECK(slots.Init(numGroups * GroupSize, numGroups * GroupSize, NumStates));
+        Passes passes{ slots };
+
+        // The first states have everything dirty; a brick's own slot is used while free.
+        passes.Next(numGroups, { 0u, 1u, 2u, 3u });
+        CHECK(slots.GetMap(passes.state)[5u] == 5u);
+        CHECK_VALID(slots);
+
+        for (unsigned pass = 0u; pass < 3u * NumStates; ++pass)
+        {
+            const auto source = passes.state;
+            const size_t dirtyGroup = pass % numGroups;
+            const auto result = passes.Next(numGroups, { dirtyGroup });
+            CHECK_VALID(slots);
+            for (size_t g = 0u; g < numGroups; ++g)
+            {
+                CHECK(result[g]);
+                if (g == dirtyGroup) CHECK(OwnsSlots(slots, passes.state, g));
+                else CHECK(SharesSlots(slots, passes.state, source, g));
+            }
+        }
+
+        // With nothing dirty for as many passes as there are states, all share the same slots.
+        for (unsigned pass = 0u; pass < NumStates; ++pass) passes.Next(numGroups, {});
+        for (unsigned state = 0u; state < NumStates; ++state)
+        {
+            for (size_t g = 0u; g < numGroups; ++g) CHECK(SharesSlots(slots, state, passes.state, g));
+        }
+        CHECK_VALID(slots);
+    }
+
+    void TestExhaustion()
+    {
+        // Overflow slots for a single group.
+        const size_t numGroups = 3u;
+        BrickSlots slots;
+        CHECK(slots.Init(numGroups * GroupSize, GroupSize, NumStates));
+        Passes passes{ slots };
+        passes.Next(numGroups, { 0u, 1u, 2u });
+        for (unsigned pass = 1u; pass < NumStates; ++pass) passes.Next(numGroups, {});
+        CHECK_VALID(slots);
+
+        // Regenerating two groups whose own slots all states use: one gets the overflow slots, the other none.
+        const auto source = passes.state;
+        auto result = passes.Next(numGroups, { 0u, 1u });
+        CHECK(result[0] && OwnsSlots(slots, passes.state, 0u));
+        CHECK(!result[1]);
+        CHECK(SharesSlots(slots, passes.state, source, 1u)); // (left with the stale data, not to be written into)
+        CHECK(result[2] && SharesSlots(slots, passes.state, source, 2u));
+        CHECK(slots.GetNumOverflowUsed() == GroupSize && slots.GetNumFreeOverflow() == 0u);
+        CHECK_VALID(slots);
+
+        // A failed group takes no slots: retried with the overflow still taken, it fails again, leaving the count as is.
+        result = passes.Next(numGroups, { 1u });
+        CHECK(!result[1]);
+        CHECK(slots.GetNumOverflowUsed() == GroupSize);
+        CHECK_VALID(slots);
+
+        // Group 0 keeps its overflow slots while states share them, so its own slots fall out of use and it's displaced;
+        // regenerating it then moves it back, and the overflow slots are freed once no state refers to them.
+        passes.Next(numGroups, {});
+        CHECK(slots.IsDisplaced(passes.state, 0u));
+        result = passes.Next(numGroups, { 0u });
+        CHECK(result[0] && OwnsSlots(slots, passes.state, 0u));
+        CHECK(slots.GetMap(passes.state)[0u] == 0u);
+        for (unsigned pass = 1u; pass < NumStates; ++pass) passes.Next(numGroups, {});
+        CHECK(slots.GetNumOverflowUsed() == 0u && slots.GetNumFreeOverflow() == GroupSize);
+        CHECK_VALID(slots);
+
+        // So group 1 can be regenerated now.
+        result = passes.Next(numGroups, { 1u });
+        CHECK(result[1] && OwnsSlots(slots, passes.state, 1u));
+        CHECK_VALID(slots);
+    }
+
+    void TestReassign()
+    {
+        const size_t numGroups = 2u;
+        BrickSlots slots;
+        CHECK(slots.Init(numGroups * GroupSize, GroupSize, NumStates));
+        Passes passes{ slots };
+        passes.Next(numGroups, { 0u, 1u });
+        for (unsigned pass = 1u; pass < NumStates; ++pass) passes.Next(numGroups, {});
+
+        // Shared bricks get slots of their own...
+        const auto older = (passes.state + NumStates - 1u) % NumStates;
+        auto group = Group(0u);
+        CHECK(slots.Reassign(older, group.data(), group.size()));
+        CHECK(OwnsSlots(slots, older, 0u));
+        CHECK_VALID(slots);
+        // ...or, with no overflow slots left, stay as they are.
+        const auto before = slots.GetMap(older);
+        group = Group(1u);
+        CHECK(!slots.Reassign(older, group.data(), group.size()));
+        CHECK(slots.GetMap(older) == before);
+        CHECK_VALID(slots);
+    }
+}
+
+int main()
+{
+    TestReferences();
+    TestExhaustion();
+    TestReassign();
+    return Test::Finish("BrickSlotsTest");
+}
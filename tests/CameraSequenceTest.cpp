@@ -0,0 +1,183 @@
+#include "CameraSequence.hpp"
+#include "Check.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <vector>
+
+namespace {
+    namespace fs = std::filesystem;
+    using Mulen::SequenceFrame;
+    using Mulen::SequenceReader;
+    using Mulen::SequenceWriter;
+
+    // A scratch directory, removed again when done.
+    struct SequenceDirectory
+    {
+        fs::path root = fs::temp_directory_path() / "mulen_camera_sequence_test";
+
+        SequenceDirectory()
+        {
+            fs::remove_all(root);
+            fs::create_directories(root);
+        }
+        ~SequenceDirectory() { fs::remove_all(root); }
+
+        std::string Path(const std::string& name) const { return (root / name).generic_string(); }
+    };
+
+    // (compared by their bits, so that the coding is checked to be lossless, signed zeros and all)
+    bool IsSame(const SequenceFrame& a, const SequenceFrame& b)
+    {
+        const double valuesA[] = { a.cameraPosition.x, a.cameraPosition.y, a.cameraPosition.z,
+            a.cameraOrientation.x, a.cameraOrientation.y, a.cameraOrientation.z, a.cameraOrientation.w,
+            a.cameraFovy, a.animationTime, a.lightTime };
+        const double valuesB[] = { b.cameraPosition.x, b.cameraPosition.y, b.cameraPosition.z,
+            b.cameraOrientation.x, b.cameraOrientation.y, b.cameraOrientation.z, b.cameraOrientation.w,
+            b.cameraFovy, b.animationTime, b.lightTime };
+        return !std::memcmp(valuesA, valuesB, sizeof(valuesA));
+    }
+
+    // A smooth path (as recorded ones mostly are), with a few jumps and odd values thrown in.
+    std::vector<SequenceFrame> MakeFrames(size_t numFrames)
+    {
+        std::vector<SequenceFrame> frames;
+        for (size_t i = 0u; i < numFrames; ++i)
+        {
+            const double t = double(i) / 60.0;
+            SequenceFrame frame{};
+            frame.cameraPosition.x = 6371.0 + 10.0 * std::sin(t);
+            frame.cameraPosition.y = i % 50u < 25u ? -0.0 : 1e-310; // (a signed zero and a denormal)
+            frame.cameraPosition.z = i == numFrames / 2u ? -1e300 : 0.5 * t;
+            const double angle = 0.5 * t;
+            frame.cameraOrientation.w = std::cos(angle);
+            frame.cameraOrientation.x = 0.0;
+            frame.cameraOrientation.y = std::sin(angle);
+            frame.cameraOrientation.z = 0.0;
+            frame.cameraFovy = i < numFrames / 3u ? 0.9 : 0.6;
+            frame.animationTime = t;
+            frame.lightTime = i % 7u ? 12.0 : std::numeric_limits<double>::max();
+            frames.push_back(frame);
+        }
+        return frames;
+    }
+
+    bool Write(const std::string& path, const std::vector<SequenceFrame>& frames, size_t numFrames)
+    {
+        SequenceWriter writer;
+        if (!writer.Open(path, { { "name", "test" }, { "frameTime", 1.0 / 60.0 } })) return false;
+        for (size_t i = 0u; i < numFrames; ++i) writer.Append(frames[i]);
+        writer.Close();
+        return numFrames == writer.GetNumFrames();
+    }
+
+    std::vector<SequenceFrame> Read(SequenceReader& reader)
+    {
+        std::vector<SequenceFrame> frames;
+        SequenceFrame frame{};
+        while (reader.Next(frame)) frames.push_back(frame);
+        return frames;
+    }
+
+    void TestRoundTrip()
+    {
+        SequenceDirectory dir;
+        const auto frames = MakeFrames(300u);
+        const auto path = dir.Path("path.mseq");
+        CHECK(Write(path, frames, frames.size()));
+
+        SequenceReader reader;
+        CHECK(reader.Open(path));
+        CHECK(frames.size() == reader.GetNumFrames());
+        CHECK("test" == reader.GetParameters()["name"]);
+        const auto read = Read(reader);
+        CHECK(frames.size() == read.size());
+        for (size_t i = 0u; i < std::min(frames.size(), read.size()); ++i) CHECK(IsSame(frames[i], read[i]));
+
+        // (a reader is reusable, and starts over with the header)
+        CHECK(reader.Open(path));
+        CHECK(frames.size() == Read(reader).size());
+    }
+
+    void TestJson()
+    {
+        // Values left out of a JSON frame carry over from the previous one, in loading and converting alike.
+        SequenceDirectory dir;
+        const auto jsonPath = dir.Path("path.json");
+        {
+            std::ofstream out(jsonPath);
+            out << R"({ "name": "json", "sequence": [
+                { "cameraPosition": [6371.0, 0.25, -3.0], "cameraOrientation": [0.0, 0.0, 0.0, 1.0],
+                  "cameraFovy": 0.9, "animationTime": 0.0, "lightTime": 12.0 },
+                { "cameraPosition": [6371.5, 0.25, -3.0], "animationTime": 0.0166 },
+                { "cameraOrientation": [0.0, 0.5, 0.0, 0.8660254037844386], "cameraFovy": 0.7 },
+                { "lightTime": 12.5 },
+                { }
+            ], "frameTime": 0.0166 })";
+        }
+
+        nlohmann::json parameters;
+        std::vector<SequenceFrame> loaded;
+        CHECK(Mulen::CameraSequence::LoadJson(jsonPath, parameters, [&](const SequenceFrame& frame) { loaded.push_back(frame); }));
+        CHECK(5u == loaded.size());
+        CHECK(!parameters.contains("sequence") && "json" == parameters["name"]);
+        if (5u == loaded.size())
+        {
+            CHECK(6371.5 == loaded[4].cameraPosition.x && 0.7 == loaded[4].cameraFovy && 12.5 == loaded[4].lightTime);
+            CHECK(0.5 == loaded[2].cameraOrientation.y && 0.0166 == loaded[2].animationTime);
+        }
+
+        const auto path = dir.Path("path.mseq");
+        CHECK(Mulen::CameraSequence::ConvertJson(jsonPath, path));
+        SequenceReader reader;
+        CHECK(reader.Open(path));
+        CHECK(parameters == reader.GetParameters());
+        CHECK(loaded.size() == reader.GetNumFrames());
+        const auto converted = Read(reader);
+        CHECK(loaded.size() == converted.size());
+        for (size_t i = 0u; i < std::min(loaded.size(), converted.size()); ++i) CHECK(IsSame(loaded[i], converted[i]));
+    }
+
+    void TestTruncated()
+    {
+        // A file cut off anywhere (by a recording that didn't get to close it) yields every frame that's whole.
+        // The size after each frame is found by writing the first so many frames on their own.
+        SequenceDirectory dir;
+        const size_t numFrames = 40u;
+        const auto frames = MakeFrames(numFrames);
+        std::vector<uintmax_t> sizes; // of the file with the first i frames
+        for (size_t i = 0u; i <= numFrames; ++i)
+        {
+            const auto path = dir.Path("prefix.mseq");
+            CHECK(Write(path, frames, i));
+            sizes.push_back(fs::file_size(path));
+        }
+
+        const auto path = dir.Path("truncated.mseq");
+        for (size_t i = 0u; i < numFrames; ++i)
+        {
+            for (auto size = sizes[i]; size < sizes[i + 1u]; ++size)
+            {
+                CHECK(Write(path, frames, numFrames));
+                fs::resize_file(path, size);
+                SequenceReader reader;
+                CHECK(reader.Open(path));
+                const auto read = Read(reader);
+                Test::Check(i == read.size(), "frames read from " + std::to_string(size) + " bytes: " + std::to_string(read.size()) +
+                    " (rather than " + std::to_string(i) + ")", __FILE__, __LINE__);
+                for (size_t j = 0u; j < std::min(i, read.size()); ++j) CHECK(IsSame(frames[j], read[j]));
+            }
+        }
+    }
+}
+
+int main()
+{
+    TestRoundTrip();
+    TestJson();
+    TestTruncated();
+    return Test::Finish("CameraSequenceTest");
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <iostream>
+#include <string>
+
+// Minimal checks for the tests: failures are reported as they happen, and counted for the exit code.
+namespace Test {
+    inline int& NumFailures()
+    {
+        static int num = 0;
+        return num;
+    }
+
+    inline bool Check(bool condition, const std::string& what, const char* file, int line)
+    {
+        if (condition) return true;
+        std::cerr << file << ":" << line << ": check failed: " << what << "\n";
+        ++NumFailures();
+        return false;
+    }
+
+    // For the classes with a Validate(std::string* error) consistency check.
+    template<typename T> bool CheckValid(const T& object, const char* what, const char* file, int line)
+    {
+        std::string error;
+        const auto valid = object.Validate(&error);
+        return Check(valid, std::string(what) + " is invalid: " + error, file, line);
+    }
+
+    inline int Finish(const char* name)
+    {
+        if (NumFailures()) std::cerr << name << ": " << NumFailures() << " checks failed\n";
+        else std::cout << name << ": passed\n";
+        return NumFailures() ? 1 : 0;
+    }
+}
+
+#define CHECK(condition) Test::Check((condition), #condition, __FILE__, __LINE__)
+#define CHECK_VALID(object) Test::CheckValid((object), #object, __FILE__, __LINE__)
@@ -0,0 +1,103 @@
+#include "util/Metrics.hpp"
+#include "Check.hpp"
+#include <initializer_list>
+#include <sstream>
+
+namespace {
+    std::string Format(const Util::Histogram& histogram)
+    {
+        std::ostringstream out;
+        histogram.Format(out, "h", "");
+        return out.str();
+    }
+
+    bool HasLine(const std::string& text, const std::string& line)
+    {
+        return text.find(line + "\n") != std::string::npos;
+    }
+
+    void TestBuckets()
+    {
+        // Buckets count values up to and including their le (as Prometheus has it), so a value at a bound is in its bucket.
+        Util::Histogram h;
+        h.Record(0.0);
+        h.Record(1.0);
+        auto text = Format(h);
+        CHECK(HasLine(text, "h_bucket{le=\"0\"} 1"));
+        CHECK(HasLine(text, "h_bucket{le=\"1\"} 2"));
+        CHECK(HasLine(text, "h_bucket{le=\"+Inf\"} 2"));
+        CHECK(HasLine(text, "h_count 2"));
+
+        for (double bound : { 3.0, 7.0, 15.0, 31.0, 63.0, 127.0 })
+        {
+            Util::Histogram b;
+            b.Record(bound);
+            b.Record(bound + 1.0); // (in the next bucket)
+            text = Format(b);
+            std::ostringstream line;
+            line << "h_bucket{le=\"" << bound << "\"} 1";
+            Test::Check(HasLine(text, line.str()), "value at its bucket's bound: " + line.str() + " in\n" + text, __FILE__, __LINE__);
+        }
+
+        // Empty buckets before the first value are left out, and the rest are cumulative.
+        Util::Histogram c;
+        c.Record(5.0);
+        c.Record(6.0);
+        c.Record(40.0);
+        text = Format(c);
+        CHECK(!HasLine(text, "h_bucket{le=\"3\"} 0"));
+        CHECK(HasLine(text, "h_bucket{le=\"7\"} 2"));
+        CHECK(HasLine(text, "h_bucket{le=\"31\"} 2"));
+        CHECK(HasLine(text, "h_bucket{le=\"63\"} 3"));
+        CHECK(HasLine(text, "h_sum 51"));
+    }
+
+    void TestUnits()
+    {
+        // Microsecond units: le bounds are scaled, and a value rounds to its nearest unit.
+        Util::Histogram h{ 1e-6 };
+        h.Record(3e-6);
+        h.Record(4e-6);
+        const auto text = Format(h);
+        CHECK(HasLine(text, "h_bucket{le=\"3e-06\"} 1"));
+        CHECK(HasLine(text, "h_bucket{le=\"7e-06\"} 2"));
+    }
+
+    void TestQuantiles()
+    {
+        Util::Histogram h;
+        for (int i = 0; i < 100; ++i) h.Record(double(i));
+        CHECK(h.GetQuantile(0.0) == 0.0);
+        CHECK(h.GetQuantile(0.1) == 9.0); // (exact below 16)
+        const auto median = h.GetQuantile(0.5);
+        CHECK(median >= 49.0 && median <= 49.0 * 1.07);
+        Util::Histogram other;
+        other.Record(1000.0);
+        h.Merge(other);
+        CHECK(h.GetCount() == 101u);
+        CHECK(h.GetQuantile(1.0) >= 1000.0 && h.GetQuantile(1.0) <= 1000.0 * 1.07);
+    }
+
+    void TestMetrics()
+    {
+        Util::Metrics metrics;
+        metrics.Describe("splits", "Splits per iteration.");
+        metrics.Observe("splits", 0.0);
+        metrics.Observe("splits", 1.0);
+        metrics.SetGauge("groups", 12.0, Util::Metrics::Label("state", "a\"b"));
+        const auto text = metrics.Format();
+        CHECK(HasLine(text, "# HELP splits Splits per iteration."));
+        CHECK(HasLine(text, "# TYPE splits histogram"));
+        CHECK(HasLine(text, "splits_bucket{le=\"0\"} 1"));
+        CHECK(HasLine(text, "groups{state=\"a\\\"b\"} 12"));
+    }
+}
+
+int main()
+{
+    TestBuckets();
+    TestUnits();
+    TestQuantiles();
+    TestMetrics();
+    return Test::Finish("MetricsTest");
+}
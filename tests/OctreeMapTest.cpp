@@ -0,0 +1,162 @@
+#include "atmosphere/OctreeMap.hpp"
+#include "Check.hpp"
+#include <cmath>
+
+namespace {
+    using namespace Mulen;
+    using namespace Mulen::Atmosphere;
+    typedef OctreeMap::Entry Entry;
+
+    // A hand-split octree, in GPU encoding: the root's nodes are all split once (into groups 1 to 8), and below that
+    // the octant nearest the origin of the root's first node further (group 9), and two of the nodes of that again
+    // (groups 10 and 11). Leaves alternate between empty and not, so that flags are in the child indices.
+    std::vector<NodeGroup> MakeGroups()
+    {
+        std::vector<NodeGroup> groups(12u);
+        for (NodeIndex gi = 0u; gi < groups.size(); ++gi)
+        {
+            groups[gi] = {};
+            for (NodeIndex ci = 0u; ci < NodeArity; ++ci)
+            {
+                groups[gi].nodes[ci].children = GpuInvalidIndex | (ci % 2u ? EmptyBrickBit : 0u);
+            }
+        }
+        auto split = [&](NodeIndex gi, NodeIndex ci, NodeIndex child)
+        {
+            groups[gi].nodes[ci].children = child;
+            groups[child].parent = Octree::GroupAndChildToNode(gi, ci);
+            groups[child].SetDepth(groups[gi].GetDepth() + 1u);
+        };
+        for (NodeIndex ci = 0u; ci < NodeArity; ++ci) split(0u, ci, 1u + ci);
+        split(1u, 7u, 9u);
+        split(9u, 0u, 10u);
+        split(9u, 7u, 11u);
+        return groups;
+    }
+
+    bool IsSame(const Entry& a, const Entry& b)
+    {
+        return a.group == b.group && a.childFlags == b.childFlags && a.depth == b.depth;
+    }
+
+    Entry GetEntry(const OctreeMap& map, unsigned x, unsigned y, unsigned z)
+    {
+        const auto res = map.GetResolution();
+        return OctreeMap::Decode(map.GetTexels()[x + res * (y + size_t(res) * z)]);
+    }
+
+    // Are entries no deeper than the map resolves? (else descents from them would skip nodes it's meant to start at)
+    bool IsDepthLimited(const OctreeMap& map, uint32_t maxDepth)
+    {
+        for (const auto texel : map.GetTexels())
+        {
+            if (OctreeMap::Decode(texel).depth > maxDepth) return false;
+        }
+        return true;
+    }
+
+    void TestEncoding()
+    {
+        // Index in the low bits, then the child flags, then the depth.
+        CHECK(19u == OctreeMap::IndexBits);
+        CHECK((9u | 0x01u << 19u | 1u << 27u) == OctreeMap::Encode({ 9u, 0x01u, 1u }));
+        CHECK((0u | 0x80u << 19u | 31u << 27u) == OctreeMap::Encode({ 0u, 0x80u, 31u }));
+        const Entry largest{ (1u << OctreeMap::IndexBits) - 1u, 0xffu, (1u << OctreeMap::DepthBits) - 1u };
+        CHECK(0xffffffffu == OctreeMap::Encode(largest));
+        CHECK(IsSame(largest, OctreeMap::Decode(0xffffffffu)));
+        const Entry entry{ 12345u, 0x5au, 7u };
+        CHECK(IsSame(entry, OctreeMap::Decode(OctreeMap::Encode(entry))));
+        // (fields out of range are cut to their bits, rather than spilling into the next)
+        CHECK(IsSame({ 0u, 0u, 0u }, OctreeMap::Decode(OctreeMap::Encode({ 1u << OctreeMap::IndexBits, 0x100u, 1u << OctreeMap::DepthBits }))));
+
+        CHECK(1u == OctreeMap::GetMaxDepth(4u));
+        CHECK(5u == OctreeMap::GetMaxDepth(64u));
+        CHECK(8u == OctreeMap::GetMaxDepth(64u, 3u));
+    }
+
+    void TestWholeMap()
+    {
+        // At a resolution of 4, texels are the size of the depth 1 nodes (those of groups 1 to 8).
+        const auto groups = MakeGroups();
+        OctreeMap map;
+        map.Build(groups, 0u, 4u);
+        CHECK(64u == map.GetTexels().size());
+        std::string error;
+        Test::Check(map.Validate(groups, 0u, &error), error, __FILE__, __LINE__);
+
+        // A leaf at depth 1 continues from its own group (at the depth of the node that group subdivides)...
+        CHECK(IsSame({ 1u, 0x80u, 0u }, GetEntry(map, 0u, 0u, 0u)));
+        CHECK(IsSame({ 8u, 0x00u, 0u }, GetEntry(map, 3u, 3u, 3u)));
+        CHECK(IsSame({ 2u, 0x00u, 0u }, GetEntry(map, 3u, 0u, 0u)));
+        // ...and a node with children from the group of those.
+        CHECK(IsSame({ 9u, 0x81u, 1u }, GetEntry(map, 1u, 1u, 1u)));
+        CHECK((9u | 0x81u << OctreeMap::IndexBits | 1u << (OctreeMap::IndexBits + OctreeMap::ChildBits)) == map.GetTexels()[1u + 4u * (1u + 4u * 1u)]);
+        CHECK(IsDepthLimited(map, 1u));
+
+        // Descents from the map end where those from the root do.
+        for (int z = -7; z <= 7; ++z)
+        for (int y = -7; y <= 7; ++y)
+        for (int x = -7; x <= 7; ++x)
+        {
+            const auto p = glm::dvec3(x, y, z) / 7.5 + 0.01;
+            CHECK(map.Descend(groups, 0u, p, false) == map.Descend(groups, 0u, p));
+        }
+        CHECK(Octree::GroupAndChildToNode(10u, 7u) == map.Descend(groups, 0u, glm::dvec3(-0.26)));
+
+        // A texel pointing at the wrong group doesn't validate.
+        auto broken = map;
+        broken.GetTexels()[0u] = OctreeMap::Encode({ 2u, 0x00u, 0u });
+        CHECK(!broken.Validate(groups, 0u, &error));
+        CHECK(error.find("texel (0, 0, 0)") != std::string::npos);
+    }
+
+    void TestPlacement()
+    {
+        // A map 2 levels smaller (half the octree across) at a resolution of 4 has texels of 1/8, the depth 3 nodes'
+        // size, and is snapped to whole texels around the point, within the octree.
+        const unsigned res = 4u, levels = 2u;
+        const auto size = 0.5, texelSize = size / res;
+        for (const auto& center : { glm::dvec3(-0.3), glm::dvec3(0.1, -0.27, 0.33), glm::dvec3(0.95, -0.99, 0.0) })
+        {
+            const auto position = OctreeMap::Place(center, res, levels);
+            for (int i = 0; i < 3; ++i)
+            {
+                const auto texels = (position[i] + 1.0) / texelSize;
+                CHECK(std::abs(texels - std::round(texels)) < 1e-9);
+                CHECK(position[i] >= -1.0 && position[i] + size <= 1.0);
+                const auto clamped = center[i] - 0.5 * size < -1.0 || center[i] + 0.5 * size > 1.0;
+                if (!clamped) CHECK(std::abs(position[i] + 0.5 * size - center[i]) <= 0.5 * texelSize + 1e-9);
+            }
+        }
+        CHECK(glm::dvec3(-0.5) == OctreeMap::Place(glm::dvec3(-0.3), res, levels));
+        CHECK(glm::dvec3(0.5, -1.0, -0.25) == OctreeMap::Place(glm::dvec3(0.95, -0.99, 0.0), res, levels));
+
+        // Around (-0.3, -0.3, -0.3), the map covers group 9's nodes, its first texel group 10's first node, and its last
+        // group 11's last.
+        const auto groups = MakeGroups();
+        OctreeMap map;
+        map.Build(groups, 0u, res, OctreeMap::Place(glm::dvec3(-0.3), res, levels), levels);
+        CHECK(glm::dvec3(-0.5) == map.GetPosition() && size == map.GetSize());
+        std::string error;
+        Test::Check(map.Validate(groups, 0u, &error), error, __FILE__, __LINE__);
+        CHECK(IsSame({ 10u, 0x00u, 2u }, GetEntry(map, 0u, 0u, 0u)));
+        CHECK(IsSame({ 11u, 0x00u, 2u }, GetEntry(map, 3u, 3u, 3u)));
+        CHECK(IsSame({ 9u, 0x81u, 1u }, GetEntry(map, 3u, 0u, 0u)));
+        CHECK(IsDepthLimited(map, 3u));
+        for (int z = 0; z < 8; ++z)
+        for (int y = 0; y < 8; ++y)
+        for (int x = 0; x < 8; ++x)
+        {
+            const auto p = map.GetPosition() + (glm::dvec3(x, y, z) + 0.3) * (size / 8.0);
+            CHECK(map.Descend(groups, 0u, p, false) == map.Descend(groups, 0u, p));
+        }
+    }
+}
+
+int main()
+{
+    TestEncoding();
+    TestWholeMap();
+    TestPlacement();
+    return Test::Finish("OctreeMapTest");
+}
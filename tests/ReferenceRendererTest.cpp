@@ -0,0 +1,247 @@
+#include "atmosphere/ReferenceRenderer.hpp"
+#include "Check.hpp"
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+// Renders a small synthetic capture and compares it with the stored result (tests/data/), so that changes to the
+// traversal, marching or lighting that change the output don't go unnoticed. If a change is meant to, the result is
+// stored anew by running the test with --update (and the stats it prints replace ExpectedStats).
+
+namespace {
+    using namespace Mulen;
+    using namespace Mulen::Atmosphere;
+    namespace fs = std::filesystem;
+
+    const std::string StoredPath = std::string(MULEN_TEST_DATA_DIR) + "ReferenceRendererTest.hdr";
+    const unsigned SplitDepth = 8u; // (where the nodes around the camera are about 27 km across)
+
+    // (of the stored image's rendering)
+    const ReferenceRenderer::Stats ExpectedStats = []()
+    {
+        ReferenceRenderer::Stats stats;
+        stats.rays = 768u;
+        stats.marchedRays = 768u;
+        stats.truncatedRays = 0u;
+        stats.nodesVisited = 30022u;
+        stats.bricks = 3452u;
+        stats.steps = 22504u;
+        return stats;
+    }();
+
+    // Density of a cloud layer between 1 and 4 km up, broken up by waves (at positions in [-1, 1] over the octree).
+    float GetDensity(const BrickStore& store, const glm::dvec3& p)
+    {
+        const auto atmScale = store.params.planetRadius * store.params.scale;
+        const auto h = glm::length(p) * atmScale - store.params.planetRadius;
+        const auto layer = glm::clamp(1.0 - std::abs(h - 2500.0) / 1500.0, 0.0, 1.0);
+        const auto waves = 0.5 + 0.5 * std::sin(p.x * 2000.0) * std::sin(p.y * 1500.0);
+        return float(0.03 * layer * waves);
+    }
+
+    // Earth-like parameters, the camera 500 m up looking along the horizon (down to the ground at the bottom of the
+    // image), and the octree split down to SplitDepth around the camera (with a brick for each leaf).
+    void MakeStore(BrickStore& store)
+    {
+        store.Clear();
+        auto& p = store.params;
+        p.planetRadius = 6371e3;
+        p.scale = 1.1;
+        p.height = 50e3;
+        p.cloudMaxHeight = 25e3;
+        p.HR = 8000.0;
+        p.HM = 1200.0;
+        p.betaR = glm::dvec3(5.802e-6, 13.558e-6, 33.1e-6);
+        p.absorptionExtinction = glm::dvec3(0.65e-6, 1.881e-6, 0.085e-6);
+        p.absorptionMiddle = 25e3;
+        p.absorptionExtent = 15e3;
+        p.mieG = 0.8;
+        p.betaMSca = 3.996e-6;
+        p.betaMEx = 4.44e-6;
+
+        auto& view = store.view;
+        view.origin = glm::dvec3(0.0, 0.0, p.planetRadius + 500.0);
+        const glm::dvec3 forward{ 1.0, 0.0, 0.02 }, right{ 0.0, 0.4, 0.0 }, up{ -0.006, 0.0, 0.3 };
+        view.invViewProj = glm::dmat4(glm::dvec4(right, 0.0), glm::dvec4(up, 0.0), glm::dvec4(forward, 0.0), glm::dvec4(0.0));
+        view.lightDir = glm::normalize(glm::dvec3(0.3, 0.2, 0.9));
+        view.sunIntensity = 10.0;
+        view.resolution = glm::ivec2(32, 24);
+
+        // Nodes are split if they're within a few of their sizes of the camera, as the octree is updated.
+        const auto atmScale = p.planetRadius * p.scale;
+        const auto camera = view.origin / atmScale;
+        struct Location
+        {
+            glm::dvec3 center;
+            double size; // (half the extent)
+        };
+        std::vector<std::pair<NodeIndex, Location>> stack{ { 0u, { glm::dvec3(0.0), 1.0 } } };
+        store.rootGroupIndex = 0u;
+        store.groups.resize(1u);
+        store.groups[0u] = {};
+        store.groups[0u].parent = InvalidIndex;
+        while (!stack.empty())
+        {
+            const auto [gi, location] = stack.back();
+            stack.pop_back();
+            const auto depth = store.groups[gi].GetDepth();
+            for (NodeIndex ci = 0u; ci < NodeArity; ++ci)
+            {
+                const auto size = location.size * 0.5;
+                const auto center = location.center + (glm::dvec3(ci & 1u, (ci >> 1u) & 1u, (ci >> 2u) & 1u) * 2.0 - 1.0) * size;
+                store.groups[gi].nodes[ci] = {};
+                store.groups[gi].nodes[ci].children = GpuInvalidIndex;
+                if (depth < SplitDepth && glm::length(center - camera) < 4.0 * size)
+                {
+                    const auto child = NodeIndex(store.groups.size());
+                    store.groups.emplace_back();
+                    store.groups[child] = {};
+                    store.groups[child].SetDepth(depth + 1u);
+                    store.groups[child].parent = Octree::GroupAndChildToNode(gi, ci);
+                    store.groups[gi].nodes[ci].children = child;
+                    stack.push_back({ child, { center, size } });
+                    continue;
+                }
+                auto& brick = store.AddBrick(Octree::GroupAndChildToNode(gi, ci));
+                for (uint32_t z = 0u; z < BrickRes; ++z)
+                for (uint32_t y = 0u; y < BrickRes; ++y)
+                for (uint32_t x = 0u; x < BrickRes; ++x)
+                {
+                    const auto lc = glm::dvec3(x, y, z) * (2.0 / double(BrickRes - 1u)) - 1.0;
+                    const auto density = GetDensity(store, center + lc * size);
+                    brick.voxels[x + y * BrickRes + z * BrickRes2] = glm::vec2(density, 1.0f - 10.0f * density);
+                }
+            }
+        }
+        store.BuildNodeMeta();
+    }
+
+    // Reads an image as ReferenceRenderer::WriteHdr writes them (uncompressed RGBE scanlines, top row first).
+    bool ReadHdr(const std::string& path, glm::ivec2& res, ReferenceRenderer::Image& image)
+    {
+        std::ifstream file{ path, std::ios::binary };
+        std::string line;
+        while (std::getline(file, line) && !line.empty()) {}
+        if (!std::getline(file, line) || 2 != std::sscanf(line.c_str(), "-Y %d +X %d", &res.y, &res.x) || res.x <= 0 || res.y <= 0) return false;
+        image.assign(size_t(res.x) * size_t(res.y), glm::vec3(0.0f));
+        for (int y = res.y - 1; y >= 0; --y)
+        {
+            for (int x = 0; x < res.x; ++x)
+            {
+                unsigned char rgbe[4];
+                if (!file.read(reinterpret_cast<char*>(rgbe), sizeof(rgbe))) return false;
+                if (!rgbe[3]) continue;
+                const auto f = std::ldexp(1.0f, int(rgbe[3]) - (128 + 8));
+                image[size_t(x) + size_t(y) * size_t(res.x)] = (glm::vec3(rgbe[0], rgbe[1], rgbe[2]) + 0.5f) * f;
+            }
+        }
+        return true;
+    }
+
+    // (counts may differ a little where floating-point results do, e.g. with fused multiply-adds)
+    bool IsClose(uint64_t value, uint64_t expected)
+    {
+        return std::abs(double(value) - double(expected)) <= 0.01 * double(expected);
+    }
+
+    void PrintStats(const ReferenceRenderer::Stats& stats)
+    {
+        std::cout << "        stats.rays = " << stats.rays << "u;\n"
+            << "        stats.marchedRays = " << stats.marchedRays << "u;\n"
+            << "        stats.truncatedRays = " << stats.truncatedRays << "u;\n"
+            << "        stats.nodesVisited = " << stats.nodesVisited << "u;\n"
+            << "        stats.bricks = " << stats.bricks << "u;\n"
+            << "        stats.steps = " << stats.steps << "u;\n";
+    }
+
+    void TestStore(const BrickStore& store)
+    {
+        // The synthetic capture is as intended: split down to SplitDepth around the camera, with empty nodes above
+        // and below the clouds.
+        size_t numEmpty = 0u, numLeaves = 0u;
+        NodeGroup::Info maxDepth = 0u;
+        store.ForEachGroup([&](NodeIndex gi)
+        {
+            maxDepth = glm::max(maxDepth, store.groups[gi].GetDepth());
+            for (const auto& node : store.groups[gi].nodes)
+            {
+                if (GpuInvalidIndex != (node.children & GpuIndexMask)) continue;
+                ++numLeaves;
+                numEmpty += 0u != (node.children & EmptyBrickBit);
+            }
+        });
+        CHECK(SplitDepth == maxDepth);
+        CHECK(store.GetNumBricks() == numLeaves);
+        CHECK(numEmpty > 0u && numEmpty < numLeaves);
+    }
+
+    void TestRender(bool update)
+    {
+        BrickStore store;
+        MakeStore(store);
+        TestStore(store);
+
+        ReferenceRenderer renderer{ store };
+        ReferenceRenderer::Settings settings;
+        settings.numThreads = 4u; // (the result doesn't depend on it; tiles are rendered alike by any thread)
+        settings.tileSize = 8u;
+        settings.jitter = false; // (its hash of the pixel coordinates is as sensitive to rounding as it's meant to be)
+        ReferenceRenderer::Image image;
+        ReferenceRenderer::Stats stats;
+        const auto res = renderer.Render(settings, image, stats);
+        CHECK(store.view.resolution == res);
+
+        if (update)
+        {
+            CHECK(ReferenceRenderer::WriteHdr(StoredPath, res, image));
+            std::cout << "Stored " << StoredPath << ", with stats:\n";
+            PrintStats(stats);
+            return;
+        }
+
+        CHECK(ExpectedStats.rays == stats.rays);
+        CHECK(IsClose(stats.marchedRays, ExpectedStats.marchedRays));
+        CHECK(IsClose(stats.truncatedRays, ExpectedStats.truncatedRays));
+        CHECK(IsClose(stats.nodesVisited, ExpectedStats.nodesVisited));
+        CHECK(IsClose(stats.bricks, ExpectedStats.bricks));
+        CHECK(IsClose(stats.steps, ExpectedStats.steps));
+        if (Test::NumFailures()) PrintStats(stats);
+
+        // Compared after the same RGBE quantisation, each pixel to within 2% of its brightest channel.
+        const auto renderedPath = (fs::temp_directory_path() / "mulen_reference_renderer_test.hdr").generic_string();
+        CHECK(ReferenceRenderer::WriteHdr(renderedPath, res, image));
+        glm::ivec2 renderedRes, storedRes;
+        ReferenceRenderer::Image rendered, stored;
+        CHECK(ReadHdr(renderedPath, renderedRes, rendered));
+        fs::remove(renderedPath);
+        if (!ReadHdr(StoredPath, storedRes, stored))
+        {
+            Test::Check(false, "could not read " + StoredPath, __FILE__, __LINE__);
+            return;
+        }
+        CHECK(renderedRes == storedRes);
+        if (rendered.size() != stored.size()) return;
+
+        size_t numDifferent = 0u;
+        float maxValue = 0.0f;
+        for (size_t i = 0u; i < rendered.size(); ++i)
+        {
+            const auto a = rendered[i], b = stored[i];
+            const auto scale = glm::max(glm::max(b.r, glm::max(b.g, b.b)), 1e-6f);
+            const auto d = glm::abs(a - b);
+            numDifferent += glm::max(d.r, glm::max(d.g, d.b)) > 0.02f * scale;
+            maxValue = glm::max(maxValue, scale);
+        }
+        Test::Check(!numDifferent, std::to_string(numDifferent) + " of " + std::to_string(rendered.size()) + " pixels differ", __FILE__, __LINE__);
+        CHECK(maxValue > 1e-3f); // (not just black)
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    TestRender(argc > 1 && std::string(argv[1]) == "--update");
+    return Test::Finish("ReferenceRendererTest");
+}
@@ -0,0 +1,140 @@
+#include "util/ShaderSources.hpp"
+#include "Check.hpp"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+
+namespace {
+    namespace fs = std::filesystem;
+
+    // A scratch directory of shader sources, removed again when done.
+    struct SourceDirectory
+    {
+        fs::path root = fs::temp_directory_path() / "mulen_shader_sources_test";
+
+        SourceDirectory()
+        {
+            fs::remove_all(root);
+            fs::create_directories(root / "generation");
+            Write("common.glsl", "float f;\n#include \"inner.glsl\"\nfloat g;\n");
+            Write("inner.glsl", "float h;\n");
+            Write("main.glsl", "#version 450\n#include \"common.glsl\"\nvoid main() {}\n");
+            Write("other.glsl", "#version 450\nvoid other() {}\n");
+            Write("generation/generator.glsl", "#version 450\n#include \"../common.glsl\"\n");
+        }
+        ~SourceDirectory() { fs::remove_all(root); }
+
+        std::string Path(const std::string& name) const { return (root / name).generic_string(); }
+        void Write(const std::string& name, const std::string& text) const
+        {
+            std::ofstream out(root / name);
+            out << text;
+        }
+        // (a rewrite within the file system's time resolution wouldn't show, so the time is moved on explicitly)
+        void Rewrite(const std::string& name, const std::string& text) const
+        {
+            const auto writeTime = fs::last_write_time(root / name);
+            Write(name, text);
+            fs::last_write_time(root / name, writeTime + std::chrono::seconds(2));
+        }
+    };
+
+    bool Contains(const std::vector<std::string>& paths, const std::string& path)
+    {
+        return paths.end() != std::find(paths.begin(), paths.end(), path);
+    }
+
+    void TestReads()
+    {
+        // Each file is read once, however many shaders include it.
+        SourceDirectory dir;
+        Util::ShaderSources sources(false);
+        std::vector<std::string> closure;
+        sources.Expand(dir.Path("main.glsl"), "", closure);
+        CHECK(3u == sources.GetNumReads());
+        CHECK(3u == closure.size());
+        closure.clear();
+        sources.Expand(dir.Path("main.glsl"), "#define A 1\n", closure);
+        sources.Expand(dir.Path("generation/generator.glsl"), "", closure);
+        CHECK(4u == sources.GetNumReads());
+    }
+
+    void TestNormalise()
+    {
+        // Includes are keyed by normalised paths, so that the same file is the same whichever directory it's included from.
+        SourceDirectory dir;
+        CHECK(Util::ShaderSources::Normalise(dir.Path("generation/../common.glsl")) == Util::ShaderSources::Normalise(dir.Path("common.glsl")));
+        CHECK(Util::ShaderSources::Normalise("a/./b/../c.glsl") == "a/c.glsl");
+
+        Util::ShaderSources sources(false);
+        std::vector<std::string> mainClosure, generatorClosure;
+        sources.Expand(dir.Path("main.glsl"), "", mainClosure);
+        sources.Expand(dir.Path("generation/generator.glsl"), "", generatorClosure);
+        const auto common = Util::ShaderSources::Normalise(dir.Path("common.glsl"));
+        CHECK(Contains(mainClosure, common));
+        CHECK(Contains(generatorClosure, common));
+    }
+
+    void TestLineNumbers()
+    {
+        // Each include is preceded by "#line 1" and followed by the number of the including file's next line,
+        // and so are defines, which go right after the #version directive.
+        SourceDirectory dir;
+        Util::ShaderSources sources(false);
+        std::vector<std::string> closure;
+        const auto src = sources.Expand(dir.Path("main.glsl"), "#define A 1\n", closure);
+        const std::string expected =
+            "#version 450\n"
+            "#define A 1\n"
+            "#line 2\n"
+            "#line 1\n"
+            "float f;\n"
+            "#line 1\n"
+            "float h;\n"
+            "#line 3\n"
+            "float g;\n"
+            "#line 3\n"
+            "void main() {}\n";
+        Test::Check(src == expected, "expanded source:\n" + src, __FILE__, __LINE__);
+
+        // (without defines there's no directive after #version)
+        closure.clear();
+        CHECK(sources.Expand(dir.Path("other.glsl"), "", closure) == "#version 450\nvoid other() {}\n");
+    }
+
+    void TestChanges()
+    {
+        // A rewritten file is dropped from the cache (and read again when next needed), and only the shaders whose
+        // closure includes it depend on the change.
+        SourceDirectory dir;
+        Util::ShaderSources sources(false);
+        std::vector<std::string> mainClosure, otherClosure;
+        sources.Expand(dir.Path("main.glsl"), "", mainClosure);
+        sources.Expand(dir.Path("other.glsl"), "", otherClosure);
+        CHECK(sources.PollChanges().empty());
+
+        dir.Rewrite("inner.glsl", "float changed;\n");
+        const auto changed = sources.PollChanges();
+        CHECK(1u == changed.size() && Contains(changed, Util::ShaderSources::Normalise(dir.Path("inner.glsl"))));
+        CHECK(Util::ShaderSources::DependsOn(mainClosure, changed));
+        CHECK(!Util::ShaderSources::DependsOn(otherClosure, changed));
+        CHECK(sources.PollChanges().empty());
+
+        const auto numReads = sources.GetNumReads();
+        mainClosure.clear();
+        const auto src = sources.Expand(dir.Path("main.glsl"), "", mainClosure);
+        CHECK(numReads + 1u == sources.GetNumReads());
+        CHECK(src.find("float changed;\n") != std::string::npos);
+        CHECK(src.find("float h;\n") == std::string::npos);
+    }
+}
+
+int main()
+{
+    TestReads();
+    TestNormalise();
+    TestLineNumbers();
+    TestChanges();
+    return Test::Finish("ShaderSourcesTest");
+}